@@ -0,0 +1,571 @@
+/* Benchmark commands for measuring the forwarding path of the router
+
+   The device can act as TCP/UDP source or sink and as UDP echo reflector.
+   The host side of the measurement is tools/natbench.py, which sends the
+   traffic from a station on the soft AP through the NAT to a host in the
+   uplink network. Every result is printed as a single line prefixed with
+   "BENCH " followed by a JSON object, so it can be grepped from the console
+   log and fed into the harness.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "esp_log.h"
+#include "esp_console.h"
+#include "esp_timer.h"
+#include "argtable3/argtable3.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "lwip/sockets.h"
+
+#include "cmd_bench.h"
+
+static const char *TAG = "cmd_bench";
+
+#define BENCH_DEFAULT_PORT 5001
+#define BENCH_DEFAULT_ECHO_PORT 5002
+#define BENCH_DEFAULT_TIME_S 10
+#define BENCH_DEFAULT_LEN 1460
+#define BENCH_MAX_LEN 8192
+#define BENCH_DEFAULT_COUNT 200
+#define BENCH_MAX_COUNT 2000
+#define BENCH_IDLE_TIMEOUT_US (3 * 1000 * 1000)
+
+typedef enum
+{
+    BENCH_TCP_SINK,
+    BENCH_TCP_SOURCE,
+    BENCH_UDP_SINK,
+    BENCH_UDP_SOURCE,
+    BENCH_ECHO,
+    BENCH_PING,
+    BENCH_MODE_COUNT
+} bench_mode_t;
+
+static const char *bench_mode_names[BENCH_MODE_COUNT] = {
+    "tcp-sink", "tcp-source", "udp-sink", "udp-source", "echo", "ping"};
+
+typedef struct
+{
+    bench_mode_t mode;
+    char host[16];
+    uint16_t port;
+    uint32_t secs;
+    uint32_t len;
+    uint32_t kbps;
+    uint32_t count;
+} bench_cfg_t;
+
+/* Header of every UDP datagram, used for loss and latency measurement */
+typedef struct __attribute__((packed))
+{
+    uint32_t seq;
+    uint32_t ts_us;
+} bench_udp_hdr_t;
+
+static bench_cfg_t bench_cfg;
+static TaskHandle_t bench_task_handle = NULL;
+static volatile bool bench_stop_requested = false;
+
+static void bench_report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Prints one result line. The build settings relevant for forwarding are
+   appended, so results of different sdkconfigs can be compared. */
+static void bench_report(const char *fmt, ...)
+{
+    va_list args;
+    printf("BENCH {\"target\":\"%s\",\"mode\":\"%s\",", CONFIG_IDF_TARGET, bench_mode_names[bench_cfg.mode]);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf(",\"sdkconfig\":{\"tcpip_recvmbox\":%d,\"tcp_wnd\":%d,\"tcp_snd_buf\":%d,\"tcp_mss\":%d,"
+           "\"wifi_static_rx\":%d,\"wifi_dynamic_rx\":%d,\"wifi_dynamic_tx\":%d}}\n",
+           CONFIG_LWIP_TCPIP_RECVMBOX_SIZE, CONFIG_LWIP_TCP_WND_DEFAULT, CONFIG_LWIP_TCP_SND_BUF_DEFAULT,
+           CONFIG_LWIP_TCP_MSS, CONFIG_ESP_WIFI_STATIC_RX_BUFFER_NUM, CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM,
+           CONFIG_ESP_WIFI_DYNAMIC_TX_BUFFER_NUM);
+}
+
+static double bench_mbps(uint64_t bytes, int64_t us)
+{
+    return us > 0 ? (double)bytes * 8.0 / (double)us : 0.0;
+}
+
+static bool bench_time_over(int64_t start)
+{
+    return bench_stop_requested || (esp_timer_get_time() - start) >= (int64_t)bench_cfg.secs * 1000000;
+}
+
+static void bench_set_rcvtimeo(int sock, int ms)
+{
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int bench_socket_bound(int type, uint16_t port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)};
+    int opt = 1;
+
+    int sock = socket(AF_INET, type, type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void bench_tcp_sink(char *buf)
+{
+    int listen_sock = bench_socket_bound(SOCK_STREAM, bench_cfg.port);
+    if (listen_sock < 0)
+    {
+        return;
+    }
+    listen(listen_sock, 1);
+    bench_set_rcvtimeo(listen_sock, 1000);
+    printf("Waiting for TCP connection on port %d\n", bench_cfg.port);
+
+    int sock = -1;
+    while (sock < 0 && !bench_stop_requested)
+    {
+        sock = accept(listen_sock, NULL, NULL);
+    }
+    close(listen_sock);
+    if (sock < 0)
+    {
+        return;
+    }
+    bench_set_rcvtimeo(sock, 1000);
+
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    int64_t last = start;
+    while (!bench_time_over(start))
+    {
+        int len = recv(sock, buf, bench_cfg.len, 0);
+        if (len > 0)
+        {
+            bytes += len;
+            last = esp_timer_get_time();
+        }
+        else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            break;
+        }
+    }
+    close(sock);
+    bench_report("\"bytes\":%llu,\"duration_us\":%lld,\"mbps\":%.3f",
+                 bytes, last - start, bench_mbps(bytes, last - start));
+}
+
+static int bench_connect(int type, struct sockaddr_in *dest)
+{
+    dest->sin_family = AF_INET;
+    dest->sin_port = htons(bench_cfg.port);
+    dest->sin_addr.s_addr = inet_addr(bench_cfg.host);
+
+    int sock = socket(AF_INET, type, type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)dest, sizeof(*dest)) != 0)
+    {
+        ESP_LOGE(TAG, "Unable to connect to %s:%d: errno %d", bench_cfg.host, bench_cfg.port, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void bench_tcp_source(char *buf)
+{
+    struct sockaddr_in dest;
+    int sock = bench_connect(SOCK_STREAM, &dest);
+    if (sock < 0)
+    {
+        return;
+    }
+    memset(buf, 'N', bench_cfg.len);
+
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    while (!bench_time_over(start))
+    {
+        int len = send(sock, buf, bench_cfg.len, 0);
+        if (len < 0)
+        {
+            ESP_LOGW(TAG, "send failed: errno %d", errno);
+            break;
+        }
+        bytes += len;
+    }
+    int64_t duration = esp_timer_get_time() - start;
+    close(sock);
+    bench_report("\"bytes\":%llu,\"duration_us\":%lld,\"mbps\":%.3f",
+                 bytes, duration, bench_mbps(bytes, duration));
+}
+
+static void bench_udp_sink(char *buf)
+{
+    int sock = bench_socket_bound(SOCK_DGRAM, bench_cfg.port);
+    if (sock < 0)
+    {
+        return;
+    }
+    bench_set_rcvtimeo(sock, 1000);
+    printf("Waiting for UDP datagrams on port %d\n", bench_cfg.port);
+
+    uint64_t bytes = 0;
+    uint32_t packets = 0;
+    uint32_t max_seq = 0;
+    uint32_t reordered = 0;
+    int64_t start = 0;
+    int64_t last = 0;
+    while (!bench_stop_requested)
+    {
+        int len = recv(sock, buf, bench_cfg.len, 0);
+        int64_t now = esp_timer_get_time();
+        if (len <= 0)
+        {
+            // the test ends, if the source has been silent for a while
+            if (packets > 0 && now - last > BENCH_IDLE_TIMEOUT_US)
+            {
+                break;
+            }
+            continue;
+        }
+        if (packets == 0)
+        {
+            start = now;
+        }
+        last = now;
+        packets++;
+        bytes += len;
+        if (len >= sizeof(bench_udp_hdr_t))
+        {
+            uint32_t seq = ntohl(((bench_udp_hdr_t *)buf)->seq);
+            if (seq < max_seq)
+            {
+                reordered++;
+            }
+            else
+            {
+                max_seq = seq;
+            }
+        }
+        if (now - start >= (int64_t)bench_cfg.secs * 1000000)
+        {
+            break;
+        }
+    }
+    close(sock);
+
+    uint32_t expected = packets > 0 ? max_seq + 1 : 0;
+    uint32_t lost = expected > packets ? expected - packets : 0;
+    int64_t duration = last - start;
+    bench_report("\"bytes\":%llu,\"packets\":%lu,\"lost\":%lu,\"reordered\":%lu,\"duration_us\":%lld,"
+                 "\"mbps\":%.3f,\"pps\":%.1f",
+                 bytes, (unsigned long)packets, (unsigned long)lost, (unsigned long)reordered, duration,
+                 bench_mbps(bytes, duration), duration > 0 ? packets * 1e6 / duration : 0.0);
+}
+
+static void bench_udp_source(char *buf)
+{
+    struct sockaddr_in dest;
+    int sock = bench_connect(SOCK_DGRAM, &dest);
+    if (sock < 0)
+    {
+        return;
+    }
+    memset(buf, 'N', bench_cfg.len);
+
+    // 0 means as fast as the stack accepts the datagrams
+    int64_t interval_us = bench_cfg.kbps > 0 ? (int64_t)bench_cfg.len * 8 * 1000 / bench_cfg.kbps : 0;
+    uint64_t bytes = 0;
+    uint32_t seq = 0;
+    uint32_t send_errors = 0;
+    int64_t start = esp_timer_get_time();
+    while (!bench_time_over(start))
+    {
+        if (interval_us > 0)
+        {
+            int64_t ahead = start + seq * interval_us - esp_timer_get_time();
+            if (ahead >= portTICK_PERIOD_MS * 1000)
+            {
+                vTaskDelay(ahead / 1000 / portTICK_PERIOD_MS);
+            }
+        }
+        bench_udp_hdr_t *hdr = (bench_udp_hdr_t *)buf;
+        hdr->seq = htonl(seq);
+        hdr->ts_us = htonl((uint32_t)esp_timer_get_time());
+        if (send(sock, buf, bench_cfg.len, 0) < 0)
+        {
+            // ENOMEM: lwIP or WiFi ran out of TX buffers, give the stack some time
+            send_errors++;
+            vTaskDelay(1);
+            continue;
+        }
+        seq++;
+        bytes += bench_cfg.len;
+    }
+    int64_t duration = esp_timer_get_time() - start;
+    close(sock);
+    bench_report("\"bytes\":%llu,\"packets\":%lu,\"send_errors\":%lu,\"duration_us\":%lld,"
+                 "\"mbps\":%.3f,\"pps\":%.1f",
+                 bytes, (unsigned long)seq, (unsigned long)send_errors, duration,
+                 bench_mbps(bytes, duration), duration > 0 ? seq * 1e6 / duration : 0.0);
+}
+
+static void bench_echo(char *buf)
+{
+    int sock = bench_socket_bound(SOCK_DGRAM, bench_cfg.port);
+    if (sock < 0)
+    {
+        return;
+    }
+    bench_set_rcvtimeo(sock, 1000);
+    printf("UDP echo on port %d, stop with 'bench stop'\n", bench_cfg.port);
+
+    uint32_t packets = 0;
+    struct sockaddr_in source;
+    socklen_t socklen = sizeof(source);
+    while (!bench_stop_requested)
+    {
+        int len = recvfrom(sock, buf, bench_cfg.len, 0, (struct sockaddr *)&source, &socklen);
+        if (len > 0 && sendto(sock, buf, len, 0, (struct sockaddr *)&source, socklen) == len)
+        {
+            packets++;
+        }
+    }
+    close(sock);
+    bench_report("\"packets\":%lu", (unsigned long)packets);
+}
+
+static int bench_compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint32_t bench_percentile(const uint32_t *sorted, uint32_t n, uint32_t p)
+{
+    return n > 0 ? sorted[(n - 1) * p / 100] : 0;
+}
+
+static void bench_ping(char *buf)
+{
+    struct sockaddr_in dest;
+    uint32_t *rtt = malloc(bench_cfg.count * sizeof(uint32_t));
+    if (rtt == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for %lu samples", (unsigned long)bench_cfg.count);
+        return;
+    }
+    int sock = bench_connect(SOCK_DGRAM, &dest);
+    if (sock < 0)
+    {
+        free(rtt);
+        return;
+    }
+    bench_set_rcvtimeo(sock, 1000);
+    memset(buf, 'N', bench_cfg.len);
+
+    uint32_t received = 0;
+    uint32_t seq;
+    for (seq = 0; seq < bench_cfg.count && !bench_stop_requested; seq++)
+    {
+        bench_udp_hdr_t *hdr = (bench_udp_hdr_t *)buf;
+        hdr->seq = htonl(seq);
+        int64_t sent = esp_timer_get_time();
+        if (send(sock, buf, bench_cfg.len, 0) < 0)
+        {
+            continue;
+        }
+        // drop late answers of previous requests
+        while (true)
+        {
+            int len = recv(sock, buf, bench_cfg.len, 0);
+            if (len < (int)sizeof(bench_udp_hdr_t))
+            {
+                break;
+            }
+            if (ntohl(hdr->seq) == seq)
+            {
+                rtt[received++] = (uint32_t)(esp_timer_get_time() - sent);
+                break;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    close(sock);
+
+    qsort(rtt, received, sizeof(uint32_t), bench_compare_u32);
+    bench_report("\"sent\":%lu,\"received\":%lu,\"rtt_us\":{\"min\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu}",
+                 (unsigned long)seq, (unsigned long)received,
+                 (unsigned long)(received > 0 ? rtt[0] : 0),
+                 (unsigned long)bench_percentile(rtt, received, 50),
+                 (unsigned long)bench_percentile(rtt, received, 90),
+                 (unsigned long)bench_percentile(rtt, received, 99),
+                 (unsigned long)(received > 0 ? rtt[received - 1] : 0));
+    free(rtt);
+}
+
+static void bench_task(void *pvParameters)
+{
+    char *buf = malloc(bench_cfg.len);
+    if (buf == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for buffer of %lu bytes", (unsigned long)bench_cfg.len);
+    }
+    else
+    {
+        switch (bench_cfg.mode)
+        {
+        case BENCH_TCP_SINK:
+            bench_tcp_sink(buf);
+            break;
+        case BENCH_TCP_SOURCE:
+            bench_tcp_source(buf);
+            break;
+        case BENCH_UDP_SINK:
+            bench_udp_sink(buf);
+            break;
+        case BENCH_UDP_SOURCE:
+            bench_udp_source(buf);
+            break;
+        case BENCH_ECHO:
+            bench_echo(buf);
+            break;
+        case BENCH_PING:
+            bench_ping(buf);
+            break;
+        default:
+            break;
+        }
+        free(buf);
+    }
+    bench_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+static struct
+{
+    struct arg_str *mode;
+    struct arg_str *host;
+    struct arg_int *port;
+    struct arg_int *time;
+    struct arg_int *len;
+    struct arg_int *kbps;
+    struct arg_int *count;
+    struct arg_end *end;
+} bench_args;
+
+static int bench(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+
+    const char *mode = bench_args.mode->sval[0];
+    if (strcmp(mode, "stop") == 0)
+    {
+        bench_stop_requested = true;
+        return 0;
+    }
+    if (bench_task_handle != NULL)
+    {
+        ESP_LOGW(TAG, "Benchmark already running, stop it with 'bench stop'");
+        return 1;
+    }
+
+    bench_cfg_t cfg = {.mode = BENCH_MODE_COUNT};
+    for (int i = 0; i < BENCH_MODE_COUNT; i++)
+    {
+        if (strcmp(mode, bench_mode_names[i]) == 0)
+        {
+            cfg.mode = i;
+        }
+    }
+    if (cfg.mode == BENCH_MODE_COUNT)
+    {
+        ESP_LOGW(TAG, "Unknown mode '%s'", mode);
+        return 1;
+    }
+
+    bool needs_host = cfg.mode == BENCH_TCP_SOURCE || cfg.mode == BENCH_UDP_SOURCE || cfg.mode == BENCH_PING;
+    if (needs_host)
+    {
+        if (bench_args.host->count == 0 || inet_addr(bench_args.host->sval[0]) == IPADDR_NONE)
+        {
+            ESP_LOGW(TAG, "Mode '%s' needs the IP of the remote host", mode);
+            return 1;
+        }
+        strlcpy(cfg.host, bench_args.host->sval[0], sizeof(cfg.host));
+    }
+
+    bool is_latency = cfg.mode == BENCH_ECHO || cfg.mode == BENCH_PING;
+    cfg.port = bench_args.port->count > 0 ? bench_args.port->ival[0] : (is_latency ? BENCH_DEFAULT_ECHO_PORT : BENCH_DEFAULT_PORT);
+    cfg.secs = bench_args.time->count > 0 ? bench_args.time->ival[0] : BENCH_DEFAULT_TIME_S;
+    cfg.len = bench_args.len->count > 0 ? bench_args.len->ival[0] : (is_latency ? 64 : BENCH_DEFAULT_LEN);
+    cfg.kbps = bench_args.kbps->count > 0 ? bench_args.kbps->ival[0] : 0;
+    cfg.count = bench_args.count->count > 0 ? bench_args.count->ival[0] : BENCH_DEFAULT_COUNT;
+    if (cfg.len < sizeof(bench_udp_hdr_t) || cfg.len > BENCH_MAX_LEN || cfg.count == 0 || cfg.count > BENCH_MAX_COUNT)
+    {
+        ESP_LOGW(TAG, "Length must be %d..%d, count 1..%d", (int)sizeof(bench_udp_hdr_t), BENCH_MAX_LEN, BENCH_MAX_COUNT);
+        return 1;
+    }
+
+    bench_cfg = cfg;
+    bench_stop_requested = false;
+    if (xTaskCreate(bench_task, "bench", 4096, NULL, 5, &bench_task_handle) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start benchmark task");
+        bench_task_handle = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+void register_bench(void)
+{
+    bench_args.mode = arg_str1(NULL, NULL, "<mode>", "tcp-sink|tcp-source|udp-sink|udp-source|echo|ping|stop");
+    bench_args.host = arg_str0(NULL, NULL, "<host>", "remote IP for tcp-source, udp-source and ping");
+    bench_args.port = arg_int0("p", "port", "<port>", "port (default 5001, echo/ping 5002)");
+    bench_args.time = arg_int0("t", "time", "<s>", "duration in seconds (default 10)");
+    bench_args.len = arg_int0("l", "len", "<bytes>", "buffer/datagram length (default 1460, echo/ping 64)");
+    bench_args.kbps = arg_int0("b", "bandwidth", "<kbit/s>", "udp-source rate, 0 = unlimited");
+    bench_args.count = arg_int0("n", "count", "<n>", "number of ping requests (default 200)");
+    bench_args.end = arg_end(7);
+
+    const esp_console_cmd_t cmd = {
+        .command = "bench",
+        .help = "Run a throughput or latency benchmark, results are printed as 'BENCH <json>'",
+        .hint = NULL,
+        .func = &bench,
+        .argtable = &bench_args};
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
@@ -0,0 +1,18 @@
+/* Benchmark commands for measuring the forwarding path of the router
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register benchmark functions
+void register_bench(void);
+
+#ifdef __cplusplus
+}
+#endif
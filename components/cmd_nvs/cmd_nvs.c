@@ -44,6 +44,7 @@ static const size_t TYPE_STR_PAIR_SIZE = sizeof(type_str_pair) / sizeof(type_str
 static const char *ARG_TYPE_STR = "type can be: i8, u8, i16, u16 i32, u32 i64, u64, str, blob";
 static char current_namespace[16] = "storage";
 static const char *TAG = "cmd_nvs";
+static nvs_commit_hook_t commit_hook = NULL;
 
 static struct {
     struct arg_str *key;
@@ -161,6 +162,18 @@ static void print_blob(const char *blob, size_t len)
 }
 
 
+void nvs_set_commit_hook(nvs_commit_hook_t hook)
+{
+    commit_hook = hook;
+}
+
+static void notify_commit(void)
+{
+    if (commit_hook != NULL) {
+        commit_hook();
+    }
+}
+
 static esp_err_t set_value_in_nvs(const char *key, const char *str_type, const char *str_value)
 {
     esp_err_t err;
@@ -242,6 +255,7 @@ static esp_err_t set_value_in_nvs(const char *key, const char *str_type, const c
         err = nvs_commit(nvs);
         if (err == ESP_OK) {
             ESP_LOGI(TAG, "Value stored under key '%s'", key);
+            notify_commit();
         }
     }
 
@@ -344,6 +358,7 @@ static esp_err_t erase(const char *key)
             err = nvs_commit(nvs);
             if (err == ESP_OK) {
                 ESP_LOGI(TAG, "Value with key '%s' erased", key);
+                notify_commit();
             }
         }
         nvs_close(nvs);
@@ -362,6 +377,9 @@ static esp_err_t erase_all(const char *name)
         if (err == ESP_OK) {
             err = nvs_commit(nvs);
         }
+        if (err == ESP_OK) {
+            notify_commit();
+        }
     }
 
     ESP_LOGI(TAG, "Namespace '%s' was %s erased", name, (err == ESP_OK) ? "" : "not");
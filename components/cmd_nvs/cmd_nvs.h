@@ -17,6 +17,10 @@ extern "C"
    void register_nvs(void);
    int erase_ns(int argc, char **argv);
 
+   typedef void (*nvs_commit_hook_t)(void);
+   // Called after the console commands have changed NVS
+   void nvs_set_commit_hook(nvs_commit_hook_t hook);
+
 #ifdef __cplusplus
 }
 #endif
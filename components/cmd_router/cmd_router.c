@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/param.h>
 #include "esp_log.h"
 #include "esp_console.h"
 #include "esp_system.h"
@@ -18,8 +19,12 @@
 #include "argtable3/argtable3.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 #include "sdkconfig.h"
 #include "nvs.h"
+#include "nvs_flash.h"
 #include "esp_wifi.h"
 #include "lwip/ip4_addr.h"
 #if !IP_NAPT
@@ -42,115 +47,529 @@ static void register_set_sta_static(void);
 static void register_set_ap(void);
 static void register_set_ap_ip(void);
 static void register_show(void);
+static void register_flows(void);
 static void register_portmap(void);
-
-esp_err_t get_config_param_str(char *name, char **param)
+static void register_stats(void);
+static void register_uplink(void);
+static void register_boot_profile(void);
+
+/* Copy of the PARAM_NAMESPACE entries, so reading a parameter doesn't need NVS
+   or heap. Values are replaced in place if the new one fits, otherwise a
+   buffer of twice the size is used. Old buffers are never freed, because
+   readers may still hold a pointer to them. As the size doubles, all old
+   buffers of an entry together are smaller than the current one, also for
+   blobs which grow with every change (portmap_v2, shaper_tab).
+   The config_set_* functions only change the copy and mark the entry dirty,
+   all dirty entries are written with one commit after CONFIG_FLUSH_DELAY_US.
+   The timer only wakes up the config_flush task, so NVS doesn't block the
+   other esp_timer callbacks. Failed writes stay dirty and are retried. */
+#define CONFIG_FLUSH_DELAY_US (2 * 1000 * 1000)
+#define CONFIG_FLUSH_RETRY_US (30 * 1000 * 1000)
+
+typedef struct
 {
-    nvs_handle_t nvs;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_type_t type;
+    bool present;
+    bool dirty;   // differs from NVS, erased if not present
+    bool written; // by the running flush, clean after the commit if unchanged meanwhile
+    uint32_t version;
+    uint32_t written_version;
+    int32_t i32;
+    char *data; // string or blob, always 0 terminated
+    size_t len; // without the terminating 0 for strings
+    size_t cap;
+} config_entry_t;
+
+static config_entry_t *config_entries = NULL;
+static size_t config_count = 0;
+static size_t config_capacity = 0;
+static SemaphoreHandle_t config_lock = NULL;
+static SemaphoreHandle_t config_flush_lock = NULL; // one flush at a time, the values aren't locked while NVS writes
+static TaskHandle_t config_flush_task_handle = NULL;
+static esp_timer_handle_t config_flush_timer = NULL;
+static config_write_stats_t config_stats;
+static uint32_t config_changes = 0; // starts at a random value, so the ETags of the API differ after a reboot
+
+static config_entry_t *config_find(const char *name)
+{
+    for (size_t i = 0; i < config_count; i++)
+    {
+        if (strcmp(config_entries[i].key, name) == 0)
+        {
+            return &config_entries[i];
+        }
+    }
+    return NULL;
+}
 
-    esp_err_t err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
-    if (err == ESP_OK)
+static config_entry_t *config_add(const char *name)
+{
+    config_entry_t *entry = config_find(name);
+    if (entry != NULL)
+    {
+        return entry;
+    }
+    if (config_count == config_capacity)
     {
-        size_t len;
-        if ((err = nvs_get_str(nvs, name, NULL, &len)) == ESP_OK)
+        size_t capacity = config_capacity == 0 ? 32 : config_capacity * 2;
+        config_entry_t *entries = realloc(config_entries, capacity * sizeof(config_entry_t));
+        if (entries == NULL)
         {
-            *param = (char *)malloc(len);
-            err = nvs_get_str(nvs, name, *param, &len);
-            ESP_LOGI(TAG, "%s %s", name, *param);
+            return NULL;
         }
-        else
+        config_entries = entries;
+        config_capacity = capacity;
+    }
+    entry = &config_entries[config_count++];
+    memset(entry, 0, sizeof(config_entry_t));
+    strlcpy(entry->key, name, sizeof(entry->key));
+    return entry;
+}
+
+// Makes sure the entry can hold len bytes and a terminating 0
+static esp_err_t config_reserve(config_entry_t *entry, size_t len)
+{
+    if (len + 1 > entry->cap)
+    {
+        size_t cap = MAX(len + 1, entry->cap * 2);
+        char *data = malloc(cap);
+        if (data == NULL)
         {
-            return err;
+            return ESP_ERR_NO_MEM;
         }
-        nvs_close(nvs);
+        entry->data = data;
+        entry->cap = cap;
     }
-    else
+    return ESP_OK;
+}
+
+// Reads the value of a string or blob entry from NVS into the entry
+static esp_err_t config_read_data(nvs_handle_t nvs, config_entry_t *entry, nvs_type_t type)
+{
+    size_t len = 0;
+    esp_err_t err = type == NVS_TYPE_STR ? nvs_get_str(nvs, entry->key, NULL, &len) : nvs_get_blob(nvs, entry->key, NULL, &len);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    if ((err = config_reserve(entry, len)) != ESP_OK)
     {
         return err;
     }
+    err = type == NVS_TYPE_STR ? nvs_get_str(nvs, entry->key, entry->data, &len) : nvs_get_blob(nvs, entry->key, entry->data, &len);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    entry->data[len] = '\0';
+    entry->len = type == NVS_TYPE_STR ? strlen(entry->data) : len;
     return ESP_OK;
 }
 
-esp_err_t get_config_param_blob(char *name, char **param, size_t *blob_len)
+static void config_load_locked(void)
 {
-    nvs_handle_t nvs;
-
-    esp_err_t err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
-    if (err == ESP_OK)
+    // NVS may have been written directly (console, nvs_set), the RAM copy changes
+    config_changes++;
+    for (size_t i = 0; i < config_count; i++)
     {
-        size_t len;
-        if ((err = nvs_get_blob(nvs, name, NULL, &len)) == ESP_OK)
+        if (!config_entries[i].dirty)
         {
-            *param = (char *)malloc(len);
-            *blob_len = len;
-
-            err = nvs_get_blob(nvs, name, *param, &len);
+            config_entries[i].present = false;
         }
-        else
+    }
+
+    nvs_handle_t nvs;
+    if (nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        // Namespace doesn't exist yet, nothing configured
+        return;
+    }
+    nvs_iterator_t it = NULL;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, PARAM_NAMESPACE, NVS_TYPE_ANY, &it);
+    while (res == ESP_OK)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        config_entry_t *entry = config_find(info.key);
+        // Pending changes are newer than NVS
+        if ((entry == NULL || !entry->dirty) && (info.type == NVS_TYPE_I32 || info.type == NVS_TYPE_STR || info.type == NVS_TYPE_BLOB))
         {
-            return err;
+            entry = config_add(info.key);
+            esp_err_t err = ESP_ERR_NO_MEM;
+            if (entry != NULL)
+            {
+                err = info.type == NVS_TYPE_I32 ? nvs_get_i32(nvs, info.key, &entry->i32) : config_read_data(nvs, entry, info.type);
+            }
+            if (err == ESP_OK)
+            {
+                entry->type = info.type;
+                entry->present = true;
+            }
+            else
+            {
+                ESP_LOGE(TAG, "Reading %s failed: %s", info.key, esp_err_to_name(err));
+            }
         }
-        nvs_close(nvs);
+        res = nvs_entry_next(&it);
     }
-    else
+    nvs_release_iterator(it);
+    nvs_close(nvs);
+}
+
+static void config_ensure_loaded(void)
+{
+    if (config_lock == NULL)
     {
-        return err;
+        config_load();
     }
-    return ESP_OK;
 }
 
-esp_err_t get_config_param_blob2(char *name, uint8_t *blob, size_t blob_len)
+static void config_flush_task(void *arg)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        config_flush();
+    }
+}
+
+static void config_flush_timer_callback(void *arg)
+{
+    if (config_flush_task_handle != NULL)
+    {
+        xTaskNotifyGive(config_flush_task_handle);
+    }
+}
+
+static void config_shutdown_handler(void)
 {
+    config_flush();
+}
+
+void config_load(void)
+{
+    if (config_lock == NULL)
+    {
+        config_lock = xSemaphoreCreateMutex();
+        config_flush_lock = xSemaphoreCreateMutex();
+        config_changes = esp_random();
+        const esp_timer_create_args_t timer_args = {
+            .callback = &config_flush_timer_callback,
+            .name = "config_flush"};
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &config_flush_timer));
+        // Pending changes are written before esp_restart
+        esp_register_shutdown_handler(config_shutdown_handler);
+    }
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_load_locked();
+    xSemaphoreGive(config_lock);
+    if (config_flush_task_handle == NULL)
+    {
+        // Created after loading, the core of the management tasks is a parameter
+        xTaskCreatePinnedToCore(config_flush_task, "config_flush", 3072, NULL, tskIDLE_PRIORITY + 1, &config_flush_task_handle, get_mgmt_task_core());
+    }
+    ESP_LOGD(TAG, "%d config parameters loaded", (int)config_count);
+}
+
+esp_err_t config_commit(nvs_handle_t nvs)
+{
+    esp_err_t err = nvs_commit(nvs);
+    config_load();
+    return err;
+}
+
+// Writes a copy of an entry, data is the copy of a string or blob
+static esp_err_t config_write(nvs_handle_t nvs, const config_entry_t *value, const char *data)
+{
+    if (!value->present)
+    {
+        esp_err_t err = nvs_erase_key(nvs, value->key);
+        return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+    }
+    if (value->type == NVS_TYPE_I32)
+    {
+        return nvs_set_i32(nvs, value->key, value->i32);
+    }
+    if (value->type == NVS_TYPE_STR)
+    {
+        return nvs_set_str(nvs, value->key, data);
+    }
+    // NVS keeps the old blob until the new one is written
+    esp_err_t err = nvs_set_blob(nvs, value->key, data, value->len);
+    if (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE)
+    {
+        // A large blob (certificate) may not fit twice, it is lost if the power fails in between
+        ESP_LOGW(TAG, "No room for a second copy of %s, replacing it", value->key);
+        nvs_erase_key(nvs, value->key);
+        err = nvs_set_blob(nvs, value->key, data, value->len);
+    }
+    return err;
+}
+
+void config_flush(void)
+{
+    config_ensure_loaded();
+    esp_timer_stop(config_flush_timer);
+    xSemaphoreTake(config_flush_lock, portMAX_DELAY);
     nvs_handle_t nvs;
+    bool opened = false;
+    bool failed = false;
+    for (size_t i = 0;; i++)
+    {
+        // The entry is copied, so the getters don't wait for NVS
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        if (i >= config_count)
+        {
+            xSemaphoreGive(config_lock);
+            break;
+        }
+        config_entry_t *entry = &config_entries[i];
+        if (!entry->dirty)
+        {
+            xSemaphoreGive(config_lock);
+            continue;
+        }
+        config_entry_t value = *entry;
+        char *data = NULL;
+        if (value.present && value.type != NVS_TYPE_I32 && (data = malloc(value.len + 1)) != NULL)
+        {
+            memcpy(data, entry->data, value.len + 1);
+        }
+        xSemaphoreGive(config_lock);
 
-    esp_err_t err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
-    if (err == ESP_OK)
+        esp_err_t err = ESP_OK;
+        if (value.present && value.type != NVS_TYPE_I32 && data == NULL)
+        {
+            err = ESP_ERR_NO_MEM;
+        }
+        else if (!opened)
+        {
+            err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+            opened = err == ESP_OK;
+        }
+        if (err == ESP_OK)
+        {
+            err = config_write(nvs, &value, data);
+        }
+        free(data);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Writing %s failed: %s", value.key, esp_err_to_name(err));
+            failed = true;
+            continue;
+        }
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        // the array may have been moved meanwhile
+        entry = &config_entries[i];
+        entry->written = true;
+        entry->written_version = value.version;
+        config_stats.writes++;
+        xSemaphoreGive(config_lock);
+    }
+    if (opened)
     {
-        size_t len;
-        if ((err = nvs_get_blob(nvs, name, NULL, &len)) == ESP_OK)
+        esp_err_t err = nvs_commit(nvs);
+        nvs_close(nvs);
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        for (size_t i = 0; i < config_count; i++)
         {
-            if (len != blob_len)
+            config_entry_t *entry = &config_entries[i];
+            if (entry->written && err == ESP_OK && entry->written_version == entry->version)
             {
-                return ESP_ERR_NVS_INVALID_LENGTH;
+                entry->dirty = false;
             }
-            err = nvs_get_blob(nvs, name, blob, &len);
-            ESP_LOGD(TAG, "%s: %d", name, len);
+            entry->written = false;
+        }
+        if (err == ESP_OK)
+        {
+            config_stats.commits++;
+            ESP_LOGI(TAG, "Config written, %lu of %lu changes needed a flash write", (unsigned long)config_stats.writes, (unsigned long)config_stats.sets);
         }
         else
         {
-            return err;
+            ESP_LOGE(TAG, "Committing config failed: %s", esp_err_to_name(err));
+            failed = true;
         }
-        nvs_close(nvs);
+        xSemaphoreGive(config_lock);
     }
-    else
+    if (failed && !esp_timer_is_active(config_flush_timer))
     {
-        return err;
+        esp_timer_start_once(config_flush_timer, CONFIG_FLUSH_RETRY_US);
+    }
+    xSemaphoreGive(config_flush_lock);
+}
+
+uint32_t config_generation(void)
+{
+    return __atomic_load_n(&config_changes, __ATOMIC_RELAXED);
+}
+
+void config_get_write_stats(config_write_stats_t *stats)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    *stats = config_stats;
+    xSemaphoreGive(config_lock);
+}
+
+/* Takes the lock and returns the entry for a change. NULL (and the lock released)
+   if there is no memory for a new entry. */
+static config_entry_t *config_begin_set(const char *name)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_stats.sets++;
+    config_entry_t *entry = config_add(name);
+    if (entry == NULL)
+    {
+        xSemaphoreGive(config_lock);
     }
+    return entry;
+}
+
+static void config_end_set(config_entry_t *entry, bool changed)
+{
+    if (changed)
+    {
+        entry->dirty = true;
+        entry->version++;
+        config_changes++;
+        // Every change restarts the delay, so a batch of changes ends up in one commit
+        esp_timer_stop(config_flush_timer);
+        esp_timer_start_once(config_flush_timer, CONFIG_FLUSH_DELAY_US);
+    }
+    xSemaphoreGive(config_lock);
+}
+
+esp_err_t config_set_i32(const char *name, int32_t value)
+{
+    config_entry_t *entry = config_begin_set(name);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    bool changed = !entry->present || entry->type != NVS_TYPE_I32 || entry->i32 != value;
+    entry->type = NVS_TYPE_I32;
+    entry->i32 = value;
+    entry->present = true;
+    config_end_set(entry, changed);
     return ESP_OK;
 }
 
-esp_err_t get_config_param_int(char *name, int32_t *param)
+static esp_err_t config_set_data(const char *name, nvs_type_t type, const void *value, size_t len)
 {
-    nvs_handle_t nvs;
+    config_entry_t *entry = config_begin_set(name);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    bool changed = !entry->present || entry->type != type || entry->len != len || memcmp(entry->data, value, len) != 0;
+    esp_err_t err = changed ? config_reserve(entry, len) : ESP_OK;
+    if (err == ESP_OK && changed)
+    {
+        memcpy(entry->data, value, len);
+        entry->data[len] = '\0';
+        entry->len = len;
+        entry->type = type;
+        entry->present = true;
+    }
+    config_end_set(entry, changed && err == ESP_OK);
+    return err;
+}
 
-    esp_err_t err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+esp_err_t config_set_str(const char *name, const char *value)
+{
+    return config_set_data(name, NVS_TYPE_STR, value, strlen(value));
+}
+
+esp_err_t config_set_blob(const char *name, const void *value, size_t len)
+{
+    return config_set_data(name, NVS_TYPE_BLOB, value, len);
+}
+
+esp_err_t config_erase(const char *name)
+{
+    config_entry_t *entry = config_begin_set(name);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    bool changed = entry->present;
+    entry->present = false;
+    config_end_set(entry, changed);
+    return ESP_OK;
+}
+
+// Looks up a present entry of the given type, the lock must be held
+static config_entry_t *config_get(const char *name, nvs_type_t type)
+{
+    config_entry_t *entry = config_find(name);
+    if (entry == NULL || !entry->present)
+    {
+        return NULL;
+    }
+    return entry->type == type ? entry : NULL;
+}
+
+esp_err_t get_config_param_str(char *name, const char **param)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_entry_t *entry = config_get(name, NVS_TYPE_STR);
+    if (entry != NULL)
+    {
+        *param = entry->data;
+    }
+    xSemaphoreGive(config_lock);
+    return entry != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t get_config_param_blob(char *name, const char **param, size_t *blob_len)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_entry_t *entry = config_get(name, NVS_TYPE_BLOB);
+    if (entry != NULL)
+    {
+        *param = entry->data;
+        *blob_len = entry->len;
+    }
+    xSemaphoreGive(config_lock);
+    return entry != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t get_config_param_blob2(char *name, uint8_t *blob, size_t blob_len)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_entry_t *entry = config_get(name, NVS_TYPE_BLOB);
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    if (entry != NULL)
+    {
+        err = entry->len == blob_len ? ESP_OK : ESP_ERR_NVS_INVALID_LENGTH;
+    }
     if (err == ESP_OK)
     {
-        if ((err = nvs_get_i32(nvs, name, param)) == ESP_OK)
-        {
-            ESP_LOGD(TAG, "%s %ld", name, *param);
-        }
-        else
-        {
-            return err;
-        }
-        nvs_close(nvs);
+        memcpy(blob, entry->data, blob_len);
+        ESP_LOGD(TAG, "%s: %d", name, blob_len);
     }
-    else
+    xSemaphoreGive(config_lock);
+    return err;
+}
+
+esp_err_t get_config_param_int(char *name, int32_t *param)
+{
+    config_ensure_loaded();
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    config_entry_t *entry = config_get(name, NVS_TYPE_I32);
+    if (entry != NULL)
     {
-        return err;
+        *param = entry->i32;
+        ESP_LOGD(TAG, "%s %ld", name, *param);
     }
-    return ESP_OK;
+    xSemaphoreGive(config_lock);
+    return entry != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
 }
 
 esp_err_t erase_key(char *name)
@@ -161,7 +580,7 @@ esp_err_t erase_key(char *name)
     if (err == ESP_OK)
     {
         nvs_erase_key(nvs, name);
-        nvs_commit(nvs);
+        config_commit(nvs);
         nvs_close(nvs);
         return ESP_OK;
     }
@@ -172,39 +591,42 @@ esp_err_t erase_key(char *name)
     return ESP_OK;
 }
 
-char *getDefaultIPByNetmask()
+const char *getDefaultIPByNetmask()
 {
+    // The netmask and the octet only change with the config, so the address is only built again after a change
+    static char result[16];
+    static uint32_t generation = 0;
+    static bool valid = false;
+    if (valid && generation == config_generation())
+    {
+        return result;
+    }
+    generation = config_generation();
 
-    char *result = (char *)malloc(15);
-    char *netmask = getNetmask();
-
+    const char *netmask = getNetmask();
     int32_t octet = 4;
     get_config_param_int("octet", &octet);
 
     char *netmask_to_compare = "255.255.255.";
     if (strncmp(netmask, netmask_to_compare, strlen(netmask_to_compare)) == 0)
     {
-        sprintf(result, DEFAULT_AP_IP_CLASS_C, octet);
-        return result;
+        snprintf(result, sizeof(result), DEFAULT_AP_IP_CLASS_C, octet);
     }
-
-    netmask_to_compare = "255.255.";
-    if (strncmp(netmask, netmask_to_compare, strlen(netmask_to_compare)) == 0)
+    else if (strncmp(netmask, "255.255.", strlen("255.255.")) == 0)
     {
-
-        sprintf(result, DEFAULT_AP_IP_CLASS_B, octet);
-        return result;
+        snprintf(result, sizeof(result), DEFAULT_AP_IP_CLASS_B, octet);
     }
     else
     {
-        sprintf(result, DEFAULT_AP_IP_CLASS_A, octet);
-        return result;
+        snprintf(result, sizeof(result), DEFAULT_AP_IP_CLASS_A, octet);
     }
+    valid = true;
+    return result;
 }
 
-char *getNetmask()
+const char *getNetmask()
 {
-    char *netmask = NULL;
+    const char *netmask = NULL;
 
     get_config_param_str("netmask", &netmask);
 
@@ -220,38 +642,9 @@ char *getNetmask()
 
 void cleanConsoleString(char *str)
 {
-    char *p, *q;
-
-    for (p = q = str; *p != 0; p++)
-    {
-        if (*(p) == '%' && *(p + 1) != 0 && *(p + 2) != 0)
-        {
-            // quoted hex
-            uint8_t a;
-            p++;
-            if (*p <= '9')
-                a = *p - '0';
-            else
-                a = toupper((unsigned char)*p) - 'A' + 10;
-            a <<= 4;
-            p++;
-            if (*p <= '9')
-                a += *p - '0';
-            else
-                a += toupper((unsigned char)*p) - 'A' + 10;
-            *q++ = a;
-        }
-        else if (*(p) == '+')
-        {
-            *q++ = ' ';
-        }
-        else
-        {
-            *q++ = *p;
-        }
-    }
-    *q = '\0';
+    url_decode(str);
 }
+
 void register_router(void)
 {
     register_set_sta();
@@ -261,6 +654,10 @@ void register_router(void)
     register_set_ap_ip();
     register_portmap();
     register_show();
+    register_flows();
+    register_stats();
+    register_uplink();
+    register_boot_profile();
 }
 
 /** Arguments used by 'set_sta' function */
@@ -305,7 +702,7 @@ int set_sta(int argc, char **argv)
     nvs_erase_key(nvs, "sta_user");
     nvs_erase_key(nvs, "sta_identity");
 
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_commit(nvs));
     ESP_LOGI(TAG, "STA settings %s/%s stored.", set_sta_arg.ssid->sval[0], set_sta_arg.password->sval[0]);
 
     nvs_close(nvs);
@@ -335,7 +732,7 @@ int set_sta_ent(int argc, char **argv)
     ESP_ERROR_CHECK(nvs_set_str(nvs, "sta_user", set_sta_ent_arg.user->sval[0]));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "sta_identity", set_sta_ent_arg.identity->sval[0]));
 
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_commit(nvs));
     ESP_LOGI(TAG, "WPA Enterprise settings SSID: '%s', User: %s, Identity: %s, Password: %s stored.", set_sta_ent_arg.ssid->sval[0], set_sta_ent_arg.user->sval[0], set_sta_ent_arg.identity->sval[0], set_sta_ent_arg.password->sval[0]);
 
     nvs_close(nvs);
@@ -402,7 +799,7 @@ int set_sta_static(int argc, char **argv)
     ESP_ERROR_CHECK(nvs_set_str(nvs, "static_ip", set_sta_static_arg.static_ip->sval[0]));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "subnet_mask", set_sta_static_arg.subnet_mask->sval[0]));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "gateway_addr", set_sta_static_arg.gateway_addr->sval[0]));
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_commit(nvs));
     ESP_LOGI(TAG, "STA Static IP settings %s/%s/%s stored.", set_sta_static_arg.static_ip->sval[0], set_sta_static_arg.subnet_mask->sval[0], set_sta_static_arg.gateway_addr->sval[0]);
 
     nvs_close(nvs);
@@ -456,7 +853,7 @@ int set_ap(int argc, char **argv)
     ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "ap_ssid", set_ap_args.ssid->sval[0]));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "ap_passwd", set_ap_args.password->sval[0]));
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_commit(nvs));
     ESP_LOGI(TAG, "AP settings %s/%s stored.", set_ap_args.ssid->sval[0], set_ap_args.password->sval[0]);
 
     nvs_close(nvs);
@@ -499,7 +896,7 @@ int set_ap_ip(int argc, char **argv)
 
     ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
     ESP_ERROR_CHECK(nvs_set_str(nvs, "ap_ip", set_ap_ip_arg.ap_ip_str->sval[0]));
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_commit(nvs));
     ESP_LOGI(TAG, "AP IP address %s stored.", set_ap_ip_arg.ap_ip_str->sval[0]);
     nvs_close(nvs);
     return ESP_OK;
@@ -607,13 +1004,13 @@ static void register_portmap(void)
 /* 'show' command */
 static int show(int argc, char **argv)
 {
-    char *ssid = NULL;
-    char *passwd = NULL;
-    char *static_ip = NULL;
-    char *subnet_mask = NULL;
-    char *gateway_addr = NULL;
-    char *ap_ssid = NULL;
-    char *ap_passwd = NULL;
+    const char *ssid = NULL;
+    const char *passwd = NULL;
+    const char *static_ip = NULL;
+    const char *subnet_mask = NULL;
+    const char *gateway_addr = NULL;
+    const char *ap_ssid = NULL;
+    const char *ap_passwd = NULL;
 
     get_config_param_str("ssid", &ssid);
     get_config_param_str("passwd", &passwd);
@@ -631,20 +1028,6 @@ static int show(int argc, char **argv)
     addr.addr = my_ap_ip;
     printf("AP IP address: " IPSTR "\n", IP2STR(&addr));
 
-    if (ssid != NULL)
-        free(ssid);
-    if (passwd != NULL)
-        free(passwd);
-    if (static_ip != NULL)
-        free(static_ip);
-    if (subnet_mask != NULL)
-        free(subnet_mask);
-    if (gateway_addr != NULL)
-        free(gateway_addr);
-    if (ap_ssid != NULL)
-        free(ap_ssid);
-    if (ap_passwd != NULL)
-        free(ap_passwd);
 
     printf("Uplink AP %sconnected\n", ap_connect ? "" : "not ");
     if (ap_connect)
@@ -669,3 +1052,149 @@ static void register_show(void)
     };
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
 }
+
+/** Arguments used by 'flows' function */
+static struct
+{
+    struct arg_int *max;
+    struct arg_end *end;
+} flows_args;
+
+/* 'flows' command */
+static int flows(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&flows_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, flows_args.end, argv[0]);
+        return 1;
+    }
+    int max = flows_args.max->count > 0 ? flows_args.max->ival[0] : 32;
+    flowtable_print(max > 0 ? max : 0);
+    return 0;
+}
+
+static void register_flows(void)
+{
+    flows_args.max = arg_int0(NULL, NULL, "<max>", "number of flows to print, default 32");
+    flows_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "flows",
+        .help = "Print the flows of the NAT table and the number of flows per client",
+        .hint = NULL,
+        .func = &flows,
+        .argtable = &flows_args};
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
+/* 'stats' command */
+static int stats(int argc, char **argv)
+{
+    char *json = malloc(STATS_JSON_MAX_LEN); // too large for the stack of the console
+    if (json == NULL)
+    {
+        return 1;
+    }
+    stats_format_json(json, STATS_JSON_MAX_LEN);
+    printf("%s\n", json);
+    free(json);
+    return 0;
+}
+
+static void register_stats(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "stats",
+        .help = "Print the traffic, drop and NAPT counters as JSON",
+        .hint = NULL,
+        .func = &stats,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
+/** Arguments used by 'uplink' function */
+static struct
+{
+    struct arg_str *add_del;
+    struct arg_str *ssid;
+    struct arg_str *password;
+    struct arg_end *end;
+} uplink_args;
+
+/* 'uplink' command */
+static int uplink(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&uplink_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, uplink_args.end, argv[0]);
+        return 1;
+    }
+    if (uplink_args.add_del->count == 0)
+    {
+        uplink_print_status();
+        return 0;
+    }
+    if (uplink_args.ssid->count == 0)
+    {
+        ESP_LOGW(TAG, "SSID missing");
+        return 1;
+    }
+    const char *ssid = uplink_args.ssid->sval[0];
+    esp_err_t err;
+    if (strcmp(uplink_args.add_del->sval[0], "add") == 0)
+    {
+        err = uplink_add_alternate(ssid, uplink_args.password->count > 0 ? uplink_args.password->sval[0] : "");
+    }
+    else if (strcmp(uplink_args.add_del->sval[0], "del") == 0)
+    {
+        err = uplink_del_alternate(ssid);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Must be 'add' or 'del'");
+        return 1;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Alternative network '%s' not changed: %s", ssid, esp_err_to_name(err));
+        return 1;
+    }
+    ESP_LOGI(TAG, "Alternative networks stored, restart to use them");
+    return 0;
+}
+
+static void register_uplink(void)
+{
+    uplink_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete an alternative network");
+    uplink_args.ssid = arg_str0(NULL, NULL, "<ssid>", "SSID of the alternative network");
+    uplink_args.password = arg_str0(NULL, NULL, "<pass>", "password of the alternative network");
+    uplink_args.end = arg_end(3);
+
+    const esp_console_cmd_t cmd = {
+        .command = "uplink",
+        .help = "Show the uplink connection or add/delete an alternative uplink network",
+        .hint = NULL,
+        .func = &uplink,
+        .argtable = &uplink_args};
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
+
+/* 'boot_profile' command */
+static int boot_profile(int argc, char **argv)
+{
+    boot_profile_print();
+    return 0;
+}
+
+static void register_boot_profile(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "boot_profile",
+        .help = "Print the time of the boot phases since the start of the chip",
+        .hint = NULL,
+        .func = &boot_profile,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+}
@@ -7,6 +7,7 @@
 
 #include "cc.h"
 #include "esp_wifi.h"
+#include "nvs.h"
 
 #pragma once
 
@@ -21,7 +22,12 @@ extern "C"
 
 #define PROTO_TCP 6
 #define PROTO_UDP 17
-#define PORTMAP_MAX 32
+/* Limit of the NVS parameter portmap_max, lwIP keeps the count of its portmap table in an u8_t */
+#define PORTMAP_MAX 255
+
+/* Limits of the NVS parameter napt_max, the size of the NAPT table */
+#define NAPT_MAX_ENTRIES_MIN 64
+#define NAPT_MAX_ENTRIES_LIMIT 2048
 
    struct portmap_table_entry
    {
@@ -31,13 +37,15 @@ extern "C"
       u8_t proto;
       u8_t valid;
    };
+   /* The first portmap_count entries are used */
    extern struct portmap_table_entry portmap_tab[PORTMAP_MAX];
+   extern uint8_t portmap_count;
 
-   extern char *ssid;
-   extern char *passwd;
-   extern char *gateway_addr;
-   extern char *ap_ssid;
-   extern char *ap_passwd;
+   extern const char *ssid;
+   extern const char *passwd;
+   extern const char *gateway_addr;
+   extern const char *ap_ssid;
+   extern const char *ap_passwd;
 
   
    extern bool ap_connect;
@@ -50,18 +58,59 @@ extern "C"
    int set_sta_static(int argc, char **argv);
    int set_ap(int argc, char **argv);
 
+   /**
+    * @brief (Re)loads all parameters of PARAM_NAMESPACE from NVS into RAM.
+    * The getters load them on first use, this is only needed after writing
+    * to NVS without config_commit.
+    */
+   void config_load(void);
+   /**
+    * @brief Commits the handle and updates the RAM copy of the parameters
+    */
+   esp_err_t config_commit(nvs_handle_t nvs);
+
+   typedef struct
+   {
+      uint32_t sets;    // calls of config_set_* and config_erase
+      uint32_t writes;  // entries written to flash, unchanged and superseded values are skipped
+      uint32_t commits; // NVS commits
+   } config_write_stats_t;
+
+   /**
+    * @brief Changes a parameter in the RAM copy. The changed parameters are written
+    * together after a short delay, at config_flush or before a restart.
+    * Setting the current value doesn't write anything.
+    */
+   esp_err_t config_set_i32(const char *name, int32_t value);
+   esp_err_t config_set_str(const char *name, const char *value);
+   esp_err_t config_set_blob(const char *name, const void *value, size_t len);
+   esp_err_t config_erase(const char *name);
+   /**
+    * @brief Writes the pending changes of config_set_* with one commit
+    */
+   void config_flush(void);
+   void config_get_write_stats(config_write_stats_t *stats);
+   /* Changes with every change of the RAM copy, i.e. to detect changes without reading the parameters.
+      Starts at a random value on every boot. */
+   uint32_t config_generation(void);
+
+   /* The getters return ESP_ERR_NVS_NOT_FOUND if the parameter isn't set.
+      Strings and blobs are borrowed from the RAM copy and must not be changed
+      or freed, blobs are 0 terminated as well. */
    esp_err_t get_config_param_int(char *name, int32_t *param);
-   esp_err_t get_config_param_str(char *name, char **param);
-   esp_err_t get_config_param_blob(char *name, char **param, size_t *blob_len);
+   esp_err_t get_config_param_str(char *name, const char **param);
+   esp_err_t get_config_param_blob(char *name, const char **param, size_t *blob_len);
    esp_err_t get_config_param_blob2(char *name, uint8_t *blob, size_t blob_len);
    esp_err_t erase_key(char *name);
 
    void print_portmap_tab();
+   uint8_t get_portmap_limit(void);
    esp_err_t add_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport);
    esp_err_t del_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport);
 
-   char *getDefaultIPByNetmask();
-   char *getNetmask();
+   /* The default IP of the AP, the string is cached and must not be freed */
+   const char *getDefaultIPByNetmask();
+   const char *getNetmask();
 
 #define DEFAULT_NETMASK_CLASS_A "255.0.0.0"
 #define DEFAULT_NETMASK_CLASS_B "255.255.0.0"
@@ -79,9 +128,53 @@ extern "C"
    void start_dns_server();
    void stop_dns_server();
    bool isDnsStarted();
+   /**
+    * @brief True as long as all queries are answered with the soft AP's IP address
+    */
+   bool isDnsCaptive();
+   /**
+    * @brief Switches the DNS server from captive portal to caching proxy mode,
+    * queries are forwarded to upstream_ip (network byte order)
+    */
+   void set_dns_upstream(uint32_t upstream_ip);
    uint16_t getConnectCount();
 
-#define DEFAULT_SCAN_LIST_SIZE 15
+   /* Uplink manager (src/uplink.c): status and the alternative uplink networks */
+   void uplink_print_status(void);
+   esp_err_t uplink_add_alternate(const char *ssid, const char *passwd);
+   esp_err_t uplink_del_alternate(const char *ssid);
+
+   /* Decodes %XX and '+' in place (src/urldecode.c) */
+   size_t url_decode(char *str);
+
+   /* Prints the boot phases of src/bootprofile.c */
+   void boot_profile_print(void);
+
+   /* Prints up to max flows of the NAPT table and the flows per client (src/flowtable.c) */
+   void flowtable_print(uint32_t max);
+
+#define STATS_JSON_MAX_LEN 3328
+
+   /**
+    * @brief Writes the traffic, drop, NAPT and DNS counters as compact JSON into buf
+    *
+    * @return length of the JSON string, truncated to size - 1
+    */
+   size_t stats_format_json(char *buf, size_t size);
+
+/* Networks kept of the last scan */
+#define DEFAULT_SCAN_LIST_SIZE 32
+
+/* Priority of the management tasks (web server, DNS, OTA, LED), below tcpip (18) and WiFi (23) */
+#define MGMT_TASK_PRIORITY 5
+
+   /**
+    * @brief Core of the management tasks. On dual core chips it is the core without
+    * the tcpip and WiFi tasks, unless the parameter task_pinning is 0.
+    *
+    * @return core id or tskNO_AFFINITY
+    */
+   int get_mgmt_task_core(void);
 
 #ifdef __cplusplus
 }
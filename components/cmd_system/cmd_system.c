@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/param.h>
 #include "esp_log.h"
 #include "esp_console.h"
 #include "esp_system.h"
@@ -168,6 +169,109 @@ static void register_heap(void)
 /** 'tasks' command prints the list of tasks and related information */
 #if WITH_TASKS_INFO
 
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+/* Run time of every task at the last call, to show the share since then */
+typedef struct
+{
+    TaskHandle_t handle;
+    configRUN_TIME_COUNTER_TYPE run_time;
+} task_sample_t;
+
+static task_sample_t *last_samples = NULL;
+static size_t last_sample_count = 0;
+static configRUN_TIME_COUNTER_TYPE last_total_run_time = 0;
+
+static configRUN_TIME_COUNTER_TYPE last_run_time(TaskHandle_t handle)
+{
+    for (size_t i = 0; i < last_sample_count; i++)
+    {
+        if (last_samples[i].handle == handle)
+        {
+            return last_samples[i].run_time;
+        }
+    }
+    return 0;
+}
+
+static const char *task_state_name(eTaskState state)
+{
+    switch (state)
+    {
+    case eRunning:
+        return "X";
+    case eReady:
+        return "R";
+    case eBlocked:
+        return "B";
+    case eSuspended:
+        return "S";
+    default:
+        return "D";
+    }
+}
+
+static int tasks_info(int argc, char **argv)
+{
+    UBaseType_t count = uxTaskGetNumberOfTasks() + 2; // tasks created meanwhile
+    TaskStatus_t *tasks = malloc(count * sizeof(TaskStatus_t));
+    task_sample_t *samples = malloc(count * sizeof(task_sample_t));
+    if (tasks == NULL || samples == NULL)
+    {
+        ESP_LOGE(TAG, "failed to allocate buffer for the task list");
+        free(tasks);
+        free(samples);
+        return 1;
+    }
+    configRUN_TIME_COUNTER_TYPE total_run_time;
+    count = uxTaskGetSystemState(tasks, count, &total_run_time);
+    // Time since the last call, every core spends it in its tasks
+    configRUN_TIME_COUNTER_TYPE elapsed = MAX(total_run_time - last_total_run_time, 1);
+
+    printf("CPU share of one core since the %s\n", last_samples == NULL ? "start" : "last 'tasks' call");
+    fputs("Task Name       \tStatus\tPrio\tHWM\tCore\tCPU\n", stdout);
+    uint32_t core_idle[portNUM_PROCESSORS] = {0};
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        TaskStatus_t *task = &tasks[i];
+        uint32_t share = (uint64_t)(task->ulRunTimeCounter - last_run_time(task->xHandle)) * 1000 / elapsed; // in 0.1 %
+        samples[i].handle = task->xHandle;
+        samples[i].run_time = task->ulRunTimeCounter;
+
+        char core[4] = "any";
+#ifdef CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+        if (task->xCoreID != tskNO_AFFINITY)
+        {
+            snprintf(core, sizeof(core), "%d", (int)task->xCoreID);
+        }
+#endif
+        printf("%-16s\t%s\t%u\t%lu\t%s\t%lu.%lu%%\n", task->pcTaskName, task_state_name(task->eCurrentState),
+               (unsigned)task->uxCurrentPriority, (unsigned long)task->usStackHighWaterMark, core,
+               (unsigned long)share / 10, (unsigned long)share % 10);
+        for (int c = 0; c < portNUM_PROCESSORS; c++)
+        {
+            if (task->xHandle == xTaskGetIdleTaskHandleForCore(c))
+            {
+                core_idle[c] = share;
+            }
+        }
+    }
+    for (int c = 0; c < portNUM_PROCESSORS; c++)
+    {
+        uint32_t load = core_idle[c] < 1000 ? 1000 - core_idle[c] : 0;
+        printf("Core %d load: %lu.%lu%%\n", c, (unsigned long)load / 10, (unsigned long)load % 10);
+    }
+
+    free(tasks);
+    free(last_samples);
+    last_samples = samples;
+    last_sample_count = count;
+    last_total_run_time = total_run_time;
+    return 0;
+}
+
+#else
+
 static int tasks_info(int argc, char **argv)
 {
     const size_t bytes_per_task = 40; /* see vTaskList description */
@@ -188,11 +292,13 @@ static int tasks_info(int argc, char **argv)
     return 0;
 }
 
+#endif // CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
 static void register_tasks(void)
 {
     const esp_console_cmd_t cmd = {
         .command = "tasks",
-        .help = "Get information about running tasks",
+        .help = "Get information about running tasks and their share of the CPU",
         .hint = NULL,
         .func = &tasks_info,
     };
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_timer.h"
+
+#include "bootprofile.h"
+#include "router_globals.h"
+
+typedef struct
+{
+    const char *phase; // set last, the entry is incomplete while it is NULL
+    int64_t time_us;
+} boot_mark_t;
+
+static boot_mark_t marks[BOOT_PROFILE_MAX_MARKS];
+static uint32_t mark_count = 0;
+
+void boot_mark(const char *phase)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t i = __atomic_fetch_add(&mark_count, 1, __ATOMIC_RELAXED);
+    if (i >= BOOT_PROFILE_MAX_MARKS)
+    {
+        return;
+    }
+    marks[i].time_us = now;
+    __atomic_store_n(&marks[i].phase, phase, __ATOMIC_RELEASE);
+}
+
+void boot_profile_print(void)
+{
+    uint32_t count = __atomic_load_n(&mark_count, __ATOMIC_RELAXED);
+    if (count > BOOT_PROFILE_MAX_MARKS)
+    {
+        count = BOOT_PROFILE_MAX_MARKS;
+    }
+    printf("%10s %10s  %s\n", "ms", "+ms", "phase");
+    int64_t previous = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *phase = __atomic_load_n(&marks[i].phase, __ATOMIC_ACQUIRE);
+        if (phase == NULL)
+        {
+            continue;
+        }
+        printf("%10ld %10ld  %s\n", (long)(marks[i].time_us / 1000), (long)((marks[i].time_us - previous) / 1000), phase);
+        previous = marks[i].time_us;
+    }
+}
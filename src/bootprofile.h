@@ -0,0 +1,9 @@
+#pragma once
+
+/* Timestamps (esp_timer_get_time, microseconds since the start of the chip) of
+   the boot phases, shown with the console command boot_profile.
+   Phases are string literals, only the first BOOT_PROFILE_MAX_MARKS are kept. */
+#define BOOT_PROFILE_MAX_MARKS 16
+
+/* Can be called from any task, including the tcpip thread */
+void boot_mark(const char *phase);
@@ -0,0 +1,205 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "lwip/prot/ethernet.h"
+
+#include "clientstats.h"
+#include "stats.h"
+
+static const char *TAG = "ClientStats";
+
+/* Weight of the last interval: 1 / 2^CLIENTSTATS_EWMA_SHIFT */
+#define CLIENTSTATS_EWMA_SHIFT 2
+
+typedef struct
+{
+    bool used;
+    uint8_t mac[6];
+    stats_counter_t rx_bytes;
+    stats_counter_t rx_packets;
+    stats_counter_t tx_bytes;
+    stats_counter_t tx_packets;
+    uint64_t last_rx_bytes;
+    uint64_t last_tx_bytes;
+    uint32_t rx_bps;
+    uint32_t tx_bps;
+    int64_t connected_us;
+} clientstats_entry_t;
+
+typedef struct
+{
+    uint8_t mac[6];
+    uint16_t aid;
+    bool connected;
+} clientstats_event_t;
+
+/* Written in the tcpip thread only, index 0 is unused (no AID). The counters
+   follow the scheme of stats.h, the rates and the flags are 32 bit or smaller
+   and are read without any lock. */
+static clientstats_entry_t entries[CLIENTSTATS_MAX_AID + 1];
+static uint16_t last_aid = 0;
+
+static inline clientstats_entry_t *clientstats_find(const uint8_t *mac)
+{
+    if (entries[last_aid].used && memcmp(entries[last_aid].mac, mac, 6) == 0)
+    {
+        return &entries[last_aid];
+    }
+    for (uint16_t aid = 1; aid <= CLIENTSTATS_MAX_AID; aid++)
+    {
+        if (entries[aid].used && memcmp(entries[aid].mac, mac, 6) == 0)
+        {
+            last_aid = aid;
+            return &entries[aid];
+        }
+    }
+    return NULL;
+}
+
+void clientstats_rx(const struct pbuf *p)
+{
+    if (p->len < SIZEOF_ETH_HDR)
+    {
+        return;
+    }
+    clientstats_entry_t *entry = clientstats_find(((const struct eth_hdr *)p->payload)->src.addr);
+    if (entry != NULL)
+    {
+        stats_add(&entry->rx_bytes, p->tot_len);
+        stats_inc(&entry->rx_packets);
+    }
+}
+
+void clientstats_tx(const struct pbuf *p)
+{
+    if (p->len < SIZEOF_ETH_HDR)
+    {
+        return;
+    }
+    clientstats_entry_t *entry = clientstats_find(((const struct eth_hdr *)p->payload)->dest.addr);
+    if (entry != NULL)
+    {
+        stats_add(&entry->tx_bytes, p->tot_len);
+        stats_inc(&entry->tx_packets);
+    }
+}
+
+static uint32_t ewma(uint32_t average, uint64_t bytes)
+{
+    int64_t rate = bytes * 8 * 1000 / CLIENTSTATS_INTERVAL_MS;
+    return average + ((rate - (int64_t)average) >> CLIENTSTATS_EWMA_SHIFT);
+}
+
+static void clientstats_update(void *arg)
+{
+    for (uint16_t aid = 1; aid <= CLIENTSTATS_MAX_AID; aid++)
+    {
+        clientstats_entry_t *entry = &entries[aid];
+        if (!entry->used)
+        {
+            continue;
+        }
+        uint64_t rx_bytes = stats_read(&entry->rx_bytes);
+        uint64_t tx_bytes = stats_read(&entry->tx_bytes);
+        entry->rx_bps = ewma(entry->rx_bps, rx_bytes - entry->last_rx_bytes);
+        entry->tx_bps = ewma(entry->tx_bps, tx_bytes - entry->last_tx_bytes);
+        entry->last_rx_bytes = rx_bytes;
+        entry->last_tx_bytes = tx_bytes;
+    }
+    sys_timeout(CLIENTSTATS_INTERVAL_MS, clientstats_update, NULL);
+}
+
+static void clientstats_start(void *arg)
+{
+    sys_timeout(CLIENTSTATS_INTERVAL_MS, clientstats_update, NULL);
+}
+
+/* Runs in the tcpip thread */
+static void clientstats_apply(void *arg)
+{
+    clientstats_event_t *event = (clientstats_event_t *)arg;
+    clientstats_entry_t *entry = &entries[event->aid];
+    if (event->connected)
+    {
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->mac, event->mac, sizeof(entry->mac));
+        entry->connected_us = esp_timer_get_time();
+    }
+    entry->used = event->connected;
+    free(event);
+}
+
+static void clientstats_post(const uint8_t *mac, uint16_t aid, bool connected)
+{
+    if (aid == 0 || aid > CLIENTSTATS_MAX_AID)
+    {
+        ESP_LOGW(TAG, "AID %u out of range", aid);
+        return;
+    }
+    clientstats_event_t *event = calloc(1, sizeof(clientstats_event_t));
+    if (event == NULL)
+    {
+        return;
+    }
+    if (mac != NULL)
+    {
+        memcpy(event->mac, mac, sizeof(event->mac));
+    }
+    event->aid = aid;
+    event->connected = connected;
+    if (tcpip_callback(clientstats_apply, event) != ERR_OK)
+    {
+        free(event);
+    }
+}
+
+void clientstats_connected(const uint8_t mac[6], uint16_t aid)
+{
+    clientstats_post(mac, aid, true);
+}
+
+void clientstats_disconnected(uint16_t aid)
+{
+    clientstats_post(NULL, aid, false);
+}
+
+static int compare_rate(const void *a, const void *b)
+{
+    uint64_t rate_a = (uint64_t)((const clientstats_t *)a)->rx_bps + ((const clientstats_t *)a)->tx_bps;
+    uint64_t rate_b = (uint64_t)((const clientstats_t *)b)->rx_bps + ((const clientstats_t *)b)->tx_bps;
+    return rate_a < rate_b ? 1 : (rate_a > rate_b ? -1 : 0);
+}
+
+size_t clientstats_get(clientstats_t *clients, size_t max)
+{
+    size_t count = 0;
+    int64_t now = esp_timer_get_time();
+    for (uint16_t aid = 1; aid <= CLIENTSTATS_MAX_AID && count < max; aid++)
+    {
+        clientstats_entry_t *entry = &entries[aid];
+        if (!entry->used)
+        {
+            continue;
+        }
+        clientstats_t *client = &clients[count++];
+        memcpy(client->mac, entry->mac, sizeof(client->mac));
+        client->aid = aid;
+        client->rx_bytes = stats_read(&entry->rx_bytes);
+        client->rx_packets = stats_read(&entry->rx_packets);
+        client->tx_bytes = stats_read(&entry->tx_bytes);
+        client->tx_packets = stats_read(&entry->tx_packets);
+        client->rx_bps = entry->rx_bps;
+        client->tx_bps = entry->tx_bps;
+        client->connected_s = (now - entry->connected_us) / 1000000;
+    }
+    qsort(clients, count, sizeof(clientstats_t), compare_rate);
+    return count;
+}
+
+void clientstats_init(void)
+{
+    tcpip_callback(clientstats_start, NULL);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lwip/pbuf.h"
+
+/* Traffic of every station of the AP, indexed by the AID. The counters are
+   updated by the hooks of the AP interface in the tcpip thread, the rates are
+   moving averages (EWMA) updated once per second. */
+#define CLIENTSTATS_MAX_AID 15
+#define CLIENTSTATS_INTERVAL_MS 1000
+
+typedef struct
+{
+    uint8_t mac[6];
+    uint16_t aid;
+    uint64_t rx_bytes; // sent by the client (upload)
+    uint64_t rx_packets;
+    uint64_t tx_bytes; // sent to the client (download)
+    uint64_t tx_packets;
+    uint32_t rx_bps;
+    uint32_t tx_bps;
+    uint32_t connected_s;
+} clientstats_t;
+
+void clientstats_init(void);
+
+/* From the WiFi events */
+void clientstats_connected(const uint8_t mac[6], uint16_t aid);
+void clientstats_disconnected(uint16_t aid);
+
+/* Only in the tcpip thread, p starts with the ethernet header */
+void clientstats_rx(const struct pbuf *p);
+void clientstats_tx(const struct pbuf *p);
+
+/* Copies the connected stations, sorted by their current rate (top talker first) */
+size_t clientstats_get(clientstats_t *clients, size_t max);
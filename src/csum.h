@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_attr.h"
+
+/* Incremental updates of the internet checksum (RFC 1624), for rewriting
+   single fields of a forwarded packet without summing it up again. The values
+   only have to be in the same byte order as the checksum field. */
+FORCE_INLINE_ATTR uint32_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/* HC' = ~(~HC + ~m + m'), the delta holds ~m + m' */
+FORCE_INLINE_ATTR uint16_t csum_update(uint16_t csum, uint32_t delta)
+{
+    return ~csum_fold((uint16_t)~csum + delta);
+}
+
+FORCE_INLINE_ATTR uint32_t csum_delta32(uint32_t old_value, uint32_t new_value)
+{
+    return (uint16_t)~(old_value >> 16) + (new_value >> 16) + (uint16_t)~old_value + (new_value & 0xffff);
+}
+
+FORCE_INLINE_ATTR uint32_t csum_delta16(uint16_t old_value, uint16_t new_value)
+{
+    return (uint16_t)~old_value + new_value;
+}
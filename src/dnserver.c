@@ -9,9 +9,12 @@
 
 #include <sys/param.h>
 
+#include <ctype.h>
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -19,29 +22,43 @@
 #include "lwip/netdb.h"
 #include "router_globals.h"
 #include "esp_wifi.h"
+#include "stats.h"
+#include "dnsparse.h"
 
 #define DNS_PORT (53)
-#define DNS_MAX_LEN (256)
+// Classic UDP limit, replies of the captive portal are never larger
+#define DNS_MAX_LEN (512)
+// EDNS answers of the upstream server may be larger than 512 bytes
+#define DNS_MAX_UDP_LEN (1232)
 
 #define OPCODE_MASK (0x7800)
-#define QR_FLAG (1 << 7)
+#define QR_FLAG_HOST (1 << 15)
+#define TC_FLAG_HOST (1 << 9)
+#define RD_FLAG_HOST (1 << 8)
+#define RCODE_MASK (0x000F)
+#define RCODE_NOERROR (0)
+#define RCODE_NXDOMAIN (3)
 #define QD_TYPE_A (0x0001)
-#define ANS_TTL_SEC (300)
+// Short, the clients shouldn't keep the address of the AP once the uplink is (back) up
+#define ANS_TTL_SEC (10)
+
+#define DNS_CACHE_ENTRIES (24)
+#define DNS_CACHE_SLOT_LEN (512)
+#define DNS_MAX_QUESTION_LEN (DNS_MAX_NAME_LEN + 4)
+#define DNS_PENDING_ENTRIES (8)
+#define DNS_PENDING_WAITERS (4)
+#define DNS_UPSTREAM_TIMEOUT_US (3 * 1000 * 1000)
+// Queries read per wakeup before the upstream socket is checked again
+#define DNS_RX_BATCH (16)
+/* Upstream sockets, new queries are sent from a new random port while the
+   queries of the previous one wait for their answers */
+#define DNS_UPSTREAM_SOCKETS (2)
+#define DNS_UPSTREAM_PORT_MIN (1024)
+#define DNS_UPSTREAM_BIND_TRIES (4)
 
 static const char *TAG = "DNSServer";
 TaskHandle_t task = NULL;
 
-// DNS Header Packet
-typedef struct __attribute__((__packed__))
-{
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qd_count;
-    uint16_t an_count;
-    uint16_t ns_count;
-    uint16_t ar_count;
-} dns_header_t;
-
 // DNS Question Packet
 typedef struct
 {
@@ -60,208 +77,617 @@ typedef struct __attribute__((__packed__))
     uint32_t ip_addr;
 } dns_answer_t;
 
+typedef struct
+{
+    int64_t stored;
+    int64_t expires;
+    int64_t last_used;
+    uint32_t hash;
+    uint16_t len; // 0 = unused
+    uint16_t qlen;
+    uint8_t data[DNS_CACHE_SLOT_LEN];
+} dns_cache_entry_t;
+
+typedef struct
+{
+    struct sockaddr_in addr;
+    uint16_t id;
+} dns_waiter_t;
+
+/* Query forwarded to the upstream server. Clients asking the same question
+   meanwhile are added as waiters instead of sending another query. */
+typedef struct
+{
+    int64_t sent;
+    uint32_t hash;
+    uint16_t upstream_id;
+    uint16_t qlen;
+    uint8_t question[DNS_MAX_QUESTION_LEN];
+    uint8_t waiter_count; // 0 = unused
+    uint8_t upstream;     // socket the query was sent from
+    dns_waiter_t waiters[DNS_PENDING_WAITERS];
+} dns_pending_t;
+
+static volatile uint32_t dns_upstream_ip = 0;
+static dns_cache_entry_t dns_cache[DNS_CACHE_ENTRIES];
+static dns_pending_t dns_pending[DNS_PENDING_ENTRIES];
+static uint8_t rx_buffer[DNS_MAX_UDP_LEN];
+static uint8_t reply_buffer[DNS_CACHE_SLOT_LEN];
+static uint32_t dns_cache_upstream_ip = 0; // server the cached answers came from
+static uint32_t dns_ap_ip = 0;
+static int dns_upstream_socks[DNS_UPSTREAM_SOCKETS];
+static int dns_upstream_current = 0;
+
+static uint32_t dns_question_hash(const uint8_t *question, size_t qlen)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < qlen; i++)
+    {
+        h = (h ^ tolower(question[i])) * 16777619u;
+    }
+    return h;
+}
+
+static bool dns_question_equal(const uint8_t *a, const uint8_t *b, size_t qlen)
+{
+    for (size_t i = 0; i < qlen; i++)
+    {
+        if (tolower(a[i]) != tolower(b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*
-    Parse the name from the packet from the DNS name format to a regular .-seperated name
-    returns the pointer to the next part of the packet
+    Turns the query in msg into the captive portal answer in place. Every A question is
+    answered with the IP of the softAP, all other types get an empty answer (NODATA),
+    so the clients don't wait for a timeout. Returns the length of the reply or 0 if
+    the query is ignored.
 */
-static char *parse_dns_name(char *raw_name, char *parsed_name, size_t parsed_name_max_len)
+static size_t dns_captive_reply(uint8_t *msg, size_t len, size_t max_len, uint32_t ap_ip)
 {
+    if (len < sizeof(dns_header_t))
+    {
+        return 0;
+    }
+    dns_header_t *header = (dns_header_t *)msg;
+    uint16_t flags = ntohs(header->flags);
+    // Not a standard query or already a response
+    if ((flags & (OPCODE_MASK | QR_FLAG_HOST)) != 0)
+    {
+        return 0;
+    }
+
+    uint16_t qd_count = ntohs(header->qd_count);
+    uint16_t a_count = 0;
+    size_t off = sizeof(dns_header_t);
+    for (int i = 0; i < qd_count; i++)
+    {
+        off = dns_skip_name(msg, len, off);
+        if (off == 0 || off + sizeof(dns_question_t) > len)
+        {
+            return 0;
+        }
+        if (((msg[off] << 8) | msg[off + 1]) == QD_TYPE_A)
+        {
+            a_count++;
+        }
+        off += sizeof(dns_question_t);
+    }
 
-    char *label = raw_name;
-    char *name_itr = parsed_name;
-    int name_len = 0;
+    // The answers replace everything after the questions (e.g. the EDNS record)
+    size_t reply_len = off + a_count * sizeof(dns_answer_t);
+    if (reply_len > max_len)
+    {
+        return 0;
+    }
 
-    do
+    header->flags = htons(QR_FLAG_HOST | (flags & RD_FLAG_HOST));
+    header->an_count = htons(a_count);
+    header->ns_count = 0;
+    header->ar_count = 0;
+
+    uint8_t *cur_ans_ptr = msg + off;
+    size_t qd_off = sizeof(dns_header_t);
+    for (int i = 0; i < qd_count; i++)
     {
-        int sub_name_len = *label;
-        // (len + 1) since we are adding  a '.'
-        name_len += (sub_name_len + 1);
-        if (name_len > parsed_name_max_len)
+        size_t name_end = dns_skip_name(msg, off, qd_off);
+        if (((msg[name_end] << 8) | msg[name_end + 1]) == QD_TYPE_A)
         {
-            return NULL;
+            dns_answer_t answer = {
+                .ptr_offset = htons(0xC000 | qd_off),
+                .type = htons(QD_TYPE_A),
+                .class = htons((msg[name_end + 2] << 8) | msg[name_end + 3]),
+                .ttl = htonl(ANS_TTL_SEC),
+                .addr_len = htons(sizeof(ap_ip)),
+                .ip_addr = ap_ip};
+            memcpy(cur_ans_ptr, &answer, sizeof(answer));
+            cur_ans_ptr += sizeof(answer);
         }
+        qd_off = name_end + sizeof(dns_question_t);
+    }
+    return reply_len;
+}
 
-        // Copy the sub name that follows the the label
-        memcpy(name_itr, label + 1, sub_name_len);
-        name_itr[sub_name_len] = '.';
-        name_itr += (sub_name_len + 1);
-        label += sub_name_len + 1;
-    } while (*label != 0);
-
-    // Terminate the final string, replacing the last '.'
-    parsed_name[name_len - 1] = '\0';
-    // Return pointer to first char after the name
-    return label + 1;
+static dns_cache_entry_t *dns_cache_lookup(const uint8_t *question, size_t qlen, uint32_t hash, int64_t now)
+{
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        dns_cache_entry_t *entry = &dns_cache[i];
+        if (entry->len > 0 && entry->hash == hash && entry->qlen == qlen &&
+            dns_question_equal(entry->data + sizeof(dns_header_t), question, qlen))
+        {
+            if (now >= entry->expires)
+            {
+                entry->len = 0;
+                return NULL;
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void dns_cache_store(const uint8_t *msg, size_t len, size_t qlen, uint32_t hash, int64_t now)
+{
+    const dns_header_t *header = (const dns_header_t *)msg;
+    uint16_t flags = ntohs(header->flags);
+    uint8_t rcode = flags & RCODE_MASK;
+    // truncated answers are retried by the client over TCP, errors are not cached
+    if (len > DNS_CACHE_SLOT_LEN || (flags & TC_FLAG_HOST) || (rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN))
+    {
+        return;
+    }
+
+    dns_cache_entry_t *slot = NULL;
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        dns_cache_entry_t *entry = &dns_cache[i];
+        if (entry->len == 0 || now >= entry->expires)
+        {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL || entry->last_used < slot->last_used)
+        {
+            slot = entry;
+        }
+    }
+
+    memcpy(slot->data, msg, len);
+    uint32_t ttl = dns_walk_ttls(slot->data, len, qlen, 0);
+    if (ttl == 0 || ttl == UINT32_MAX)
+    {
+        slot->len = 0;
+        return;
+    }
+    slot->len = len;
+    slot->qlen = qlen;
+    slot->hash = hash;
+    slot->stored = now;
+    slot->expires = now + (int64_t)ttl * 1000000;
+    slot->last_used = now;
+}
+
+static dns_pending_t *dns_pending_find(const uint8_t *question, size_t qlen, uint32_t hash)
+{
+    for (int i = 0; i < DNS_PENDING_ENTRIES; i++)
+    {
+        dns_pending_t *pending = &dns_pending[i];
+        if (pending->waiter_count > 0 && pending->hash == hash && pending->qlen == qlen &&
+            dns_question_equal(pending->question, question, qlen))
+        {
+            return pending;
+        }
+    }
+    return NULL;
 }
 
-// Parses the DNS request and prepares a DNS response with the IP of the softAP
-static int parse_dns_request(char *req, size_t req_len, char *dns_reply, size_t dns_reply_max_len)
+static int dns_upstream_pending(int slot)
 {
-    if (req_len > dns_reply_max_len)
+    int count = 0;
+    for (int i = 0; i < DNS_PENDING_ENTRIES; i++)
+    {
+        if (dns_pending[i].waiter_count > 0 && dns_pending[i].upstream == slot)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Socket bound to a random port. Together with the random id, an off-path
+   attacker has to guess about 32 bits to get a forged answer into the cache. */
+static int dns_upstream_open(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0)
     {
         return -1;
     }
+    for (int i = 0; i < DNS_UPSTREAM_BIND_TRIES; i++)
+    {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(DNS_UPSTREAM_PORT_MIN + esp_random() % (65536 - DNS_UPSTREAM_PORT_MIN)),
+            .sin_addr.s_addr = htonl(INADDR_ANY)};
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return sock;
+        }
+    }
+    close(sock);
+    return -1;
+}
 
-    // Prepare the reply
-    memset(dns_reply, 0, dns_reply_max_len);
-    memcpy(dns_reply, req, req_len);
+static void dns_upstream_close(int slot)
+{
+    if (dns_upstream_socks[slot] >= 0)
+    {
+        close(dns_upstream_socks[slot]);
+        dns_upstream_socks[slot] = -1;
+    }
+}
 
-    // Endianess of NW packet different from chip
-    dns_header_t *header = (dns_header_t *)dns_reply;
-    ESP_LOGD(TAG, "DNS query with header id: 0x%X, flags: 0x%X, qd_count: %d",
-             ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
+/* Moves the new queries to a new port, unless the other socket still waits for
+   answers. Without a free lwIP socket the current one is kept. */
+static int dns_upstream_rotate(void)
+{
+    int next = (dns_upstream_current + 1) % DNS_UPSTREAM_SOCKETS;
+    if (dns_upstream_pending(next) == 0)
+    {
+        dns_upstream_close(next);
+        dns_upstream_socks[next] = dns_upstream_open();
+        if (dns_upstream_socks[next] >= 0)
+        {
+            dns_upstream_current = next;
+        }
+    }
+    return dns_upstream_current;
+}
 
-    // Not a standard query
-    if ((header->flags & OPCODE_MASK) != 0)
+// Closes the previous sockets, once all their queries are answered or timed out
+static void dns_upstream_release(void)
+{
+    for (int slot = 0; slot < DNS_UPSTREAM_SOCKETS; slot++)
     {
-        return 0;
+        if (slot != dns_upstream_current && dns_upstream_pending(slot) == 0)
+        {
+            dns_upstream_close(slot);
+        }
     }
+}
 
-    // Set question response flag
-    header->flags |= QR_FLAG;
+static dns_pending_t *dns_pending_find_free(void)
+{
+    dns_pending_t *oldest = &dns_pending[0];
+    for (int i = 0; i < DNS_PENDING_ENTRIES; i++)
+    {
+        dns_pending_t *pending = &dns_pending[i];
+        if (pending->waiter_count == 0)
+        {
+            return pending;
+        }
+        if (pending->sent < oldest->sent)
+        {
+            oldest = pending;
+        }
+    }
+    // all slots busy, give up the oldest query
+    stats_inc(&stats_dns.upstream_timeouts);
+    oldest->waiter_count = 0;
+    return oldest;
+}
 
-    uint16_t qd_count = ntohs(header->qd_count);
-    header->an_count = htons(qd_count);
+// A free entry for a new query and the socket it is sent from
+static dns_pending_t *dns_pending_alloc(int64_t now)
+{
+    dns_pending_t *pending = dns_pending_find_free();
+    pending->upstream = dns_upstream_rotate();
+    return pending;
+}
 
-    int reply_len = qd_count * sizeof(dns_answer_t) + req_len;
-    if (reply_len > dns_reply_max_len)
+static void dns_pending_expire(int64_t now)
+{
+    for (int i = 0; i < DNS_PENDING_ENTRIES; i++)
     {
-        return -1;
+        dns_pending_t *pending = &dns_pending[i];
+        if (pending->waiter_count > 0 && now - pending->sent > DNS_UPSTREAM_TIMEOUT_US)
+        {
+            // the clients will retry themselves
+            pending->waiter_count = 0;
+            stats_inc(&stats_dns.upstream_timeouts);
+        }
     }
+}
 
-    // Pointer to current answer and question
-    char *cur_ans_ptr = dns_reply + req_len;
-    char *cur_qd_ptr = dns_reply + sizeof(dns_header_t);
-    char name[128];
+static void dns_send_with_id(int sock, uint8_t *msg, size_t len, uint16_t id, const struct sockaddr_in *addr)
+{
+    ((dns_header_t *)msg)->id = id;
+    sendto(sock, msg, len, 0, (const struct sockaddr *)addr, sizeof(*addr));
+}
 
-    // Respond to all questions with the ESP32's IP address
-    for (int i = 0; i < qd_count; i++)
+/* Answers a query of a client from the cache or forwards it to the upstream DNS server */
+static void dns_proxy_query(int sock, uint32_t upstream_ip, uint8_t *msg, size_t len, const struct sockaddr_in *client)
+{
+    int64_t now = esp_timer_get_time();
+    size_t qlen = dns_question_len(msg, len);
+    const uint8_t *question = msg + sizeof(dns_header_t);
+    uint16_t client_id = ((dns_header_t *)msg)->id;
+
+    if (upstream_ip != dns_cache_upstream_ip)
+    {
+        // answers of the previous server may be wrong for the new network
+        memset(dns_cache, 0, sizeof(dns_cache));
+        dns_cache_upstream_ip = upstream_ip;
+    }
+    stats_inc(&stats_dns.queries);
+    if (qlen == 0 || qlen > DNS_MAX_QUESTION_LEN || (ntohs(((dns_header_t *)msg)->flags) & OPCODE_MASK) != 0)
+    {
+        // nothing to cache or coalesce, but the upstream server gives the right answer
+        dns_pending_t *pending = dns_pending_alloc(now);
+        pending->hash = 0;
+        pending->qlen = 0;
+        pending->upstream_id = client_id;
+        pending->sent = now;
+        pending->waiters[0].addr = *client;
+        pending->waiters[0].id = client_id;
+        pending->waiter_count = 1;
+    }
+    else
     {
-        char *name_end_ptr = parse_dns_name(cur_qd_ptr, name, sizeof(name));
-        if (name_end_ptr == NULL)
+        uint32_t hash = dns_question_hash(question, qlen);
+        dns_cache_entry_t *entry = dns_cache_lookup(question, qlen, hash, now);
+        if (entry != NULL)
         {
-            ESP_LOGE(TAG, "Failed to parse DNS question: %s", cur_qd_ptr);
-            return -1;
+            stats_inc(&stats_dns.hits);
+            entry->last_used = now;
+            memcpy(reply_buffer, entry->data, entry->len);
+            uint32_t elapsed = (now - entry->stored) / 1000000;
+            if (elapsed > 0)
+            {
+                dns_walk_ttls(reply_buffer, entry->len, qlen, elapsed);
+            }
+            dns_send_with_id(sock, reply_buffer, entry->len, client_id, client);
+            return;
         }
+        stats_inc(&stats_dns.misses);
+
+        dns_pending_t *pending = dns_pending_find(question, qlen, hash);
+        if (pending != NULL)
+        {
+            if (pending->waiter_count < DNS_PENDING_WAITERS)
+            {
+                stats_inc(&stats_dns.coalesced);
+                pending->waiters[pending->waiter_count].addr = *client;
+                pending->waiters[pending->waiter_count].id = client_id;
+                pending->waiter_count++;
+            }
+            return;
+        }
+
+        pending = dns_pending_alloc(now);
+        pending->hash = hash;
+        pending->qlen = qlen;
+        memcpy(pending->question, question, qlen);
+        pending->upstream_id = (uint16_t)esp_random();
+        pending->sent = now;
+        pending->waiters[0].addr = *client;
+        pending->waiters[0].id = client_id;
+        pending->waiter_count = 1;
+        ((dns_header_t *)msg)->id = pending->upstream_id;
+    }
+    // unparsable messages are forwarded as they are, the upstream server answers them
+    dns_clamp_udp_size(msg, len, DNS_MAX_UDP_LEN);
+
+    struct sockaddr_in upstream = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = upstream_ip};
+    // the pending entry was just given the current socket
+    if (sendto(dns_upstream_socks[dns_upstream_current], msg, len, 0, (struct sockaddr *)&upstream, sizeof(upstream)) < 0)
+    {
+        stats_inc(&stats_dns.upstream_errors);
+    }
+}
 
-        dns_question_t *question = (dns_question_t *)(name_end_ptr);
-        uint16_t qd_type = ntohs(question->type);
-        uint16_t qd_class = ntohs(question->class);
+/* Delivers a response of the upstream DNS server to all waiting clients */
+static void dns_proxy_response(int sock, int upstream, uint8_t *msg, size_t len)
+{
+    if (len < sizeof(dns_header_t))
+    {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint16_t id = ((dns_header_t *)msg)->id;
+    size_t qlen = dns_question_len(msg, len);
 
-        ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", qd_type, qd_class, name);
+    if (len >= sizeof(rx_buffer))
+    {
+        // lwIP cut the answer to the buffer, only the question is relayed with the TC flag set
+        dns_header_t *header = (dns_header_t *)msg;
+        header->flags |= htons(TC_FLAG_HOST);
+        header->qd_count = htons(qlen > 0 ? 1 : 0);
+        header->an_count = 0;
+        header->ns_count = 0;
+        header->ar_count = 0;
+        len = sizeof(dns_header_t) + qlen;
+    }
 
-        if (qd_type == QD_TYPE_A)
+    for (int i = 0; i < DNS_PENDING_ENTRIES; i++)
+    {
+        dns_pending_t *pending = &dns_pending[i];
+        // a forged answer has to hit the port of the query as well
+        if (pending->waiter_count == 0 || pending->upstream_id != id || pending->upstream != upstream)
         {
-            dns_answer_t *answer = (dns_answer_t *)cur_ans_ptr;
-
-            answer->ptr_offset = htons(0xC000 | (cur_qd_ptr - dns_reply));
-            answer->type = htons(qd_type);
-            answer->class = htons(qd_class);
-            answer->ttl = htonl(ANS_TTL_SEC);
-
-            esp_netif_ip_info_t ip_info;
-            esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ip_info);
-            
-            // ESP_LOGD(TAG, "Answer with PTR offset: 0x%X and IP 0x%X", ntohs(answer->ptr_offset), ip_info.ip.addr);
-            answer->addr_len = htons(sizeof(ip_info.ip.addr));
-            answer->ip_addr = ip_info.ip.addr;
+            continue;
         }
+        // queries which can't be cached are only matched by their id
+        if (pending->qlen > 0 && (pending->qlen != qlen || !dns_question_equal(pending->question, msg + sizeof(dns_header_t), qlen)))
+        {
+            continue;
+        }
+        if (pending->qlen > 0)
+        {
+            dns_cache_store(msg, len, qlen, pending->hash, now);
+        }
+        for (int w = 0; w < pending->waiter_count; w++)
+        {
+            dns_send_with_id(sock, msg, len, pending->waiters[w].id, &pending->waiters[w].addr);
+        }
+        pending->waiter_count = 0;
+        return;
     }
-    return reply_len;
+}
+
+static int dns_create_socket(uint16_t port)
+{
+    struct sockaddr_in dest_addr;
+    dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(port);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    if (err < 0)
+    {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
 }
 
 /*
-    Sets up a socket and listen for DNS queries,
-    replies to all type A queries with the IP of the softAP
+    Sets up a socket and listen for DNS queries.
+    As long as no upstream server is known, all type A queries are answered with the
+    IP of the softAP (captive portal). Afterwards the queries are answered from the
+    cache or forwarded to the upstream server.
 */
 void dns_server_task(void *pvParameters)
 {
-    char rx_buffer[128];
-    char addr_str[128];
-    int addr_family;
-    int ip_protocol;
-
     while (1)
     {
+        esp_netif_ip_info_t ip_info;
+        esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ip_info);
+        dns_ap_ip = ip_info.ip.addr;
 
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(DNS_PORT);
-        addr_family = AF_INET;
-        ip_protocol = IPPROTO_IP;
-        inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-
-        int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
+        int sock = dns_create_socket(DNS_PORT);
         if (sock < 0)
         {
-            ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
             break;
         }
-        ESP_LOGI(TAG, "Socket created");
-
-        int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-        if (err < 0)
+        ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
+        memset(dns_pending, 0, sizeof(dns_pending));
+        for (int slot = 0; slot < DNS_UPSTREAM_SOCKETS; slot++)
         {
-            ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+            dns_upstream_socks[slot] = -1;
+        }
+        dns_upstream_current = 0;
+        dns_upstream_socks[0] = dns_upstream_open();
+        if (dns_upstream_socks[0] < 0)
+        {
+            ESP_LOGE(TAG, "Unable to create the upstream socket: errno %d", errno);
+            close(sock);
+            break;
         }
-        ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
 
         while (1)
         {
-            ESP_LOGI(TAG, "Waiting for data");
-            struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-            socklen_t socklen = sizeof(source_addr);
-            int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
-
-            // Error occurred during receiving
-            if (len < 0)
+            fd_set read_set;
+            FD_ZERO(&read_set);
+            FD_SET(sock, &read_set);
+            int max_fd = sock;
+            for (int slot = 0; slot < DNS_UPSTREAM_SOCKETS; slot++)
             {
-                ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-                close(sock);
+                if (dns_upstream_socks[slot] >= 0)
+                {
+                    FD_SET(dns_upstream_socks[slot], &read_set);
+                    max_fd = MAX(max_fd, dns_upstream_socks[slot]);
+                }
+            }
+            struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+            int ready = select(max_fd + 1, &read_set, NULL, NULL, &timeout);
+            if (ready < 0)
+            {
+                ESP_LOGE(TAG, "select failed: errno %d", errno);
                 break;
             }
-            // Data received
-            else
+            dns_pending_expire(esp_timer_get_time());
+
+            for (int slot = 0; slot < DNS_UPSTREAM_SOCKETS; slot++)
             {
-                // Get the sender's ip address as string
-                if (source_addr.sin6_family == PF_INET)
+                int upstream_sock = dns_upstream_socks[slot];
+                if (upstream_sock < 0 || !FD_ISSET(upstream_sock, &read_set))
                 {
-                    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
+                    continue;
                 }
-                else if (source_addr.sin6_family == PF_INET6)
+                struct sockaddr_in source_addr;
+                socklen_t socklen = sizeof(source_addr);
+                int len = recvfrom(upstream_sock, rx_buffer, sizeof(rx_buffer), 0, (struct sockaddr *)&source_addr, &socklen);
+                // only accept answers of the server the query was sent to
+                if (len > 0 && source_addr.sin_addr.s_addr == dns_upstream_ip && source_addr.sin_port == htons(DNS_PORT))
                 {
-                    inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+                    dns_proxy_response(sock, slot, rx_buffer, len);
                 }
+            }
+            dns_upstream_release();
 
-                // Null-terminate whatever we received and treat like a string...
-                rx_buffer[len] = 0;
-
-                char reply[DNS_MAX_LEN];
-                int reply_len = parse_dns_request(rx_buffer, len, reply, DNS_MAX_LEN);
+            if (!FD_ISSET(sock, &read_set))
+            {
+                continue;
+            }
+            // Drain the queries which arrived meanwhile without going through select again
+            int err = 0;
+            for (int i = 0; i < DNS_RX_BATCH; i++)
+            {
+                struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+                socklen_t socklen = sizeof(source_addr);
+                int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen);
+                if (len < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        err = errno;
+                    }
+                    break;
+                }
 
-                ESP_LOGI(TAG, "Received %d bytes from %s | DNS reply with len: %d", len, addr_str, reply_len);
-                if (reply_len <= 0)
+                uint32_t upstream_ip = dns_upstream_ip;
+                if (upstream_ip != 0 && source_addr.sin6_family == PF_INET)
                 {
-                    ESP_LOGE(TAG, "Failed to prepare a DNS reply");
+                    dns_proxy_query(sock, upstream_ip, rx_buffer, len, (struct sockaddr_in *)&source_addr);
+                    continue;
                 }
-                else
+
+                stats_inc(&stats_dns.captive);
+                size_t reply_len = dns_captive_reply(rx_buffer, len, DNS_MAX_LEN, dns_ap_ip);
+                if (reply_len > 0)
                 {
-                    int err = sendto(sock, reply, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
-                    if (err < 0)
-                    {
-                        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                        break;
-                    }
+                    // A full send buffer only loses this answer, the client asks again
+                    sendto(sock, rx_buffer, reply_len, 0, (struct sockaddr *)&source_addr, socklen);
                 }
             }
+            if (err != 0)
+            {
+                ESP_LOGE(TAG, "recvfrom failed: errno %d", err);
+                break;
+            }
         }
 
-        if (sock != -1)
+        ESP_LOGE(TAG, "Shutting down socket");
+        shutdown(sock, 0);
+        close(sock);
+        for (int slot = 0; slot < DNS_UPSTREAM_SOCKETS; slot++)
         {
-            ESP_LOGE(TAG, "Shutting down socket");
-            shutdown(sock, 0);
-            close(sock);
+            dns_upstream_close(slot);
         }
     }
     vTaskDelete(NULL);
@@ -272,6 +698,26 @@ bool isDnsStarted()
     return task != NULL;
 }
 
+bool isDnsCaptive()
+{
+    return task != NULL && dns_upstream_ip == 0;
+}
+
+void set_dns_upstream(uint32_t upstream_ip)
+{
+    if (upstream_ip == dns_upstream_ip)
+    {
+        return;
+    }
+    dns_upstream_ip = upstream_ip;
+    if (upstream_ip == 0)
+    {
+        ESP_LOGI(TAG, "Uplink lost, DNS queries are answered by the captive portal");
+        return;
+    }
+    ESP_LOGI(TAG, "DNS proxy forwards to " IPSTR, IP2STR((ip4_addr_t *)&upstream_ip));
+}
+
 uint16_t getConnectCount()
 {
 
@@ -288,7 +734,7 @@ uint16_t getConnectCount()
 
 void start_dns_server()
 {
-    xTaskCreate(dns_server_task, "dns_server", 4096, NULL, 5, &task);
+    xTaskCreatePinnedToCore(dns_server_task, "dns_server", 4096, NULL, MGMT_TASK_PRIORITY, &task, get_mgmt_task_core());
     ESP_LOGI(TAG, "DNS Server started");
 }
 
@@ -0,0 +1,155 @@
+#include "dnsparse.h"
+
+#define DNS_QUESTION_FIXED_LEN (4) // type and class
+#define DNS_RR_FIXED_LEN (10)      // type, class, TTL and length of the data
+
+// The messages are in network byte order, the fields are read byte by byte
+static uint16_t dns_read16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t dns_read32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void dns_write16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static void dns_write32(uint8_t *p, uint32_t value)
+{
+    dns_write16(p, value >> 16);
+    dns_write16(p + 2, value & 0xFFFF);
+}
+
+size_t dns_skip_name(const uint8_t *msg, size_t len, size_t off)
+{
+    size_t name_len = 0;
+    while (off < len)
+    {
+        uint8_t label_len = msg[off];
+        if (label_len == 0)
+        {
+            return off + 1;
+        }
+        if ((label_len & 0xC0) == 0xC0)
+        {
+            // a pointer ends the name
+            return off + 2 <= len ? off + 2 : 0;
+        }
+        // 0x40 and 0x80 are reserved label types, a name has at most 255 bytes
+        name_len += label_len + 1;
+        if (label_len > DNS_MAX_LABEL_LEN || name_len >= DNS_MAX_NAME_LEN)
+        {
+            return 0;
+        }
+        off += label_len + 1;
+    }
+    return 0;
+}
+
+size_t dns_question_len(const uint8_t *msg, size_t len)
+{
+    if (len < sizeof(dns_header_t))
+    {
+        return 0;
+    }
+    if (dns_read16(msg + offsetof(dns_header_t, qd_count)) != 1)
+    {
+        return 0;
+    }
+    size_t end = dns_skip_name(msg, len, sizeof(dns_header_t));
+    if (end == 0 || end + DNS_QUESTION_FIXED_LEN > len)
+    {
+        return 0;
+    }
+    return end + DNS_QUESTION_FIXED_LEN - sizeof(dns_header_t);
+}
+
+uint32_t dns_walk_ttls(uint8_t *msg, size_t len, size_t qlen, uint32_t elapsed)
+{
+    if (len < sizeof(dns_header_t) + qlen)
+    {
+        return UINT32_MAX;
+    }
+    uint32_t rr_count = dns_read16(msg + offsetof(dns_header_t, an_count)) + dns_read16(msg + offsetof(dns_header_t, ns_count)) +
+                        dns_read16(msg + offsetof(dns_header_t, ar_count));
+    size_t off = sizeof(dns_header_t) + qlen;
+    uint32_t min_ttl = DNS_CACHE_MAX_TTL_SEC;
+
+    for (uint32_t i = 0; i < rr_count; i++)
+    {
+        off = dns_skip_name(msg, len, off);
+        if (off == 0 || off + DNS_RR_FIXED_LEN > len)
+        {
+            return UINT32_MAX;
+        }
+        uint16_t type = dns_read16(msg + off);
+        uint16_t rdlen = dns_read16(msg + off + 8);
+        // the TTL of the EDNS pseudo record holds flags
+        if (type != QD_TYPE_OPT)
+        {
+            uint32_t ttl = dns_read32(msg + off + 4);
+            if (elapsed == 0)
+            {
+                min_ttl = ttl < min_ttl ? ttl : min_ttl;
+            }
+            else
+            {
+                dns_write32(msg + off + 4, ttl > elapsed ? ttl - elapsed : 0);
+            }
+        }
+        off += DNS_RR_FIXED_LEN + rdlen;
+        if (off > len)
+        {
+            return UINT32_MAX;
+        }
+    }
+    // negative answers without SOA are cached shortly
+    return rr_count == 0 ? DNS_CACHE_NEGATIVE_TTL_SEC : min_ttl;
+}
+
+bool dns_clamp_udp_size(uint8_t *msg, size_t len, uint16_t max_size)
+{
+    if (len < sizeof(dns_header_t))
+    {
+        return false;
+    }
+    uint16_t qd_count = dns_read16(msg + offsetof(dns_header_t, qd_count));
+    uint32_t rr_count = dns_read16(msg + offsetof(dns_header_t, an_count)) + dns_read16(msg + offsetof(dns_header_t, ns_count)) +
+                        dns_read16(msg + offsetof(dns_header_t, ar_count));
+    size_t off = sizeof(dns_header_t);
+
+    for (int i = 0; i < qd_count; i++)
+    {
+        off = dns_skip_name(msg, len, off);
+        if (off == 0 || off + DNS_QUESTION_FIXED_LEN > len)
+        {
+            return false;
+        }
+        off += DNS_QUESTION_FIXED_LEN;
+    }
+    for (uint32_t i = 0; i < rr_count; i++)
+    {
+        off = dns_skip_name(msg, len, off);
+        if (off == 0 || off + DNS_RR_FIXED_LEN > len)
+        {
+            return false;
+        }
+        // the class of the EDNS pseudo record holds the UDP payload size
+        if (dns_read16(msg + off) == QD_TYPE_OPT && dns_read16(msg + off + 2) > max_size)
+        {
+            dns_write16(msg + off + 2, max_size);
+        }
+        off += DNS_RR_FIXED_LEN + dns_read16(msg + off + 8);
+        if (off > len)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Parsing of the DNS messages of the proxy. Only depends on the C library,
+   so it can be built for the host (pio test -e native). */
+
+#define QD_TYPE_OPT (41)
+#define DNS_MAX_LABEL_LEN (63)
+#define DNS_MAX_NAME_LEN (255) // including the length bytes and the root label
+#define DNS_CACHE_MAX_TTL_SEC (3600)
+#define DNS_CACHE_NEGATIVE_TTL_SEC (30)
+
+// DNS Header Packet
+typedef struct __attribute__((__packed__))
+{
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qd_count;
+    uint16_t an_count;
+    uint16_t ns_count;
+    uint16_t ar_count;
+} dns_header_t;
+
+/*
+    Parses the name at offset off of the message, a compression pointer ends the name.
+    returns the offset of the first byte after the name or 0 if the name is invalid
+*/
+size_t dns_skip_name(const uint8_t *msg, size_t len, size_t off);
+
+/*
+    Length of the (single) question section of a query or response,
+    0 if the message can't be forwarded or cached
+*/
+size_t dns_question_len(const uint8_t *msg, size_t len);
+
+/*
+    Walks all resource records of a response. If elapsed is 0, the minimum TTL is returned.
+    Otherwise the TTLs are decreased by elapsed seconds. Returns UINT32_MAX for malformed messages.
+*/
+uint32_t dns_walk_ttls(uint8_t *msg, size_t len, size_t qlen, uint32_t elapsed);
+
+/*
+    Lowers the UDP payload size of the EDNS record of a query to max_size, so the
+    upstream server doesn't send answers larger than the receive buffer.
+    Returns false for malformed messages.
+*/
+bool dns_clamp_udp_size(uint8_t *msg, size_t len, uint16_t max_size);
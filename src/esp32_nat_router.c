@@ -7,7 +7,7 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
-#include <pthread.h>
+#include <sys/param.h>
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_console.h"
@@ -42,6 +42,17 @@
 #include "lwip/lwip_napt.h"
 
 #include "router_globals.h"
+#include "nethook.h"
+#include "flowtable.h"
+#include "flowcache.h"
+#include "clientstats.h"
+#include "scan.h"
+#include "profile.h"
+#include "uplink.h"
+#include "bootprofile.h"
+#include "heapmon.h"
+#include "statusled.h"
+#include "powersave.h"
 
 // On board LED
 #define BLINK_GPIO 2
@@ -67,6 +78,7 @@ uint32_t my_ip;
 uint32_t my_ap_ip;
 
 struct portmap_table_entry portmap_tab[PORTMAP_MAX];
+uint8_t portmap_count = 0;
 
 esp_netif_t *wifiAP;
 esp_netif_t *wifiSTA;
@@ -75,20 +87,44 @@ httpd_handle_t start_webserver(void);
 
 static const char *TAG = "ESP32NRE";
 
-char *ssid = NULL;
-char *passwd = NULL;
-char *static_ip = NULL;
-char *subnet_mask = NULL;
-char *gateway_addr = NULL;
-char *ap_ssid = NULL;
-char *lock_pass = NULL;
+const char *ssid = NULL;
+const char *passwd = NULL;
+const char *static_ip = NULL;
+const char *subnet_mask = NULL;
+const char *gateway_addr = NULL;
+const char *ap_ssid = NULL;
+const char *lock_pass = NULL;
 
-char *ap_passwd = NULL;
-char *ap_ip = NULL;
+const char *ap_passwd = NULL;
+const char *ap_ip = NULL;
 
 /* WPA2 settings */
-char *sta_identity = NULL;
-char *sta_user = NULL;
+const char *sta_identity = NULL;
+const char *sta_user = NULL;
+
+int get_mgmt_task_core(void)
+{
+#if CONFIG_FREERTOS_UNICORE
+    return tskNO_AFFINITY;
+#else
+    static int core = -1;
+    if (core < 0)
+    {
+        int32_t pinning = 1;
+        get_config_param_int("task_pinning", &pinning);
+#if CONFIG_ESP_WIFI_TASK_PINNED_TO_CORE_1
+        core = pinning != 0 ? 0 : tskNO_AFFINITY;
+#else
+        core = pinning != 0 ? 1 : tskNO_AFFINITY;
+#endif
+        if (core != tskNO_AFFINITY)
+        {
+            ESP_LOGI(TAG, "Management tasks are pinned to core %d", core);
+        }
+    }
+    return core;
+#endif
+}
 
 static void initialize_nvs(void)
 {
@@ -101,129 +137,261 @@ static void initialize_nvs(void)
     ESP_ERROR_CHECK(err);
 }
 
-esp_err_t apply_portmap_tab()
+/* Portmap entries are kept packed in portmap_tab and found by (proto, mport)
+   through an open addressing index, so adding and removing doesn't scan the table. */
+#define PORTMAP_INDEX_BITS 9
+#define PORTMAP_INDEX_SIZE (1 << PORTMAP_INDEX_BITS) // more than twice PORTMAP_MAX
+#define PORTMAP_V1_MAX 32                            // entries of the old "portmap_tab" blob
+#define PORTMAP_NVS_VERSION 2
+
+typedef struct
+{
+    u8_t version;
+    u8_t count;
+    u16_t reserved;
+} portmap_blob_header_t; // followed by count entries
+
+static uint8_t portmap_index[PORTMAP_INDEX_SIZE]; // slot + 1, 0 = empty
+static u32_t portmap_applied_ip[PORTMAP_MAX];     // external IP the entry is set in lwIP with, 0 = not set
+static uint8_t portmap_limit = IP_PORTMAP_MAX;    // size of the lwIP portmap table
+
+static uint32_t portmap_hash(u8_t proto, u16_t mport)
 {
-    for (int i = 0; i < PORTMAP_MAX; i++)
+    return ((uint32_t)mport << 8 | proto) * 2654435761u >> (32 - PORTMAP_INDEX_BITS);
+}
+
+// Position of the entry in the index or the empty position, where it would be stored
+static uint32_t portmap_probe(u8_t proto, u16_t mport)
+{
+    uint32_t pos = portmap_hash(proto, mport);
+    while (portmap_index[pos] != 0)
     {
-        if (portmap_tab[i].valid)
+        struct portmap_table_entry *entry = &portmap_tab[portmap_index[pos] - 1];
+        if (entry->proto == proto && entry->mport == mport)
         {
-            ip_portmap_add(portmap_tab[i].proto, my_ip, portmap_tab[i].mport, portmap_tab[i].daddr, portmap_tab[i].dport);
+            break;
         }
+        pos = (pos + 1) & (PORTMAP_INDEX_SIZE - 1);
     }
-    return ESP_OK;
+    return pos;
 }
 
-esp_err_t delete_portmap_tab()
+// Clears the position and moves the following entries back, so no lookup stops early
+static void portmap_index_remove(uint32_t pos)
 {
-    for (int i = 0; i < PORTMAP_MAX; i++)
+    uint32_t next = pos;
+    while (true)
     {
-        if (portmap_tab[i].valid)
+        next = (next + 1) & (PORTMAP_INDEX_SIZE - 1);
+        if (portmap_index[next] == 0)
         {
-            ip_portmap_remove(portmap_tab[i].proto, portmap_tab[i].mport);
+            break;
+        }
+        struct portmap_table_entry *entry = &portmap_tab[portmap_index[next] - 1];
+        uint32_t home = portmap_hash(entry->proto, entry->mport);
+        if (((next - home) & (PORTMAP_INDEX_SIZE - 1)) >= ((next - pos) & (PORTMAP_INDEX_SIZE - 1)))
+        {
+            portmap_index[pos] = portmap_index[next];
+            pos = next;
         }
     }
-    return ESP_OK;
+    portmap_index[pos] = 0;
 }
 
-void print_portmap_tab()
+static int portmap_insert(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
 {
-    for (int i = 0; i < PORTMAP_MAX; i++)
+    uint32_t pos = portmap_probe(proto, mport);
+    if (portmap_index[pos] != 0 || portmap_count >= PORTMAP_MAX)
     {
-        if (portmap_tab[i].valid)
+        return -1;
+    }
+    int slot = portmap_count++;
+    portmap_tab[slot] = (struct portmap_table_entry){.daddr = daddr, .mport = mport, .dport = dport, .proto = proto, .valid = 1};
+    portmap_applied_ip[slot] = 0;
+    portmap_index[pos] = slot + 1;
+    return slot;
+}
+
+// Removes the entry, the last entry takes its slot
+static void portmap_remove_slot(int slot)
+{
+    portmap_index_remove(portmap_probe(portmap_tab[slot].proto, portmap_tab[slot].mport));
+    int last = --portmap_count;
+    if (slot != last)
+    {
+        portmap_tab[slot] = portmap_tab[last];
+        portmap_applied_ip[slot] = portmap_applied_ip[last];
+        portmap_index[portmap_probe(portmap_tab[slot].proto, portmap_tab[slot].mport)] = slot + 1;
+    }
+    memset(&portmap_tab[last], 0, sizeof(portmap_tab[last]));
+    portmap_applied_ip[last] = 0;
+}
+
+// (Re)sets the entry in lwIP with the current external IP
+static void portmap_apply_slot(int slot)
+{
+    struct portmap_table_entry *entry = &portmap_tab[slot];
+    if (portmap_applied_ip[slot] != 0)
+    {
+        ip_portmap_remove(entry->proto, entry->mport);
+        portmap_applied_ip[slot] = 0;
+    }
+    if (my_ip != 0 && ip_portmap_add(entry->proto, my_ip, entry->mport, entry->daddr, entry->dport))
+    {
+        portmap_applied_ip[slot] = my_ip;
+    }
+}
+
+static esp_err_t portmap_save()
+{
+    size_t len = sizeof(portmap_blob_header_t) + portmap_count * sizeof(struct portmap_table_entry);
+    uint8_t *blob = malloc(len);
+    if (blob == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    portmap_blob_header_t header = {.version = PORTMAP_NVS_VERSION, .count = portmap_count};
+    memcpy(blob, &header, sizeof(header));
+    memcpy(blob + sizeof(header), portmap_tab, portmap_count * sizeof(struct portmap_table_entry));
+    // Written with the next batch of changes, not on every edit
+    esp_err_t err = config_set_blob("portmap_v2", blob, len);
+    free(blob);
+    return err;
+}
+
+// Only touches entries, which aren't set with the current external IP yet
+esp_err_t apply_portmap_tab()
+{
+    for (int i = 0; i < portmap_count; i++)
+    {
+        if (portmap_applied_ip[i] != my_ip)
         {
-            ESP_LOGI(TAG, "%s", portmap_tab[i].proto == PROTO_TCP ? "TCP " : "UDP ");
-            esp_ip4_addr_t addr;
-            addr.addr = my_ip;
-            ESP_LOGI(TAG, IPSTR ":%d -> ", IP2STR(&addr), portmap_tab[i].mport);
-            addr.addr = portmap_tab[i].daddr;
-            ESP_LOGI(TAG, IPSTR ":%d\n", IP2STR(&addr), portmap_tab[i].dport);
+            portmap_apply_slot(i);
         }
     }
+    return ESP_OK;
 }
 
-esp_err_t get_portmap_tab()
+void print_portmap_tab()
 {
-    esp_err_t err;
-    nvs_handle_t nvs;
-    size_t len;
+    for (int i = 0; i < portmap_count; i++)
+    {
+        ESP_LOGI(TAG, "%s", portmap_tab[i].proto == PROTO_TCP ? "TCP " : "UDP ");
+        esp_ip4_addr_t addr;
+        addr.addr = my_ip;
+        ESP_LOGI(TAG, IPSTR ":%d -> ", IP2STR(&addr), portmap_tab[i].mport);
+        addr.addr = portmap_tab[i].daddr;
+        ESP_LOGI(TAG, IPSTR ":%d\n", IP2STR(&addr), portmap_tab[i].dport);
+    }
+}
 
-    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+// Converts the fixed size table of older versions
+static esp_err_t migrate_portmap_tab()
+{
+    struct portmap_table_entry old_tab[PORTMAP_V1_MAX];
+    esp_err_t err = get_config_param_blob2("portmap_tab", (uint8_t *)old_tab, sizeof(old_tab));
     if (err != ESP_OK)
     {
         return err;
     }
-    err = nvs_get_blob(nvs, "portmap_tab", NULL, &len);
+    for (int i = 0; i < PORTMAP_V1_MAX; i++)
+    {
+        if (old_tab[i].valid)
+        {
+            portmap_insert(old_tab[i].proto, old_tab[i].mport, old_tab[i].daddr, old_tab[i].dport);
+        }
+    }
+    ESP_LOGI(TAG, "Migrated %d portmap entries", portmap_count);
+    err = portmap_save();
     if (err == ESP_OK)
     {
-        if (len != sizeof(portmap_tab))
+        err = config_erase("portmap_tab");
+    }
+    return err;
+}
+
+esp_err_t get_portmap_tab()
+{
+    int32_t portmap_max = IP_PORTMAP_MAX;
+    get_config_param_int("portmap_max", &portmap_max);
+    portmap_limit = portmap_max >= 1 && portmap_max <= PORTMAP_MAX ? portmap_max : IP_PORTMAP_MAX;
+
+    const char *blob;
+    size_t len;
+    esp_err_t err = get_config_param_blob("portmap_v2", &blob, &len);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = migrate_portmap_tab();
+    }
+    else if (err == ESP_OK)
+    {
+        portmap_blob_header_t header;
+        memcpy(&header, blob, MIN(len, sizeof(header)));
+        if (len < sizeof(header) || header.version != PORTMAP_NVS_VERSION || len != sizeof(header) + header.count * sizeof(struct portmap_table_entry))
         {
-            err = ESP_ERR_NVS_INVALID_LENGTH;
+            ESP_LOGW(TAG, "Invalid portmap table");
+            return ESP_ERR_NVS_INVALID_LENGTH;
         }
-        else
+        for (int i = 0; i < header.count; i++)
         {
-            err = nvs_get_blob(nvs, "portmap_tab", portmap_tab, &len);
-            if (err != ESP_OK)
-            {
-                memset(portmap_tab, 0, sizeof(portmap_tab));
-            }
+            struct portmap_table_entry entry;
+            memcpy(&entry, blob + sizeof(header) + i * sizeof(entry), sizeof(entry));
+            portmap_insert(entry.proto, entry.mport, entry.daddr, entry.dport);
         }
     }
-    nvs_close(nvs);
-
+    // Stored entries are never dropped, because of a smaller limit
+    portmap_limit = MAX(portmap_limit, portmap_count);
     return err;
 }
 
-esp_err_t add_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
+uint8_t get_portmap_limit(void)
 {
-    nvs_handle_t nvs;
+    return portmap_limit;
+}
 
-    for (int i = 0; i < PORTMAP_MAX; i++)
+esp_err_t add_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
+{
+    uint32_t pos = portmap_probe(proto, mport);
+    int slot;
+    if (portmap_index[pos] != 0)
     {
-        if (!portmap_tab[i].valid)
+        // Only one mapping per external port, the target is replaced
+        slot = portmap_index[pos] - 1;
+        if (portmap_tab[slot].daddr == daddr && portmap_tab[slot].dport == dport)
         {
-            portmap_tab[i].proto = proto;
-            portmap_tab[i].mport = mport;
-            portmap_tab[i].daddr = daddr;
-            portmap_tab[i].dport = dport;
-            portmap_tab[i].valid = 1;
-
-            ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-            ESP_ERROR_CHECK(nvs_set_blob(nvs, "portmap_tab", portmap_tab, sizeof(portmap_tab)));
-            ESP_ERROR_CHECK(nvs_commit(nvs));
-            ESP_LOGI(TAG, "New portmap table stored.");
-
-            nvs_close(nvs);
-
-            ip_portmap_add(proto, my_ip, mport, daddr, dport);
-
             return ESP_OK;
         }
+        portmap_tab[slot].daddr = daddr;
+        portmap_tab[slot].dport = dport;
+    }
+    else if (portmap_count >= portmap_limit || (slot = portmap_insert(proto, mport, daddr, dport)) < 0)
+    {
+        return ESP_ERR_NO_MEM;
     }
-    return ESP_ERR_NO_MEM;
+    portmap_apply_slot(slot);
+    flowcache_flush();
+    return portmap_save();
 }
 
 esp_err_t del_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
 {
-    nvs_handle_t nvs;
-
-    for (int i = 0; i < PORTMAP_MAX; i++)
+    uint32_t pos = portmap_probe(proto, mport);
+    if (portmap_index[pos] == 0)
     {
-        if (portmap_tab[i].valid && portmap_tab[i].mport == mport && portmap_tab[i].proto == proto && portmap_tab[i].dport == dport && portmap_tab[i].daddr == daddr)
-        {
-            portmap_tab[i].valid = 0;
-
-            ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-            ESP_ERROR_CHECK(nvs_set_blob(nvs, "portmap_tab", portmap_tab, sizeof(portmap_tab)));
-            ESP_ERROR_CHECK(nvs_commit(nvs));
-            ESP_LOGI(TAG, "New portmap table stored.");
-
-            nvs_close(nvs);
-
-            ip_portmap_remove(proto, mport);
-            return ESP_OK;
-        }
+        return ESP_OK;
     }
-    return ESP_OK;
+    int slot = portmap_index[pos] - 1;
+    if (portmap_tab[slot].daddr != daddr || portmap_tab[slot].dport != dport)
+    {
+        return ESP_OK;
+    }
+    if (portmap_applied_ip[slot] != 0)
+    {
+        ip_portmap_remove(proto, mport);
+    }
+    portmap_remove_slot(slot);
+    flowcache_flush();
+    return portmap_save();
 }
 
 static void initialize_console(void)
@@ -289,32 +457,9 @@ static void initialize_console(void)
     linenoiseHistorySetMaxLen(100);
 }
 
-void *led_status_thread(void *p)
-{
-    gpio_reset_pin(BLINK_GPIO);
-    gpio_set_direction(BLINK_GPIO, GPIO_MODE_OUTPUT);
-
-    uint16_t connect_count = getConnectCount();
-
-    while (true)
-    {
-        gpio_set_level(BLINK_GPIO, ap_connect);
-
-        for (int i = 0; i < connect_count; i++)
-        {
-            gpio_set_level(BLINK_GPIO, 1 - ap_connect);
-            vTaskDelay(50 / portTICK_PERIOD_MS);
-            gpio_set_level(BLINK_GPIO, ap_connect);
-            vTaskDelay(50 / portTICK_PERIOD_MS);
-        }
-
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-    }
-}
-
 void fillDNS(esp_ip_addr_t *dnsserver, esp_ip_addr_t *fallback)
 {
-    char *customDNS = NULL;
+    const char *customDNS = NULL;
     get_config_param_str("custom_dns", &customDNS);
 
     if (customDNS == NULL)
@@ -351,15 +496,13 @@ void set3rdOctet()
     }
 
     ESP_LOGI(TAG, "3rd octet not set or invalid. Setting to default. ");
-    nvs_handle_t nvs;
-    ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-    ESP_ERROR_CHECK(nvs_set_i32(nvs, "octet", 4));
-    ESP_ERROR_CHECK(nvs_commit(nvs));
+    ESP_ERROR_CHECK(config_set_i32("octet", 4));
 }
 
 void setHostName()
 {
-    char *hostName = NULL;
+    const char *hostName = NULL;
+    char generatedName[14];
     get_config_param_str("hostname", &hostName);
     if (hostName == NULL || strlen(hostName) == 0 || strlen(hostName) >= 250)
     {
@@ -367,12 +510,9 @@ void setHostName()
         ESP_LOGI(TAG, "No hostname set. Generating and setting random");
         // Generate a random number between 1000 and 9999
         int random_number = esp_random() % 9000 + 1000;
-        hostName = (char *)malloc(14 * sizeof(char));
-        sprintf(hostName, "esp32nre%d", random_number);
-        nvs_handle_t nvs;
-        ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-        ESP_ERROR_CHECK(nvs_set_str(nvs, "hostname", hostName));
-        ESP_ERROR_CHECK(nvs_commit(nvs));
+        sprintf(generatedName, "esp32nre%d", random_number);
+        hostName = generatedName;
+        ESP_ERROR_CHECK(config_set_str("hostname", hostName));
     }
     ESP_LOGI(TAG, "Setting hostname to: %s", hostName);
     esp_netif_t *sta_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
@@ -380,18 +520,15 @@ void setHostName()
     if (err != ESP_OK)
     {
         ESP_LOGW(TAG, "Invalid hostname (%s) detected. Will be resetted", hostName);
-        nvs_handle_t nvs;
-        ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-        ESP_ERROR_CHECK(nvs_erase_key(nvs, "hostname"));
-        ESP_ERROR_CHECK(nvs_commit(nvs));
+        ESP_ERROR_CHECK(config_erase("hostname"));
+        // The shutdown handler writes the change
         esp_restart();
     }
-    free(hostName);
 }
 
 void fillMac()
 {
-    char *customMac = NULL;
+    const char *customMac = NULL;
     get_config_param_str("custom_mac", &customMac);
     if (customMac != NULL)
     {
@@ -444,46 +581,80 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
 
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
-        esp_wifi_connect();
+        nethook_install(wifiSTA, STATS_IF_STA);
+        if (strlen(ssid) > 0) // Also started in AP mode for a scan
+        {
+            uplink_connect();
+        }
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START)
+    {
+        nethook_install(wifiAP, STATS_IF_AP);
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
-        ESP_LOGI(TAG, "disconnected - retry to connect to the STA");
         ap_connect = false;
-        esp_wifi_connect();
-        ESP_LOGI(TAG, "retry to connect to the STA");
+        statusled_set_uplink(false);
+        flowcache_flush();
+        set_dns_upstream(0); // The clients get answers of the captive portal instead of waiting for timeouts
         xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        if (scan_sta_disconnected())
+        {
+            ESP_LOGI(TAG, "disconnected - reconnecting after the scan");
+        }
+        else if (strlen(ssid) > 0)
+        {
+            uplink_disconnected(((wifi_event_sta_disconnected_t *)event_data)->reason);
+        }
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
         ESP_LOGI(TAG, "Got IP: http://" IPSTR, IP2STR(&event->ip_info.ip));
-        stop_dns_server();
+        int32_t dnsProxy = 1;
+        get_config_param_int("dns_proxy", &dnsProxy);
+        if (dnsProxy != 1)
+        {
+            stop_dns_server();
+        }
         ap_connect = true;
         my_ip = event->ip_info.ip.addr;
-        delete_portmap_tab();
-        apply_portmap_tab();
+        statusled_set_uplink(true);
+        uplink_connected();
+        flowcache_flush();
+        apply_portmap_tab(); // Nothing to do, if the IP didn't change
         esp_netif_dns_info_t dns;
         if (esp_netif_get_dns_info(wifiSTA, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
         {
             esp_ip_addr_t newDns;
             fillDNS(&newDns, &dns.ip);
-            setDnsServer(wifiAP, &newDns); // Set the correct DNS server for the AP clients
+            if (dnsProxy == 1)
+            {
+                set_dns_upstream(newDns.u_addr.ip4.addr); // The AP clients keep using the ESP32 as DNS server
+            }
+            else
+            {
+                setDnsServer(wifiAP, &newDns); // Set the correct DNS server for the AP clients
+            }
         }
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED)
     {
+        wifi_event_ap_staconnected_t *event = (wifi_event_ap_staconnected_t *)event_data;
         ESP_LOGI(TAG, "Station connected");
+        clientstats_connected(event->mac, event->aid);
+        statusled_set_clients(getConnectCount());
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STADISCONNECTED)
     {
+        wifi_event_ap_stadisconnected_t *event = (wifi_event_ap_stadisconnected_t *)event_data;
         ESP_LOGI(TAG, "Station disconnected");
+        clientstats_disconnected(event->aid);
+        statusled_set_clients(getConnectCount());
+        flowcache_flush();
     }
 }
-const int CONNECTED_BIT = BIT0;
-#define JOIN_TIMEOUT_MS (2000)
-
 void setWpaEnterprise(const char *sta_identity, const char *sta_user, const char *password)
 {
 
@@ -502,7 +673,7 @@ void setWpaEnterprise(const char *sta_identity, const char *sta_user, const char
     }
     ESP_LOGI(TAG, "Reading WPA certificate");
 
-    char *cer = NULL;
+    const char *cer = NULL;
     size_t len = 0;
 
     get_config_param_blob("cer", &cer, &len);
@@ -546,7 +717,7 @@ void wifi_init(const char *ssid, const char *passwd, const char *static_ip, cons
     ipInfo_ap.ip.addr = my_ap_ip;
     ipInfo_ap.gw.addr = my_ap_ip;
 
-    char *netmask = getNetmask();
+    const char *netmask = getNetmask();
 
     ipInfo_ap.netmask.addr = ipaddr_addr(netmask);
 
@@ -570,6 +741,7 @@ void wifi_init(const char *ssid, const char *passwd, const char *static_ip, cons
                                                         &instance_got_ip));
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    perf_profile_apply(&cfg);
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     int32_t isLowerBandwith = 0;
@@ -636,6 +808,7 @@ void wifi_init(const char *ssid, const char *passwd, const char *static_ip, cons
             ESP_LOGI(TAG, "WPA enterprise settings found!");
             setWpaEnterprise(sta_identity, sta_user, passwd);
         }
+        uplink_init(ssid, passwd, isWpaEnterprise);
     }
     else
     {
@@ -643,16 +816,13 @@ void wifi_init(const char *ssid, const char *passwd, const char *static_ip, cons
         ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &ap_config));
     }
     esp_ip_addr_t dnsserver;
-    char *defaultIP = getDefaultIPByNetmask();
-    dnsserver.u_addr.ip4.addr = esp_ip4addr_aton(defaultIP);
+    dnsserver.u_addr.ip4.addr = esp_ip4addr_aton(getDefaultIPByNetmask());
 
     setDnsServer(wifiAP, &dnsserver);
 
-    free(defaultIP);
-
-    xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT,
-                        pdFALSE, pdTRUE, JOIN_TIMEOUT_MS / portTICK_PERIOD_MS);
+    // The connection is set up by the events, nothing to wait for here
     ESP_ERROR_CHECK(esp_wifi_start());
+    boot_mark("wifi started");
 
     if (strlen(ssid) > 0)
     {
@@ -724,7 +894,7 @@ bool checkForResetPinAndReset()
 
 static void setLogLevel(void)
 {
-    char *loglevel = NULL;
+    const char *loglevel = NULL;
     get_config_param_str("loglevel", &loglevel);
     if (loglevel == NULL)
     {
@@ -753,20 +923,17 @@ static void setLogLevel(void)
 
 void app_main(void)
 {
+    boot_mark("app_main");
     initialize_nvs();
     register_nvs();
+    nvs_set_commit_hook(config_load);
     if (checkForResetPinAndReset())
     {
         return;
     }
     setLogLevel();
+    boot_mark("nvs");
 
-    initialize_console();
-    /* Register commands */
-    esp_console_register_help_command();
-    register_system();
-
-    register_router();
     fillMac();
     get_config_param_str("ssid", &ssid);
     if (ssid == NULL)
@@ -806,9 +973,7 @@ void app_main(void)
     get_config_param_str("ap_ip", &ap_ip);
     if (ap_ip == NULL)
     {
-        char *defaultIP = getDefaultIPByNetmask();
-        ap_ip = param_set_default(defaultIP);
-        free(defaultIP);
+        ap_ip = param_set_default(getDefaultIPByNetmask());
     }
 
     get_config_param_str("sta_user", &sta_user);
@@ -820,53 +985,41 @@ void app_main(void)
         lock_pass = param_set_default("");
     }
 
-    char *scan_result = NULL;
-    get_config_param_str("scan_result", &scan_result);
-    int32_t result_shown = 0;
-    get_config_param_int("result_shown", &result_shown);
-
-    if (scan_result != NULL && result_shown >= 3)
-    {
-        erase_key("scan_result");
-        erase_key("result_shown");
-        ESP_LOGI(TAG, "Scan result was shown %ld times. Result will be deleted", result_shown);
-    }
-    else if (scan_result != NULL && result_shown > 0)
-    {
-        nvs_handle_t nvs;
-        ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-        nvs_set_i32(nvs, "result_shown", ++result_shown);
-        ESP_LOGI(TAG, "result_shown increased to %ld after reboot", result_shown);
-    }
+    // Left over by older versions, which stored the scan result
+    config_erase("scan_result");
+    config_erase("result_shown");
 
     get_portmap_tab();
+    boot_mark("config");
 
-    // Setup WIFI
+    /* Forwarding comes first: WiFi, the hooks and NAT. The web server, the LED
+       and the console follow, while the STA is still connecting. */
     wifi_init(ssid, passwd, static_ip, subnet_mask, gateway_addr, ap_ssid, ap_passwd, ap_ip, sta_user, sta_identity);
+    scan_init();
+    nethook_init();
 
-    pthread_t t1;
-    int32_t led_disabled = 0;
-    get_config_param_int("led_disabled", &led_disabled);
-    if (led_disabled == 0)
-    {
-        ESP_LOGI(TAG, "On board LED is enabled");
-        pthread_create(&t1, NULL, led_status_thread, NULL);
-    }
-    else
-    {
-        ESP_LOGI(TAG, "On board LED is disabled");
-    }
     int32_t nat_disabled = 0;
     get_config_param_int("nat_disabled", &nat_disabled);
     if (nat_disabled == 0)
     {
+        int32_t napt_max = perf_profile_get()->napt_max;
+        get_config_param_int("napt_max", &napt_max);
+        if (napt_max < NAPT_MAX_ENTRIES_MIN || napt_max > NAPT_MAX_ENTRIES_LIMIT)
+        {
+            napt_max = perf_profile_get()->napt_max;
+        }
+        // Allocates the tables, the later enable keeps the sizes set here
+        ip_napt_init(napt_max, portmap_limit);
+        flowtable_init(napt_max);
+        flowcache_init();
         ip_napt_enable(my_ap_ip, 1);
-        ESP_LOGI(TAG, "NAT is enabled");
+        ESP_LOGI(TAG, "NAT is enabled with %ld entries", napt_max);
     }
     else
     {
         ESP_LOGI(TAG, "NAT is disabled");
     }
+    boot_mark("nat");
 
     int32_t lock = 0;
     get_config_param_int("lock", &lock);
@@ -881,6 +1034,30 @@ void app_main(void)
         ESP_LOGW(TAG, "'nvs_namespace esp32_nat'");
         ESP_LOGW(TAG, "'nvs_set lock i32 -v 0'");
     }
+    boot_mark("web server");
+    heapmon_init();
+    powersave_init();
+
+    int32_t led_disabled = 0;
+    get_config_param_int("led_disabled", &led_disabled);
+    if (led_disabled == 0)
+    {
+        ESP_LOGI(TAG, "On board LED is enabled");
+        statusled_init(BLINK_GPIO);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "On board LED is disabled");
+    }
+
+    initialize_console();
+    /* Register commands */
+    esp_console_register_help_command();
+    register_system();
+
+    register_router();
+    register_bench();
+    boot_mark("console");
 
     /* Prompt to be printed before each line.
      * This can be customized, made dynamic, etc.
@@ -0,0 +1,262 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "lwip/sys.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/iana.h"
+#include "lwip/lwip_napt.h"
+
+#include "flowcache.h"
+#include "csum.h"
+
+static const char *TAG = "FlowCache";
+
+/* Below the shortest NAPT timeout of lwIP, so the lwIP entry of a cached flow
+   is refreshed by the normal path before it can expire */
+#define FLOWCACHE_REFRESH_MS (IP_NAPT_TIMEOUT_MS_UDP / 2)
+
+#define FLOWCACHE_TCP_FIN 0x01U
+#define FLOWCACHE_TCP_SYN 0x02U
+#define FLOWCACHE_TCP_RST 0x04U
+
+/* Addresses and ports in network byte order */
+typedef struct
+{
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t in_if;
+} flowcache_key_t;
+
+typedef struct
+{
+    flowcache_key_t key;
+    uint32_t generation;
+    uint32_t expires_ms;
+    uint32_t new_src;
+    uint32_t new_dst;
+    uint16_t new_sport;
+    uint16_t new_dport;
+    uint16_t ip_delta; // one's complement sums, which are added to the checksums
+    uint16_t l4_delta;
+    uint16_t mtu;
+    uint8_t out_if;
+    uint8_t eth[SIZEOF_ETH_HDR];
+} flowcache_entry_t;
+
+/* The packet on the normal path, whose rewrite is learned */
+typedef struct
+{
+    bool active;
+    flowcache_key_t key;
+    uint16_t ip_id;
+    uint16_t ip_len;
+} flowcache_pending_t;
+
+typedef struct
+{
+    flowcache_key_t key;
+    uint8_t *ip;
+    uint8_t *l4;
+    uint16_t ip_len;
+    uint8_t tcp_flags;
+} flowcache_packet_t;
+
+stats_flowcache_t stats_flowcache;
+
+static flowcache_entry_t *cache = NULL;
+static flowcache_pending_t pending;
+// Entries of older generations are invalid, 0 is never used
+static uint32_t generation = 1;
+
+FORCE_INLINE_ATTR uint32_t flowcache_hash(const flowcache_key_t *key)
+{
+    uint32_t h = 2166136261u;
+    h = (h ^ key->src) * 16777619u;
+    h = (h ^ key->dst) * 16777619u;
+    h = (h ^ (((uint32_t)key->sport << 16) | key->dport)) * 16777619u;
+    h = (h ^ ((uint32_t)key->proto << 8 | key->in_if)) * 16777619u;
+    return (h ^ (h >> 16)) & (FLOWCACHE_SIZE - 1);
+}
+
+FORCE_INLINE_ATTR bool flowcache_key_equal(const flowcache_key_t *a, const flowcache_key_t *b)
+{
+    return a->src == b->src && a->dst == b->dst && a->sport == b->sport && a->dport == b->dport &&
+           a->proto == b->proto && a->in_if == b->in_if;
+}
+
+FORCE_INLINE_ATTR uint16_t read16(const uint8_t *pos)
+{
+    uint16_t value;
+    memcpy(&value, pos, sizeof(value));
+    return value;
+}
+
+FORCE_INLINE_ATTR void write16(uint8_t *pos, uint16_t value)
+{
+    memcpy(pos, &value, sizeof(value));
+}
+
+/* Only plain IPv4 TCP and UDP packets without options and fragments */
+static IRAM_ATTR bool flowcache_parse(const struct pbuf *p, flowcache_packet_t *packet)
+{
+    uint8_t *frame = (uint8_t *)p->payload;
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN + 8 || ((struct eth_hdr *)frame)->type != PP_HTONS(ETHTYPE_IP))
+    {
+        return false;
+    }
+    uint8_t *ip = frame + SIZEOF_ETH_HDR;
+    if (ip[0] != 0x45 || (ip[6] & 0x3f) != 0 || ip[7] != 0)
+    {
+        return false;
+    }
+    uint16_t ip_len = (ip[2] << 8) | ip[3];
+    uint8_t proto = ip[9];
+    uint16_t l4_len = proto == IP_PROTO_TCP ? 20 : 8;
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) || ip_len < IP_HLEN + l4_len || ip_len > p->len - SIZEOF_ETH_HDR)
+    {
+        return false;
+    }
+    packet->ip = ip;
+    packet->l4 = ip + IP_HLEN;
+    packet->ip_len = ip_len;
+    packet->tcp_flags = proto == IP_PROTO_TCP ? packet->l4[13] : 0;
+    memcpy(&packet->key.src, ip + 12, sizeof(packet->key.src));
+    memcpy(&packet->key.dst, ip + 16, sizeof(packet->key.dst));
+    packet->key.sport = read16(packet->l4);
+    packet->key.dport = read16(packet->l4 + 2);
+    packet->key.proto = proto;
+    return true;
+}
+
+static IRAM_ATTR void flowcache_rewrite(const flowcache_entry_t *entry, uint8_t *frame, flowcache_packet_t *packet)
+{
+    uint8_t *ip = packet->ip;
+    uint8_t *l4 = packet->l4;
+
+    memcpy(frame, entry->eth, SIZEOF_ETH_HDR);
+
+    uint16_t ttl_proto = read16(ip + 8);
+    ip[8]--;
+    uint32_t ip_delta = entry->ip_delta + csum_delta16(ttl_proto, read16(ip + 8));
+    write16(ip + 10, csum_update(read16(ip + 10), ip_delta));
+    memcpy(ip + 12, &entry->new_src, sizeof(entry->new_src));
+    memcpy(ip + 16, &entry->new_dst, sizeof(entry->new_dst));
+
+    write16(l4, entry->new_sport);
+    write16(l4 + 2, entry->new_dport);
+    uint8_t *l4_csum = l4 + (packet->key.proto == IP_PROTO_TCP ? 16 : 6);
+    uint16_t csum = read16(l4_csum);
+    if (packet->key.proto == IP_PROTO_UDP && csum == 0)
+    {
+        return; // UDP without checksum
+    }
+    csum = csum_update(csum, entry->l4_delta);
+    write16(l4_csum, packet->key.proto == IP_PROTO_UDP && csum == 0 ? 0xffff : csum);
+}
+
+stats_if_t IRAM_ATTR flowcache_forward(struct pbuf *p, stats_if_t in_if)
+{
+    flowcache_packet_t packet;
+    if (cache == NULL || p->next != NULL || !flowcache_parse(p, &packet))
+    {
+        return STATS_IF_COUNT;
+    }
+    packet.key.in_if = in_if;
+    flowcache_entry_t *entry = &cache[flowcache_hash(&packet.key)];
+    bool match = entry->generation == __atomic_load_n(&generation, __ATOMIC_RELAXED) && flowcache_key_equal(&entry->key, &packet.key);
+
+    // lwIP has to see the packets, which change the state of the connection
+    if (packet.tcp_flags & (FLOWCACHE_TCP_SYN | FLOWCACHE_TCP_FIN | FLOWCACHE_TCP_RST))
+    {
+        if (match)
+        {
+            entry->generation = 0;
+        }
+        return STATS_IF_COUNT;
+    }
+    if (packet.ip[8] <= 1)
+    {
+        return STATS_IF_COUNT; // lwIP sends the time exceeded message
+    }
+    if (match && (int32_t)(entry->expires_ms - sys_now()) > 0 && packet.ip_len <= entry->mtu)
+    {
+        flowcache_rewrite(entry, (uint8_t *)p->payload, &packet);
+        stats_inc(&stats_flowcache.hits);
+        return entry->out_if;
+    }
+
+    pending.key = packet.key;
+    pending.ip_id = read16(packet.ip + 4);
+    pending.ip_len = packet.ip_len;
+    pending.active = true;
+    return STATS_IF_COUNT;
+}
+
+void IRAM_ATTR flowcache_learn(const struct pbuf *p, struct netif *netif, stats_if_t out_if)
+{
+    if (!pending.active || out_if == pending.key.in_if)
+    {
+        return;
+    }
+    flowcache_packet_t packet;
+    // The forwarded packet keeps id and length, anything else sent meanwhile is ignored
+    if (p->next != NULL || !flowcache_parse(p, &packet) || packet.key.proto != pending.key.proto ||
+        read16(packet.ip + 4) != pending.ip_id || packet.ip_len != pending.ip_len)
+    {
+        return;
+    }
+    pending.active = false;
+
+    flowcache_entry_t *entry = &cache[flowcache_hash(&pending.key)];
+    entry->key = pending.key;
+    entry->new_src = packet.key.src;
+    entry->new_dst = packet.key.dst;
+    entry->new_sport = packet.key.sport;
+    entry->new_dport = packet.key.dport;
+    uint32_t addr_delta = csum_delta32(pending.key.src, packet.key.src) + csum_delta32(pending.key.dst, packet.key.dst);
+    entry->ip_delta = csum_fold(addr_delta);
+    entry->l4_delta = csum_fold(addr_delta + csum_delta16(pending.key.sport, packet.key.sport) +
+                                csum_delta16(pending.key.dport, packet.key.dport));
+    entry->mtu = netif->mtu;
+    entry->out_if = out_if;
+    memcpy(entry->eth, p->payload, SIZEOF_ETH_HDR);
+    entry->expires_ms = sys_now() + FLOWCACHE_REFRESH_MS;
+    entry->generation = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+    stats_inc(&stats_flowcache.misses);
+}
+
+void IRAM_ATTR flowcache_slow_path_done(void)
+{
+    pending.active = false;
+}
+
+void flowcache_flush(void)
+{
+    uint32_t next = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    if (next == 0)
+    {
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void flowcache_init(void)
+{
+    if (cache != NULL)
+    {
+        return;
+    }
+    // Internal RAM, the cache is read for every forwarded packet
+    cache = heap_caps_calloc(FLOWCACHE_SIZE, sizeof(flowcache_entry_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (cache == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for the flow cache");
+        return;
+    }
+    stats_flowcache.size = FLOWCACHE_SIZE;
+    ESP_LOGI(TAG, "Caching up to %d flows", FLOWCACHE_SIZE);
+}
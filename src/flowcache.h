@@ -0,0 +1,33 @@
+#pragma once
+
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "stats.h"
+
+/* Fast path for established TCP and UDP flows. The first packets of a flow
+   take the normal lwIP path (routing, NAPT, ARP). The resulting rewrite of
+   the addresses, ports and the ethernet header is learned, when the packet
+   leaves on the other interface, and later packets are rewritten in place
+   with precomputed checksum deltas and sent directly.
+   Entries are only valid for FLOWCACHE_REFRESH_MS, then one packet takes the
+   normal path again, so the NAPT entries of lwIP don't time out and changed
+   translations are learned again. */
+#define FLOWCACHE_SIZE 128
+
+void flowcache_init(void);
+
+/* Invalidates all entries, can be called from any task (i.e. after the IP
+   of the STA, a client or the port forwardings changed) */
+void flowcache_flush(void);
+
+/* Only in the tcpip thread: p starts with the ethernet header. Rewrites the
+   frame of a cached flow and returns the interface to send it on.
+   Returns STATS_IF_COUNT, if the packet has to take the normal path. */
+stats_if_t flowcache_forward(struct pbuf *p, stats_if_t in_if);
+
+/* Called for every frame sent by the hooked interfaces, learns the rewrite
+   of the packet which took the normal path after flowcache_forward */
+void flowcache_learn(const struct pbuf *p, struct netif *netif, stats_if_t out_if);
+
+/* End of the normal path of the packet passed to flowcache_forward */
+void flowcache_slow_path_done(void);
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/timeouts.h"
+#include "lwip/prot/iana.h"
+#include "lwip/lwip_napt.h"
+
+#include "flowtable.h"
+#include "stats.h"
+
+static const char *TAG = "FlowTable";
+
+#define FLOW_NIL 0xffff
+#define FLOW_SWEEP_INTERVAL_MS 1000
+#define FLOW_PRINT_CLIENTS 16
+
+/* Every list has a single timeout, so the least recently used entry of a list
+   is always the first one to expire. Expiry and eviction only have to look at
+   the tails and never scan the table. */
+typedef enum
+{
+    FLOW_LIST_TCP,
+    FLOW_LIST_TCP_CLOSING,
+    FLOW_LIST_DGRAM, // UDP and ICMP, lwIP uses the same timeout for both by default
+    FLOW_LIST_COUNT // marks a free entry
+} flow_list_t;
+
+typedef struct
+{
+    flow_key_t key;
+    uint32_t created_ms;
+    uint32_t last_ms;
+    uint32_t bytes_out;
+    uint32_t bytes_in;
+    uint16_t hash_next;
+    uint16_t prev; // towards the most recently used entry
+    uint16_t next; // towards the least recently used entry, also links the free list
+    uint8_t list;
+} flow_entry_t;
+
+typedef struct
+{
+    uint16_t head;
+    uint16_t tail;
+    uint32_t timeout_ms;
+} flow_lru_t;
+
+static flow_entry_t *flows = NULL;
+static uint32_t flow_slots = 0;
+static uint16_t *buckets = NULL;
+static uint32_t bucket_mask = 0;
+static uint16_t free_head = FLOW_NIL;
+static flow_lru_t lru[FLOW_LIST_COUNT] = {
+    {FLOW_NIL, FLOW_NIL, IP_NAPT_TIMEOUT_MS_TCP},
+    {FLOW_NIL, FLOW_NIL, IP_NAPT_TIMEOUT_MS_TCP_DISCON},
+    {FLOW_NIL, FLOW_NIL, IP_NAPT_TIMEOUT_MS_UDP},
+};
+
+static uint32_t flow_hash(const flow_key_t *key)
+{
+    uint32_t h = 2166136261u;
+    h = (h ^ key->src) * 16777619u;
+    h = (h ^ key->dst) * 16777619u;
+    h = (h ^ (((uint32_t)key->sport << 16) | key->dport)) * 16777619u;
+    h = (h ^ key->proto) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+static bool flow_key_equal(const flow_key_t *a, const flow_key_t *b)
+{
+    return a->src == b->src && a->dst == b->dst && a->sport == b->sport && a->dport == b->dport && a->proto == b->proto;
+}
+
+static void lru_unlink(uint16_t idx)
+{
+    flow_entry_t *entry = &flows[idx];
+    flow_lru_t *l = &lru[entry->list];
+    if (entry->prev != FLOW_NIL)
+    {
+        flows[entry->prev].next = entry->next;
+    }
+    else
+    {
+        l->head = entry->next;
+    }
+    if (entry->next != FLOW_NIL)
+    {
+        flows[entry->next].prev = entry->prev;
+    }
+    else
+    {
+        l->tail = entry->prev;
+    }
+}
+
+static void lru_push_head(uint16_t idx, flow_list_t list)
+{
+    flow_entry_t *entry = &flows[idx];
+    flow_lru_t *l = &lru[list];
+    entry->list = list;
+    entry->prev = FLOW_NIL;
+    entry->next = l->head;
+    if (l->head != FLOW_NIL)
+    {
+        flows[l->head].prev = idx;
+    }
+    l->head = idx;
+    if (l->tail == FLOW_NIL)
+    {
+        l->tail = idx;
+    }
+}
+
+static void hash_unlink(uint16_t idx)
+{
+    uint16_t *link = &buckets[flow_hash(&flows[idx].key) & bucket_mask];
+    while (*link != FLOW_NIL)
+    {
+        if (*link == idx)
+        {
+            *link = flows[idx].hash_next;
+            return;
+        }
+        link = &flows[*link].hash_next;
+    }
+}
+
+static void flow_release(uint16_t idx)
+{
+    hash_unlink(idx);
+    lru_unlink(idx);
+    flows[idx].next = free_head;
+    flows[idx].list = FLOW_LIST_COUNT;
+    free_head = idx;
+    stats_napt.in_use--;
+}
+
+static bool flow_tail_expired(flow_list_t list, uint32_t now)
+{
+    uint16_t tail = lru[list].tail;
+    return tail != FLOW_NIL && (now - flows[tail].last_ms) > lru[list].timeout_ms;
+}
+
+static void flow_expire(uint32_t now)
+{
+    for (int list = 0; list < FLOW_LIST_COUNT; list++)
+    {
+        while (flow_tail_expired(list, now))
+        {
+            flow_release(lru[list].tail);
+            stats_inc(&stats_napt.expired);
+        }
+    }
+}
+
+/* Table is full: drop the least recently used entry of all lists, like lwIP does */
+static void flow_evict_oldest(void)
+{
+    uint16_t oldest = FLOW_NIL;
+    for (int list = 0; list < FLOW_LIST_COUNT; list++)
+    {
+        uint16_t tail = lru[list].tail;
+        if (tail != FLOW_NIL && (oldest == FLOW_NIL || (int32_t)(flows[tail].last_ms - flows[oldest].last_ms) < 0))
+        {
+            oldest = tail;
+        }
+    }
+    if (oldest != FLOW_NIL)
+    {
+        flow_release(oldest);
+        stats_inc(&stats_napt.evicted);
+    }
+}
+
+static void flowtable_sweep(void *arg)
+{
+    flow_expire(sys_now());
+    sys_timeout(FLOW_SWEEP_INTERVAL_MS, flowtable_sweep, NULL);
+}
+
+static void flowtable_start_sweep(void *arg)
+{
+    sys_timeout(FLOW_SWEEP_INTERVAL_MS, flowtable_sweep, NULL);
+}
+
+void flowtable_init(uint32_t max_entries)
+{
+    if (max_entries == 0 || max_entries >= FLOW_NIL)
+    {
+        ESP_LOGE(TAG, "Invalid number of flow entries %lu", (unsigned long)max_entries);
+        return;
+    }
+    uint32_t bucket_count = 1;
+    while (bucket_count < max_entries)
+    {
+        bucket_count <<= 1;
+    }
+    flows = calloc(max_entries, sizeof(flow_entry_t));
+    buckets = malloc(bucket_count * sizeof(uint16_t));
+    if (flows == NULL || buckets == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for %lu flow entries", (unsigned long)max_entries);
+        free(flows);
+        free(buckets);
+        flows = NULL;
+        buckets = NULL;
+        return;
+    }
+    memset(buckets, 0xff, bucket_count * sizeof(uint16_t));
+    for (uint32_t i = 0; i < max_entries; i++)
+    {
+        flows[i].next = i + 1 < max_entries ? i + 1 : FLOW_NIL;
+        flows[i].list = FLOW_LIST_COUNT;
+    }
+    free_head = 0;
+    flow_slots = max_entries;
+    bucket_mask = bucket_count - 1;
+    stats_napt.max = max_entries;
+    ESP_LOGI(TAG, "Tracking up to %lu flows", (unsigned long)max_entries);
+    tcpip_callback(flowtable_start_sweep, NULL);
+}
+
+static uint16_t flow_find(const flow_key_t *key, uint16_t *bucket)
+{
+    for (uint16_t idx = *bucket; idx != FLOW_NIL; idx = flows[idx].hash_next)
+    {
+        if (flow_key_equal(&flows[idx].key, key))
+        {
+            return idx;
+        }
+    }
+    return FLOW_NIL;
+}
+
+void flowtable_track(const flow_key_t *key, bool closing, uint32_t len)
+{
+    if (flows == NULL)
+    {
+        return;
+    }
+    uint32_t now = sys_now();
+    uint16_t *bucket = &buckets[flow_hash(key) & bucket_mask];
+
+    uint16_t found = flow_find(key, bucket);
+    if (found != FLOW_NIL)
+    {
+        flow_entry_t *entry = &flows[found];
+        entry->last_ms = now;
+        entry->bytes_out += len;
+        lru_unlink(found);
+        lru_push_head(found, closing || entry->list == FLOW_LIST_TCP_CLOSING ? FLOW_LIST_TCP_CLOSING : entry->list);
+        return;
+    }
+
+    if (free_head == FLOW_NIL)
+    {
+        flow_expire(now);
+    }
+    if (free_head == FLOW_NIL)
+    {
+        flow_evict_oldest();
+    }
+    uint16_t idx = free_head;
+    flow_entry_t *entry = &flows[idx];
+    free_head = entry->next;
+
+    entry->key = *key;
+    entry->created_ms = now;
+    entry->last_ms = now;
+    entry->bytes_out = len;
+    entry->bytes_in = 0;
+    entry->hash_next = *bucket;
+    *bucket = idx;
+    if (key->proto == IP_PROTO_TCP)
+    {
+        lru_push_head(idx, closing ? FLOW_LIST_TCP_CLOSING : FLOW_LIST_TCP);
+    }
+    else
+    {
+        lru_push_head(idx, FLOW_LIST_DGRAM);
+    }
+
+    stats_napt.in_use++;
+    if (stats_napt.in_use > stats_napt.high_water)
+    {
+        stats_napt.high_water = stats_napt.in_use;
+    }
+    stats_inc(&stats_napt.created);
+}
+
+void flowtable_reply(const flow_key_t *key, uint32_t len)
+{
+    if (flows == NULL)
+    {
+        return;
+    }
+    uint16_t idx = flow_find(key, &buckets[flow_hash(key) & bucket_mask]);
+    if (idx != FLOW_NIL)
+    {
+        flows[idx].bytes_in += len;
+    }
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    flow_info_t *infos;
+    size_t max;
+    uint32_t cursor;
+    size_t count;
+} flow_snapshot_call_t;
+
+static err_t flowtable_copy(struct tcpip_api_call_data *data)
+{
+    flow_snapshot_call_t *c = (flow_snapshot_call_t *)data;
+    uint32_t now = sys_now();
+    for (; c->cursor < flow_slots && c->count < c->max; c->cursor++)
+    {
+        const flow_entry_t *entry = &flows[c->cursor];
+        if (entry->list == FLOW_LIST_COUNT)
+        {
+            continue;
+        }
+        flow_info_t *info = &c->infos[c->count++];
+        info->key = entry->key;
+        info->closing = entry->list == FLOW_LIST_TCP_CLOSING;
+        info->age_s = (now - entry->created_ms) / 1000;
+        info->idle_s = (now - entry->last_ms) / 1000;
+        info->bytes_out = entry->bytes_out;
+        info->bytes_in = entry->bytes_in;
+    }
+    return ERR_OK;
+}
+
+size_t flowtable_snapshot(flow_info_t *infos, size_t max, uint32_t *cursor)
+{
+    if (flows == NULL || *cursor >= flow_slots)
+    {
+        return 0;
+    }
+    flow_snapshot_call_t call = {.infos = infos, .max = max, .cursor = *cursor};
+    tcpip_api_call(flowtable_copy, &call.call);
+    *cursor = call.cursor;
+    return call.count;
+}
+
+static const char *flow_proto_name(uint8_t proto)
+{
+    switch (proto)
+    {
+    case IP_PROTO_TCP:
+        return "tcp";
+    case IP_PROTO_UDP:
+        return "udp";
+    default:
+        return "icmp";
+    }
+}
+
+void flowtable_print(uint32_t max)
+{
+    flow_info_t *infos = malloc(FLOWTABLE_SNAPSHOT_BATCH * sizeof(flow_info_t));
+    if (infos == NULL)
+    {
+        printf("No memory\n");
+        return;
+    }
+    struct
+    {
+        uint32_t ip;
+        uint32_t flows;
+    } clients[FLOW_PRINT_CLIENTS] = {0};
+    uint32_t total = 0;
+    uint32_t cursor = 0;
+    size_t count;
+
+    printf("%-5s %-21s %-21s %7s %6s %10s %10s\n", "proto", "client", "destination", "age_s", "idle_s", "out", "in");
+    while ((count = flowtable_snapshot(infos, FLOWTABLE_SNAPSHOT_BATCH, &cursor)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const flow_info_t *info = &infos[i];
+            for (int c = 0; c < FLOW_PRINT_CLIENTS; c++)
+            {
+                if (clients[c].ip == info->key.src || clients[c].flows == 0)
+                {
+                    clients[c].ip = info->key.src;
+                    clients[c].flows++;
+                    break;
+                }
+            }
+            if (total++ >= max)
+            {
+                continue;
+            }
+            char src[22];
+            char dst[22];
+            const uint8_t *s = (const uint8_t *)&info->key.src;
+            const uint8_t *d = (const uint8_t *)&info->key.dst;
+            snprintf(src, sizeof(src), "%u.%u.%u.%u:%u", s[0], s[1], s[2], s[3], info->key.sport);
+            snprintf(dst, sizeof(dst), "%u.%u.%u.%u:%u", d[0], d[1], d[2], d[3], info->key.dport);
+            printf("%-5s %-21s %-21s %7lu %6lu %10lu %10lu%s\n", flow_proto_name(info->key.proto), src, dst,
+                   (unsigned long)info->age_s, (unsigned long)info->idle_s,
+                   (unsigned long)info->bytes_out, (unsigned long)info->bytes_in, info->closing ? " closing" : "");
+        }
+    }
+    free(infos);
+
+    if (total > max)
+    {
+        printf("... %lu more\n", (unsigned long)(total - max));
+    }
+    printf("\n%lu flows of %lu\n", (unsigned long)total, (unsigned long)flow_slots);
+    for (int c = 0; c < FLOW_PRINT_CLIENTS && clients[c].flows > 0; c++)
+    {
+        const uint8_t *ip = (const uint8_t *)&clients[c].ip;
+        printf("%u.%u.%u.%u: %lu flows\n", ip[0], ip[1], ip[2], ip[3], (unsigned long)clients[c].flows);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Shadow of the NAPT table of lwIP. lwIP doesn't expose its table, so the
+   flows leaving the AP are tracked here with the same size and timeouts to get
+   the number of entries in use and the evictions. Lookup is hashed, expiry and
+   eviction work on LRU lists, so the costs don't grow with the table size.
+   Except flowtable_snapshot only to be used in the tcpip thread. */
+typedef struct
+{
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+} flow_key_t;
+
+#define FLOWTABLE_SNAPSHOT_BATCH 32
+
+/* A copy of a tracked flow, the key as sent by the client */
+typedef struct
+{
+    flow_key_t key;
+    bool closing;
+    uint32_t age_s;
+    uint32_t idle_s;
+    uint32_t bytes_out; // sent by the client
+    uint32_t bytes_in;  // received by the client
+} flow_info_t;
+
+void flowtable_init(uint32_t max_entries);
+/* A packet of a client leaving the AP, len is the size of the frame */
+void flowtable_track(const flow_key_t *key, bool closing, uint32_t len);
+/* A packet sent to a client, key is already in the direction of the client */
+void flowtable_reply(const flow_key_t *key, uint32_t len);
+
+/* Not for the tcpip thread: copies up to max flows from the slot *cursor on
+   and advances the cursor, 0 means the end of the table. Every batch is copied
+   at once in the tcpip thread, the table isn't locked between the batches. */
+size_t flowtable_snapshot(flow_info_t *infos, size_t max, uint32_t *cursor);
+/* Console: prints up to max flows and the number of flows per client */
+void flowtable_print(uint32_t max);
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "heapmon.h"
+#include "stats.h"
+#include "timer.h"
+#include "router_globals.h"
+
+static const char *TAG = "HeapMon";
+
+stats_heap_t stats_heap;
+
+/* xTaskGetHandle works on all targets, uxTaskGetSystemState needs the trace facility */
+static heapmon_task_t tasks[] = {
+    {"tiT"},        // tcpip thread
+    {"wifi"},
+    {"sys_evt"},    // default event loop
+    {"esp_timer"},
+    {"httpd"},
+    {"dns_server"},
+    {"config_flush"},
+    {"main"},       // console
+};
+#define HEAPMON_TASKS (sizeof(tasks) / sizeof(tasks[0]))
+
+static heapmon_sample_t history[HEAPMON_HISTORY];
+static size_t history_next = 0;
+static size_t history_count = 0;
+static portMUX_TYPE heapmon_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t sample_timer = NULL;
+static int32_t restart_below = 0;
+
+static void heapmonSample(void *arg)
+{
+    heapmon_sample_t sample = {
+        .uptime_s = esp_timer_get_time() / 1000000,
+        .free = heap_caps_get_free_size(MALLOC_CAP_8BIT),
+        .largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+    };
+    uint32_t stack_free[HEAPMON_TASKS];
+    for (size_t i = 0; i < HEAPMON_TASKS; i++)
+    {
+        TaskHandle_t handle = xTaskGetHandle(tasks[i].name);
+        stack_free[i] = handle != NULL ? uxTaskGetStackHighWaterMark(handle) : 0; // bytes on ESP-IDF
+    }
+
+    portENTER_CRITICAL(&heapmon_lock);
+    history[history_next] = sample;
+    history_next = (history_next + 1) % HEAPMON_HISTORY;
+    history_count = MIN(history_count + 1, HEAPMON_HISTORY);
+    for (size_t i = 0; i < HEAPMON_TASKS; i++)
+    {
+        tasks[i].stack_free = stack_free[i];
+    }
+    portEXIT_CRITICAL(&heapmon_lock);
+
+    stats_heap.free = sample.free;
+    stats_heap.largest = sample.largest;
+    stats_heap.min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    bool low = sample.largest < MAX(restart_below, HEAPMON_LOW_BLOCK);
+    stats_heap.low_samples = low ? stats_heap.low_samples + 1 : 0;
+    if (!low)
+    {
+        return;
+    }
+    stats_inc(&stats_heap.alarms);
+    ESP_LOGW(TAG, "Heap fragmented: %lu bytes free, largest block %lu bytes", (unsigned long)sample.free, (unsigned long)sample.largest);
+    if (restart_below > 0 && sample.largest < restart_below && stats_heap.low_samples >= HEAPMON_ALARM_SAMPLES)
+    {
+        ESP_LOGE(TAG, "Largest free block below %ld bytes for %d samples, restarting", (long)restart_below, HEAPMON_ALARM_SAMPLES);
+        esp_timer_stop(sample_timer);
+        restartByTimer();
+    }
+}
+
+void heapmon_init(void)
+{
+    get_config_param_int("heap_restart", &restart_below);
+    if (restart_below < 0)
+    {
+        restart_below = 0;
+    }
+    stats_heap.restart_below = restart_below;
+    initializeRestartTimer();
+    const esp_timer_create_args_t timer_args = {.callback = &heapmonSample, .name = "heapmon"};
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sample_timer));
+    heapmonSample(NULL);
+    ESP_ERROR_CHECK(esp_timer_start_periodic(sample_timer, HEAPMON_PERIOD_S * 1000000ULL));
+}
+
+size_t heapmon_get_history(heapmon_sample_t *samples, size_t max_samples)
+{
+    portENTER_CRITICAL(&heapmon_lock);
+    size_t count = MIN(history_count, max_samples);
+    size_t first = (history_next + HEAPMON_HISTORY - history_count) % HEAPMON_HISTORY;
+    for (size_t i = 0; i < count; i++)
+    {
+        samples[i] = history[(first + history_count - count + i) % HEAPMON_HISTORY];
+    }
+    portEXIT_CRITICAL(&heapmon_lock);
+    return count;
+}
+
+size_t heapmon_get_tasks(heapmon_task_t *copy, size_t max_tasks)
+{
+    portENTER_CRITICAL(&heapmon_lock);
+    size_t count = MIN(HEAPMON_TASKS, max_tasks);
+    memcpy(copy, tasks, count * sizeof(heapmon_task_t));
+    portEXIT_CRITICAL(&heapmon_lock);
+    return count;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Samples the heap and the stack high-water marks of the long running tasks
+   every HEAPMON_PERIOD_S into a ring of the last HEAPMON_HISTORY samples.
+   With heap_restart set, the router restarts when the largest free block
+   stays below that many bytes for HEAPMON_ALARM_SAMPLES samples in a row,
+   before the fragmented heap stalls the forwarding. */
+#define HEAPMON_PERIOD_S 60
+#define HEAPMON_HISTORY 24
+#define HEAPMON_ALARM_SAMPLES 3
+#define HEAPMON_LOW_BLOCK 8192 // largest free block which is logged as warning
+
+typedef struct
+{
+    uint32_t uptime_s;
+    uint32_t free;
+    uint32_t largest; // largest free block
+} heapmon_sample_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t stack_free; // minimum since the start in bytes, 0 if the task doesn't exist (yet)
+} heapmon_task_t;
+
+void heapmon_init(void);
+
+/* Copies the samples, the oldest first. Returns the number copied */
+size_t heapmon_get_history(heapmon_sample_t *samples, size_t max_samples);
+/* Copies the stack high-water marks of the last sample. Returns the number copied */
+size_t heapmon_get_tasks(heapmon_task_t *tasks, size_t max_tasks);
@@ -1,10 +1,114 @@
 #include "urihandler/handler.h"
+#include "urihandler/arena.h"
 
+#include <errno.h>
+#include "esp_timer.h"
+#include "lwip/sockets.h"
 #include "router_globals.h"
 #include "timer.h"
+#include "stats.h"
 
 static const char *TAG = "HTTPServer";
 
+/* Connections are kept open, so a page and its assets are loaded over one
+   connection. esp_http_server needs 3 of the lwIP sockets itself, the DNS
+   server and the OTA client need some more. Idle connections are closed
+   after http_idle seconds, the least recently used one when all are busy. */
+#define HTTP_SOCKETS_MAX (CONFIG_LWIP_MAX_SOCKETS - 3)
+#define HTTP_SOCKETS_DEFAULT 5
+#define HTTP_IDLE_DEFAULT_S 15
+#define HTTP_IDLE_MAX_S 300
+#define HTTP_REAP_PERIOD_US (5 * 1000000)
+
+stats_http_t stats_http;
+
+static httpd_handle_t http_server = NULL;
+static esp_timer_handle_t http_reap_timer = NULL;
+// Last received data per socket, only used in the server task
+static int64_t http_last_active_us[CONFIG_LWIP_MAX_SOCKETS];
+
+static int64_t *httpLastActive(int sockfd)
+{
+    int index = sockfd - LWIP_SOCKET_OFFSET;
+    return index >= 0 && index < CONFIG_LWIP_MAX_SOCKETS ? &http_last_active_us[index] : NULL;
+}
+
+/* Same as the default of esp_http_server, but remembers the time of the last request */
+static int httpRecv(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags)
+{
+    if (buf == NULL)
+    {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    int ret = recv(sockfd, buf, buf_len, flags);
+    if (ret < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    int64_t *lastActive = httpLastActive(sockfd);
+    if (lastActive != NULL)
+    {
+        *lastActive = esp_timer_get_time();
+    }
+    return ret;
+}
+
+static esp_err_t httpOpen(httpd_handle_t hd, int sockfd)
+{
+    int64_t *lastActive = httpLastActive(sockfd);
+    if (lastActive != NULL)
+    {
+        *lastActive = esp_timer_get_time();
+    }
+    httpd_sess_set_recv_override(hd, sockfd, httpRecv);
+    stats_inc(&stats_http.opened);
+    uint32_t open = __atomic_add_fetch(&stats_http.open, 1, __ATOMIC_RELAXED);
+    if (open > stats_http.high_water)
+    {
+        stats_http.high_water = open;
+    }
+    return ESP_OK;
+}
+
+// With a close_fn the server doesn't close the socket itself
+static void httpClose(httpd_handle_t hd, int sockfd)
+{
+    __atomic_sub_fetch(&stats_http.open, 1, __ATOMIC_RELAXED);
+    close(sockfd);
+}
+
+static void httpReap(void *arg)
+{
+    int fds[HTTP_SOCKETS_MAX];
+    size_t count = HTTP_SOCKETS_MAX;
+    if (httpd_get_client_list(http_server, &count, fds) != ESP_OK)
+    {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < count; i++)
+    {
+        int64_t *lastActive = httpLastActive(fds[i]);
+        // A WebSocket (the OTA progress) only receives, it is closed by the browser
+        if (httpd_ws_get_fd_info(http_server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
+        {
+            continue;
+        }
+        if (lastActive != NULL && now - *lastActive > (int64_t)stats_http.idle_timeout_s * 1000000)
+        {
+            ESP_LOGD(TAG, "Closing idle connection %d", fds[i]);
+            httpd_sess_trigger_close(http_server, fds[i]);
+            stats_inc(&stats_http.reaped);
+        }
+    }
+}
+
+// The client list is only consistent in the server task
+static void httpReapTimer(void *arg)
+{
+    httpd_queue_work(http_server, httpReap, NULL);
+}
+
 static httpd_uri_t applyp = {
     .uri = "/apply",
     .method = HTTP_POST,
@@ -60,6 +164,51 @@ static httpd_uri_t apig = {
     .method = HTTP_GET,
     .handler = rest_handler,
 };
+static httpd_uri_t statsg = {
+    .uri = "/api/stats",
+    .method = HTTP_GET,
+    .handler = stats_get_handler,
+};
+static httpd_uri_t scang = {
+    .uri = "/api/scan",
+    .method = HTTP_GET,
+    .handler = scan_api_get_handler,
+};
+static httpd_uri_t scanp = {
+    .uri = "/api/scan",
+    .method = HTTP_POST,
+    .handler = scan_api_post_handler,
+};
+static httpd_uri_t clientsg = {
+    .uri = "/api/clients",
+    .method = HTTP_GET,
+    .handler = api_v1_clients_get_handler,
+};
+static httpd_uri_t statusv1g = {
+    .uri = "/api/v1/status",
+    .method = HTTP_GET,
+    .handler = api_v1_status_get_handler,
+};
+static httpd_uri_t configv1g = {
+    .uri = "/api/v1/config",
+    .method = HTTP_GET,
+    .handler = api_v1_config_get_handler,
+};
+static httpd_uri_t portmapv1g = {
+    .uri = "/api/v1/portmap",
+    .method = HTTP_GET,
+    .handler = api_v1_portmap_get_handler,
+};
+static httpd_uri_t clientsv1g = {
+    .uri = "/api/v1/clients",
+    .method = HTTP_GET,
+    .handler = api_v1_clients_get_handler,
+};
+static httpd_uri_t flowsv1g = {
+    .uri = "/api/v1/flows",
+    .method = HTTP_GET,
+    .handler = api_v1_flows_get_handler,
+};
 
 // URI handler for getting "html page" file
 static httpd_uri_t scan_page_download = {
@@ -80,6 +229,12 @@ static httpd_uri_t clients_page_download = {
     .handler = clients_download_get_handler,
     .user_ctx = NULL};
 
+static httpd_uri_t clients_post = {
+    .uri = "/clients",
+    .method = HTTP_POST,
+    .handler = clients_post_handler,
+    .user_ctx = NULL};
+
 static httpd_uri_t ota_page_download = {
     .uri = "/ota",
     .method = HTTP_GET,
@@ -104,6 +259,13 @@ static httpd_uri_t otalog_post_download = {
     .handler = otalog_post_handler,
     .user_ctx = NULL};
 
+static httpd_uri_t otaws = {
+    .uri = "/otaws",
+    .method = HTTP_GET,
+    .handler = otaws_handler,
+    .is_websocket = true,
+};
+
 static httpd_uri_t advanced_page_download = {
     .uri = "/advanced",
     .method = HTTP_GET,
@@ -147,17 +309,67 @@ static httpd_uri_t styles_handler = {
     .handler = styles_download_get_handler,
     .user_ctx = NULL};
 
+static httpd_uri_t *const http_uris[] = {
+    &indexp, &indexg, &applyg, &applyp, &resetg, &scan_page_download, &result_page_download, &unlockg, &unlockp, &lockg,
+    &lockp, &favicon_handler, &jquery_handler, &about_handler, &styles_handler, &apig, &statsg, &scang, &scanp,
+    &clientsg, &statusv1g, &configv1g, &portmapv1g, &clientsv1g, &flowsv1g, &advanced_page_download, &clients_page_download,
+    &clients_post, &ota_page_download, &ota_page_post, &otalog_page_download, &otalog_post_download, &otaws,
+    &portmap_page_download, &portmap_post_download,
+};
+
+/* Every handler runs through httpDispatch, which releases the request arena,
+   when the handler returned. The handler itself is kept in user_ctx. */
+static esp_err_t httpDispatch(httpd_req_t *req)
+{
+    esp_err_t (*handler)(httpd_req_t *) = (esp_err_t (*)(httpd_req_t *))req->user_ctx;
+    esp_err_t err = handler(req);
+    req_arena_reset();
+    return err;
+}
+
+static void httpRegister(httpd_handle_t server, httpd_uri_t *uri)
+{
+    if (uri->handler != httpDispatch)
+    {
+        uri->user_ctx = (void *)uri->handler;
+        uri->handler = httpDispatch;
+    }
+    httpd_register_uri_handler(server, uri);
+}
+
 httpd_handle_t start_webserver(void)
 {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 25;
+    config.max_uri_handlers = sizeof(http_uris) / sizeof(http_uris[0]) + captive_probe_count();
     config.stack_size = 16384;
     config.lru_purge_enable = true;
+    config.open_fn = httpOpen;
+    config.close_fn = httpClose;
+
+    int32_t sockets = HTTP_SOCKETS_DEFAULT;
+    int32_t idle = HTTP_IDLE_DEFAULT_S;
+    get_config_param_int("http_sockets", &sockets);
+    get_config_param_int("http_idle", &idle);
+    if (sockets < 1 || sockets > HTTP_SOCKETS_MAX)
+    {
+        ESP_LOGW(TAG, "Invalid http_sockets %ld, using %d", (long)sockets, HTTP_SOCKETS_DEFAULT);
+        sockets = HTTP_SOCKETS_DEFAULT;
+    }
+    if (idle < 1 || idle > HTTP_IDLE_MAX_S)
+    {
+        ESP_LOGW(TAG, "Invalid http_idle %ld, using %d", (long)idle, HTTP_IDLE_DEFAULT_S);
+        idle = HTTP_IDLE_DEFAULT_S;
+    }
+    config.max_open_sockets = sockets;
+    stats_http.max = sockets;
+    stats_http.idle_timeout_s = idle;
+    config.core_id = get_mgmt_task_core();
+    config.task_priority = MGMT_TASK_PRIORITY;
 
     initializeRestartTimer();
 
-    char *lock_pass = NULL;
+    const char *lock_pass = NULL;
     int32_t keepAlive = 0;
 
     get_config_param_str("lock_pass", &lock_pass);
@@ -183,31 +395,20 @@ httpd_handle_t start_webserver(void)
     {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
-        httpd_register_uri_handler(server, &indexp);
-        httpd_register_uri_handler(server, &indexg);
-        httpd_register_uri_handler(server, &applyg);
-        httpd_register_uri_handler(server, &applyp);
-        httpd_register_uri_handler(server, &resetg);
-        httpd_register_uri_handler(server, &scan_page_download);
-        httpd_register_uri_handler(server, &result_page_download);
-        httpd_register_uri_handler(server, &unlockg);
-        httpd_register_uri_handler(server, &unlockp);
-        httpd_register_uri_handler(server, &lockg);
-        httpd_register_uri_handler(server, &lockp);
-        httpd_register_uri_handler(server, &favicon_handler);
-        httpd_register_uri_handler(server, &jquery_handler);
-        httpd_register_uri_handler(server, &about_handler);
-        httpd_register_uri_handler(server, &styles_handler);
-        httpd_register_uri_handler(server, &apig);
-        httpd_register_uri_handler(server, &advanced_page_download);
-        httpd_register_uri_handler(server, &clients_page_download);
-        httpd_register_uri_handler(server, &ota_page_download);
-        httpd_register_uri_handler(server, &ota_page_post);
-        httpd_register_uri_handler(server, &otalog_page_download);
-        httpd_register_uri_handler(server, &otalog_post_download);
-        httpd_register_uri_handler(server, &portmap_page_download);
-        httpd_register_uri_handler(server, &portmap_post_download);
+        for (size_t i = 0; i < sizeof(http_uris) / sizeof(http_uris[0]); i++)
+        {
+            httpRegister(server, http_uris[i]);
+        }
+        captive_probe_register(server);
         httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, http_404_error_handler);
+
+        http_server = server;
+        const esp_timer_create_args_t reap_timer_args = {.callback = &httpReapTimer, .name = "http_reap"};
+        if (esp_timer_create(&reap_timer_args, &http_reap_timer) == ESP_OK)
+        {
+            esp_timer_start_periodic(http_reap_timer, HTTP_REAP_PERIOD_US);
+        }
+        ESP_LOGI(TAG, "Keeping up to %ld connections, closed after %lds idle", (long)sockets, (long)idle);
         return server;
     }
 
@@ -0,0 +1,111 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/iana.h"
+
+#include "mssclamp.h"
+#include "csum.h"
+#include "stats.h"
+#include "router_globals.h"
+
+static const char *TAG = "MssClamp";
+
+#define MSSCLAMP_TCP_SYN 0x02U
+#define MSSCLAMP_OPT_END 0
+#define MSSCLAMP_OPT_NOP 1
+#define MSSCLAMP_OPT_MSS 2
+
+stats_mss_t stats_mss;
+
+void mssclamp_init(void)
+{
+    int32_t mtu = MSSCLAMP_MTU_MAX;
+    int32_t mss = 0;
+    get_config_param_int("uplink_mtu", &mtu);
+    get_config_param_int("mss_clamp", &mss);
+    if (mtu < MSSCLAMP_MTU_MIN || mtu > MSSCLAMP_MTU_MAX)
+    {
+        ESP_LOGW(TAG, "Invalid uplink MTU %ld, using %d", (long)mtu, MSSCLAMP_MTU_MAX);
+        mtu = MSSCLAMP_MTU_MAX;
+    }
+    // 0 derives the MSS from the MTU (IP and TCP header without options)
+    if (mss < MSSCLAMP_MSS_MIN || mss > mtu - 40)
+    {
+        mss = mtu - 40;
+    }
+    stats_mss.mtu = mtu;
+    stats_mss.clamp = mss;
+    ESP_LOGI(TAG, "Uplink MTU %ld, TCP MSS clamped to %ld", (long)mtu, (long)mss);
+}
+
+uint16_t mssclamp_mtu(void)
+{
+    return stats_mss.mtu;
+}
+
+bool IRAM_ATTR mssclamp_apply(struct pbuf *p)
+{
+    uint8_t *frame = (uint8_t *)p->payload;
+    if (stats_mss.clamp == 0 || p->len < SIZEOF_ETH_HDR + IP_HLEN + 20 ||
+        ((struct eth_hdr *)frame)->type != PP_HTONS(ETHTYPE_IP))
+    {
+        return false;
+    }
+    uint8_t *ip = frame + SIZEOF_ETH_HDR;
+    uint16_t ihl = (ip[0] & 0x0f) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < IP_HLEN || ip[9] != IP_PROTO_TCP || (ip[6] & 0x1f) != 0 || ip[7] != 0 ||
+        p->len < SIZEOF_ETH_HDR + ihl + 20)
+    {
+        return false;
+    }
+    uint8_t *tcp = ip + ihl;
+    if ((tcp[13] & MSSCLAMP_TCP_SYN) == 0)
+    {
+        return false;
+    }
+    stats_inc(&stats_mss.syns);
+
+    uint16_t tcp_hlen = (tcp[12] >> 4) * 4;
+    if (tcp_hlen < 20 || p->len < SIZEOF_ETH_HDR + ihl + tcp_hlen)
+    {
+        return false;
+    }
+    uint8_t *opt = tcp + 20;
+    uint8_t *end = tcp + tcp_hlen;
+    while (opt < end && *opt != MSSCLAMP_OPT_END)
+    {
+        if (*opt == MSSCLAMP_OPT_NOP)
+        {
+            opt++;
+            continue;
+        }
+        if (opt + 2 > end || opt[1] < 2 || opt + opt[1] > end)
+        {
+            return false;
+        }
+        if (opt[0] == MSSCLAMP_OPT_MSS && opt[1] == 4)
+        {
+            uint16_t mss = (opt[2] << 8) | opt[3];
+            if (mss <= stats_mss.clamp)
+            {
+                return false;
+            }
+            uint16_t old_value, new_value;
+            memcpy(&old_value, opt + 2, sizeof(old_value));
+            opt[2] = stats_mss.clamp >> 8;
+            opt[3] = stats_mss.clamp & 0xff;
+            memcpy(&new_value, opt + 2, sizeof(new_value));
+
+            uint16_t csum;
+            memcpy(&csum, tcp + 16, sizeof(csum));
+            csum = csum_update(csum, csum_delta16(old_value, new_value));
+            memcpy(tcp + 16, &csum, sizeof(csum));
+            stats_inc(&stats_mss.clamped);
+            return true;
+        }
+        opt += opt[1];
+    }
+    return false;
+}
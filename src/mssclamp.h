@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "lwip/pbuf.h"
+
+/* MTU of the uplink and clamping of the TCP MSS. Hotspots behind PPPoE or a
+   VPN often have a smaller MTU than the 1500 bytes of WiFi, the clients don't
+   know that and open connections with segments which have to be fragmented.
+   The MSS option of every forwarded SYN is lowered to uplink_mtu - 40 or to
+   mss_clamp, the checksum is updated incrementally. */
+#define MSSCLAMP_MTU_MIN 576
+#define MSSCLAMP_MTU_MAX 1500
+#define MSSCLAMP_MSS_MIN 536
+#define MSSCLAMP_MSS_MAX (MSSCLAMP_MTU_MAX - 40)
+
+/* Loads uplink_mtu and mss_clamp */
+void mssclamp_init(void);
+
+/* MTU of the STA interface */
+uint16_t mssclamp_mtu(void);
+
+/* Only in the tcpip thread, p starts with the ethernet header.
+   Returns true, if the MSS of a SYN was lowered. */
+bool mssclamp_apply(struct pbuf *p);
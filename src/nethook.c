@@ -0,0 +1,300 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+#include "lwip/netif.h"
+#include "lwip/tcpip.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/iana.h"
+#include "netif/ethernet.h"
+
+#include "nethook.h"
+#include "flowtable.h"
+#include "flowcache.h"
+#include "shaper.h"
+#include "mssclamp.h"
+#include "clientstats.h"
+#include "bootprofile.h"
+
+static const char *TAG = "NetHook";
+
+/* TCP flags of the header, lwip/prot/tcp.h isn't needed for these two */
+#define HOOK_TCP_FIN 0x01U
+#define HOOK_TCP_RST 0x04U
+
+static struct netif *hooked_netif[STATS_IF_COUNT];
+static bool forwarded = false; // for the boot profile
+static netif_input_fn orig_input[STATS_IF_COUNT];
+static netif_linkoutput_fn orig_linkoutput[STATS_IF_COUNT];
+
+static err_t hook_linkoutput(struct netif *netif, struct pbuf *p);
+static err_t hook_send(struct netif *netif, struct pbuf *p, stats_if_t interface);
+
+static inline stats_if_t hook_interface(const struct netif *netif)
+{
+    return netif == hooked_netif[STATS_IF_AP] ? STATS_IF_AP : STATS_IF_STA;
+}
+
+/* The flow key of an unfragmented IPv4 packet, as it is seen on the wire */
+static bool hook_parse_flow(const struct pbuf *p, flow_key_t *key, bool *closing)
+{
+    const uint8_t *frame = (const uint8_t *)p->payload;
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN + 4)
+    {
+        return false;
+    }
+    const struct eth_hdr *eth = (const struct eth_hdr *)frame;
+    if (eth->type != PP_HTONS(ETHTYPE_IP))
+    {
+        return false;
+    }
+    const uint8_t *ip = frame + SIZEOF_ETH_HDR;
+    uint16_t ihl = (ip[0] & 0x0f) * 4;
+    uint16_t frag = ((ip[6] & 0x1f) << 8) | ip[7];
+    if ((ip[0] >> 4) != 4 || ihl < IP_HLEN || frag != 0)
+    {
+        return false;
+    }
+
+    memcpy(&key->src, ip + 12, sizeof(key->src));
+    memcpy(&key->dst, ip + 16, sizeof(key->dst));
+    key->proto = ip[9];
+
+    const uint8_t *l4 = ip + ihl;
+    *closing = false;
+    switch (key->proto)
+    {
+    case IP_PROTO_TCP:
+        if (p->len < SIZEOF_ETH_HDR + ihl + 14)
+        {
+            return false;
+        }
+        *closing = (l4[13] & (HOOK_TCP_FIN | HOOK_TCP_RST)) != 0;
+        /* fall through */
+    case IP_PROTO_UDP:
+        if (p->len < SIZEOF_ETH_HDR + ihl + 4)
+        {
+            return false;
+        }
+        key->sport = (l4[0] << 8) | l4[1];
+        key->dport = (l4[2] << 8) | l4[3];
+        break;
+    case IP_PROTO_ICMP:
+        if (p->len < SIZEOF_ETH_HDR + ihl + 8)
+        {
+            return false;
+        }
+        // the id of echo requests is used by NAPT like a port
+        key->sport = (l4[4] << 8) | l4[5];
+        key->dport = 0;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Records the flows of the AP clients, which lwIP will translate */
+static void hook_track_flow(const struct pbuf *p, const struct netif *netif)
+{
+    flow_key_t key;
+    bool closing;
+    if (!hook_parse_flow(p, &key, &closing))
+    {
+        return;
+    }
+
+    // traffic to the router itself or to the local subnet isn't translated
+    uint32_t local = netif_ip4_addr(netif)->addr;
+    uint32_t mask = netif_ip4_netmask(netif)->addr;
+    if ((key.dst & mask) == (local & mask) || key.dst == IPADDR_NONE || (((const uint8_t *)&key.dst)[0] & 0xf0) == 0xe0)
+    {
+        return;
+    }
+    flowtable_track(&key, closing, p->tot_len);
+}
+
+/* Counts the answers of the translated flows, which are sent to the AP clients */
+static void hook_count_reply(const struct pbuf *p)
+{
+    flow_key_t key;
+    bool closing;
+    if (!hook_parse_flow(p, &key, &closing))
+    {
+        return;
+    }
+    uint32_t addr = key.src;
+    key.src = key.dst;
+    key.dst = addr;
+    if (key.proto != IP_PROTO_ICMP) // the id of an echo reply is already in sport
+    {
+        uint16_t port = key.sport;
+        key.sport = key.dport;
+        key.dport = port;
+    }
+    flowtable_reply(&key, p->tot_len);
+}
+
+static err_t hook_process(struct pbuf *p, struct netif *netif, stats_if_t interface)
+{
+    if (interface == STATS_IF_AP)
+    {
+        clientstats_rx(p);
+        hook_track_flow(p, netif);
+    }
+    // SYNs never take the fast path, the clamped SYN is forwarded by lwIP
+    mssclamp_apply(p);
+    stats_if_t out = flowcache_forward(p, interface);
+    if (out != STATS_IF_COUNT)
+    {
+        hook_linkoutput(hooked_netif[out], p);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+    err_t err = ethernet_input(p, netif);
+    flowcache_slow_path_done();
+    return err;
+}
+
+/* Runs in the tcpip thread, when the packet is taken from the mbox */
+static err_t hook_ethernet_input(struct pbuf *p, struct netif *netif)
+{
+    stats_mbox_taken();
+    stats_if_t interface = hook_interface(netif);
+    if (interface == STATS_IF_AP && shaper_input(p, netif_ip4_addr(netif)->addr))
+    {
+        return ERR_OK;
+    }
+    return hook_process(p, netif, interface);
+}
+
+/* Queued packets of the shaper, in the tcpip thread */
+static void hook_shaped_input(struct pbuf *p)
+{
+    hook_process(p, hooked_netif[STATS_IF_AP], STATS_IF_AP);
+}
+
+static void hook_shaped_output(struct pbuf *p)
+{
+    hook_send(hooked_netif[STATS_IF_AP], p, STATS_IF_AP);
+    pbuf_free(p);
+}
+
+/* Runs in the context of the WiFi driver */
+static err_t hook_input(struct pbuf *p, struct netif *netif)
+{
+    stats_if_t interface = hook_interface(netif);
+    stats_netif_t *s = &stats_netif[interface];
+    // p may already be freed by the tcpip thread after posting
+    uint16_t len = p->tot_len;
+    err_t err;
+
+    if (orig_input[interface] == tcpip_input)
+    {
+        stats_mbox_posted();
+        err = tcpip_inpkt(p, netif, hook_ethernet_input);
+        if (err != ERR_OK)
+        {
+            stats_mbox_taken();
+        }
+    }
+    else
+    {
+        err = orig_input[interface](p, netif);
+    }
+
+    if (err == ERR_OK)
+    {
+        stats_inc(&s->rx_packets);
+        stats_add(&s->rx_bytes, len);
+    }
+    else
+    {
+        stats_inc(&s->rx_drop_mbox);
+    }
+    return err;
+}
+
+static err_t hook_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    stats_if_t interface = hook_interface(netif);
+    flowcache_learn(p, netif, interface);
+    if (interface == STATS_IF_AP && shaper_output(p, netif_ip4_addr(netif)->addr))
+    {
+        return ERR_OK;
+    }
+    return hook_send(netif, p, interface);
+}
+
+static err_t hook_send(struct netif *netif, struct pbuf *p, stats_if_t interface)
+{
+    stats_netif_t *s = &stats_netif[interface];
+    uint16_t len = p->tot_len;
+
+    err_t err = orig_linkoutput[interface](netif, p);
+    if (err == ERR_OK)
+    {
+        if (interface == STATS_IF_AP)
+        {
+            clientstats_tx(p);
+            hook_count_reply(p);
+        }
+        stats_inc(&s->tx_packets);
+        stats_add(&s->tx_bytes, len);
+        // The first packet on the uplink, after lwIP translated a flow of a client
+        if (!forwarded && interface == STATS_IF_STA && stats_read(&stats_napt.created) > 0)
+        {
+            forwarded = true;
+            boot_mark("first forwarded packet");
+        }
+    }
+    else if (err == ERR_MEM)
+    {
+        stats_inc(&s->tx_drop_nobuf);
+    }
+    else
+    {
+        stats_inc(&s->tx_drop_err);
+    }
+    return err;
+}
+
+/* In the tcpip thread, runs after the MTU was loaded and after the STA was hooked */
+static void hook_apply_mtu(void *arg)
+{
+    struct netif *netif = hooked_netif[STATS_IF_STA];
+    uint16_t mtu = mssclamp_mtu();
+    if (netif != NULL && mtu != 0 && netif->mtu != mtu)
+    {
+        netif->mtu = mtu;
+        ESP_LOGI(TAG, "Uplink MTU set to %u", mtu);
+    }
+}
+
+void nethook_init(void)
+{
+    mssclamp_init();
+    tcpip_callback(hook_apply_mtu, NULL);
+    shaper_init(hook_shaped_output, hook_shaped_input);
+    clientstats_init();
+}
+
+void nethook_install(esp_netif_t *esp_netif, stats_if_t interface)
+{
+    struct netif *netif = esp_netif_get_netif_impl(esp_netif);
+    if (netif == NULL || netif == hooked_netif[interface])
+    {
+        return;
+    }
+    orig_input[interface] = netif->input;
+    orig_linkoutput[interface] = netif->linkoutput;
+    hooked_netif[interface] = netif;
+    netif->input = hook_input;
+    netif->linkoutput = hook_linkoutput;
+    ESP_LOGI(TAG, "Counters installed on %c%c%d", netif->name[0], netif->name[1], netif->num);
+    if (interface == STATS_IF_STA)
+    {
+        tcpip_callback(hook_apply_mtu, NULL);
+    }
+}
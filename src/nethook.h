@@ -0,0 +1,11 @@
+#pragma once
+
+#include <esp_netif.h>
+#include "stats.h"
+
+/* Hooks the receive and transmit functions of the lwIP netif behind the given
+   esp_netif to count the traffic. Can be called more than once. */
+void nethook_install(esp_netif_t *esp_netif, stats_if_t interface);
+
+/* Sets up the per client shaper and counters and the MTU of the uplink */
+void nethook_init(void);
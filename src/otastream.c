@@ -0,0 +1,241 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_http_client.h"
+#include "miniz.h"
+
+#include "otastream.h"
+
+static const char *TAG = "OtaStream";
+
+#define OTA_STREAM_BLOCK_SIZE 1024
+#define OTA_STREAM_RETRY_DELAY_MS 2000
+
+/* The inflater writes into a ring of the size of the deflate window,
+   everything it produced is flashed before the ring wraps */
+typedef struct
+{
+    tinfl_decompressor inflator;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+    size_t dict_ofs;
+    bool done;
+} ota_inflate_t;
+
+typedef struct
+{
+    const esp_partition_t *partition;
+    esp_ota_handle_t ota;
+    bool started;
+    ota_inflate_t *inflate;
+    size_t written;
+} ota_stream_t;
+
+static esp_err_t otaWrite(ota_stream_t *s, const uint8_t *data, size_t len)
+{
+    if (!s->started)
+    {
+        esp_err_t err = esp_ota_begin(s->partition, OTA_WITH_SEQUENTIAL_WRITES, &s->ota);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        s->started = true;
+    }
+    s->written += len;
+    return esp_ota_write(s->ota, data, len);
+}
+
+static esp_err_t otaInflate(ota_stream_t *s, const uint8_t *in, size_t len)
+{
+    ota_inflate_t *inf = s->inflate;
+    tinfl_status status;
+    do
+    {
+        if (inf->done)
+        {
+            return len == 0 ? ESP_OK : ESP_ERR_INVALID_SIZE; // data behind the end of the stream
+        }
+        size_t in_bytes = len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - inf->dict_ofs;
+        status = tinfl_decompress(&inf->inflator, in, &in_bytes, inf->dict, inf->dict + inf->dict_ofs, &out_bytes,
+                                  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_COMPUTE_ADLER32);
+        in += in_bytes;
+        len -= in_bytes;
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "Inflating failed: %d", status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (out_bytes > 0)
+        {
+            esp_err_t err = otaWrite(s, inf->dict + inf->dict_ofs, out_bytes);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            inf->dict_ofs = (inf->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        inf->done = status == TINFL_STATUS_DONE;
+    } while (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT);
+    return ESP_OK;
+}
+
+static void otaReset(ota_stream_t *s)
+{
+    if (s->started)
+    {
+        esp_ota_abort(s->ota);
+        s->started = false;
+    }
+    s->written = 0;
+    if (s->inflate != NULL)
+    {
+        tinfl_init(&s->inflate->inflator);
+        s->inflate->dict_ofs = 0;
+        s->inflate->done = false;
+    }
+}
+
+esp_err_t ota_stream_run(const ota_stream_config_t *config)
+{
+    ota_stream_t s = {.partition = esp_ota_get_next_update_partition(NULL)};
+    if (s.partition == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (config->compressed)
+    {
+        s.inflate = malloc(sizeof(ota_inflate_t));
+        if (s.inflate == NULL)
+        {
+            ESP_LOGE(TAG, "No memory for the inflater");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    otaReset(&s);
+    uint8_t *block = malloc(OTA_STREAM_BLOCK_SIZE);
+    esp_http_client_config_t http_config = {
+        .url = config->url,
+        .timeout_ms = config->timeout_ms,
+        .skip_cert_common_name_check = true,
+        .keep_alive_enable = true,
+    };
+    esp_http_client_handle_t client = block != NULL ? esp_http_client_init(&http_config) : NULL;
+    if (client == NULL)
+    {
+        free(block);
+        free(s.inflate);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t received = 0;
+    size_t total = 0;
+    int retries = 0;
+    esp_err_t err = ESP_FAIL;
+    while (true)
+    {
+        char range[32];
+        if (received > 0)
+        {
+            snprintf(range, sizeof(range), "bytes=%u-", (unsigned)received);
+            esp_http_client_set_header(client, "Range", range);
+        }
+        else
+        {
+            esp_http_client_delete_header(client, "Range");
+        }
+        err = esp_http_client_open(client, 0);
+        if (err == ESP_OK)
+        {
+            int64_t length = esp_http_client_fetch_headers(client);
+            int status = esp_http_client_get_status_code(client);
+            if (status == 404 && received == 0)
+            {
+                err = ESP_ERR_NOT_FOUND;
+                esp_http_client_close(client);
+                break;
+            }
+            if (status == 200 && received > 0)
+            {
+                ESP_LOGW(TAG, "Server doesn't support ranges, starting over");
+                otaReset(&s);
+                received = 0;
+            }
+            else if (status != 200 && status != 206)
+            {
+                ESP_LOGE(TAG, "Download failed with HTTP-Code %d", status);
+                err = ESP_ERR_INVALID_RESPONSE;
+                esp_http_client_close(client);
+                break;
+            }
+            if (length > 0)
+            {
+                total = received + length;
+            }
+
+            int len;
+            err = ESP_OK;
+            while (err == ESP_OK && (len = esp_http_client_read(client, (char *)block, OTA_STREAM_BLOCK_SIZE)) > 0)
+            {
+                err = s.inflate != NULL ? otaInflate(&s, block, len) : otaWrite(&s, block, len);
+                received += len;
+                if (config->progress != NULL)
+                {
+                    config->progress(received, total);
+                }
+                if (config->throttle_delay_ms > 0)
+                {
+                    vTaskDelay(pdMS_TO_TICKS(config->throttle_delay_ms));
+                }
+            }
+            if (err != ESP_OK)
+            {
+                esp_http_client_close(client);
+                break; // the image itself is broken, another try wouldn't help
+            }
+            bool complete = esp_http_client_is_complete_data_received(client);
+            esp_http_client_close(client);
+            if (complete && (total == 0 || received >= total))
+            {
+                break;
+            }
+            err = ESP_ERR_TIMEOUT;
+        }
+        if (++retries > OTA_STREAM_RETRIES)
+        {
+            ESP_LOGE(TAG, "Giving up after %d retries", OTA_STREAM_RETRIES);
+            break;
+        }
+        ESP_LOGW(TAG, "Connection lost after %u bytes (%s), retry %d", (unsigned)received, esp_err_to_name(err), retries);
+        vTaskDelay(pdMS_TO_TICKS(OTA_STREAM_RETRY_DELAY_MS));
+    }
+    esp_http_client_cleanup(client);
+    free(block);
+
+    if (err == ESP_OK && s.inflate != NULL && !s.inflate->done)
+    {
+        ESP_LOGE(TAG, "Compressed image is truncated");
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    free(s.inflate);
+    s.inflate = NULL;
+    if (err == ESP_OK && !s.started)
+    {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK)
+    {
+        otaReset(&s);
+        return err;
+    }
+    // Checks the image (header, chip and SHA-256) before it's activated
+    err = esp_ota_end(s.ota);
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Downloaded %u bytes, %u bytes written", (unsigned)received, (unsigned)s.written);
+        err = esp_ota_set_boot_partition(s.partition);
+    }
+    return err;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/* Downloads a firmware image into the next OTA partition. A compressed image
+   (zlib, firmware.bin.zz of the releases) is inflated while it is written.
+   After a broken connection the download continues with a range request at
+   the received offset, the inflater keeps its state meanwhile. */
+#define OTA_STREAM_RETRIES 5
+
+typedef void (*ota_stream_progress_fn)(size_t received, size_t total);
+
+typedef struct
+{
+    const char *url;
+    bool compressed;
+    int timeout_ms;
+    int throttle_delay_ms; // pause after every block, 0 for full speed
+    ota_stream_progress_fn progress;
+} ota_stream_config_t;
+
+/* Blocks until the image is written and set as boot partition.
+   Returns ESP_ERR_NOT_FOUND, if the url doesn't exist (i.e. no compressed image). */
+esp_err_t ota_stream_run(const ota_stream_config_t *config);
@@ -0,0 +1,14 @@
+#include <stdlib.h>
+
+#include "portparse.h"
+
+uint16_t parse_port(const char *value)
+{
+    if (value == NULL || *value < '0' || *value > '9')
+    {
+        return 0;
+    }
+    char *endptr;
+    unsigned long port = strtoul(value, &endptr, 10);
+    return *endptr == '\0' && port <= UINT16_MAX ? port : 0;
+}
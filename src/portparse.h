@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A port between 1 and 65535 without anything behind it, 0 if it's invalid.
+   NULL is invalid as well. Only depends on the C library, so it can be built
+   for the host. */
+uint16_t parse_port(const char *value);
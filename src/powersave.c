@@ -0,0 +1,172 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "powersave.h"
+#include "stats.h"
+#include "router_globals.h"
+
+static const char *TAG = "PowerSave";
+
+static const power_profile_t profiles[] = {
+    {.name = "off",
+     .description = "Always full power, the lowest latency"},
+    {.name = "latency",
+     .description = "Lower CPU clock while idle, full power within 100 ms of traffic",
+     .min_mhz = 80,
+     .sample_ms = 100,
+     .busy_pps = 20,
+     .idle_hold_ms = 10000,
+     .sta_ps = WIFI_PS_NONE},
+    {.name = "balanced",
+     .description = "Lower CPU clock and modem sleep while idle, full power within 250 ms of traffic",
+     .min_mhz = 80,
+     .sample_ms = 250,
+     .busy_pps = 50,
+     .idle_hold_ms = 5000,
+     .sta_ps = WIFI_PS_MIN_MODEM},
+    {.name = "battery",
+     .description = "Lowest CPU clock and deep modem sleep while idle, full power within a second of traffic",
+     .min_mhz = 40,
+     .sample_ms = 1000,
+     .busy_pps = 200,
+     .idle_hold_ms = 2000,
+     .sta_ps = WIFI_PS_MAX_MODEM},
+};
+
+stats_power_t stats_power;
+
+static const power_profile_t *profile = NULL;
+static esp_pm_lock_handle_t full_power_lock = NULL;
+static esp_timer_handle_t sample_timer = NULL;
+static uint64_t last_packets = 0;
+static uint32_t idle_ms = 0;
+
+const power_profile_t *power_profile_list(size_t *count)
+{
+    *count = sizeof(profiles) / sizeof(profiles[0]);
+    return profiles;
+}
+
+const power_profile_t *power_profile_find(const char *name)
+{
+    for (int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (name != NULL && strcmp(profiles[i].name, name) == 0)
+        {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+const power_profile_t *power_profile_get(void)
+{
+    if (profile != NULL)
+    {
+        return profile;
+    }
+    const char *name = NULL;
+    get_config_param_str("power_profile", &name);
+    profile = power_profile_find(name);
+    if (profile == NULL)
+    {
+        profile = power_profile_find(POWER_PROFILE_DEFAULT);
+    }
+    return profile;
+}
+
+static uint64_t powersavePackets(void)
+{
+    uint64_t packets = 0;
+    for (int i = 0; i < STATS_IF_COUNT; i++)
+    {
+        packets += stats_read(&stats_netif[i].rx_packets) + stats_read(&stats_netif[i].tx_packets);
+    }
+    return packets;
+}
+
+static void powersaveSetFull(bool full)
+{
+    if (full == stats_power.full_power)
+    {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (full)
+    {
+        esp_pm_lock_acquire(full_power_lock);
+        esp_wifi_set_ps(WIFI_PS_NONE);
+        stats_power.full_power_since_us = now;
+        stats_inc(&stats_power.boosts);
+    }
+    else
+    {
+        esp_wifi_set_ps(profile->sta_ps);
+        esp_pm_lock_release(full_power_lock);
+        stats_power.full_power_ms += (now - stats_power.full_power_since_us) / 1000;
+    }
+    stats_power.full_power = full;
+}
+
+static void powersaveSample(void *arg)
+{
+    uint64_t packets = powersavePackets();
+    uint64_t pps = (packets - last_packets) * 1000 / profile->sample_ms;
+    last_packets = packets;
+    stats_power.pps = pps;
+    if (pps >= profile->busy_pps)
+    {
+        idle_ms = 0;
+        powersaveSetFull(true);
+    }
+    else if (stats_power.full_power)
+    {
+        idle_ms += profile->sample_ms;
+        if (idle_ms >= profile->idle_hold_ms)
+        {
+            powersaveSetFull(false);
+        }
+    }
+}
+
+void powersave_init(void)
+{
+    const power_profile_t *p = power_profile_get();
+    stats_power.profile = p->name;
+    if (p->min_mhz == 0)
+    {
+        return;
+    }
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = p->min_mhz,
+        .light_sleep_enable = false,
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err == ESP_OK)
+    {
+        err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "powersave", &full_power_lock);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Power management isn't available: %s", esp_err_to_name(err));
+        stats_power.profile = "off";
+        return;
+    }
+
+    // Starts at full power, the first idle period lowers it
+    esp_pm_lock_acquire(full_power_lock);
+    esp_wifi_set_ps(WIFI_PS_NONE);
+    stats_power.full_power = true;
+    stats_power.full_power_since_us = esp_timer_get_time();
+    last_packets = powersavePackets();
+
+    const esp_timer_create_args_t timer_args = {.callback = &powersaveSample, .name = "powersave"};
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sample_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(sample_timer, p->sample_ms * 1000ULL));
+    ESP_LOGI(TAG, "Power profile %s: %d..%d MHz, full power above %lu packets/s", p->name, p->min_mhz,
+             CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, (unsigned long)p->busy_pps);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_wifi.h"
+
+/* Adaptive power management for routers on battery or solar. The traffic of
+   both interfaces is sampled every sample_ms: above busy_pps the CPU runs at
+   its maximum frequency and the STA doesn't sleep, after idle_hold_ms below
+   it the CPU drops to min_mhz and the STA uses sta_ps. The time to ramp up
+   is at most sample_ms (plus the DTIM interval of the uplink in modem sleep).
+   Needs CONFIG_PM_ENABLE, light sleep stays off because the AP has to send
+   its beacons. */
+typedef struct
+{
+    const char *name;
+    const char *description;
+    uint16_t min_mhz; // 0 keeps the CPU at full speed
+    uint32_t sample_ms;
+    uint32_t busy_pps;
+    uint32_t idle_hold_ms;
+    wifi_ps_type_t sta_ps;
+} power_profile_t;
+
+/* Default of the NVS parameter power_profile */
+#define POWER_PROFILE_DEFAULT "off"
+
+/* After esp_wifi_start, loads power_profile and starts the sampling */
+void powersave_init(void);
+
+const power_profile_t *power_profile_get(void);
+const power_profile_t *power_profile_list(size_t *count);
+const power_profile_t *power_profile_find(const char *name);
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+#include "lwip/lwip_napt.h"
+
+#include "profile.h"
+#include "router_globals.h"
+
+static const char *TAG = "Profile";
+
+static const perf_profile_t profiles[] = {
+    {.name = "low-memory",
+     .description = "Fewer buffers and no AMPDU RX, leaves the most heap",
+     .static_rx_buf = 4,
+     .dynamic_rx_buf = 12,
+     .dynamic_tx_buf = 16,
+     .ampdu_rx = false,
+     .ampdu_tx = true,
+     .rx_ba_win = 6,
+     .napt_max = 256},
+    // The values of the sdkconfig
+    {.name = "balanced",
+     .description = "Default buffer sizes",
+     .static_rx_buf = CONFIG_ESP_WIFI_STATIC_RX_BUFFER_NUM,
+     .dynamic_rx_buf = CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM,
+     .dynamic_tx_buf = CONFIG_ESP_WIFI_DYNAMIC_TX_BUFFER_NUM,
+     .ampdu_rx = true,
+     .ampdu_tx = true,
+     .rx_ba_win = CONFIG_ESP_WIFI_RX_BA_WIN,
+     .napt_max = IP_NAPT_MAX},
+    {.name = "max-throughput",
+     .description = "More buffers and a larger AMPDU window, needs up to 60 KB more heap under load",
+     .static_rx_buf = 16,
+     .dynamic_rx_buf = 48,
+     .dynamic_tx_buf = 48,
+     .ampdu_rx = true,
+     .ampdu_tx = true,
+     .rx_ba_win = 16,
+     .napt_max = IP_NAPT_MAX},
+    {.name = "many-clients",
+     .description = "Many buffers and the largest NAT table, the buffers are allocated in PSRAM",
+     .static_rx_buf = 16,
+     .dynamic_rx_buf = 128,
+     .dynamic_tx_buf = 128,
+     .ampdu_rx = true,
+     .ampdu_tx = true,
+     .rx_ba_win = 16,
+     .napt_max = NAPT_MAX_ENTRIES_LIMIT,
+     .needs_psram = true},
+};
+
+const perf_profile_t *perf_profile_list(size_t *count)
+{
+    *count = sizeof(profiles) / sizeof(profiles[0]);
+    return profiles;
+}
+
+const perf_profile_t *perf_profile_find(const char *name)
+{
+    for (int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (strcmp(profiles[i].name, name) == 0)
+        {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+bool perf_profile_available(const perf_profile_t *profile)
+{
+    return !profile->needs_psram || heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+}
+
+const perf_profile_t *perf_profile_get(void)
+{
+    static const perf_profile_t *current = NULL;
+    if (current != NULL)
+    {
+        return current;
+    }
+    const char *name = NULL;
+    get_config_param_str("perf_profile", &name);
+    current = perf_profile_find(name != NULL ? name : PERF_PROFILE_DEFAULT);
+    if (current == NULL || !perf_profile_available(current))
+    {
+        ESP_LOGW(TAG, "Profile %s isn't available on this board", name != NULL ? name : PERF_PROFILE_DEFAULT);
+        current = perf_profile_find(PERF_PROFILE_DEFAULT);
+        if (current == NULL || !perf_profile_available(current))
+        {
+            current = perf_profile_find("balanced");
+        }
+    }
+    return current;
+}
+
+void perf_profile_apply(wifi_init_config_t *cfg)
+{
+    const perf_profile_t *profile = perf_profile_get();
+    cfg->static_rx_buf_num = profile->static_rx_buf;
+    cfg->dynamic_rx_buf_num = profile->dynamic_rx_buf;
+    cfg->dynamic_tx_buf_num = profile->dynamic_tx_buf;
+    cfg->ampdu_rx_enable = profile->ampdu_rx;
+    cfg->ampdu_tx_enable = profile->ampdu_tx;
+    cfg->rx_ba_win = profile->rx_ba_win;
+    ESP_LOGI(TAG, "Using profile %s: %d static and %d dynamic RX, %d dynamic TX buffers, AMPDU RX %s (window %d)",
+             profile->name, profile->static_rx_buf, profile->dynamic_rx_buf, profile->dynamic_tx_buf,
+             profile->ampdu_rx ? "on" : "off", profile->rx_ba_win);
+}
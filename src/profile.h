@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_wifi.h"
+
+/* Default of the NVS parameter perf_profile, builds for boards with PSRAM set it to "many-clients" */
+#ifndef PERF_PROFILE_DEFAULT
+#define PERF_PROFILE_DEFAULT "balanced"
+#endif
+
+/* Buffer sizing, which trades memory for throughput. Applied to the WiFi driver
+   in wifi_init, the lwIP options (mbox size, IRAM) are fixed by the sdkconfig. */
+typedef struct
+{
+    const char *name;
+    const char *description;
+    uint8_t static_rx_buf;
+    uint16_t dynamic_rx_buf;
+    uint16_t dynamic_tx_buf;
+    bool ampdu_rx;
+    bool ampdu_tx;
+    uint8_t rx_ba_win;  // at most 2 * static_rx_buf and below dynamic_rx_buf
+    int32_t napt_max;   // default size of the NAT table
+    bool needs_psram;
+} perf_profile_t;
+
+/* The profile selected by perf_profile, falls back to the default, if it isn't available */
+const perf_profile_t *perf_profile_get(void);
+/* All profiles, for the selection on the advanced page */
+const perf_profile_t *perf_profile_list(size_t *count);
+const perf_profile_t *perf_profile_find(const char *name);
+bool perf_profile_available(const perf_profile_t *profile);
+void perf_profile_apply(wifi_init_config_t *cfg);
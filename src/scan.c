@@ -1,202 +1,152 @@
-/* Scan Example
+/* Background WiFi scan
 
-   This example code is in the Public Domain (or CC0 licensed, at your option.)
-
-   Unless required by applicable law or agreed to in writing, this
-   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
-   CONDITIONS OF ANY KIND, either express or implied.
-*/
-
-/*
-    This example shows how to scan for available set of APs.
-*/
+   The scan runs in APSTA mode while forwarding continues, it is finished by
+   WIFI_EVENT_SCAN_DONE. Only the last result is kept in RAM. */
 
 #include "scan.h"
-#include "router_globals.h"
+#include "uplink.h"
+#include <sys/param.h>
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 
 static const char *TAG = "Wifi-Scan";
 
-static void print_auth_mode(int authmode)
+static SemaphoreHandle_t scan_lock = NULL;
+static scan_record_t scan_records[DEFAULT_SCAN_LIST_SIZE];
+static size_t scan_count = 0;
+static int64_t scan_time = 0;
+static volatile scan_state_t scan_state = SCAN_IDLE;
+static volatile bool scan_pending = false; // waits for the STA to stop connecting
+static bool scan_restore_ap_mode = false;
+
+static esp_err_t scan_begin(void)
 {
-    switch (authmode)
-    {
-    case WIFI_AUTH_OPEN:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_OPEN");
-        break;
-    case WIFI_AUTH_OWE:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_OWE");
-        break;
-    case WIFI_AUTH_WEP:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WEP");
-        break;
-    case WIFI_AUTH_WPA_PSK:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA_PSK");
-        break;
-    case WIFI_AUTH_WPA2_PSK:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA2_PSK");
-        break;
-    case WIFI_AUTH_WPA_WPA2_PSK:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA_WPA2_PSK");
-        break;
-    case WIFI_AUTH_ENTERPRISE:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_ENTERPRISE");
-        break;
-    case WIFI_AUTH_WPA3_PSK:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA3_PSK");
-        break;
-    case WIFI_AUTH_WPA2_WPA3_PSK:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA2_WPA3_PSK");
-        break;
-    case WIFI_AUTH_WPA3_ENT_192:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_WPA3_ENT_192");
-        break;
-    default:
-        ESP_LOGI(TAG, "Authmode \tWIFI_AUTH_UNKNOWN");
-        break;
-    }
+    // Short dwell times, so the AP is back on its channel quickly
+    wifi_scan_config_t config = {
+        .show_hidden = false,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active = {.min = 0, .max = 120}};
+    return esp_wifi_scan_start(&config, false);
 }
-static void print_cipher_type(int pairwise_cipher, int group_cipher)
+
+static void scan_finish(scan_state_t state)
 {
-    switch (pairwise_cipher)
+    scan_pending = false;
+    scan_state = state;
+    if (scan_restore_ap_mode)
     {
-    case WIFI_CIPHER_TYPE_NONE:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_NONE");
-        break;
-    case WIFI_CIPHER_TYPE_WEP40:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_WEP40");
-        break;
-    case WIFI_CIPHER_TYPE_WEP104:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_WEP104");
-        break;
-    case WIFI_CIPHER_TYPE_TKIP:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_TKIP");
-        break;
-    case WIFI_CIPHER_TYPE_CCMP:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_CCMP");
-        break;
-    case WIFI_CIPHER_TYPE_TKIP_CCMP:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_TKIP_CCMP");
-        break;
-    case WIFI_CIPHER_TYPE_AES_CMAC128:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_AES_CMAC128");
-        break;
-    case WIFI_CIPHER_TYPE_SMS4:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_SMS4");
-        break;
-    case WIFI_CIPHER_TYPE_GCMP:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_GCMP");
-        break;
-    case WIFI_CIPHER_TYPE_GCMP256:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_GCMP256");
-        break;
-    default:
-        ESP_LOGI(TAG, "Pairwise Cipher \tWIFI_CIPHER_TYPE_UNKNOWN");
-        break;
+        scan_restore_ap_mode = false;
+        esp_wifi_set_mode(WIFI_MODE_AP);
     }
-
-    switch (group_cipher)
+    else if (!ap_connect && strlen(ssid) > 0)
     {
-    case WIFI_CIPHER_TYPE_NONE:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_NONE");
-        break;
-    case WIFI_CIPHER_TYPE_WEP40:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_WEP40");
-        break;
-    case WIFI_CIPHER_TYPE_WEP104:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_WEP104");
-        break;
-    case WIFI_CIPHER_TYPE_TKIP:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_TKIP");
-        break;
-    case WIFI_CIPHER_TYPE_CCMP:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_CCMP");
-        break;
-    case WIFI_CIPHER_TYPE_TKIP_CCMP:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_TKIP_CCMP");
-        break;
-    case WIFI_CIPHER_TYPE_SMS4:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_SMS4");
-        break;
-    case WIFI_CIPHER_TYPE_GCMP:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_GCMP");
-        break;
-    case WIFI_CIPHER_TYPE_GCMP256:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_GCMP256");
-        break;
-    default:
-        ESP_LOGI(TAG, "Group Cipher \tWIFI_CIPHER_TYPE_UNKNOWN");
-        break;
+        uplink_connect();
     }
 }
 
-/* Initialize Wi-Fi as sta and set scan method */
-static char *wifi_scan(void)
+static void scan_done_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-    esp_wifi_disconnect();
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
+    wifi_event_sta_scan_done_t *event = (wifi_event_sta_scan_done_t *)event_data;
     uint16_t number = DEFAULT_SCAN_LIST_SIZE;
-    wifi_ap_record_t ap_info[DEFAULT_SCAN_LIST_SIZE];
-    uint16_t ap_count = 0;
-    memset(ap_info, 0, sizeof(ap_info));
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    esp_wifi_scan_start(NULL, true);
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
-    ESP_LOGI(TAG, "Total APs scanned = %u", ap_count);
-
-    char result[DEFAULT_SCAN_LIST_SIZE * 100];
-    strcpy(result, "");
-
-    for (int i = 0; (i < DEFAULT_SCAN_LIST_SIZE) && (i < ap_count); i++)
+    wifi_ap_record_t *ap_info = calloc(number, sizeof(wifi_ap_record_t));
+    if (event->status != 0 || ap_info == NULL)
     {
-        ESP_LOGI(TAG, "SSID \t\t%s", ap_info[i].ssid);
-        ESP_LOGI(TAG, "RSSI \t\t%d", ap_info[i].rssi);
-        print_auth_mode(ap_info[i].authmode);
-        if (ap_info[i].authmode != WIFI_AUTH_WEP)
-        {
-            print_cipher_type(ap_info[i].pairwise_cipher, ap_info[i].group_cipher);
-        }
-        ESP_LOGI(TAG, "Channel \t\t%d\n", ap_info[i].primary);
-
-        char *tmp = malloc(100);
-
-        sprintf(tmp, "%s\x03%d\x05", ap_info[i].ssid, ap_info[i].rssi);
-
-        strcat(result, tmp);
-        free(tmp);
+        free(ap_info);
+        esp_wifi_clear_ap_list();
+        ESP_LOGW(TAG, "Scan failed");
+        scan_finish(SCAN_FAILED);
+        return;
     }
+    esp_wifi_scan_get_ap_records(&number, ap_info);
 
-    char *a_ptr = result;
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    for (int i = 0; i < number; i++)
+    {
+        strlcpy(scan_records[i].ssid, (const char *)ap_info[i].ssid, sizeof(scan_records[i].ssid));
+        scan_records[i].rssi = ap_info[i].rssi;
+        scan_records[i].channel = ap_info[i].primary;
+        scan_records[i].authmode = ap_info[i].authmode;
+        ESP_LOGD(TAG, "%s: %d dBm, channel %d", scan_records[i].ssid, ap_info[i].rssi, ap_info[i].primary);
+    }
+    scan_count = number;
+    scan_time = esp_timer_get_time();
+    xSemaphoreGive(scan_lock);
+    free(ap_info);
 
-    return a_ptr;
+    ESP_LOGI(TAG, "Total APs scanned = %u", event->number);
+    scan_finish(SCAN_DONE);
+}
 
+void scan_init(void)
+{
+    scan_lock = xSemaphoreCreateMutex();
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &scan_done_handler, NULL, NULL));
 }
 
-void fillNodes()
+esp_err_t scan_start(void)
 {
-    // Initialize NVS
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    if (scan_state == SCAN_RUNNING)
     {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+        return ESP_OK;
     }
-    ESP_ERROR_CHECK(ret);
+    wifi_mode_t mode;
+    esp_err_t err = esp_wifi_get_mode(&mode);
+    if (err == ESP_OK && mode == WIFI_MODE_AP)
+    {
+        // Scanning needs the STA interface, the AP keeps running
+        scan_restore_ap_mode = true;
+        err = esp_wifi_set_mode(WIFI_MODE_APSTA);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    scan_state = SCAN_RUNNING;
+    err = scan_begin();
+    if (err == ESP_ERR_WIFI_STATE && !ap_connect)
+    {
+        // A scan can't start while the STA is connecting, it starts on the disconnect event
+        ESP_LOGI(TAG, "Stopping the connection attempt for the scan");
+        scan_pending = true;
+        err = esp_wifi_disconnect();
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Starting scan failed: %s", esp_err_to_name(err));
+        scan_finish(SCAN_FAILED);
+    }
+    return err;
+}
 
-    const char *scan_result = wifi_scan();
-    nvs_handle_t nvs;
-    ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-    ESP_ERROR_CHECK(nvs_set_str(nvs, "scan_result", scan_result));
-    nvs_erase_key(nvs, "result_shown");
+bool scan_sta_disconnected(void)
+{
+    if (!scan_pending)
+    {
+        return scan_state == SCAN_RUNNING;
+    }
+    scan_pending = false;
+    esp_err_t err = scan_begin();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Starting scan failed: %s", esp_err_to_name(err));
+        scan_state = SCAN_FAILED;
+        return false;
+    }
+    return true;
+}
 
-    ESP_ERROR_CHECK(nvs_commit(nvs));
-    nvs_close(nvs);
-    esp_restart();
-}
\ No newline at end of file
+size_t scan_get_results(scan_record_t *records, size_t max_records, scan_state_t *state, int64_t *age_ms)
+{
+    *state = scan_state;
+    if (scan_lock == NULL)
+    {
+        *age_ms = -1;
+        return 0;
+    }
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    size_t count = MIN(scan_count, max_records);
+    memcpy(records, scan_records, count * sizeof(scan_record_t));
+    *age_ms = scan_time > 0 ? (esp_timer_get_time() - scan_time) / 1000 : -1;
+    xSemaphoreGive(scan_lock);
+    return count;
+}
@@ -2,8 +2,37 @@
 #include "freertos/FreeRTOS.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
-#include "nvs_flash.h"
 #include "router_globals.h"
 
-void fillNodes();
-char *findTextColorForSSID(int8_t rssi);
\ No newline at end of file
+typedef enum
+{
+    SCAN_IDLE,    // no scan since boot
+    SCAN_RUNNING,
+    SCAN_DONE,
+    SCAN_FAILED
+} scan_state_t;
+
+typedef struct
+{
+    char ssid[33];
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t authmode; // wifi_auth_mode_t
+} scan_record_t;
+
+/* Registers the WIFI_EVENT_SCAN_DONE handler, the default event loop must exist */
+void scan_init(void);
+/**
+ * @brief Starts a scan in the background, the AP clients stay connected.
+ * If the STA is just connecting, the attempt is stopped and continued after the scan.
+ */
+esp_err_t scan_start(void);
+/* Called on WIFI_EVENT_STA_DISCONNECTED, true if the STA must not reconnect now */
+bool scan_sta_disconnected(void);
+/**
+ * @brief Copies the networks of the last scan (strongest first) into records
+ *
+ * @return number of records copied
+ */
+size_t scan_get_results(scan_record_t *records, size_t max_records, scan_state_t *state, int64_t *age_ms);
+char *findTextColorForSSID(int8_t rssi);
@@ -0,0 +1,416 @@
+#include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+
+#include "shaper.h"
+#include "stats.h"
+#include "router_globals.h"
+#include "profile.h"
+
+static const char *TAG = "Shaper";
+
+#define SHAPER_TICK_MS 5
+/* Size of the buckets: traffic of up to this time can be sent at once */
+#define SHAPER_BURST_MS 20
+#define SHAPER_MIN_BURST_BITS (2 * 1514 * 8)
+/* Bytes a queue may send per round, at least one full frame */
+#define SHAPER_QUANTUM 1514
+/* Queued packets per client and direction and for all clients. A full queue
+   drops, which makes TCP slow down instead of building up latency. Queued
+   packets are copies in heap, so they don't hold the RX buffers of the WiFi
+   driver. The total is lowered for profiles with few of them, as these have
+   little heap as well. */
+#define SHAPER_QUEUE_LEN 8
+#define SHAPER_QUEUE_TOTAL 32
+
+typedef enum
+{
+    SHAPER_DOWN,
+    SHAPER_UP,
+    SHAPER_DIR_COUNT
+} shaper_dir_t;
+
+typedef enum
+{
+    SHAPER_PASS, // send now
+    SHAPER_QUEUED,
+    SHAPER_DROPPED
+} shaper_verdict_t;
+
+typedef struct
+{
+    uint32_t kbps; // 0 = unlimited
+    int32_t tokens; // bits
+    int32_t burst;
+    int32_t deficit; // bytes
+    uint32_t last_ms;
+    struct pbuf *queue[SHAPER_QUEUE_LEN];
+    uint8_t head;
+    uint8_t count;
+} shaper_bucket_t;
+
+typedef struct
+{
+    bool used;
+    uint8_t mac[6];
+    shaper_bucket_t bucket[SHAPER_DIR_COUNT];
+} shaper_class_t;
+
+stats_shaper_t stats_shaper;
+
+// Persisted limits, only used outside of the tcpip thread
+static shaper_limit_t limits[SHAPER_MAX_CLIENTS];
+static size_t limit_count = 0;
+
+// State of the tcpip thread
+static shaper_class_t *classes = NULL;
+static uint32_t class_count = 0;
+static uint32_t queued_total = 0;
+static uint32_t queue_total_max = SHAPER_QUEUE_TOTAL;
+static uint32_t next_class = 0;
+static bool tick_scheduled = false;
+static shaper_send_fn send_fn[SHAPER_DIR_COUNT];
+
+static void shaper_tick(void *arg);
+
+static void bucket_refill(shaper_bucket_t *bucket, uint32_t now)
+{
+    // At most a second, so kbps * elapsed fits
+    uint32_t elapsed = MIN(now - bucket->last_ms, 1000);
+    bucket->last_ms = now;
+    bucket->tokens = MIN(bucket->tokens + (int32_t)(bucket->kbps * elapsed), bucket->burst);
+}
+
+static void bucket_configure(shaper_bucket_t *bucket, uint32_t kbps)
+{
+    bucket->kbps = kbps;
+    bucket->burst = MAX((int32_t)(kbps * SHAPER_BURST_MS), SHAPER_MIN_BURST_BITS);
+    bucket->tokens = bucket->burst;
+    bucket->deficit = 0;
+    bucket->last_ms = sys_now();
+}
+
+static struct pbuf *bucket_pop(shaper_bucket_t *bucket)
+{
+    struct pbuf *p = bucket->queue[bucket->head];
+    bucket->head = (bucket->head + 1) % SHAPER_QUEUE_LEN;
+    bucket->count--;
+    queued_total--;
+    return p;
+}
+
+static void bucket_flush(shaper_bucket_t *bucket)
+{
+    while (bucket->count > 0)
+    {
+        pbuf_free(bucket_pop(bucket));
+    }
+}
+
+static shaper_class_t *class_find(const uint8_t *mac)
+{
+    for (int i = 0; i < SHAPER_MAX_CLIENTS; i++)
+    {
+        if (classes[i].used && memcmp(classes[i].mac, mac, sizeof(classes[i].mac)) == 0)
+        {
+            return &classes[i];
+        }
+    }
+    return NULL;
+}
+
+static void schedule_tick(void)
+{
+    if (!tick_scheduled)
+    {
+        tick_scheduled = true;
+        sys_timeout(SHAPER_TICK_MS, shaper_tick, NULL);
+    }
+}
+
+/* Runs in the tcpip thread: sends the queued packets, which have tokens now.
+   Every backlogged queue gets a quantum per round, so a client with many
+   small packets can't starve the others within a tick. */
+static void shaper_tick(void *arg)
+{
+    tick_scheduled = false;
+    uint32_t now = sys_now();
+    for (int n = 0; n < SHAPER_MAX_CLIENTS; n++)
+    {
+        shaper_class_t *class = &classes[(next_class + n) % SHAPER_MAX_CLIENTS];
+        if (!class->used)
+        {
+            continue;
+        }
+        for (int dir = 0; dir < SHAPER_DIR_COUNT; dir++)
+        {
+            shaper_bucket_t *bucket = &class->bucket[dir];
+            if (bucket->count == 0)
+            {
+                continue;
+            }
+            bucket_refill(bucket, now);
+            bucket->deficit += SHAPER_QUANTUM;
+            while (bucket->count > 0)
+            {
+                struct pbuf *p = bucket->queue[bucket->head];
+                if (p->tot_len > bucket->deficit || p->tot_len * 8 > bucket->tokens)
+                {
+                    break;
+                }
+                bucket_pop(bucket);
+                bucket->deficit -= p->tot_len;
+                bucket->tokens -= p->tot_len * 8;
+                send_fn[dir](p);
+            }
+            if (bucket->count == 0)
+            {
+                bucket->deficit = 0;
+            }
+        }
+    }
+    next_class = (next_class + 1) % SHAPER_MAX_CLIENTS;
+    __atomic_store_n(&stats_shaper.queued, queued_total, __ATOMIC_RELAXED);
+    if (queued_total > 0)
+    {
+        schedule_tick();
+    }
+}
+
+static shaper_verdict_t shaper_enqueue(shaper_bucket_t *bucket, struct pbuf *p)
+{
+    uint32_t now = sys_now();
+    bucket_refill(bucket, now);
+    int32_t cost = p->tot_len * 8;
+    if (bucket->count == 0 && bucket->tokens >= cost)
+    {
+        bucket->tokens -= cost;
+        return SHAPER_PASS;
+    }
+    // The frame may be in an RX buffer of the driver, which every station needs
+    struct pbuf *copy = NULL;
+    if (bucket->count >= SHAPER_QUEUE_LEN || queued_total >= queue_total_max ||
+        (copy = pbuf_clone(PBUF_RAW, PBUF_RAM, p)) == NULL)
+    {
+        stats_inc(&stats_shaper.dropped);
+        return SHAPER_DROPPED;
+    }
+    bucket->queue[(bucket->head + bucket->count) % SHAPER_QUEUE_LEN] = copy;
+    bucket->count++;
+    queued_total++;
+    __atomic_store_n(&stats_shaper.queued, queued_total, __ATOMIC_RELAXED);
+    stats_inc(&stats_shaper.delayed);
+    schedule_tick();
+    return SHAPER_QUEUED;
+}
+
+/* IPv4 packets which are forwarded and not sent or received by the router itself */
+static bool shaper_is_forwarded(const struct pbuf *p, size_t ip_offset, uint32_t own_ip)
+{
+    const struct eth_hdr *eth = (const struct eth_hdr *)p->payload;
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN || eth->type != PP_HTONS(ETHTYPE_IP))
+    {
+        return false;
+    }
+    uint32_t addr;
+    memcpy(&addr, (const uint8_t *)p->payload + SIZEOF_ETH_HDR + ip_offset, sizeof(addr));
+    return addr != own_ip;
+}
+
+bool shaper_output(struct pbuf *p, uint32_t own_ip)
+{
+    if (class_count == 0 || !shaper_is_forwarded(p, 12, own_ip))
+    {
+        return false;
+    }
+    shaper_class_t *class = class_find(((const struct eth_hdr *)p->payload)->dest.addr);
+    if (class == NULL || class->bucket[SHAPER_DOWN].kbps == 0)
+    {
+        return false;
+    }
+    // The caller frees the packet after the output, a copy is queued
+    return shaper_enqueue(&class->bucket[SHAPER_DOWN], p) != SHAPER_PASS;
+}
+
+bool shaper_input(struct pbuf *p, uint32_t own_ip)
+{
+    if (class_count == 0 || !shaper_is_forwarded(p, 16, own_ip))
+    {
+        return false;
+    }
+    shaper_class_t *class = class_find(((const struct eth_hdr *)p->payload)->src.addr);
+    if (class == NULL || class->bucket[SHAPER_UP].kbps == 0)
+    {
+        return false;
+    }
+    if (shaper_enqueue(&class->bucket[SHAPER_UP], p) == SHAPER_PASS)
+    {
+        return false;
+    }
+    // Queued as a copy or dropped, the RX buffer goes back to the driver
+    pbuf_free(p);
+    return true;
+}
+
+/* Runs in the tcpip thread */
+static void shaper_apply(void *arg)
+{
+    shaper_limit_t *limit = (shaper_limit_t *)arg;
+    shaper_class_t *class = class_find(limit->mac);
+    if (limit->down_kbps == 0 && limit->up_kbps == 0)
+    {
+        if (class != NULL)
+        {
+            bucket_flush(&class->bucket[SHAPER_DOWN]);
+            bucket_flush(&class->bucket[SHAPER_UP]);
+            class->used = false;
+            class_count--;
+        }
+        free(limit);
+        return;
+    }
+    if (class == NULL)
+    {
+        for (int i = 0; i < SHAPER_MAX_CLIENTS && class == NULL; i++)
+        {
+            if (!classes[i].used)
+            {
+                class = &classes[i];
+            }
+        }
+        if (class == NULL)
+        {
+            free(limit);
+            return;
+        }
+        memset(class, 0, sizeof(*class));
+        memcpy(class->mac, limit->mac, sizeof(class->mac));
+        class->used = true;
+        class_count++;
+    }
+    // Queued packets are sent at the new rate
+    bucket_configure(&class->bucket[SHAPER_DOWN], limit->down_kbps);
+    bucket_configure(&class->bucket[SHAPER_UP], limit->up_kbps);
+    free(limit);
+}
+
+static void shaper_post(const shaper_limit_t *limit)
+{
+    if (classes == NULL)
+    {
+        return;
+    }
+    shaper_limit_t *copy = malloc(sizeof(shaper_limit_t));
+    if (copy == NULL)
+    {
+        return;
+    }
+    *copy = *limit;
+    if (tcpip_callback(shaper_apply, copy) != ERR_OK)
+    {
+        free(copy);
+    }
+}
+
+static shaper_limit_t *limit_find(const uint8_t mac[6])
+{
+    for (size_t i = 0; i < limit_count; i++)
+    {
+        if (memcmp(limits[i].mac, mac, sizeof(limits[i].mac)) == 0)
+        {
+            return &limits[i];
+        }
+    }
+    return NULL;
+}
+
+bool shaper_get_limit(const uint8_t mac[6], shaper_limit_t *limit)
+{
+    shaper_limit_t *entry = limit_find(mac);
+    if (entry != NULL)
+    {
+        *limit = *entry;
+    }
+    return entry != NULL;
+}
+
+esp_err_t shaper_set_limit(const uint8_t mac[6], uint32_t down_kbps, uint32_t up_kbps)
+{
+    if (down_kbps > SHAPER_MAX_KBPS || up_kbps > SHAPER_MAX_KBPS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    shaper_limit_t *entry = limit_find(mac);
+    if (entry == NULL && down_kbps == 0 && up_kbps == 0)
+    {
+        return ESP_OK;
+    }
+    if (entry == NULL)
+    {
+        if (limit_count >= SHAPER_MAX_CLIENTS)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        entry = &limits[limit_count++];
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->mac, mac, sizeof(entry->mac));
+    }
+    else if (entry->down_kbps == down_kbps && entry->up_kbps == up_kbps)
+    {
+        return ESP_OK;
+    }
+    entry->down_kbps = down_kbps;
+    entry->up_kbps = up_kbps;
+    shaper_post(entry);
+    ESP_LOGI(TAG, "Limit of %02x:%02x:%02x:%02x:%02x:%02x: %lu kbit/s down, %lu kbit/s up", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+             (unsigned long)down_kbps, (unsigned long)up_kbps);
+
+    if (down_kbps == 0 && up_kbps == 0)
+    {
+        *entry = limits[--limit_count];
+    }
+    stats_shaper.clients = limit_count;
+    if (limit_count == 0)
+    {
+        return config_erase("shaper_tab");
+    }
+    return config_set_blob("shaper_tab", limits, limit_count * sizeof(shaper_limit_t));
+}
+
+void shaper_init(shaper_send_fn down, shaper_send_fn up)
+{
+    send_fn[SHAPER_DOWN] = down;
+    send_fn[SHAPER_UP] = up;
+    queue_total_max = MIN(SHAPER_QUEUE_TOTAL, perf_profile_get()->dynamic_rx_buf / 2);
+    classes = calloc(SHAPER_MAX_CLIENTS, sizeof(shaper_class_t));
+    if (classes == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for the shaper");
+        return;
+    }
+
+    const char *blob;
+    size_t len;
+    if (get_config_param_blob("shaper_tab", &blob, &len) != ESP_OK)
+    {
+        return;
+    }
+    if (len % sizeof(shaper_limit_t) != 0 || len / sizeof(shaper_limit_t) > SHAPER_MAX_CLIENTS)
+    {
+        ESP_LOGW(TAG, "Invalid shaper table");
+        return;
+    }
+    memcpy(limits, blob, len);
+    limit_count = len / sizeof(shaper_limit_t);
+    stats_shaper.clients = limit_count;
+    for (size_t i = 0; i < limit_count; i++)
+    {
+        shaper_post(&limits[i]);
+    }
+    ESP_LOGI(TAG, "Loaded %u client limits", (unsigned)limit_count);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "lwip/pbuf.h"
+
+/* Per client bandwidth limits of the AP. Every limited client has a token
+   bucket per direction, packets above the rate are queued and sent by a timer
+   in the tcpip thread, which serves the queues with deficit round robin.
+   Clients without a limit and the traffic of the router itself aren't touched. */
+#define SHAPER_MAX_CLIENTS 16
+#define SHAPER_MAX_KBPS 1000000
+
+/* Stored as blob shaper_tab, a rate of 0 means unlimited */
+typedef struct
+{
+    uint8_t mac[6];
+    uint16_t reserved;
+    uint32_t down_kbps;
+    uint32_t up_kbps;
+} shaper_limit_t;
+
+/* Called in the tcpip thread for a queued packet, takes over p */
+typedef void (*shaper_send_fn)(struct pbuf *p);
+
+/* Loads the limits, down sends a frame to a client, up processes a frame of a client */
+void shaper_init(shaper_send_fn down, shaper_send_fn up);
+
+/* Not for the tcpip thread: stores the limit of the client, 0 and 0 removes it */
+esp_err_t shaper_set_limit(const uint8_t mac[6], uint32_t down_kbps, uint32_t up_kbps);
+/* Returns false, if the client has no limit */
+bool shaper_get_limit(const uint8_t mac[6], shaper_limit_t *limit);
+
+/* Only in the tcpip thread, p starts with the ethernet header.
+   Return true, if the packet was queued or dropped and must not be sent now.
+   shaper_output keeps a reference if needed, the caller still frees p.
+   shaper_input takes over p, if it returns true. */
+bool shaper_output(struct pbuf *p, uint32_t own_ip);
+bool shaper_input(struct pbuf *p, uint32_t own_ip);
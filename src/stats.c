@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "lwip/lwip_napt.h"
+
+#include "stats.h"
+#include "profile.h"
+#include "heapmon.h"
+#include "urihandler/arena.h"
+#include "router_globals.h"
+
+stats_netif_t stats_netif[STATS_IF_COUNT];
+stats_napt_t stats_napt;
+stats_dns_t stats_dns;
+
+static uint32_t mbox_depth;
+static uint32_t mbox_high_water;
+
+static const char *stats_if_names[STATS_IF_COUNT] = {"ap", "sta"};
+
+uint64_t stats_read(const stats_counter_t *counter)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++)
+    {
+        // the two halves of a slot are written one after the other, read until two reads agree
+        const volatile uint64_t *slot = &counter->v[i];
+        uint64_t value;
+        do
+        {
+            value = *slot;
+        } while (value != *slot);
+        sum += value;
+    }
+    return sum;
+}
+
+void stats_mbox_posted(void)
+{
+    uint32_t depth = __atomic_add_fetch(&mbox_depth, 1, __ATOMIC_RELAXED);
+    uint32_t high = __atomic_load_n(&mbox_high_water, __ATOMIC_RELAXED);
+    while (depth > high && !__atomic_compare_exchange_n(&mbox_high_water, &high, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+void stats_mbox_taken(void)
+{
+    __atomic_sub_fetch(&mbox_depth, 1, __ATOMIC_RELAXED);
+}
+
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+} json_out_t;
+
+static void json_append(json_out_t *out, const char *fmt, ...)
+{
+    if (out->len >= out->size)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+    va_end(args);
+    if (n > 0)
+    {
+        out->len += n;
+    }
+}
+
+size_t stats_format_json(char *buf, size_t size)
+{
+    json_out_t out = {.buf = buf, .size = size, .len = 0};
+
+    json_append(&out, "{\"uptime_ms\":%llu,\"profile\":\"%s\",\"if\":{", (unsigned long long)(esp_timer_get_time() / 1000), perf_profile_get()->name);
+    for (int i = 0; i < STATS_IF_COUNT; i++)
+    {
+        stats_netif_t *s = &stats_netif[i];
+        json_append(&out, "%s\"%s\":{\"rx_pkts\":%llu,\"rx_bytes\":%llu,\"tx_pkts\":%llu,\"tx_bytes\":%llu,"
+                          "\"drop\":{\"rx_mbox\":%llu,\"tx_nobuf\":%llu,\"tx_err\":%llu}}",
+                    i > 0 ? "," : "", stats_if_names[i],
+                    (unsigned long long)stats_read(&s->rx_packets), (unsigned long long)stats_read(&s->rx_bytes),
+                    (unsigned long long)stats_read(&s->tx_packets), (unsigned long long)stats_read(&s->tx_bytes),
+                    (unsigned long long)stats_read(&s->rx_drop_mbox), (unsigned long long)stats_read(&s->tx_drop_nobuf),
+                    (unsigned long long)stats_read(&s->tx_drop_err));
+    }
+    json_append(&out, "},\"mbox\":{\"size\":%d,\"depth\":%lu,\"high_water\":%lu}",
+                CONFIG_LWIP_TCPIP_RECVMBOX_SIZE,
+                (unsigned long)__atomic_load_n(&mbox_depth, __ATOMIC_RELAXED),
+                (unsigned long)__atomic_load_n(&mbox_high_water, __ATOMIC_RELAXED));
+    json_append(&out, ",\"napt\":{\"max\":%lu,\"in_use\":%lu,\"high_water\":%lu,\"created\":%llu,\"expired\":%llu,\"evicted\":%llu,"
+                      "\"timeouts_ms\":{\"tcp\":%lu,\"tcp_closing\":%lu,\"udp\":%lu,\"icmp\":%lu}}",
+                (unsigned long)stats_napt.max, (unsigned long)__atomic_load_n(&stats_napt.in_use, __ATOMIC_RELAXED),
+                (unsigned long)__atomic_load_n(&stats_napt.high_water, __ATOMIC_RELAXED),
+                (unsigned long long)stats_read(&stats_napt.created), (unsigned long long)stats_read(&stats_napt.expired),
+                (unsigned long long)stats_read(&stats_napt.evicted),
+                (unsigned long)IP_NAPT_TIMEOUT_MS_TCP, (unsigned long)IP_NAPT_TIMEOUT_MS_TCP_DISCON,
+                (unsigned long)IP_NAPT_TIMEOUT_MS_UDP, (unsigned long)IP_NAPT_TIMEOUT_MS_ICMP);
+    json_append(&out, ",\"dns\":{\"queries\":%llu,\"hits\":%llu,\"misses\":%llu,\"coalesced\":%llu,"
+                      "\"upstream_timeouts\":%llu,\"upstream_errors\":%llu,\"captive\":%llu}",
+                (unsigned long long)stats_read(&stats_dns.queries), (unsigned long long)stats_read(&stats_dns.hits),
+                (unsigned long long)stats_read(&stats_dns.misses), (unsigned long long)stats_read(&stats_dns.coalesced),
+                (unsigned long long)stats_read(&stats_dns.upstream_timeouts),
+                (unsigned long long)stats_read(&stats_dns.upstream_errors),
+                (unsigned long long)stats_read(&stats_dns.captive));
+    uint64_t hits = stats_read(&stats_flowcache.hits);
+    uint64_t misses = stats_read(&stats_flowcache.misses);
+    json_append(&out, ",\"flowcache\":{\"size\":%lu,\"hits\":%llu,\"misses\":%llu,\"hit_rate_pct\":%u}",
+                (unsigned long)stats_flowcache.size, (unsigned long long)hits, (unsigned long long)misses,
+                (unsigned)(hits + misses > 0 ? hits * 100 / (hits + misses) : 0));
+    json_append(&out, ",\"mss\":{\"mtu\":%u,\"clamp\":%u,\"syns\":%llu,\"clamped\":%llu}",
+                (unsigned)stats_mss.mtu, (unsigned)stats_mss.clamp,
+                (unsigned long long)stats_read(&stats_mss.syns), (unsigned long long)stats_read(&stats_mss.clamped));
+    uint64_t full_power_ms = stats_power.full_power_ms;
+    if (stats_power.full_power)
+    {
+        full_power_ms += (esp_timer_get_time() - stats_power.full_power_since_us) / 1000;
+    }
+    json_append(&out, ",\"power\":{\"profile\":\"%s\",\"full_power\":%s,\"pps\":%lu,\"boosts\":%llu,\"full_power_ms\":%llu}",
+                stats_power.profile != NULL ? stats_power.profile : "off", stats_power.full_power ? "true" : "false",
+                (unsigned long)stats_power.pps, (unsigned long long)stats_read(&stats_power.boosts),
+                (unsigned long long)full_power_ms);
+    json_append(&out, ",\"shaper\":{\"clients\":%lu,\"queued\":%lu,\"delayed\":%llu,\"dropped\":%llu}",
+                (unsigned long)stats_shaper.clients, (unsigned long)__atomic_load_n(&stats_shaper.queued, __ATOMIC_RELAXED),
+                (unsigned long long)stats_read(&stats_shaper.delayed), (unsigned long long)stats_read(&stats_shaper.dropped));
+    uint64_t reconnects = stats_read(&stats_uplink.reconnects);
+    json_append(&out, ",\"uplink\":{\"first_connect_ms\":%lu,\"reconnects\":%llu,\"fast_reconnects\":%llu,\"failed_attempts\":%llu,"
+                      "\"last_outage_ms\":%lu,\"max_outage_ms\":%lu,\"avg_outage_ms\":%llu}",
+                (unsigned long)stats_uplink.first_connect_ms, (unsigned long long)reconnects,
+                (unsigned long long)stats_read(&stats_uplink.fast_reconnects), (unsigned long long)stats_read(&stats_uplink.failed_attempts),
+                (unsigned long)stats_uplink.last_outage_ms, (unsigned long)stats_uplink.max_outage_ms,
+                (unsigned long long)(reconnects > 0 ? stats_uplink.total_outage_ms / reconnects : 0));
+    json_append(&out, ",\"heap\":{\"free\":%lu,\"largest\":%lu,\"min_free\":%lu,\"frag_pct\":%lu,\"alarms\":%llu,\"restart_below\":%lu,\"history\":[",
+                (unsigned long)stats_heap.free, (unsigned long)stats_heap.largest, (unsigned long)stats_heap.min_free,
+                (unsigned long)(stats_heap.free > 0 ? 100 - (uint64_t)stats_heap.largest * 100 / stats_heap.free : 0),
+                (unsigned long long)stats_read(&stats_heap.alarms), (unsigned long)stats_heap.restart_below);
+    heapmon_sample_t samples[HEAPMON_HISTORY];
+    size_t count = heapmon_get_history(samples, HEAPMON_HISTORY);
+    for (size_t i = 0; i < count; i++)
+    {
+        json_append(&out, "%s[%lu,%lu,%lu]", i > 0 ? "," : "", (unsigned long)samples[i].uptime_s,
+                    (unsigned long)samples[i].free, (unsigned long)samples[i].largest);
+    }
+    json_append(&out, "],\"stack_free\":{");
+    heapmon_task_t tasks[16];
+    count = heapmon_get_tasks(tasks, sizeof(tasks) / sizeof(tasks[0]));
+    for (size_t i = 0; i < count; i++)
+    {
+        json_append(&out, "%s\"%s\":%lu", i > 0 ? "," : "", tasks[i].name, (unsigned long)tasks[i].stack_free);
+    }
+    json_append(&out, "}}");
+    json_append(&out, ",\"http\":{\"max\":%lu,\"open\":%lu,\"high_water\":%lu,\"opened\":%llu,\"reaped\":%llu,\"idle_timeout_s\":%lu,\"probes\":%llu,"
+                      "\"arena\":{\"size\":%d,\"high_water\":%lu,\"failed\":%llu}}",
+                (unsigned long)stats_http.max, (unsigned long)__atomic_load_n(&stats_http.open, __ATOMIC_RELAXED),
+                (unsigned long)stats_http.high_water, (unsigned long long)stats_read(&stats_http.opened),
+                (unsigned long long)stats_read(&stats_http.reaped), (unsigned long)stats_http.idle_timeout_s,
+                (unsigned long long)stats_read(&stats_http.probes),
+                REQ_ARENA_SIZE, (unsigned long)stats_http.arena_high_water, (unsigned long long)stats_read(&stats_http.arena_failed));
+    config_write_stats_t config_writes;
+    config_get_write_stats(&config_writes);
+    json_append(&out, ",\"config\":{\"sets\":%lu,\"writes\":%lu,\"commits\":%lu,\"writes_saved\":%lu}",
+                (unsigned long)config_writes.sets, (unsigned long)config_writes.writes, (unsigned long)config_writes.commits,
+                (unsigned long)(config_writes.sets - config_writes.writes));
+
+    json_append(&out, "}");
+
+    return out.len < size ? out.len : size - 1;
+}
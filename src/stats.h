@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+/* Counters are kept per core, every core only writes its own slot. This avoids
+   contention between the WiFi task and the tcpip thread without any lock.
+   A slot is incremented with a plain add, 64 bit atomics are no instructions on
+   the ESP32 targets but a libatomic call under a spinlock. An increment may get
+   lost, when a task is preempted in the middle of it by another task on the same
+   core, which is accepted for statistics. The slots are summed up, when the
+   counters are read. */
+typedef struct
+{
+    uint64_t v[portNUM_PROCESSORS];
+} stats_counter_t;
+
+typedef enum
+{
+    STATS_IF_AP,
+    STATS_IF_STA,
+    STATS_IF_COUNT
+} stats_if_t;
+
+typedef struct
+{
+    stats_counter_t rx_packets;
+    stats_counter_t rx_bytes;
+    stats_counter_t tx_packets;
+    stats_counter_t tx_bytes;
+    stats_counter_t rx_drop_mbox;  // tcpip mbox full, packet was dropped before lwIP saw it
+    stats_counter_t tx_drop_nobuf; // driver returned ERR_MEM, WiFi TX buffers exhausted
+    stats_counter_t tx_drop_err;   // any other error of the driver
+} stats_netif_t;
+
+typedef struct
+{
+    stats_counter_t created;
+    stats_counter_t expired;
+    stats_counter_t evicted; // entries dropped while still active, because the table was full
+    uint32_t in_use;
+    uint32_t high_water;
+    uint32_t max;
+} stats_napt_t;
+
+typedef struct
+{
+    stats_counter_t queries; // queries received while forwarding to the upstream server
+    stats_counter_t hits;
+    stats_counter_t misses;
+    stats_counter_t coalesced; // queries answered by a query already sent upstream
+    stats_counter_t upstream_timeouts;
+    stats_counter_t upstream_errors;
+    stats_counter_t captive; // queries answered with the IP of the soft AP
+} stats_dns_t;
+
+typedef struct
+{
+    stats_counter_t hits;   // packets forwarded by the fast path
+    stats_counter_t misses; // TCP and UDP packets forwarded by lwIP, the rewrite was learned
+    uint32_t size;
+} stats_flowcache_t;
+
+typedef struct
+{
+    stats_counter_t delayed; // packets queued, because the client was above its limit
+    stats_counter_t dropped; // packets dropped, because the queue was full
+    uint32_t queued;
+    uint32_t clients; // clients with a limit
+} stats_shaper_t;
+
+typedef struct
+{
+    stats_counter_t opened;
+    stats_counter_t reaped; // closed by the server, because they were idle too long
+    uint32_t open;
+    uint32_t high_water;
+    uint32_t max;
+    uint32_t idle_timeout_s;
+    stats_counter_t probes;       // connectivity checks of the operating systems
+    stats_counter_t arena_failed; // allocations which didn't fit into the request arena
+    uint32_t arena_high_water;
+} stats_http_t;
+
+typedef struct
+{
+    stats_counter_t reconnects;      // connections after a lost connection
+    stats_counter_t fast_reconnects; // of them with the stored BSSID and channel
+    stats_counter_t failed_attempts;
+    uint32_t first_connect_ms; // from the start of WiFi to the first IP
+    uint32_t last_outage_ms;
+    uint32_t max_outage_ms;
+    uint64_t total_outage_ms;
+} stats_uplink_t;
+
+typedef struct
+{
+    stats_counter_t alarms; // samples with a fragmented heap
+    uint32_t free;
+    uint32_t largest; // largest free block
+    uint32_t min_free;
+    uint32_t low_samples; // samples in a row with a fragmented heap
+    uint32_t restart_below;
+} stats_heap_t;
+
+typedef struct
+{
+    stats_counter_t syns;    // TCP SYNs forwarded in both directions
+    stats_counter_t clamped; // of them with a lowered MSS
+    uint16_t mtu;            // of the uplink
+    uint16_t clamp;          // largest MSS of a forwarded SYN
+} stats_mss_t;
+
+typedef struct
+{
+    stats_counter_t boosts; // changes to full power
+    const char *profile;
+    bool full_power;
+    uint32_t pps;           // packets per second of the last sample
+    uint64_t full_power_ms; // time at full power, without the current period
+    int64_t full_power_since_us;
+} stats_power_t;
+
+extern stats_netif_t stats_netif[STATS_IF_COUNT];
+extern stats_napt_t stats_napt;
+extern stats_dns_t stats_dns;
+extern stats_flowcache_t stats_flowcache;
+extern stats_shaper_t stats_shaper;
+extern stats_http_t stats_http;
+extern stats_uplink_t stats_uplink;
+extern stats_heap_t stats_heap;
+extern stats_mss_t stats_mss;
+extern stats_power_t stats_power;
+
+static inline void stats_add(stats_counter_t *counter, uint32_t value)
+{
+    volatile uint64_t *slot = &counter->v[xPortGetCoreID()];
+    *slot += value;
+}
+
+static inline void stats_inc(stats_counter_t *counter)
+{
+    stats_add(counter, 1);
+}
+
+uint64_t stats_read(const stats_counter_t *counter);
+
+/* Depth of the tcpip mbox, only packets posted by the receive hook are counted */
+void stats_mbox_posted(void);
+void stats_mbox_taken(void);
@@ -0,0 +1,81 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "statusled.h"
+
+static const char *TAG = "StatusLed";
+
+static esp_timer_handle_t led_timer = NULL;
+static gpio_num_t led_gpio;
+static bool uplink = false;
+static uint16_t clients = 0;
+static bool restart = false;
+static uint32_t step = 0; // only in the esp_timer task
+
+/* Every blink takes two steps, the pause after the last blink shows the uplink state */
+static void statusledStep(void *arg)
+{
+    bool on = __atomic_load_n(&uplink, __ATOMIC_RELAXED);
+    uint32_t count = __atomic_load_n(&clients, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&restart, false, __ATOMIC_RELAXED))
+    {
+        step = 0;
+    }
+    if (step >= 2 * count)
+    {
+        gpio_set_level(led_gpio, on);
+        step = 0;
+        if (count > 0)
+        {
+            esp_timer_start_once(led_timer, STATUSLED_PAUSE_MS * 1000);
+        }
+        return;
+    }
+    gpio_set_level(led_gpio, step % 2 == 0 ? !on : on);
+    step++;
+    esp_timer_start_once(led_timer, STATUSLED_BLINK_MS * 1000);
+}
+
+/* If the timer task is just running the step, it rearms the timer itself and
+   the new state is shown with the next step */
+static void statusledRestart(void)
+{
+    if (led_timer == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&restart, true, __ATOMIC_RELAXED);
+    esp_timer_stop(led_timer);
+    esp_timer_start_once(led_timer, 1000);
+}
+
+void statusled_init(gpio_num_t gpio)
+{
+    led_gpio = gpio;
+    gpio_reset_pin(gpio);
+    gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+    const esp_timer_create_args_t timer_args = {.callback = &statusledStep, .name = "status_led"};
+    if (esp_timer_create(&timer_args, &led_timer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Creating the LED timer failed");
+        led_timer = NULL;
+        return;
+    }
+    statusledRestart();
+}
+
+void statusled_set_uplink(bool connected)
+{
+    if (__atomic_exchange_n(&uplink, connected, __ATOMIC_RELAXED) != connected)
+    {
+        statusledRestart();
+    }
+}
+
+void statusled_set_clients(uint16_t count)
+{
+    if (__atomic_exchange_n(&clients, count, __ATOMIC_RELAXED) != count)
+    {
+        statusledRestart();
+    }
+}
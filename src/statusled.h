@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+
+/* The on board LED: on while the uplink is connected, one short blink per
+   connected client every second. The pattern is a state machine on a one-shot
+   esp_timer, which is only armed while clients are connected. Without clients
+   the LED is set once per change and nothing wakes up the chip. */
+#define STATUSLED_BLINK_MS 50
+#define STATUSLED_PAUSE_MS 1000
+
+void statusled_init(gpio_num_t gpio);
+
+/* From the WiFi events, before statusled_init the state is only stored */
+void statusled_set_uplink(bool connected);
+void statusled_set_clients(uint16_t count);
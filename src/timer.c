@@ -51,7 +51,10 @@ esp_timer_create_args_t refresh_timer_args = {
 
 void initializeRestartTimer()
 {
-    esp_timer_create(&restart_timer_args, &restart_timer);
+    if (restart_timer == NULL) // the web server and the heap monitor both need it
+    {
+        esp_timer_create(&restart_timer_args, &restart_timer);
+    }
 }
 void initializeKeepAliveTimer()
 {
@@ -0,0 +1,399 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "mbedtls/pkcs5.h"
+
+#include "uplink.h"
+#include "scan.h"
+#include "stats.h"
+#include "bootprofile.h"
+#include "router_globals.h"
+
+static const char *TAG = "Uplink";
+
+#define UPLINK_BACKOFF_MIN_MS 500
+#define UPLINK_BACKOFF_MAX_MS 30000
+#define UPLINK_SCAN_MAX_AGE_MS 60000
+#define UPLINK_PSK_LEN 32
+
+/* Stored as blob uplink_alt */
+typedef struct
+{
+    char ssid[33];
+    char passwd[65];
+} uplink_network_t;
+
+/* Stored as blob uplink_last, only used for the network and passphrase of check */
+typedef struct
+{
+    uint32_t check;
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t has_psk;
+    uint8_t psk[UPLINK_PSK_LEN];
+} uplink_last_t;
+
+stats_uplink_t stats_uplink;
+
+// 0 is the configured network, then the alternatives
+static uplink_network_t networks[1 + UPLINK_MAX_ALTERNATES];
+static size_t network_count = 0;
+static size_t current = 0;
+static bool enterprise = false;
+
+static uplink_last_t last;
+static bool fast_attempt = false; // the running attempt uses the stored BSSID and channel
+static bool psk_attempt = false;  // and the stored PSK instead of the passphrase
+static bool connected = false;
+static uint32_t failures = 0; // since the connection was lost
+static uint8_t network_failures = 0;
+static int64_t down_since_us = 0;
+static bool first_connect = true;
+static esp_timer_handle_t retry_timer = NULL;
+static bool select_pending = false; // a network is chosen after the running scan
+
+static uint32_t uplinkCheck(const uplink_network_t *network)
+{
+    uint32_t h = 2166136261u;
+    for (const char *c = network->ssid; *c != '\0'; c++)
+    {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    h = (h ^ 0xff) * 16777619u;
+    for (const char *c = network->passwd; *c != '\0'; c++)
+    {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    return h;
+}
+
+static bool uplinkLastValid(void)
+{
+    return last.check != 0 && last.check == uplinkCheck(&networks[current]) && last.channel != 0;
+}
+
+static void uplinkSaveLast(void)
+{
+    config_set_blob("uplink_last", &last, sizeof(last));
+}
+
+static size_t uplinkLoadAlternates(uplink_network_t *alternates)
+{
+    const char *blob = NULL;
+    size_t len = 0;
+    if (get_config_param_blob("uplink_alt", &blob, &len) != ESP_OK || blob == NULL)
+    {
+        return 0;
+    }
+    size_t count = MIN(len / sizeof(uplink_network_t), UPLINK_MAX_ALTERNATES);
+    memcpy(alternates, blob, count * sizeof(uplink_network_t));
+    for (size_t i = 0; i < count; i++)
+    {
+        alternates[i].ssid[sizeof(alternates[i].ssid) - 1] = '\0';
+        alternates[i].passwd[sizeof(alternates[i].passwd) - 1] = '\0';
+    }
+    return count;
+}
+
+static void uplinkAttempt(bool fast)
+{
+    const uplink_network_t *network = &networks[current];
+    wifi_config_t config;
+    esp_wifi_get_config(WIFI_IF_STA, &config);
+    memset(config.sta.ssid, 0, sizeof(config.sta.ssid));
+    strncpy((char *)config.sta.ssid, network->ssid, sizeof(config.sta.ssid));
+    fast_attempt = fast && uplinkLastValid();
+    psk_attempt = !enterprise && uplinkLastValid() && last.has_psk;
+    if (!enterprise)
+    {
+        memset(config.sta.password, 0, sizeof(config.sta.password));
+        if (psk_attempt)
+        {
+            // 64 hex digits are taken as the PSK, the 4096 rounds of PBKDF2 are skipped
+            for (int i = 0; i < UPLINK_PSK_LEN; i++)
+            {
+                sprintf((char *)config.sta.password + i * 2, "%02x", last.psk[i]);
+            }
+        }
+        else
+        {
+            strncpy((char *)config.sta.password, network->passwd, sizeof(config.sta.password));
+        }
+    }
+    config.sta.bssid_set = fast_attempt;
+    config.sta.channel = fast_attempt ? last.channel : 0;
+    if (fast_attempt)
+    {
+        memcpy(config.sta.bssid, last.bssid, sizeof(config.sta.bssid));
+    }
+    // Without the stored access point the strongest one of the network is chosen
+    config.sta.scan_method = fast_attempt ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN;
+    config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &config);
+    if (err == ESP_OK)
+    {
+        err = esp_wifi_connect();
+    }
+    ESP_LOGI(TAG, "Connecting to '%s'%s: %s", network->ssid, fast_attempt ? " (stored access point)" : "", esp_err_to_name(err));
+}
+
+static void uplinkRetry(void *arg)
+{
+    if (!connected)
+    {
+        uplinkAttempt(true);
+    }
+}
+
+/* Chooses the strongest configured network of the last scan, round robin if
+   none is in range. Returns true, if a scan was started to find them. */
+static bool uplinkSelectNetwork(bool allowScan)
+{
+    scan_record_t *records = malloc(DEFAULT_SCAN_LIST_SIZE * sizeof(scan_record_t));
+    if (records == NULL)
+    {
+        return false;
+    }
+    scan_state_t state;
+    int64_t age_ms;
+    size_t count = scan_get_results(records, DEFAULT_SCAN_LIST_SIZE, &state, &age_ms);
+    if (allowScan && (age_ms < 0 || age_ms > UPLINK_SCAN_MAX_AGE_MS))
+    {
+        free(records);
+        // Reconnects via uplink_connect, when the scan is done
+        select_pending = scan_start() == ESP_OK;
+        if (select_pending)
+        {
+            return true;
+        }
+        records = NULL;
+        count = 0;
+    }
+    size_t best = (current + 1) % network_count;
+    int best_rssi = INT8_MIN;
+    for (size_t i = 0; i < count; i++) // strongest first
+    {
+        for (size_t n = 0; n < network_count; n++)
+        {
+            if (n != current && records[i].rssi > best_rssi && strcmp(records[i].ssid, networks[n].ssid) == 0)
+            {
+                best = n;
+                best_rssi = records[i].rssi;
+            }
+        }
+    }
+    free(records);
+    ESP_LOGI(TAG, "Switching to '%s' (%d dBm)", networks[best].ssid, best_rssi);
+    current = best;
+    return false;
+}
+
+void uplink_init(const char *ssid, const char *passwd, bool enterpriseMode)
+{
+    enterprise = enterpriseMode;
+    strlcpy(networks[0].ssid, ssid, sizeof(networks[0].ssid));
+    strlcpy(networks[0].passwd, enterprise ? "" : passwd, sizeof(networks[0].passwd));
+    network_count = 1;
+    if (!enterprise)
+    {
+        network_count += uplinkLoadAlternates(&networks[1]);
+    }
+    if (get_config_param_blob2("uplink_last", (uint8_t *)&last, sizeof(last)) != ESP_OK)
+    {
+        memset(&last, 0, sizeof(last));
+    }
+    const esp_timer_create_args_t timer_args = {.callback = &uplinkRetry, .name = "uplink"};
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &retry_timer));
+    down_since_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "%u networks, stored access point %s", (unsigned)network_count, uplinkLastValid() ? "found" : "not found");
+}
+
+void uplink_connect(void)
+{
+    if (network_count == 0)
+    {
+        return;
+    }
+    esp_timer_stop(retry_timer);
+    if (select_pending)
+    {
+        select_pending = false;
+        uplinkSelectNetwork(false);
+    }
+    uplinkAttempt(true);
+}
+
+void uplink_disconnected(uint8_t reason)
+{
+    if (network_count == 0)
+    {
+        return;
+    }
+    if (connected)
+    {
+        connected = false;
+        failures = 0;
+        network_failures = 0;
+        down_since_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Connection lost (reason %u)", reason);
+        uplinkAttempt(true);
+        return;
+    }
+    stats_inc(&stats_uplink.failed_attempts);
+    bool authFailed = reason == WIFI_REASON_AUTH_FAIL || reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT ||
+                      reason == WIFI_REASON_HANDSHAKE_TIMEOUT || reason == WIFI_REASON_AUTH_EXPIRE;
+    if (psk_attempt && authFailed)
+    {
+        ESP_LOGW(TAG, "Stored PSK rejected, using the passphrase");
+        last.has_psk = 0;
+        uplinkSaveLast();
+    }
+    if (fast_attempt)
+    {
+        // The access point moved or is gone, a full scan finds the others
+        uplinkAttempt(false);
+        return;
+    }
+    failures++;
+    if (++network_failures >= UPLINK_ATTEMPTS_PER_NETWORK && network_count > 1)
+    {
+        network_failures = 0;
+        if (uplinkSelectNetwork(true))
+        {
+            return;
+        }
+    }
+    uint32_t delay_ms = MIN(UPLINK_BACKOFF_MIN_MS << MIN(failures - 1, 6), UPLINK_BACKOFF_MAX_MS);
+    ESP_LOGI(TAG, "Attempt %lu failed (reason %u), retry in %lu ms", (unsigned long)failures, reason, (unsigned long)delay_ms);
+    esp_timer_stop(retry_timer);
+    esp_timer_start_once(retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+// The PSK is derived once in the background, the connection doesn't wait for it
+static void uplinkPskTask(void *arg)
+{
+    uplink_network_t network = networks[current];
+    uint8_t psk[UPLINK_PSK_LEN];
+    int ret = mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, (const unsigned char *)network.passwd, strlen(network.passwd),
+                                            (const unsigned char *)network.ssid, strlen(network.ssid), 4096, sizeof(psk), psk);
+    if (ret == 0 && last.check == uplinkCheck(&network))
+    {
+        memcpy(last.psk, psk, sizeof(psk));
+        last.has_psk = 1;
+        uplinkSaveLast();
+        ESP_LOGI(TAG, "PSK of '%s' stored", network.ssid);
+    }
+    vTaskDelete(NULL);
+}
+
+void uplink_connected(void)
+{
+    if (network_count == 0)
+    {
+        return;
+    }
+    connected = true;
+    esp_timer_stop(retry_timer);
+    uint32_t outage_ms = (esp_timer_get_time() - down_since_us) / 1000;
+    if (first_connect)
+    {
+        first_connect = false;
+        stats_uplink.first_connect_ms = outage_ms;
+        boot_mark("uplink connected");
+    }
+    else
+    {
+        stats_inc(&stats_uplink.reconnects);
+        if (fast_attempt)
+        {
+            stats_inc(&stats_uplink.fast_reconnects);
+        }
+        stats_uplink.last_outage_ms = outage_ms;
+        stats_uplink.max_outage_ms = MAX(stats_uplink.max_outage_ms, outage_ms);
+        stats_uplink.total_outage_ms += outage_ms;
+    }
+    ESP_LOGI(TAG, "Connected to '%s' after %lu ms%s", networks[current].ssid, (unsigned long)outage_ms, fast_attempt ? " (stored access point)" : "");
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+    {
+        return;
+    }
+    uint32_t check = uplinkCheck(&networks[current]);
+    bool samePsk = last.check == check && last.has_psk;
+    last.check = check;
+    memcpy(last.bssid, ap.bssid, sizeof(last.bssid));
+    last.channel = ap.primary;
+    last.has_psk = samePsk;
+    uplinkSaveLast(); // Not written, if nothing changed
+
+    // Only plain WPA2, a PSK would disable WPA3 (SAE) on mixed networks
+    bool pskUsable = (ap.authmode == WIFI_AUTH_WPA2_PSK || ap.authmode == WIFI_AUTH_WPA_WPA2_PSK) && !enterprise &&
+                     strlen(networks[current].passwd) >= 8 && strlen(networks[current].passwd) < 64;
+    if (!samePsk && pskUsable)
+    {
+        xTaskCreatePinnedToCore(&uplinkPskTask, "uplink_psk", 3072, NULL, tskIDLE_PRIORITY + 1, NULL, get_mgmt_task_core());
+    }
+}
+
+void uplink_print_status(void)
+{
+    for (size_t i = 0; i < network_count; i++)
+    {
+        printf("%s %s%s\n", i == current ? "*" : " ", networks[i].ssid, i == 0 ? " (configured)" : "");
+    }
+    if (uplinkLastValid())
+    {
+        printf("Stored access point: %02x:%02x:%02x:%02x:%02x:%02x channel %u%s\n", last.bssid[0], last.bssid[1], last.bssid[2],
+               last.bssid[3], last.bssid[4], last.bssid[5], last.channel, last.has_psk ? ", PSK stored" : "");
+    }
+    uint64_t reconnects = stats_read(&stats_uplink.reconnects);
+    printf("First connect: %lu ms\nReconnects: %llu (%llu to the stored access point), failed attempts: %llu\n",
+           (unsigned long)stats_uplink.first_connect_ms, (unsigned long long)reconnects,
+           (unsigned long long)stats_read(&stats_uplink.fast_reconnects), (unsigned long long)stats_read(&stats_uplink.failed_attempts));
+    printf("Outage: last %lu ms, max %lu ms, avg %llu ms\n", (unsigned long)stats_uplink.last_outage_ms,
+           (unsigned long)stats_uplink.max_outage_ms, (unsigned long long)(reconnects > 0 ? stats_uplink.total_outage_ms / reconnects : 0));
+}
+
+esp_err_t uplink_add_alternate(const char *ssid, const char *passwd)
+{
+    uplink_network_t alternates[UPLINK_MAX_ALTERNATES + 1];
+    size_t count = uplinkLoadAlternates(alternates);
+    if (strlen(ssid) == 0 || strlen(ssid) >= sizeof(alternates[0].ssid) || strlen(passwd) >= sizeof(alternates[0].passwd))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t i;
+    for (i = 0; i < count && strcmp(alternates[i].ssid, ssid) != 0; i++)
+    {
+    }
+    if (i == UPLINK_MAX_ALTERNATES)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(&alternates[i], 0, sizeof(alternates[i]));
+    strlcpy(alternates[i].ssid, ssid, sizeof(alternates[i].ssid));
+    strlcpy(alternates[i].passwd, passwd, sizeof(alternates[i].passwd));
+    return config_set_blob("uplink_alt", alternates, MAX(count, i + 1) * sizeof(uplink_network_t));
+}
+
+esp_err_t uplink_del_alternate(const char *ssid)
+{
+    uplink_network_t alternates[UPLINK_MAX_ALTERNATES];
+    size_t count = uplinkLoadAlternates(alternates);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strcmp(alternates[i].ssid, ssid) == 0)
+        {
+            memmove(&alternates[i], &alternates[i + 1], (count - i - 1) * sizeof(uplink_network_t));
+            count--;
+            return count > 0 ? config_set_blob("uplink_alt", alternates, count * sizeof(uplink_network_t)) : config_erase("uplink_alt");
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Connection of the STA to the uplink network.
+
+   After a working connection the BSSID, the channel and the PSK derived from
+   the passphrase are stored (uplink_last), the next connect goes straight to
+   that access point without a scan and without deriving the key again.
+   If that fails a full scan picks the strongest access point of the network.
+   Failed attempts are retried with an exponential backoff. With alternative
+   networks (uplink_alt) the STA switches to the strongest one of the last
+   scan after UPLINK_ATTEMPTS_PER_NETWORK failed attempts. */
+#define UPLINK_MAX_ALTERNATES 3
+#define UPLINK_ATTEMPTS_PER_NETWORK 3
+
+/* After esp_wifi_set_config of the STA and before esp_wifi_start */
+void uplink_init(const char *ssid, const char *passwd, bool enterprise);
+
+/* From the WiFi events, all in the event loop task */
+void uplink_connect(void);
+void uplink_disconnected(uint8_t reason);
+void uplink_connected(void);
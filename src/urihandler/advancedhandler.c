@@ -5,9 +5,41 @@
 #include "esp_wifi.h"
 #include "esp_mac.h"
 #include "esp_err.h"
+#include "lwip/lwip_napt.h"
+#include "stats.h"
+#include "profile.h"
+#include "mssclamp.h"
+#include "powersave.h"
 
 static const char *TAG = "Advancedhandler";
 
+static void writeProfileOptions(template_out_t *out, void *arg)
+{
+    const perf_profile_t *activeProfile = perf_profile_get();
+    size_t profileCount;
+    const perf_profile_t *profiles = perf_profile_list(&profileCount);
+    for (size_t i = 0; i < profileCount; i++)
+    {
+        if (perf_profile_available(&profiles[i]))
+        {
+            template_printf(out, "<option value=\"%s\" title=\"%s\" %s>%s</option>", profiles[i].name, profiles[i].description,
+                            &profiles[i] == activeProfile ? "selected" : "", profiles[i].name);
+        }
+    }
+}
+
+static void writePowerOptions(template_out_t *out, void *arg)
+{
+    const power_profile_t *activeProfile = power_profile_get();
+    size_t profileCount;
+    const power_profile_t *profiles = power_profile_list(&profileCount);
+    for (size_t i = 0; i < profileCount; i++)
+    {
+        template_printf(out, "<option value=\"%s\" title=\"%s\" %s>%s</option>", profiles[i].name, profiles[i].description,
+                        &profiles[i] == activeProfile ? "selected" : "", profiles[i].name);
+    }
+}
+
 esp_err_t advanced_download_get_handler(httpd_req_t *req)
 {
     if (isLocked())
@@ -17,36 +49,36 @@ esp_err_t advanced_download_get_handler(httpd_req_t *req)
 
     httpd_req_to_sockfd(req);
     extern const char advanced_start[] asm("_binary_advanced_html_start");
-    extern const char advanced_end[] asm("_binary_advanced_html_end");
-    const size_t advanced_html_size = (advanced_end - advanced_start);
 
     int32_t keepAlive = 0;
     int32_t ledDisabled = 0;
     int32_t natDisabled = 0;
+    int32_t dnsProxy = 1;
     char *aliveCB = "";
     char *ledCB = "";
     char *natCB = "";
-    char *currentDNS = "";
+    char *dnsProxyCB = "";
+    char currentDNS[16] = "";
     char *defCB = "";
     char *cloudCB = "";
     char *adguardCB = "";
     char *customCB = "";
-    char *customDNSIP = "";
+    const char *customDNSIP = "";
     char *defMacCB = "";
     char *rndMacCB = "";
     char *customMacCB = "";
     char *customMac = "";
-    char *macSetting = "";
+    const char *macSetting = "";
     char *classACB = "";
     char *classBCB = "";
     char *classCCB = "";
     char *customMaskCB = "";
-    char *customMask = "";
+    const char *customMask = "";
 
     char currentMAC[18];
     char defaultMAC[18];
 
-    char *hostName = NULL;
+    const char *hostName = NULL;
     int32_t octet = 4;
     get_config_param_str("hostname", &hostName);
     get_config_param_int("octet", &octet);
@@ -106,16 +138,30 @@ esp_err_t advanced_download_get_handler(httpd_req_t *req)
     {
         natCB = "checked";
     }
+    int32_t naptMax = perf_profile_get()->napt_max;
+    get_config_param_int("napt_max", &naptMax);
+    int32_t uplinkMtu = MSSCLAMP_MTU_MAX;
+    get_config_param_int("uplink_mtu", &uplinkMtu);
+    int32_t mssClamp = 0;
+    get_config_param_int("mss_clamp", &mssClamp);
+
+    const perf_profile_t *activeProfile = perf_profile_get();
+
     esp_netif_dns_info_t dns;
     esp_netif_t *wifiSTA = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
     if (esp_netif_get_dns_info(wifiSTA, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
     {
-        currentDNS = malloc(16);
         sprintf(currentDNS, IPSTR, IP2STR(&(dns.ip.u_addr.ip4)));
         ESP_LOGI(TAG, "Current DNS is: %s", currentDNS);
     }
 
-    char *customDNS = NULL;
+    get_config_param_int("dns_proxy", &dnsProxy);
+    if (dnsProxy == 1)
+    {
+        dnsProxyCB = "checked";
+    }
+
+    const char *customDNS = NULL;
     get_config_param_str("custom_dns", &customDNS);
 
     if (customDNS == NULL)
@@ -161,7 +207,7 @@ esp_err_t advanced_download_get_handler(httpd_req_t *req)
         customMac = currentMAC;
     }
 
-    char *netmask = getNetmask();
+    const char *netmask = getNetmask();
 
     if (strcmp(netmask, DEFAULT_NETMASK_CLASS_A) == 0)
     {
@@ -182,23 +228,65 @@ esp_err_t advanced_download_get_handler(httpd_req_t *req)
         customMask = netmask;
     }
 
-    u_int size = advanced_html_size + strlen(aliveCB) + strlen(ledCB) + strlen(natCB) + strlen(currentDNS) + strlen(currentMAC) + 3 * strlen("checked") + strlen(customDNSIP) + 2 * strlen(defaultMAC) + strlen(customMac) + strlen(netmask) + strlen(hostName) + 2 * strlen("selected") + strlen(customMask) + 4 /* 4 * Octet - 4 *%d*/;
-    ESP_LOGI(TAG, "Allocating additional %d bytes for advanced page.", size);
-    char *advanced_page = malloc(size);
-
-    char *subMac = malloc(strlen(defaultMAC) + 1);
-    strcpy(subMac, defaultMAC);
-
+    char subMac[18];
+    strlcpy(subMac, defaultMAC, sizeof(subMac));
     subMac[strlen(subMac) - 2] = '\0';
 
-    sprintf(advanced_page, advanced_start, hostName, octet, lowSelected, mediumSelected, highSelected, bwHigh, bwLow, ledCB, aliveCB, natCB, currentDNS, defCB, cloudCB, adguardCB, customCB, customDNSIP, currentMAC, defMacCB, defaultMAC, rndMacCB, subMac, customMacCB, customMac, netmask, classCCB, octet, classBCB, octet, classACB, octet, customMaskCB, customMask);
-
-    closeHeader(req);
-    esp_err_t ret = httpd_resp_send(req, advanced_page, HTTPD_RESP_USE_STRLEN);
-
-    free(advanced_page);
-    free(subMac);
-    free(currentDNS);
+    char octetValue[12], naptMaxValue[12], naptInUse[12], naptHighWater[12], naptEvicted[12];
+    sprintf(octetValue, "%d", (int)octet);
+    sprintf(naptMaxValue, "%d", (int)naptMax);
+    sprintf(naptInUse, "%d", (int)stats_napt.in_use);
+    sprintf(naptHighWater, "%d", (int)stats_napt.high_water);
+    sprintf(naptEvicted, "%d", (int)stats_read(&stats_napt.evicted));
+    char uplinkMtuValue[12], mssClampValue[12], mssSyns[24], mssClamped[24];
+    sprintf(uplinkMtuValue, "%d", (int)uplinkMtu);
+    sprintf(mssClampValue, "%d", (int)mssClamp);
+    sprintf(mssSyns, "%llu", (unsigned long long)stats_read(&stats_mss.syns));
+    sprintf(mssClamped, "%llu", (unsigned long long)stats_read(&stats_mss.clamped));
 
-    return ret;
+    const template_var_t vars[] = {
+        {.name = "hostname", .value = hostName},
+        {.name = "octet", .value = octetValue},
+        {.name = "tx_low", .value = lowSelected},
+        {.name = "tx_medium", .value = mediumSelected},
+        {.name = "tx_high", .value = highSelected},
+        {.name = "bw_high", .value = bwHigh},
+        {.name = "bw_low", .value = bwLow},
+        {.name = "led", .value = ledCB},
+        {.name = "keepalive", .value = aliveCB},
+        {.name = "nat", .value = natCB},
+        {.name = "napt_max", .value = naptMaxValue},
+        {.name = "napt_in_use", .value = naptInUse},
+        {.name = "napt_high_water", .value = naptHighWater},
+        {.name = "napt_evicted", .value = naptEvicted},
+        {.name = "uplink_mtu", .value = uplinkMtuValue},
+        {.name = "mss_clamp", .value = mssClampValue},
+        {.name = "mss_syns", .value = mssSyns},
+        {.name = "mss_clamped", .value = mssClamped},
+        {.name = "profile_options", .cb = writeProfileOptions},
+        {.name = "profile", .value = activeProfile->name},
+        {.name = "power_options", .cb = writePowerOptions},
+        {.name = "power_profile", .value = power_profile_get()->description},
+        {.name = "dns", .value = currentDNS},
+        {.name = "dns_default", .value = defCB},
+        {.name = "dns_cloudflare", .value = cloudCB},
+        {.name = "dns_adguard", .value = adguardCB},
+        {.name = "dns_custom", .value = customCB},
+        {.name = "dns_custom_ip", .value = customDNSIP},
+        {.name = "dns_proxy", .value = dnsProxyCB},
+        {.name = "mac", .value = currentMAC},
+        {.name = "mac_default", .value = defMacCB},
+        {.name = "default_mac", .value = defaultMAC},
+        {.name = "mac_random", .value = rndMacCB},
+        {.name = "mac_prefix", .value = subMac},
+        {.name = "mac_custom", .value = customMacCB},
+        {.name = "custom_mac", .value = customMac},
+        {.name = "netmask", .value = netmask},
+        {.name = "netmask_classc", .value = classCCB},
+        {.name = "netmask_classb", .value = classBCB},
+        {.name = "netmask_classa", .value = classACB},
+        {.name = "netmask_custom", .value = customMaskCB},
+        {.name = "custom_netmask", .value = customMask},
+    };
+    return template_send(req, advanced_start, vars, sizeof(vars) / sizeof(vars[0]));
 }
@@ -0,0 +1,336 @@
+#include "handler.h"
+#include "json.h"
+#include "scan.h"
+#include "stats.h"
+#include "profile.h"
+#include "shaper.h"
+#include "clientstats.h"
+#include "flowtable.h"
+#include "router_globals.h"
+
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_app_desc.h"
+#include "esp_wifi_ap_get_sta_list.h"
+#include "lwip/prot/iana.h"
+
+static const char *TAG = "ApiHandler";
+
+typedef enum
+{
+    API_PARAM_INT,
+    API_PARAM_STR,
+    API_PARAM_SECRET, // only reported as set or not set
+} api_param_type_t;
+
+typedef struct
+{
+    const char *name;
+    api_param_type_t type;
+} api_param_t;
+
+/* The parameters of the esp32 namespace (see docs/advanced.md) */
+static const api_param_t CONFIG_PARAMS[] = {
+    {"ap_ssid", API_PARAM_STR},
+    {"ap_passwd", API_PARAM_SECRET},
+    {"ap_ip", API_PARAM_STR},
+    {"ssid", API_PARAM_STR},
+    {"passwd", API_PARAM_SECRET},
+    {"static_ip", API_PARAM_STR},
+    {"subnet_mask", API_PARAM_STR},
+    {"gateway_addr", API_PARAM_STR},
+    {"sta_identity", API_PARAM_STR},
+    {"sta_user", API_PARAM_STR},
+    {"cer", API_PARAM_SECRET},
+    {"ssid_hidden", API_PARAM_INT},
+    {"keep_alive", API_PARAM_INT},
+    {"led_disabled", API_PARAM_INT},
+    {"nat_disabled", API_PARAM_INT},
+    {"napt_max", API_PARAM_INT},
+    {"uplink_mtu", API_PARAM_INT},
+    {"mss_clamp", API_PARAM_INT},
+    {"portmap_max", API_PARAM_INT},
+    {"task_pinning", API_PARAM_INT},
+    {"http_sockets", API_PARAM_INT},
+    {"http_idle", API_PARAM_INT},
+    {"heap_restart", API_PARAM_INT},
+    {"perf_profile", API_PARAM_STR},
+    {"power_profile", API_PARAM_STR},
+    {"custom_mac", API_PARAM_STR},
+    {"custom_dns", API_PARAM_STR},
+    {"dns_proxy", API_PARAM_INT},
+    {"hostname", API_PARAM_STR},
+    {"octet", API_PARAM_INT},
+    {"lock_pass", API_PARAM_SECRET},
+    {"txpower", API_PARAM_INT},
+    {"lower_bandwith", API_PARAM_INT},
+    {"netmask", API_PARAM_STR},
+    {"ota_url", API_PARAM_STR},
+    {"canary", API_PARAM_INT},
+    {"loglevel", API_PARAM_STR},
+};
+
+/* The config and the port forwardings only change with the config, so a
+   client which polls them gets 304 with the ETag of the last answer. */
+static bool apiNotModified(httpd_req_t *req)
+{
+    static char etag[16]; // the header is only sent with the response
+    char value[32];
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)config_generation());
+    httpd_resp_set_hdr(req, "ETag", etag);
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK && strcmp(value, etag) == 0)
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+        return true;
+    }
+    return false;
+}
+
+static void writeIp(json_writer_t *w, const char *key, uint32_t addr)
+{
+    char ip[IP4ADDR_STRLEN_MAX];
+    esp_ip4_addr_t ip4 = {.addr = addr};
+    esp_ip4addr_ntoa(&ip4, ip, sizeof(ip));
+    json_string(w, key, addr != 0 ? ip : NULL);
+}
+
+static void writeMac(json_writer_t *w, const char *key, const uint8_t *mac)
+{
+    char value[18];
+    sprintf(value, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    json_string(w, key, value);
+}
+
+esp_err_t api_v1_status_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    json_writer_t w;
+    json_begin(&w, req, false);
+    json_object_begin(&w, NULL);
+    json_string(&w, "version", esp_app_get_description()->version);
+    json_uint(&w, "uptime_s", esp_timer_get_time() / 1000000);
+    json_uint(&w, "heap_free", heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+    json_uint(&w, "heap_min_free", heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    json_string(&w, "profile", perf_profile_get()->name);
+
+    json_object_begin(&w, "sta");
+    json_string(&w, "ssid", ssid);
+    json_bool(&w, "connected", ap_connect);
+    writeIp(&w, "ip", ap_connect ? my_ip : 0);
+    wifi_ap_record_t apinfo;
+    if (ap_connect && esp_wifi_sta_get_ap_info(&apinfo) == ESP_OK)
+    {
+        json_int(&w, "rssi", apinfo.rssi);
+        json_string(&w, "signal", findTextColorForSSID(apinfo.rssi));
+        json_uint(&w, "channel", apinfo.primary);
+    }
+    else
+    {
+        json_null(&w, "rssi");
+        json_string(&w, "signal", "danger");
+        json_null(&w, "channel");
+    }
+    json_object_end(&w);
+
+    json_object_begin(&w, "ap");
+    json_string(&w, "ssid", ap_ssid);
+    writeIp(&w, "ip", my_ap_ip);
+    json_uint(&w, "clients", getConnectCount());
+    json_object_end(&w);
+
+    json_object_begin(&w, "nat");
+    json_bool(&w, "enabled", stats_napt.max > 0);
+    json_uint(&w, "max", stats_napt.max);
+    json_uint(&w, "in_use", __atomic_load_n(&stats_napt.in_use, __ATOMIC_RELAXED));
+    json_object_end(&w);
+
+    json_uint(&w, "config_generation", config_generation());
+    json_object_end(&w);
+    return json_end(&w);
+}
+
+esp_err_t api_v1_config_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    if (apiNotModified(req))
+    {
+        return httpd_resp_send(req, NULL, 0);
+    }
+    json_writer_t w;
+    json_begin(&w, req, true);
+    json_object_begin(&w, NULL);
+    for (size_t i = 0; i < sizeof(CONFIG_PARAMS) / sizeof(CONFIG_PARAMS[0]); i++)
+    {
+        const api_param_t *param = &CONFIG_PARAMS[i];
+        if (param->type == API_PARAM_INT)
+        {
+            int32_t value;
+            if (get_config_param_int((char *)param->name, &value) == ESP_OK)
+            {
+                json_int(&w, param->name, value);
+            }
+            continue;
+        }
+        const char *value = NULL;
+        size_t len = 0;
+        esp_err_t err = param->type == API_PARAM_SECRET && strcmp(param->name, "cer") == 0
+                            ? get_config_param_blob((char *)param->name, &value, &len)
+                            : get_config_param_str((char *)param->name, &value);
+        if (err != ESP_OK)
+        {
+            continue;
+        }
+        if (param->type == API_PARAM_SECRET)
+        {
+            json_bool(&w, param->name, value != NULL && value[0] != '\0');
+        }
+        else
+        {
+            json_string(&w, param->name, value);
+        }
+    }
+    json_object_end(&w);
+    return json_end(&w);
+}
+
+esp_err_t api_v1_portmap_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    if (apiNotModified(req))
+    {
+        return httpd_resp_send(req, NULL, 0);
+    }
+    json_writer_t w;
+    json_begin(&w, req, true);
+    json_object_begin(&w, NULL);
+    json_uint(&w, "max", get_portmap_limit());
+    json_array_begin(&w, "entries");
+    for (int i = 0; i < portmap_count; i++)
+    {
+        json_object_begin(&w, NULL);
+        json_string(&w, "proto", portmap_tab[i].proto == PROTO_TCP ? "tcp" : "udp");
+        json_uint(&w, "eport", portmap_tab[i].mport);
+        writeIp(&w, "ip", portmap_tab[i].daddr);
+        json_uint(&w, "iport", portmap_tab[i].dport);
+        json_object_end(&w);
+    }
+    json_array_end(&w);
+    json_object_end(&w);
+    return json_end(&w);
+}
+
+esp_err_t api_v1_clients_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    clientstats_t *clients = req_arena_alloc(req, CLIENTSTATS_MAX_AID * sizeof(clientstats_t));
+    if (clients == NULL)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+    size_t count = clientstats_get(clients, CLIENTSTATS_MAX_AID);
+
+    wifi_sta_list_t wifi_sta_list;
+    wifi_sta_mac_ip_list_t adapter_sta_list;
+    memset(&wifi_sta_list, 0, sizeof(wifi_sta_list));
+    memset(&adapter_sta_list, 0, sizeof(adapter_sta_list));
+    esp_wifi_ap_get_sta_list(&wifi_sta_list);
+    esp_wifi_ap_get_sta_list_with_ip(&wifi_sta_list, &adapter_sta_list);
+
+    json_writer_t w;
+    json_begin(&w, req, false);
+    json_object_begin(&w, NULL);
+    json_array_begin(&w, "clients");
+    for (size_t i = 0; i < count; i++)
+    {
+        clientstats_t *c = &clients[i];
+        uint32_t ip = 0;
+        for (int j = 0; j < adapter_sta_list.num; j++)
+        {
+            if (memcmp(adapter_sta_list.sta[j].mac, c->mac, sizeof(c->mac)) == 0)
+            {
+                ip = adapter_sta_list.sta[j].ip.addr;
+            }
+        }
+        shaper_limit_t limit = {0};
+        shaper_get_limit(c->mac, &limit);
+
+        json_object_begin(&w, NULL);
+        json_uint(&w, "rank", i + 1);
+        json_uint(&w, "aid", c->aid);
+        writeMac(&w, "mac", c->mac);
+        writeIp(&w, "ip", ip);
+        json_uint(&w, "connected_s", c->connected_s);
+        json_uint(&w, "rx_bytes", c->rx_bytes);
+        json_uint(&w, "rx_packets", c->rx_packets);
+        json_uint(&w, "tx_bytes", c->tx_bytes);
+        json_uint(&w, "tx_packets", c->tx_packets);
+        json_uint(&w, "rx_bps", c->rx_bps);
+        json_uint(&w, "tx_bps", c->tx_bps);
+        json_uint(&w, "limit_down_kbps", limit.down_kbps);
+        json_uint(&w, "limit_up_kbps", limit.up_kbps);
+        json_object_end(&w);
+    }
+    json_array_end(&w);
+    json_object_end(&w);
+    ESP_LOGD(TAG, "Sent %u clients", (unsigned)count);
+    return json_end(&w);
+}
+
+/* The flows are copied in batches, so the tcpip thread is only blocked for a
+   short copy and the response is streamed while the table is walked. */
+esp_err_t api_v1_flows_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    flow_info_t *infos = req_arena_alloc(req, FLOWTABLE_SNAPSHOT_BATCH * sizeof(flow_info_t));
+    if (infos == NULL)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+
+    json_writer_t w;
+    json_begin(&w, req, false);
+    json_object_begin(&w, NULL);
+    json_uint(&w, "max", stats_napt.max);
+    json_array_begin(&w, "flows");
+    uint32_t cursor = 0;
+    size_t count;
+    while ((count = flowtable_snapshot(infos, FLOWTABLE_SNAPSHOT_BATCH, &cursor)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const flow_info_t *f = &infos[i];
+            json_object_begin(&w, NULL);
+            json_string(&w, "proto", f->key.proto == IP_PROTO_TCP ? "tcp" : f->key.proto == IP_PROTO_UDP ? "udp" : "icmp");
+            writeIp(&w, "ip", f->key.src);
+            json_uint(&w, "port", f->key.sport);
+            writeIp(&w, "dst_ip", f->key.dst);
+            json_uint(&w, "dst_port", f->key.dport);
+            json_bool(&w, "closing", f->closing);
+            json_uint(&w, "age_s", f->age_s);
+            json_uint(&w, "idle_s", f->idle_s);
+            json_uint(&w, "bytes_out", f->bytes_out);
+            json_uint(&w, "bytes_in", f->bytes_in);
+            json_object_end(&w);
+        }
+    }
+    json_array_end(&w);
+    json_object_end(&w);
+    return json_end(&w);
+}
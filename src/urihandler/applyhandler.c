@@ -8,49 +8,52 @@
 #include "nvs.h"
 #include "cmd_nvs.h"
 #include "router_globals.h"
+#include "profile.h"
+#include "mssclamp.h"
+#include "powersave.h"
 #include "esp_wifi.h"
 
 static const char *TAG = "ApplyHandler";
 
-void setApByQuery(char *urlContent, nvs_handle_t nvs)
+void setApByQuery(char *urlContent)
 {
     size_t contentLength = 600; //passwords are max 64 characters, but special characters (i.e € = 9 character) are a lot more url encoded 
     char param[contentLength];
     readUrlParameterIntoBuffer(urlContent, "ap_ssid", param, contentLength);
-    ESP_ERROR_CHECK(nvs_set_str(nvs, "ap_ssid", param));
+    ESP_ERROR_CHECK(config_set_str("ap_ssid", param));
     readUrlParameterIntoBuffer(urlContent, "ap_password", param, contentLength);
     if (strlen(param) < 8)
     {
-        nvs_erase_key(nvs, "ap_passwd");
+        config_erase("ap_passwd");
     }
     else
     {
-        ESP_ERROR_CHECK(nvs_set_str(nvs, "ap_passwd", param));
+        ESP_ERROR_CHECK(config_set_str("ap_passwd", param));
     }
 
     readUrlParameterIntoBuffer(urlContent, "ssid_hidden", param, contentLength);
     if (strcmp(param, "on") == 0)
     {
         ESP_LOGI(TAG, "AP-SSID should be hidden.");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "ssid_hidden", 1));
+        ESP_ERROR_CHECK(config_set_i32("ssid_hidden", 1));
     }
     else
     {
-        nvs_erase_key(nvs, "ssid_hidden");
+        config_erase("ssid_hidden");
     }
 }
 
-void setStaByQuery(char *urlContent, nvs_handle_t nvs)
+void setStaByQuery(char *urlContent)
 {
 
     size_t contentLength = 600;
     char param[contentLength];
     readUrlParameterIntoBuffer(urlContent, "ssid", param, contentLength);
-    ESP_ERROR_CHECK(nvs_set_str(nvs, "ssid", param));
+    ESP_ERROR_CHECK(config_set_str("ssid", param));
     readUrlParameterIntoBuffer(urlContent, "password", param, contentLength);
-    ESP_ERROR_CHECK(nvs_set_str(nvs, "passwd", param));
+    ESP_ERROR_CHECK(config_set_str("passwd", param));
 }
-void setWpa2(char *urlContent, nvs_handle_t nvs)
+void setWpa2(char *urlContent)
 {
     size_t contentLength = strlen(urlContent);
     char param[contentLength];
@@ -58,12 +61,12 @@ void setWpa2(char *urlContent, nvs_handle_t nvs)
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "WPA2 Identity set to '%s'", param);
-        ESP_ERROR_CHECK(nvs_set_str(nvs, "sta_identity", param));
+        ESP_ERROR_CHECK(config_set_str("sta_identity", param));
     }
     else
     {
         ESP_LOGI(TAG, "WPA2 Identity will be deleted");
-        nvs_erase_key(nvs, "sta_identity");
+        config_erase("sta_identity");
     }
 
     readUrlParameterIntoBuffer(urlContent, "sta_user", param, contentLength);
@@ -71,37 +74,33 @@ void setWpa2(char *urlContent, nvs_handle_t nvs)
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "WPA2 user set to '%s'", param);
-        ESP_ERROR_CHECK(nvs_set_str(nvs, "sta_user", param));
+        ESP_ERROR_CHECK(config_set_str("sta_user", param));
     }
     else
     {
         ESP_LOGI(TAG, "WPA2 user will be deleted");
-        nvs_erase_key(nvs, "sta_user");
+        config_erase("sta_user");
     }
     readUrlParameterIntoBuffer(urlContent, "cer", param, contentLength);
 
     if (strlen(param) > 0)
     {
-        nvs_erase_key(nvs, "cer"); // do not double size in nvs
         ESP_LOGI(TAG, "Certificate with size %d set", strlen(param));
-        ESP_ERROR_CHECK(nvs_set_blob(nvs, "cer", param, contentLength));
+        ESP_ERROR_CHECK(config_set_blob("cer", param, contentLength));
     }
     else
     {
         ESP_LOGI(TAG, "Certificate will be deleted");
-        nvs_erase_key(nvs, "cer");
+        config_erase("cer");
     }
 }
 
 void applyApStaConfig(char *buf)
 {
-    nvs_handle_t nvs;
-    ESP_ERROR_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs));
-    setApByQuery(buf, nvs);
-    setStaByQuery(buf, nvs);
-    setWpa2(buf, nvs);
-    ESP_ERROR_CHECK(nvs_commit(nvs));
-    nvs_close(nvs);
+    setApByQuery(buf);
+    setStaByQuery(buf);
+    setWpa2(buf);
+    config_flush();
 }
 
 void eraseNvs()
@@ -114,15 +113,15 @@ void eraseNvs()
     erase_ns(argc, argv);
 }
 
-void setDNSToDefault(nvs_handle_t *nvs)
+void setDNSToDefault()
 {
-    nvs_erase_key(*nvs, "custom_dns");
+    config_erase("custom_dns");
     ESP_LOGI(TAG, "DNS set to default (uplink network)");
 }
 
-void setMACToDefault(nvs_handle_t *nvs)
+void setMACToDefault()
 {
-    nvs_erase_key(*nvs, "custom_mac");
+    config_erase("custom_mac");
     ESP_LOGI(TAG, "MAC set to default");
 }
 
@@ -139,36 +138,24 @@ bool str2mac(const char *mac)
     }
 }
 
-char *getRedirectUrl(httpd_req_t *req)
+static void getRedirectUrl(httpd_req_t *req, char *url, size_t url_len)
 {
-
-    size_t buf_len = 16;
-    char *host = malloc(buf_len);
-    httpd_req_get_hdr_value_str(req, "Host", host, buf_len);
+    char host[16] = "";
+    httpd_req_get_hdr_value_str(req, "Host", host, sizeof(host));
     ESP_LOGI(TAG, "Host of request is '%s'", host);
-    char *str = malloc(strlen("http://") + buf_len);
-    strcpy(str, "http://");
     if (strcmp(host, DEFAULT_AP_IP_CLASS_A) == 0 || strcmp(host, DEFAULT_AP_IP_CLASS_B) == 0 || strcmp(host, DEFAULT_AP_IP_CLASS_C) == 0)
     {
-        char *defaultIP = getDefaultIPByNetmask();
-        strcat(str, defaultIP);
-        free(defaultIP);
+        snprintf(url, url_len, "http://%s", getDefaultIPByNetmask());
     }
     else
     {
-        strcat(str, host);
+        snprintf(url, url_len, "http://%s", host);
     }
-    free(host);
-
-    return str;
 }
 
 void applyAdvancedConfig(char *buf)
 {
     ESP_LOGI(TAG, "Applying advanced config");
-    nvs_handle_t nvs;
-    nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
-
     size_t contentLength = 250;
     char param[contentLength];
     readUrlParameterIntoBuffer(buf, "keepalive", param, contentLength);
@@ -176,43 +163,80 @@ void applyAdvancedConfig(char *buf)
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "keep alive will be enabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "keep_alive", 1));
+        ESP_ERROR_CHECK(config_set_i32("keep_alive", 1));
     }
     else
     {
         ESP_LOGI(TAG, "keep alive will be disabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "keep_alive", 0));
+        ESP_ERROR_CHECK(config_set_i32("keep_alive", 0));
     }
 
     readUrlParameterIntoBuffer(buf, "ledenabled", param, contentLength);
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "ON Board LED will be enabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "led_disabled", 0));
+        ESP_ERROR_CHECK(config_set_i32("led_disabled", 0));
     }
     else
     {
         ESP_LOGI(TAG, "ON Board LED will be disabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "led_disabled", 1));
+        ESP_ERROR_CHECK(config_set_i32("led_disabled", 1));
     }
 
     readUrlParameterIntoBuffer(buf, "natenabled", param, contentLength);
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "NAT will be enabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "nat_disabled", 0));
+        ESP_ERROR_CHECK(config_set_i32("nat_disabled", 0));
     }
     else
     {
         ESP_LOGI(TAG, "NAT will be disabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "nat_disabled", 1));
+        ESP_ERROR_CHECK(config_set_i32("nat_disabled", 1));
+    }
+
+    readUrlParameterIntoBuffer(buf, "naptmax", param, contentLength);
+    int naptMax = atoi(param);
+    if (naptMax >= NAPT_MAX_ENTRIES_MIN && naptMax <= NAPT_MAX_ENTRIES_LIMIT)
+    {
+        ESP_LOGI(TAG, "NAT table size set to %d", naptMax);
+        ESP_ERROR_CHECK(config_set_i32("napt_max", naptMax));
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Invalid NAT table size. Will be erased");
+        config_erase("napt_max");
+    }
+
+    readUrlParameterIntoBuffer(buf, "uplinkmtu", param, contentLength);
+    int uplinkMtu = atoi(param);
+    if (uplinkMtu >= MSSCLAMP_MTU_MIN && uplinkMtu < MSSCLAMP_MTU_MAX)
+    {
+        ESP_LOGI(TAG, "Uplink MTU set to %d", uplinkMtu);
+        ESP_ERROR_CHECK(config_set_i32("uplink_mtu", uplinkMtu));
+    }
+    else
+    {
+        config_erase("uplink_mtu");
+    }
+
+    readUrlParameterIntoBuffer(buf, "mssclamp", param, contentLength);
+    int mssClamp = atoi(param);
+    if (mssClamp >= MSSCLAMP_MSS_MIN && mssClamp <= MSSCLAMP_MSS_MAX)
+    {
+        ESP_LOGI(TAG, "TCP MSS clamped to %d", mssClamp);
+        ESP_ERROR_CHECK(config_set_i32("mss_clamp", mssClamp));
+    }
+    else
+    {
+        config_erase("mss_clamp");
     }
 
     readUrlParameterIntoBuffer(buf, "wsenabled", param, contentLength);
     if (strlen(param) == 0)
     {
         ESP_LOGI(TAG, "Webserver will be disabled");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "lock", 1));
+        ESP_ERROR_CHECK(config_set_i32("lock", 1));
     }
 
     readUrlParameterIntoBuffer(buf, "custommac", param, contentLength);
@@ -223,7 +247,7 @@ void applyAdvancedConfig(char *buf)
         if (strcmp("random", param) == 0)
         {
             ESP_LOGI(TAG, "MAC address set to random");
-            ESP_ERROR_CHECK(nvs_set_str(nvs, "custom_mac", param));
+            ESP_ERROR_CHECK(config_set_str("custom_mac", param));
         }
         else if (strlen(macaddress) > 0)
         {
@@ -231,17 +255,17 @@ void applyAdvancedConfig(char *buf)
             if (success)
             {
                 ESP_LOGI(TAG, "MAC address set to: %s", macaddress);
-                ESP_ERROR_CHECK(nvs_set_str(nvs, "custom_mac", macaddress));
+                ESP_ERROR_CHECK(config_set_str("custom_mac", macaddress));
             }
             else
             {
                 ESP_LOGI(TAG, "MAC address '%s' is invalid", macaddress);
-                setMACToDefault(&nvs);
+                setMACToDefault();
             }
         }
         else
         {
-            setMACToDefault(&nvs);
+            setMACToDefault();
         }
     }
     readUrlParameterIntoBuffer(buf, "dns", param, contentLength);
@@ -257,31 +281,41 @@ void applyAdvancedConfig(char *buf)
                 if (ipasInt == UINT32_MAX || ipasInt == 0)
                 {
                     ESP_LOGW(TAG, "Invalid custom DNS. Setting back to default!");
-                    setDNSToDefault(&nvs);
+                    setDNSToDefault();
                 }
                 else
                 {
-                    esp_ip4_addr_t *addr = malloc(16);
-                    addr->addr = ipasInt;
-                    esp_ip4addr_ntoa(addr, customDnsParam, 16);
+                    esp_ip4_addr_t addr = {.addr = ipasInt};
+                    esp_ip4addr_ntoa(&addr, customDnsParam, 16);
                     ESP_LOGI(TAG, "DNS set to: %s", customDnsParam);
-                    ESP_ERROR_CHECK(nvs_set_str(nvs, "custom_dns", customDnsParam));
+                    ESP_ERROR_CHECK(config_set_str("custom_dns", customDnsParam));
                 }
             }
             else
             {
-                setDNSToDefault(&nvs);
+                setDNSToDefault();
             }
         }
         else
         {
             ESP_LOGI(TAG, "DNS set to: %s", param);
-            ESP_ERROR_CHECK(nvs_set_str(nvs, "custom_dns", param));
+            ESP_ERROR_CHECK(config_set_str("custom_dns", param));
         }
     }
     else
     {
-        setDNSToDefault(&nvs);
+        setDNSToDefault();
+    }
+    readUrlParameterIntoBuffer(buf, "dnsproxy", param, contentLength);
+    if (strlen(param) > 0)
+    {
+        ESP_LOGI(TAG, "DNS proxy will be enabled");
+        ESP_ERROR_CHECK(config_set_i32("dns_proxy", 1));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "DNS proxy will be disabled");
+        ESP_ERROR_CHECK(config_set_i32("dns_proxy", 0));
     }
     readUrlParameterIntoBuffer(buf, "netmask", param, contentLength);
     if (strlen(param) > 0)
@@ -289,17 +323,17 @@ void applyAdvancedConfig(char *buf)
         if (strcmp("classa", param) == 0)
         {
             ESP_LOGI(TAG, "Netmask set to Class A");
-            ESP_ERROR_CHECK(nvs_set_str(nvs, "netmask", DEFAULT_NETMASK_CLASS_A));
+            ESP_ERROR_CHECK(config_set_str("netmask", DEFAULT_NETMASK_CLASS_A));
         }
         else if (strcmp("classb", param) == 0)
         {
             ESP_LOGI(TAG, "Netmask set to Class B");
-            ESP_ERROR_CHECK(nvs_set_str(nvs, "netmask", DEFAULT_NETMASK_CLASS_B));
+            ESP_ERROR_CHECK(config_set_str("netmask", DEFAULT_NETMASK_CLASS_B));
         }
         else if (strcmp("classc", param) == 0)
         {
             ESP_LOGI(TAG, "Netmask set to Class C");
-            ESP_ERROR_CHECK(nvs_set_str(nvs, "netmask", DEFAULT_NETMASK_CLASS_C));
+            ESP_ERROR_CHECK(config_set_str("netmask", DEFAULT_NETMASK_CLASS_C));
         }
         else
         {
@@ -307,12 +341,12 @@ void applyAdvancedConfig(char *buf)
             if (is_valid_subnet_mask(param))
             {
                 ESP_LOGI(TAG, "Netmask set to %s", param);
-                ESP_ERROR_CHECK(nvs_set_str(nvs, "netmask", param));
+                ESP_ERROR_CHECK(config_set_str("netmask", param));
             }
             else
             {
                 ESP_LOGW(TAG, "Invalid custom subnetmask. Setting to default.");
-                ESP_ERROR_CHECK(nvs_set_str(nvs, "netmask", DEFAULT_NETMASK_CLASS_C));
+                ESP_ERROR_CHECK(config_set_str("netmask", DEFAULT_NETMASK_CLASS_C));
             }
         }
     }
@@ -320,12 +354,12 @@ void applyAdvancedConfig(char *buf)
     if (strlen(param) > 0)
     {
         ESP_LOGI(TAG, "Set hostname to: %s", param);
-        ESP_ERROR_CHECK(nvs_set_str(nvs, "hostname", param));
+        ESP_ERROR_CHECK(config_set_str("hostname", param));
     }
     else
     {
         ESP_LOGI(TAG, "Erasing hostname. Will be regenerated on boot.");
-        nvs_erase_key(nvs, "hostname");
+        config_erase("hostname");
     }
 
     readUrlParameterIntoBuffer(buf, "octet", param, contentLength);
@@ -333,34 +367,48 @@ void applyAdvancedConfig(char *buf)
     if (strlen(param) > 0 && octet >= 0 && octet <= 255)
     {
         ESP_LOGI(TAG, "Set third octet to: %d", octet);
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "octet", octet));
+        ESP_ERROR_CHECK(config_set_i32("octet", octet));
     }
     else
     {
         ESP_LOGW(TAG, "Invalid octet parameter. Will be erased");
-        nvs_erase_key(nvs, "octet");
+        config_erase("octet");
+    }
+    readUrlParameterIntoBuffer(buf, "perfprofile", param, contentLength);
+    const perf_profile_t *profile = perf_profile_find(param);
+    if (profile != NULL && perf_profile_available(profile))
+    {
+        ESP_LOGI(TAG, "Setting performance profile to %s", profile->name);
+        ESP_ERROR_CHECK(config_set_str("perf_profile", profile->name));
+    }
+    readUrlParameterIntoBuffer(buf, "powerprofile", param, contentLength);
+    const power_profile_t *powerProfile = power_profile_find(param);
+    if (powerProfile != NULL)
+    {
+        ESP_LOGI(TAG, "Setting power profile to %s", powerProfile->name);
+        ESP_ERROR_CHECK(config_set_str("power_profile", powerProfile->name));
     }
     readUrlParameterIntoBuffer(buf, "txpower", param, contentLength);
     int txPower = atoi(param);
     if (txPower >= 8 && txPower <= 84)
     {
         ESP_LOGI(TAG, "Setting Wifi tx power to %d.", txPower);
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "txpower", txPower));
+        ESP_ERROR_CHECK(config_set_i32("txpower", txPower));
     }
     readUrlParameterIntoBuffer(buf, "bandwith", param, contentLength);
     int useLowerBandwith = atoi(param);
     if (useLowerBandwith == 1)
     {
         ESP_LOGI(TAG, "Using lower bandwith with 40 MHz");
-        ESP_ERROR_CHECK(nvs_set_i32(nvs, "lower_bandwith", 1));
+        ESP_ERROR_CHECK(config_set_i32("lower_bandwith", 1));
     }
     else
     {
-        nvs_erase_key(nvs, "lower_bandwith");
+        config_erase("lower_bandwith");
     }
 
-    nvs_commit(nvs);
-    nvs_close(nvs);
+    // One commit for all settings of the page
+    config_flush();
 }
 
 esp_err_t apply_get_handler(httpd_req_t *req)
@@ -371,18 +419,16 @@ esp_err_t apply_get_handler(httpd_req_t *req)
         return redirectToLock(req);
     }
     extern const char apply_start[] asm("_binary_apply_html_start");
-    extern const char apply_end[] asm("_binary_apply_html_end");
     ESP_LOGI(TAG, "Requesting apply page");
-    closeHeader(req);
-
-    char *redirectUrl = getRedirectUrl(req);
-    char *apply_page = malloc(apply_end - apply_start + strlen(redirectUrl) - 2);
 
+    char redirectUrl[32];
+    getRedirectUrl(req, redirectUrl, sizeof(redirectUrl));
     ESP_LOGI(TAG, "Redirecting after apply to '%s'", redirectUrl);
-    sprintf(apply_page, apply_start, redirectUrl);
-    free(redirectUrl);
 
-    return httpd_resp_send(req, apply_page, HTTPD_RESP_USE_STRLEN);
+    const template_var_t vars[] = {
+        {.name = "redirect", .value = redirectUrl},
+    };
+    return template_send(req, apply_start, vars, sizeof(vars) / sizeof(vars[0]));
 }
 esp_err_t apply_post_handler(httpd_req_t *req)
 {
@@ -0,0 +1,31 @@
+#include "arena.h"
+#include <esp_log.h>
+#include "stats.h"
+
+static const char *TAG = "ReqArena";
+
+static uint8_t arena[REQ_ARENA_SIZE] __attribute__((aligned(8)));
+static size_t arena_used = 0;
+
+void *req_arena_alloc(httpd_req_t *req, size_t size)
+{
+    size_t aligned = (size + 7) & ~(size_t)7;
+    if (aligned > REQ_ARENA_SIZE - arena_used)
+    {
+        stats_inc(&stats_http.arena_failed);
+        ESP_LOGW(TAG, "No space for %u bytes in the arena (%u used) for %s", (unsigned)size, (unsigned)arena_used, req->uri);
+        return NULL;
+    }
+    void *p = arena + arena_used;
+    arena_used += aligned;
+    if (arena_used > stats_http.arena_high_water)
+    {
+        stats_http.arena_high_water = arena_used;
+    }
+    return p;
+}
+
+void req_arena_reset(void)
+{
+    arena_used = 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <esp_http_server.h>
+
+/* Scratch memory of the request running in the server task, so the handlers
+   don't allocate from the heap the WiFi driver needs for its buffers.
+   Everything is released at once, when the handler returned (see http_server.c). */
+#define REQ_ARENA_SIZE 4096
+
+/**
+ * @brief Allocates size bytes (aligned to 8) for the current request
+ * Only in the handlers of the server task, the memory must not be freed.
+ *
+ * @return NULL if the arena is full
+ */
+void *req_arena_alloc(httpd_req_t *req, size_t size);
+
+/* Called by the server after every handler */
+void req_arena_reset(void);
@@ -9,18 +9,20 @@
 #include "router_globals.h"
 #include "esp_wifi.h"
 #include "esp_wifi_ap_get_sta_list.h"
+#include "shaper.h"
 
 static const char *TAG = "ClientsHandler";
 
-const char *CLIENT_TEMPLATE = "<tr><td>%i</td><td>%s</td><td style='text-transform: uppercase;'>%s</td></tr>";
+/* The rates are filled in by the page from /api/clients */
+static const char *CLIENT_TEMPLATE = "<tr data-mac='%s'><td class=rank>%i</td><td class=ip>%s</td><td style='text-transform: uppercase;'>%s</td>"
+                                     "<td class=down>-</td><td class=up>-</td><td class=total>-</td><td>"
+                                     "<form action='/clients' method='POST' class='d-flex'><input type='hidden' name='mac' value='%s'>"
+                                     "<input type='number' class='form-control' name='down' min='0' max='%d' value='%lu' title='Download limit in kbit/s, 0 = unlimited'>"
+                                     "<input type='number' class='form-control' name='up' min='0' max='%d' value='%lu' title='Upload limit in kbit/s, 0 = unlimited'>"
+                                     "<button class='btn btn-light' title='Save the limits'>Save</button></form></td></tr>";
 
-esp_err_t clients_download_get_handler(httpd_req_t *req)
+static void writeClientRows(template_out_t *out, void *arg)
 {
-    if (isLocked())
-    {
-        return redirectToLock(req);
-    }
-
     wifi_sta_list_t wifi_sta_list;
     wifi_sta_mac_ip_list_t adapter_sta_list;
     memset(&wifi_sta_list, 0, sizeof(wifi_sta_list));
@@ -29,44 +31,84 @@ esp_err_t clients_download_get_handler(httpd_req_t *req)
 
     esp_wifi_ap_get_sta_list_with_ip(&wifi_sta_list, &adapter_sta_list);
 
-    char result[1000];
-    strcpy(result, "");
-    if (wifi_sta_list.num > 0)
+    if (wifi_sta_list.num == 0)
     {
-        for (int i = 0; i < adapter_sta_list.num; i++)
-        {
+        const char *noClients = "<tr id=noclients class='text-danger'><td colspan='7'>No clients connected</td></tr>";
+        template_write(out, noClients, strlen(noClients));
+        return;
+    }
+    for (int i = 0; i < adapter_sta_list.num; i++)
+    {
+        esp_netif_pair_mac_ip_t station = adapter_sta_list.sta[i];
 
-            char *template = malloc(strlen(CLIENT_TEMPLATE) + 100);
-            esp_netif_pair_mac_ip_t station = adapter_sta_list.sta[i];
+        char str_ip[16];
+        esp_ip4addr_ntoa(&(station.ip), str_ip, IP4ADDR_STRLEN_MAX);
 
-            char str_ip[16];
-            esp_ip4addr_ntoa(&(station.ip), str_ip, IP4ADDR_STRLEN_MAX);
+        char currentMAC[18];
+        sprintf(currentMAC, "%x:%x:%x:%x:%x:%x", station.mac[0], station.mac[1], station.mac[2], station.mac[3], station.mac[4], station.mac[5]);
 
-            char currentMAC[18];
-            sprintf(currentMAC, "%x:%x:%x:%x:%x:%x", station.mac[0], station.mac[1], station.mac[2], station.mac[3], station.mac[4], station.mac[5]);
+        char macParam[18];
+        sprintf(macParam, "%02x:%02x:%02x:%02x:%02x:%02x", station.mac[0], station.mac[1], station.mac[2], station.mac[3], station.mac[4], station.mac[5]);
+        shaper_limit_t limit = {0};
+        shaper_get_limit(station.mac, &limit);
 
-            sprintf(template, CLIENT_TEMPLATE, i + 1, str_ip, currentMAC);
-            strcat(result, template);
-        }
+        template_printf(out, CLIENT_TEMPLATE, macParam, i + 1, str_ip, currentMAC, macParam, SHAPER_MAX_KBPS, (unsigned long)limit.down_kbps,
+                        SHAPER_MAX_KBPS, (unsigned long)limit.up_kbps);
     }
-    else
+}
+
+esp_err_t clients_download_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
     {
-        strcat(result, "<tr class='text-danger'><td colspan='3'>No clients connected</td></tr>");
+        return redirectToLock(req);
     }
 
     httpd_req_to_sockfd(req);
     extern const char clients_start[] asm("_binary_clients_html_start");
-    extern const char clients_end[] asm("_binary_clients_html_end");
-    const size_t clients_html_size = (clients_end - clients_start);
-
-    int size = clients_html_size + strlen(result);
-    char *clients_page = malloc(size - 2);
-    sprintf(clients_page, clients_start, result);
 
-    closeHeader(req);
+    const template_var_t vars[] = {
+        {.name = "clients", .cb = writeClientRows},
+    };
 
-    esp_err_t ret = httpd_resp_send(req, clients_page, HTTPD_RESP_USE_STRLEN);
-    free(clients_page);
     ESP_LOGI(TAG, "Requesting clients page");
-    return ret;
+    return template_send(req, clients_start, vars, sizeof(vars) / sizeof(vars[0]));}
+
+esp_err_t clients_post_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return redirectToLock(req);
+    }
+    httpd_req_to_sockfd(req);
+
+    size_t content_len = req->content_len;
+    char buf[content_len];
+
+    if (fill_post_buffer(req, buf, content_len) == ESP_OK)
+    {
+        char param[24];
+        uint8_t mac[6];
+        readUrlParameterIntoBuffer(buf, "mac", param, sizeof(param));
+        if (sscanf(param, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6)
+        {
+            readUrlParameterIntoBuffer(buf, "down", param, sizeof(param));
+            uint32_t down = strtoul(param, NULL, 10);
+            readUrlParameterIntoBuffer(buf, "up", param, sizeof(param));
+            uint32_t up = strtoul(param, NULL, 10);
+            esp_err_t err = shaper_set_limit(mac, down, up);
+            if (err != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Limit not set: %s", esp_err_to_name(err));
+            }
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Invalid MAC");
+        }
+    }
+
+    httpd_resp_set_status(req, "302 Found");
+    httpd_resp_set_hdr(req, "Location", "/clients");
+    return httpd_resp_send(req, NULL, 0);
 }
@@ -3,10 +3,11 @@
 #include "router_globals.h"
 #include "lwip/ip4_addr.h"
 #include "helper.h"
+#include "template.h"
+#include "arena.h"
 #include "cmd_system.h"
 
 /* Static */
-void closeHeader(httpd_req_t *req);
 esp_err_t styles_download_get_handler(httpd_req_t *req);
 esp_err_t jquery_get_handler(httpd_req_t *req);
 esp_err_t favicon_get_handler(httpd_req_t *req);
@@ -14,6 +15,10 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err);
 esp_err_t redirectToRoot(httpd_req_t *req);
 esp_err_t reset_get_handler(httpd_req_t *req);
 
+/* ProbeHandler, the connectivity checks of the operating systems */
+size_t captive_probe_count(void);
+void captive_probe_register(httpd_handle_t server);
+
 /* IndexHandler */
 esp_err_t index_get_handler(httpd_req_t *req);
 esp_err_t index_post_handler(httpd_req_t *req);
@@ -26,7 +31,8 @@ esp_err_t lock_handler(httpd_req_t *req);
 esp_err_t redirectToLock(httpd_req_t *req);
 
 /* ScanHandler */
-void fillInfoData(char **db, char **textColor);
+/* db gets the RSSI of the uplink, it needs 5 bytes */
+void fillInfoData(char *db, size_t db_len, char **textColor);
 esp_err_t scan_download_get_handler(httpd_req_t *req);
 
 /* ResultHandler */
@@ -38,18 +44,30 @@ esp_err_t apply_post_handler(httpd_req_t *req);
 
 // /* RestHandler */
 esp_err_t rest_handler(httpd_req_t *req);
+esp_err_t stats_get_handler(httpd_req_t *req);
+esp_err_t scan_api_get_handler(httpd_req_t *req);
+esp_err_t scan_api_post_handler(httpd_req_t *req);
+
+/* ApiHandler, /api/v1 */
+esp_err_t api_v1_status_get_handler(httpd_req_t *req);
+esp_err_t api_v1_config_get_handler(httpd_req_t *req);
+esp_err_t api_v1_portmap_get_handler(httpd_req_t *req);
+esp_err_t api_v1_clients_get_handler(httpd_req_t *req);
+esp_err_t api_v1_flows_get_handler(httpd_req_t *req);
 
 /* advanced handler */
 esp_err_t advanced_download_get_handler(httpd_req_t *req);
 
 /* clients handler*/
 esp_err_t clients_download_get_handler(httpd_req_t *req);
+esp_err_t clients_post_handler(httpd_req_t *req);
 
 /* OTA */
 esp_err_t ota_download_get_handler(httpd_req_t *req);
 esp_err_t otalog_get_handler(httpd_req_t *req);
 esp_err_t ota_post_handler(httpd_req_t *req);
 esp_err_t otalog_post_handler(httpd_req_t *req);
+esp_err_t otaws_handler(httpd_req_t *req);
 
 /* About-Handler */
 esp_err_t about_get_handler(httpd_req_t *req);
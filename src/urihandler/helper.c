@@ -1,41 +1,11 @@
 #include "helper.h"
-#include <ctype.h>
+#include "urldecode.h"
 
 static const char *TAG = "urihelper";
 
 void preprocess_string(char *str)
 {
-    char *p, *q;
-
-    for (p = q = str; *p != 0; p++)
-    {
-        if (*(p) == '%' && *(p + 1) != 0 && *(p + 2) != 0)
-        {
-            // quoted hex
-            uint8_t a;
-            p++;
-            if (*p <= '9')
-                a = *p - '0';
-            else
-                a = toupper((unsigned char)*p) - 'A' + 10;
-            a <<= 4;
-            p++;
-            if (*p <= '9')
-                a += *p - '0';
-            else
-                a += toupper((unsigned char)*p) - 'A' + 10;
-            *q++ = a;
-        }
-        else if (*(p) == '+')
-        {
-            *q++ = ' ';
-        }
-        else
-        {
-            *q++ = *p;
-        }
-    }
-    *q = '\0';
+    url_decode(str);
 }
 
 void readUrlParameterIntoBuffer(char *parameterString, char *parameter, char *buffer, size_t paramLength)
@@ -59,7 +29,7 @@ esp_err_t fill_post_buffer(httpd_req_t *req, char *buf, size_t len)
     while (remaining > 0)
     {
         /* Read the data for the request */
-        if ((ret = httpd_req_recv(req, buf, MIN(remaining, len))) <= 0)
+        if ((ret = httpd_req_recv(req, buf + len - remaining, remaining)) <= 0)
         {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT)
             {
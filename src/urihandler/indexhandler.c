@@ -1,26 +1,25 @@
 #include "handler.h"
+#include "scan.h"
 #include <sys/param.h>
 #include "router_globals.h"
 
 static const char *TAG = "IndexHandler";
 
-char *appliedSSID = NULL;
+// SSID chosen on the result page, shown once by the next config page
+static char appliedSSID[33] = "";
 
 bool isWrongHost(httpd_req_t *req)
 {
-    char *currentIP = getDefaultIPByNetmask();
-    size_t buf_len = strlen(currentIP) + 1;
-    char *host = malloc(buf_len);
-    httpd_req_get_hdr_value_str(req, "Host", host, buf_len);
-    bool out = strcmp(host, currentIP) != 0;
-    free(host);
-    free(currentIP);
-    return out;
+    const char *currentIP = getDefaultIPByNetmask();
+    char host[16] = "";
+    // Only compared as long as the IP, so a port doesn't matter
+    httpd_req_get_hdr_value_str(req, "Host", host, MIN(sizeof(host), strlen(currentIP) + 1));
+    return strcmp(host, currentIP) != 0;
 }
 
 esp_err_t index_get_handler(httpd_req_t *req)
 {
-    if (isWrongHost(req) && isDnsStarted())
+    if (isWrongHost(req) && isDnsCaptive())
     {
         ESP_LOGI(TAG, "Captive portal redirect");
         return redirectToRoot(req);
@@ -30,36 +29,25 @@ esp_err_t index_get_handler(httpd_req_t *req)
     {
         return redirectToLock(req);
     }
-    char *result_param = NULL;
     char *displayResult = "none";
 
     char *scanButtonWidth = "12";
-    get_config_param_str("scan_result", &result_param);
-    int32_t result_shown = 0;
-    get_config_param_int("result_shown", &result_shown);
-    if (result_param != NULL && result_shown < 3)
+    scan_record_t record;
+    scan_state_t scanState;
+    int64_t scanAge;
+    if (scan_get_results(&record, 1, &scanState, &scanAge) > 0 || scanState == SCAN_RUNNING)
     {
-        if (result_shown == 0)
-        {
-            ESP_LOGI(TAG, "Scan result is available and not shown already. Forwarding to scan page");
-            httpd_resp_set_status(req, "302 Found");
-            httpd_resp_set_hdr(req, "Location", "/result");
-            return httpd_resp_send(req, NULL, 0);
-        }
-
         scanButtonWidth = "9";
         displayResult = "block";
     }
 
     httpd_req_to_sockfd(req);
     extern const char config_start[] asm("_binary_config_html_start");
-    extern const char config_end[] asm("_binary_config_html_end");
-    const size_t config_html_size = (config_end - config_start);
 
     char *displayLockButton = NULL;
     char *displayRelockButton = NULL;
 
-    char *lock_pass = NULL;
+    const char *lock_pass = NULL;
     get_config_param_str("lock_pass", &lock_pass);
     if (lock_pass != NULL && strlen(lock_pass) > 0)
     {
@@ -84,19 +72,10 @@ esp_err_t index_get_handler(httpd_req_t *req)
         hiddenSSID = "";
     }
 
-    size_t size = strlen(ap_ssid) + strlen(ap_passwd) + strlen(displayLockButton);
-    if (appliedSSID != NULL && strlen(appliedSSID) > 0)
-    {
-        size = size + strlen(appliedSSID);
-    }
-    else
-    {
-        size = size + strlen(ssid) + strlen(passwd);
-    }
-    char *db = NULL;
+    char db[5];
     char *textColor = NULL;
     char *wifiOn, *wifiOff = NULL;
-    fillInfoData(&db, &textColor);
+    fillInfoData(db, sizeof(db), &textColor);
     if (strcmp(db, "0") == 0)
     {
         wifiOn = "none";
@@ -108,25 +87,19 @@ esp_err_t index_get_handler(httpd_req_t *req)
         wifiOff = "none";
     }
 
-    size = size + +strlen(wifiOn) + strlen(wifiOff) + strlen(textColor) + 5 /* Länge der clients */ + strlen(db);
     /* WPA2  */
     char *wpa2CB = NULL;
     char *wpa2Input = NULL;
-    char *sta_identity = NULL;
-    char *sta_user = NULL;
+    const char *sta_identity = NULL;
+    const char *sta_user = NULL;
     size_t len = 0;
 
-    char *cert = NULL;
+    const char *cert = NULL;
     get_config_param_str("sta_identity", &sta_identity);
     get_config_param_str("sta_user", &sta_user);
 
     get_config_param_blob("cer", &cert, &len);
-    char *cer = NULL;
-    if (len > 0)
-    {
-        cer = (char *)malloc(len + 1 * sizeof(char));
-        strncpy(cer, cert, len + 1);
-    }
+    const char *cer = len > 0 ? cert : NULL;
     if ((sta_identity != NULL && strlen(sta_identity) != 0) || (sta_user != NULL && strlen(sta_user) != 0))
     {
         wpa2CB = "checked";
@@ -153,32 +126,41 @@ esp_err_t index_get_handler(httpd_req_t *req)
         cer = "";
     }
 
-    size = size + strlen(wpa2CB) + strlen(wpa2Input) + strlen(sta_identity) + strlen(sta_user) + strlen(cer) + strlen(displayResult) + strlen(scanButtonWidth) + strlen(displayLockButton) + strlen(displayRelockButton);
-    ESP_LOGI(TAG, "Allocating additional %d bytes for config page.", config_html_size + size);
-
-    char *config_page = malloc(config_html_size + size);
-    uint16_t connect_count = getConnectCount();
-
-    if (appliedSSID != NULL && strlen(appliedSSID) > 0)
-    {
-        sprintf(config_page, config_start, connect_count, hiddenSSID, ap_ssid, ap_passwd, textColor, wifiOff, wifiOn, db, wpa2CB, appliedSSID, wpa2Input, sta_identity, sta_user, cer, "", scanButtonWidth, displayResult, displayLockButton, displayRelockButton);
-    }
-    else
-    {
-        sprintf(config_page, config_start, connect_count, hiddenSSID, ap_ssid, ap_passwd, textColor, wifiOff, wifiOn, db, wpa2CB, ssid, wpa2Input, sta_identity, sta_user, cer, passwd, scanButtonWidth, displayResult, displayLockButton, displayRelockButton);
-    }
-
-    closeHeader(req);
-
-    esp_err_t ret = httpd_resp_send(req, config_page, HTTPD_RESP_USE_STRLEN);
-    free(config_page);
-    free(appliedSSID);
-    appliedSSID = NULL;
-    free(db);
-    if (strlen(cer) > 0) // Error on C3
-    {
-        free(cer);
-    }
+    char connectCount[6];
+    sprintf(connectCount, "%u", getConnectCount());
+
+    const char *staSSID = ssid;
+    const char *staPasswd = passwd;
+    if (strlen(appliedSSID) > 0)
+    {
+        staSSID = appliedSSID;
+        staPasswd = "";
+    }
+
+    const template_var_t vars[] = {
+        {.name = "clients", .value = connectCount},
+        {.name = "ssid_hidden", .value = hiddenSSID},
+        {.name = "ap_ssid", .value = ap_ssid},
+        {.name = "ap_passwd", .value = ap_passwd},
+        {.name = "sta_color", .value = textColor},
+        {.name = "wifi_off", .value = wifiOff},
+        {.name = "wifi_on", .value = wifiOn},
+        {.name = "db", .value = db},
+        {.name = "wpa2_checked", .value = wpa2CB},
+        {.name = "ssid", .value = staSSID},
+        {.name = "wpa2_display", .value = wpa2Input},
+        {.name = "sta_identity", .value = sta_identity},
+        {.name = "sta_user", .value = sta_user},
+        {.name = "cert", .value = cer},
+        {.name = "passwd", .value = staPasswd},
+        {.name = "scan_width", .value = scanButtonWidth},
+        {.name = "result_display", .value = displayResult},
+        {.name = "lock_display", .value = displayLockButton},
+        {.name = "relock_display", .value = displayRelockButton},
+    };
+
+    esp_err_t ret = template_send(req, config_start, vars, sizeof(vars) / sizeof(vars[0]));
+    appliedSSID[0] = '\0';
 
     return ret;
 }
@@ -205,8 +187,7 @@ esp_err_t index_post_handler(httpd_req_t *req)
         if (strlen(ssidParam) > 0)
         {
             ESP_LOGI(TAG, "Found SSID parameter => %s", ssidParam);
-            appliedSSID = malloc(strlen(ssidParam) + 1);
-            strcpy(appliedSSID, ssidParam);
+            strlcpy(appliedSSID, ssidParam, sizeof(appliedSSID));
         }
     }
     httpd_resp_set_status(req, "302 Temporary Redirect");
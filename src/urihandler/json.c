@@ -0,0 +1,131 @@
+#include <string.h>
+#include "json.h"
+
+void json_write_escaped(template_out_t *out, const char *text)
+{
+    template_write(out, "\"", 1);
+    const char *start = text;
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\' || *c < 0x20)
+        {
+            template_write(out, start, (const char *)c - start);
+            if (*c < 0x20)
+            {
+                template_printf(out, "\\u%04x", *c);
+            }
+            else
+            {
+                template_printf(out, "\\%c", *c);
+            }
+            start = (const char *)c + 1;
+        }
+    }
+    template_write(out, start, strlen(start));
+    template_write(out, "\"", 1);
+}
+
+static void json_prefix(json_writer_t *w, const char *key)
+{
+    if (w->depth > 0 && w->depth <= JSON_MAX_DEPTH)
+    {
+        if (w->has_items[w->depth - 1])
+        {
+            template_write(&w->out, ",", 1);
+        }
+        w->has_items[w->depth - 1] = true;
+    }
+    if (key != NULL)
+    {
+        json_write_escaped(&w->out, key);
+        template_write(&w->out, ":", 1);
+    }
+}
+
+static void json_open(json_writer_t *w, const char *key, const char *bracket)
+{
+    json_prefix(w, key);
+    template_write(&w->out, bracket, 1);
+    if (w->depth < JSON_MAX_DEPTH)
+    {
+        w->has_items[w->depth] = false;
+    }
+    w->depth++;
+}
+
+static void json_close(json_writer_t *w, const char *bracket)
+{
+    if (w->depth > 0)
+    {
+        w->depth--;
+    }
+    template_write(&w->out, bracket, 1);
+}
+
+void json_begin(json_writer_t *w, httpd_req_t *req, bool revalidate)
+{
+    template_begin(&w->out, req);
+    w->depth = 0;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", revalidate ? "no-cache" : "no-store");
+}
+
+esp_err_t json_end(json_writer_t *w)
+{
+    return template_finish(&w->out);
+}
+
+void json_object_begin(json_writer_t *w, const char *key)
+{
+    json_open(w, key, "{");
+}
+
+void json_object_end(json_writer_t *w)
+{
+    json_close(w, "}");
+}
+
+void json_array_begin(json_writer_t *w, const char *key)
+{
+    json_open(w, key, "[");
+}
+
+void json_array_end(json_writer_t *w)
+{
+    json_close(w, "]");
+}
+
+void json_string(json_writer_t *w, const char *key, const char *value)
+{
+    if (value == NULL)
+    {
+        json_null(w, key);
+        return;
+    }
+    json_prefix(w, key);
+    json_write_escaped(&w->out, value);
+}
+
+void json_int(json_writer_t *w, const char *key, int64_t value)
+{
+    json_prefix(w, key);
+    template_printf(&w->out, "%lld", (long long)value);
+}
+
+void json_uint(json_writer_t *w, const char *key, uint64_t value)
+{
+    json_prefix(w, key);
+    template_printf(&w->out, "%llu", (unsigned long long)value);
+}
+
+void json_bool(json_writer_t *w, const char *key, bool value)
+{
+    json_prefix(w, key);
+    template_write(&w->out, value ? "true" : "false", value ? 4 : 5);
+}
+
+void json_null(json_writer_t *w, const char *key)
+{
+    json_prefix(w, key);
+    template_write(&w->out, "null", 4);
+}
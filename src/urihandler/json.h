@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "template.h"
+
+#define JSON_MAX_DEPTH 8
+
+/* Writes a JSON response as it is generated, only the chunk buffer of the
+   template engine is needed. key is NULL for the root and array elements. */
+typedef struct
+{
+    template_out_t out;
+    uint8_t depth;
+    bool has_items[JSON_MAX_DEPTH];
+} json_writer_t;
+
+/* Sets the content type, revalidate allows caching with an ETag set by the
+   caller, otherwise the response isn't stored at all */
+void json_begin(json_writer_t *w, httpd_req_t *req, bool revalidate);
+esp_err_t json_end(json_writer_t *w);
+
+void json_object_begin(json_writer_t *w, const char *key);
+void json_object_end(json_writer_t *w);
+void json_array_begin(json_writer_t *w, const char *key);
+void json_array_end(json_writer_t *w);
+
+/* A NULL value is written as null */
+void json_string(json_writer_t *w, const char *key, const char *value);
+void json_int(json_writer_t *w, const char *key, int64_t value);
+void json_uint(json_writer_t *w, const char *key, uint64_t value);
+void json_bool(json_writer_t *w, const char *key, bool value);
+void json_null(json_writer_t *w, const char *key);
+
+/* Writes text as quoted and escaped JSON string */
+void json_write_escaped(template_out_t *out, const char *text);
@@ -34,7 +34,7 @@ esp_err_t unlock_handler(httpd_req_t *req)
 
         if (strlen(unlockParam) > 0)
         {
-            char *lock;
+            const char *lock;
             get_config_param_str("lock_pass", &lock);
             if (strcmp(lock, unlockParam) == 0)
             {
@@ -52,7 +52,6 @@ esp_err_t unlock_handler(httpd_req_t *req)
     }
     extern const char ul_start[] asm("_binary_unlock_html_start");
 
-    closeHeader(req);
     return httpd_resp_send(req, ul_start, HTTPD_RESP_USE_STRLEN);
 }
 
@@ -106,7 +105,7 @@ esp_err_t lock_handler(httpd_req_t *req)
             nvs_handle_t nvs;
             nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
             nvs_set_str(nvs, "lock_pass", passParam);
-            nvs_commit(nvs);
+            config_commit(nvs);
             nvs_close(nvs);
             httpd_resp_set_status(req, "302 Found");
             if (strlen(passParam) > 0)
@@ -127,12 +126,10 @@ esp_err_t lock_handler(httpd_req_t *req)
     }
 
     extern const char l_start[] asm("_binary_lock_html_start");
-    extern const char l_end[] asm("_binary_lock_html_end");
-    const size_t l_html_size = (l_end - l_start);
 
     char *display = NULL;
 
-    char *lock_pass = NULL;
+    const char *lock_pass = NULL;
     get_config_param_str("lock_pass", &lock_pass);
     if (lock_pass != NULL && strlen(lock_pass) > 0)
     {
@@ -143,13 +140,8 @@ esp_err_t lock_handler(httpd_req_t *req)
         display = "none";
     }
 
-    char *lock_page = malloc(l_html_size + strlen(display) + 1);
-
-    sprintf(lock_page, l_start, display);
-
-    closeHeader(req);
-
-    esp_err_t out = httpd_resp_send(req, lock_page, HTTPD_RESP_USE_STRLEN);
-    free(lock_page);
-    return out;
+    const template_var_t vars[] = {
+        {.name = "lock_display", .value = display},
+    };
+    return template_send(req, l_start, vars, sizeof(vars) / sizeof(vars[0]));
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 
 #include "handler.h"
 #include <esp_ota_ops.h>
-#include <esp_https_ota.h>
+#include "otastream.h"
 #include <esp_log.h>
 #include <sys/param.h>
 #include "timer.h"
@@ -13,111 +13,184 @@ static const char *NOT_DETERMINED = "Not determined yet";
 static const char *ERROR_RETRIEVING = "Error retrieving the data. HTTP-Code: %d";
 static char latest_version[50] = "";
 static char changelog[400] = "";
-bool finished = false;
-bool otaRunning = false;
-
-char chip_type[30];
-
-char otalog[400] = "";
-char resultLog[110] = "";
-char progressLabel[20] = "";
-
+static bool finished = false;
+static bool otaRunning = false;
+static bool otaThrottled = false;
+
+static char chip_type[30];
+
+/* The state of the running update, written by the OTA task and pushed to the
+   open /otaws connections by the server task */
+#define OTA_LOG_LINES 6
+#define OTA_LOG_LINE_LEN 64
+static char otalog[OTA_LOG_LINES][OTA_LOG_LINE_LEN];
+static uint8_t otalogCount = 0;
+static char resultLog[64] = "";
+static const char *resultClass = "";
+static char progressLabel[24] = "";
+static int progressInt = 0;
+static httpd_handle_t otaServer = NULL;
+
+/* The version file is parsed while it is downloaded: the first line is the
+   version, every other line an entry of the changelog */
+#define VERSION_LINE_MAX 128
 typedef struct
 {
     int http_code;
-} http_handler_data_t;
+    int line_number;
+    size_t line_len;
+    char line[VERSION_LINE_MAX];
+} version_parser_t;
 
 static const char *DEFAULT_URL = "https://raw.githubusercontent.com/dchristl/esp32_nat_router_extended/releases-production/";
 static const char *DEFAULT_URL_CANARY = "https://raw.githubusercontent.com/dchristl/esp32_nat_router_extended/releases-staging/";
+// zlib stream of firmware.bin, built by the release workflow
+#define OTA_COMPRESSED_SUFFIX ".zz"
 
-void appendToLog(const char *message)
+#define DOWNLOAD_TIMEOUT_MS 5000
+// Pause between the blocks of a throttled update, so forwarding keeps the CPU and the WiFi
+#define OTA_THROTTLE_DELAY_MS 10
+#define OTA_PUSH_MAX_LEN 640
+
+static void otaPushWork(void *arg)
 {
-    char tmp[500] = "";
+    static char message[OTA_PUSH_MAX_LEN];
+    // Only fixed messages and numbers are logged, so nothing needs to be escaped
+    int len = snprintf(message, sizeof(message), "{\"progress\":%d,\"label\":\"%s\",\"log\":[", progressInt, progressLabel);
+    for (int i = 0; i < otalogCount && len < sizeof(message); i++)
+    {
+        len += snprintf(message + len, sizeof(message) - len, "%s\"%s\"", i > 0 ? "," : "", otalog[i]);
+    }
+    if (len < sizeof(message))
+    {
+        len += snprintf(message + len, sizeof(message) - len, "],\"result\":\"%s\",\"class\":\"%s\",\"finished\":%s}",
+                        resultLog, resultClass, finished ? "true" : "false");
+    }
+    if (len >= sizeof(message))
+    {
+        ESP_LOGW(TAG, "Progress message too long");
+        return;
+    }
 
-    sprintf(tmp, "<tr><th>%s</th></tr>", message);
+    httpd_ws_frame_t frame = {.type = HTTPD_WS_TYPE_TEXT, .payload = (uint8_t *)message, .len = len};
+    int fds[CONFIG_LWIP_MAX_SOCKETS];
+    size_t count = CONFIG_LWIP_MAX_SOCKETS;
+    if (httpd_get_client_list(otaServer, &count, fds) != ESP_OK)
+    {
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (httpd_ws_get_fd_info(otaServer, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
+        {
+            httpd_ws_send_frame_async(otaServer, fds[i], &frame);
+        }
+    }
+}
 
-    strcat(otalog, tmp);
+// Sending is done by the server task, the sockets belong to it
+static void otaPush()
+{
+    if (otaServer != NULL)
+    {
+        httpd_queue_work(otaServer, otaPushWork, NULL);
+    }
+}
+
+void appendToLog(const char *message)
+{
+    if (otalogCount < OTA_LOG_LINES)
+    {
+        strlcpy(otalog[otalogCount], message, OTA_LOG_LINE_LEN);
+        otalogCount++;
+    }
     ESP_LOGI(TAG, "%s", message);
+    otaPush();
 }
 
 void setResultLog(const char *message, const char *cssClass)
 {
-
-    sprintf(resultLog, "<tr><th class=\"%s\">%s</th></tr>", cssClass, message);
-
+    strlcpy(resultLog, message, sizeof(resultLog));
+    resultClass = cssClass;
     ESP_LOGI(TAG, "%s", message);
 }
 
-#define DOWNLOAD_TIMEOUT_MS 5000
-char *file_buffer = NULL;
-size_t file_size = 0;
-
-int64_t data_length = 0;
-int64_t content_length = 0;
-int threshold = 0;
-int progressInt = 0;
-
-// HTTP-Client-Event-Handler
-esp_err_t ota_event_event_handler(esp_http_client_event_t *evt)
+static void writeLog(template_out_t *out, void *arg)
 {
-    char tmp[50] = "";
-
-    switch (evt->event_id)
+    for (int i = 0; i < otalogCount; i++)
     {
-    case HTTP_EVENT_ON_DATA:
-
-        data_length = data_length + ((int64_t)evt->data_len * 1000);
-        if (content_length != 0)
-        {
-            int64_t progress = (data_length * 100) / content_length / 1000;
-            progressInt = (int)progress;
-            sprintf(progressLabel, "%d of %d kB", (int)(data_length / 1000 / 1000), (int)(content_length / 1000));
+        template_printf(out, "<tr><th>%s</th></tr>", otalog[i]);
+    }
+}
 
-            if (progressInt >= threshold) // do not flood log
-            {
-                threshold = threshold + 10;
-                ESP_LOGI(TAG, "%s", progressLabel);
-            }
-        }
+static void writeResult(template_out_t *out, void *arg)
+{
+    if (resultLog[0] != '\0')
+    {
+        template_printf(out, "<tr><th class=\"%s\">%s</th></tr>", resultClass, resultLog);
+    }
+}
 
-        break;
-    case HTTP_EVENT_ERROR:
-        return ESP_FAIL;
-    case HTTP_EVENT_ON_HEADER:
+static void appendToChangelog(const char *entry)
+{
+    size_t len = strlen(changelog);
+    // Entries which don't fit anymore are skipped instead of cut in the middle of the markup
+    if (len + strlen(entry) + sizeof("<li></li>") > sizeof(changelog))
+    {
+        ESP_LOGW(TAG, "Changelog entry skipped: %s", entry);
+        return;
+    }
+    sprintf(changelog + len, "<li>%s</li>", entry);
+}
 
-        char *endptr;
-        if (strcasecmp("Content-Length", evt->header_key) == 0)
-        {
-            content_length = strtol(evt->header_value, &endptr, 10);
-            sprintf(tmp, "Download size is %lld kB", (content_length / 1000));
-            appendToLog(tmp);
-        }
-        break;
-    default:
-        break;
+static void versionLine(version_parser_t *parser)
+{
+    size_t len = parser->line_len;
+    if (len > 0 && parser->line[len - 1] == '\r')
+    {
+        len--;
     }
-    return ESP_OK;
+    parser->line[len] = '\0';
+    parser->line_len = 0;
+    if (len == 0)
+    {
+        return;
+    }
+    ESP_LOGD(TAG, "Line %d: %s", parser->line_number + 1, parser->line);
+    if (parser->line_number == 0)
+    {
+        strlcpy(latest_version, parser->line, sizeof(latest_version));
+    }
+    else
+    {
+        appendToChangelog(parser->line);
+    }
+    parser->line_number++;
 }
 
 esp_err_t version_event_handler(esp_http_client_event_t *evt)
 {
-
-    http_handler_data_t *handler_data = (http_handler_data_t *)evt->user_data;
+    version_parser_t *parser = (version_parser_t *)evt->user_data;
 
     switch (evt->event_id)
     {
     case HTTP_EVENT_ON_DATA:
-        if (!esp_http_client_is_chunked_response(evt->client))
+        for (int i = 0; i < evt->data_len; i++)
         {
-            size_t new_size = file_size + evt->data_len;
-            file_buffer = realloc(file_buffer, new_size);
-            memcpy(file_buffer + file_size, evt->data, evt->data_len);
-            file_size = new_size;
+            char c = ((const char *)evt->data)[i];
+            if (c == '\n')
+            {
+                versionLine(parser);
+            }
+            else if (parser->line_len < VERSION_LINE_MAX - 1)
+            {
+                parser->line[parser->line_len++] = c; // longer lines are cut
+            }
         }
         break;
     case HTTP_EVENT_ON_FINISH:
-        int http_status_code = esp_http_client_get_status_code(evt->client);
-        handler_data->http_code = http_status_code;
+        versionLine(parser);
+        parser->http_code = esp_http_client_get_status_code(evt->client);
         ESP_LOGI(TAG, "Download finished");
         break;
     default:
@@ -138,9 +211,16 @@ const char *get_default_url()
     return DEFAULT_URL;
 }
 
+static bool isCustomOtaUrl()
+{
+    const char *customUrl = NULL;
+    get_config_param_str("ota_url", &customUrl);
+    return customUrl != NULL && strlen(customUrl) > 0;
+}
+
 void getOtaUrl(char *url, char *label)
 {
-    char *customUrl = NULL;
+    const char *customUrl = NULL;
     // Assuming the function get_config_param_str is defined elsewhere
     get_config_param_str("ota_url", &customUrl);
     if (customUrl != NULL && strlen(customUrl) > 0)
@@ -168,49 +248,111 @@ void getOtaUrl(char *url, char *label)
     }
 }
 
+static bool otaSizeLogged = false;
+
+static void otaProgress(size_t received, size_t total)
+{
+    if (total == 0)
+    {
+        return;
+    }
+    if (!otaSizeLogged)
+    {
+        char tmp[OTA_LOG_LINE_LEN];
+        snprintf(tmp, sizeof(tmp), "Download size is %u kB", (unsigned)(total / 1000));
+        appendToLog(tmp);
+        otaSizeLogged = true;
+    }
+    int progress = (int)((uint64_t)received * 100 / total);
+    if (progress == progressInt)
+    {
+        return; // do not flood the clients
+    }
+    progressInt = progress;
+    snprintf(progressLabel, sizeof(progressLabel), "%u of %u kB", (unsigned)(received / 1000), (unsigned)(total / 1000));
+    if (progress % 10 == 0)
+    {
+        ESP_LOGI(TAG, "%s", progressLabel);
+    }
+    otaPush();
+}
+
+static bool endsWith(const char *text, const char *suffix)
+{
+    size_t len = strlen(text);
+    size_t suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(text + len - suffixLen, suffix) == 0;
+}
+
 void ota_task(void *pvParameter)
 {
-    data_length = 0;
-    content_length = 0;
-    threshold = 0;
     char url[200];
     char label[20];
+    char tmp[OTA_LOG_LINE_LEN];
 
     getOtaUrl(url, label);
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .event_handler = ota_event_event_handler,
-        .skip_cert_common_name_check = true,
-        .timeout_ms = DOWNLOAD_TIMEOUT_MS};
+    finished = false;
+    progressInt = 0;
+    progressLabel[0] = '\0';
+    otaSizeLogged = false;
+    if (otaThrottled)
+    {
+        appendToLog("Client traffic has priority, the download is throttled");
+    }
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
+    ota_stream_config_t config = {
+        .url = url,
+        .compressed = endsWith(url, OTA_COMPRESSED_SUFFIX),
+        .timeout_ms = DOWNLOAD_TIMEOUT_MS,
+        .throttle_delay_ms = otaThrottled ? OTA_THROTTLE_DELAY_MS : 0,
+        .progress = otaProgress,
     };
-    finished = false;
-    esp_err_t ret = esp_https_ota(&ota_config);
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    // The releases contain a compressed image next to firmware.bin, older ones only the image
+    char compressedUrl[sizeof(url) + sizeof(OTA_COMPRESSED_SUFFIX)];
+    if (!config.compressed && !isCustomOtaUrl())
+    {
+        snprintf(compressedUrl, sizeof(compressedUrl), "%s%s", url, OTA_COMPRESSED_SUFFIX);
+        ota_stream_config_t compressed = config;
+        compressed.url = compressedUrl;
+        compressed.compressed = true;
+        ret = ota_stream_run(&compressed);
+        if (ret == ESP_OK)
+        {
+            appendToLog("Compressed image installed");
+        }
+        else if (ret == ESP_ERR_NOT_FOUND || ret == ESP_ERR_NO_MEM)
+        {
+            appendToLog("No compressed image, downloading the full image");
+        }
+    }
+    if (ret == ESP_ERR_NOT_FOUND || ret == ESP_ERR_NO_MEM)
+    {
+        otaSizeLogged = false;
+        ret = ota_stream_run(&config);
+    }
     if (ret == ESP_OK)
     {
         setResultLog("OTA update succesful. The device is restarting.", "text-success");
     }
     else
     {
+        snprintf(tmp, sizeof(tmp), "Update failed: %s", esp_err_to_name(ret));
+        appendToLog(tmp);
         setResultLog("Error occured. The device is restarting ", "text-danger");
     }
     finished = true;
+    otaPush();
+    restartByTimerinS(3);
     vTaskDelete(NULL);
 }
 
 void start_ota_update()
 {
-    xTaskCreate(&ota_task, "ota_task", 8192, NULL, 5, NULL);
-}
-
-void appendToChangelog(const char *entry)
-{
-    char tmp[500] = "";
-    sprintf(tmp, "<li>%s</li>", entry);
-    strcat(changelog, tmp);
+    // A throttled update runs below the other management tasks
+    UBaseType_t priority = otaThrottled ? tskIDLE_PRIORITY + 1 : MGMT_TASK_PRIORITY;
+    xTaskCreatePinnedToCore(&ota_task, "ota_task", 8192, NULL, priority, NULL, get_mgmt_task_core());
 }
 
 void updateVersion()
@@ -219,52 +361,61 @@ void updateVersion()
     char url[strlen(usedUrl) + 50];
     strcpy(url, usedUrl);
     strcat(url, "version");
+    version_parser_t *parser = calloc(1, sizeof(version_parser_t));
+    if (parser == NULL)
+    {
+        return;
+    }
+    parser->http_code = 200;
     esp_http_client_config_t config = {
         .url = url,
         .event_handler = version_event_handler,
-        .user_data = &(http_handler_data_t){.http_code = 200},
+        .user_data = parser,
     };
+    changelog[0] = '\0';
     esp_http_client_handle_t client = esp_http_client_init(&config);
     esp_http_client_set_timeout_ms(client, DOWNLOAD_TIMEOUT_MS);
     esp_err_t err = esp_http_client_perform(client);
-    changelog[0] = '\0';
-    http_handler_data_t *handler_data = (http_handler_data_t *)config.user_data;
 
-    if (err == ESP_OK && handler_data->http_code == 200)
+    if (err == ESP_OK && parser->http_code == 200)
     {
-        ESP_LOGI(TAG, "Version and changelog download succesful. File size is: %d Bytes", file_size);
-        file_buffer[file_size - 1] = '\0'; // Terminate the string on the correct length
-        char *rest = file_buffer;
-        char *line;
-        int lineNumber = 1;
-        while ((line = strtok_r(rest, "\n", &rest)) != NULL)
-        {
-            ESP_LOGD(TAG, "Line %d: %s\n", lineNumber, line);
-            switch (lineNumber)
-            {
-            case 1:
-                strcpy(latest_version, line);
-                break;
-
-            default:
-                appendToChangelog(line);
-                break;
-            }
-            lineNumber++;
-        }
-
-        free(file_buffer);
-        file_buffer = NULL;
-        file_size = 0;
+        ESP_LOGI(TAG, "Version and changelog download succesful. %d lines", parser->line_number);
     }
     else
     {
-        ESP_LOGE(TAG, "Error on download: %s -> %d\n", esp_err_to_name(err), handler_data->http_code);
-        snprintf(latest_version, sizeof(latest_version), ERROR_RETRIEVING, handler_data->http_code);
+        ESP_LOGE(TAG, "Error on download: %s -> %d\n", esp_err_to_name(err), parser->http_code);
+        snprintf(latest_version, sizeof(latest_version), ERROR_RETRIEVING, parser->http_code);
+        changelog[0] = '\0';
         appendToChangelog(latest_version);
     }
     esp_http_client_cleanup(client);
+    free(parser);
+}
+
+/* Pushes the progress of the update as JSON, the client doesn't send anything */
+esp_err_t otaws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET)
+    {
+        if (isLocked())
+        {
+            return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+        }
+        otaServer = req->handle;
+        otaPush(); // the current state, once the handshake is done
+        return ESP_OK;
+    }
+    uint8_t buf[16];
+    httpd_ws_frame_t frame = {0};
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK || frame.len > sizeof(buf))
+    {
+        return ESP_FAIL;
+    }
+    frame.payload = buf;
+    return httpd_ws_recv_frame(req, &frame, frame.len);
 }
+
 esp_err_t otalog_get_handler(httpd_req_t *req)
 {
 
@@ -282,29 +433,29 @@ esp_err_t otalog_get_handler(httpd_req_t *req)
     httpd_req_to_sockfd(req);
 
     extern const char otalog_start[] asm("_binary_otalog_html_start");
-    extern const char otalog_end[] asm("_binary_otalog_html_end");
-    const size_t otalog_html_size = (otalog_end - otalog_start);
-    char *otaLogRedirect = "1; url=/otalog";
+    // Shown when the update finished before the page was loaded, otherwise the page follows /otaws
+    const char *otaLogRedirect = finished ? "<meta http-equiv=refresh content=\"3; url=/apply\">" : "";
 
-    if (finished)
-    {
-        otaLogRedirect = "3; url=/apply";
-        restartByTimerinS(3);
-    }
     char url[200];
     char label[20];
 
     getOtaUrl(url, label);
 
-    char *otalog_page = malloc(otalog_html_size + strlen(otalog) + strlen(otaLogRedirect) + strlen(resultLog) + strlen(progressLabel) + 50 + strlen(label));
-    sprintf(otalog_page, otalog_start, otaLogRedirect, progressInt, progressLabel, label, otalog, resultLog);
+    char progress[12];
+    sprintf(progress, "%d", progressInt);
 
-    closeHeader(req);
+    const template_var_t vars[] = {
+        {.name = "redirect", .value = otaLogRedirect},
+        {.name = "progress", .value = progress},
+        {.name = "progress_label", .value = progressLabel},
+        {.name = "label", .value = label},
+        {.name = "log", .cb = writeLog},
+        {.name = "result", .cb = writeResult},
+    };
 
     ESP_LOGI(TAG, "Requesting OTA-Log page");
 
-    esp_err_t ret = httpd_resp_send(req, otalog_page, HTTPD_RESP_USE_STRLEN);
-    return ret;
+    return template_send(req, otalog_start, vars, sizeof(vars) / sizeof(vars[0]));
 }
 
 esp_err_t otalog_post_handler(httpd_req_t *req)
@@ -313,8 +464,26 @@ esp_err_t otalog_post_handler(httpd_req_t *req)
     {
         return redirectToLock(req);
     }
+    if (otaRunning)
+    {
+        httpd_resp_set_status(req, "302 Found");
+        httpd_resp_set_hdr(req, "Location", "/otalog");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    char buf[64] = "";
+    size_t len = MIN(req->content_len, sizeof(buf) - 1);
+    if (fill_post_buffer(req, buf, len) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    buf[len] = '\0';
+    char throttle[8] = "";
+    readUrlParameterIntoBuffer(buf, "throttle", throttle, sizeof(throttle));
+    otaThrottled = strlen(throttle) > 0;
+
     resultLog[0] = '\0';
-    otalog[0] = '\0';
+    resultClass = "";
+    otalogCount = 0;
     otaRunning = true;
     start_ota_update();
 
@@ -332,8 +501,6 @@ esp_err_t ota_download_get_handler(httpd_req_t *req)
 
     httpd_req_to_sockfd(req);
     extern const char ota_start[] asm("_binary_ota_html_start");
-    extern const char ota_end[] asm("_binary_ota_html_end");
-    const size_t ota_html_size = (ota_end - ota_start);
 
     if (strlen(latest_version) == 0)
     {
@@ -348,16 +515,18 @@ esp_err_t ota_download_get_handler(httpd_req_t *req)
     char label[20];
     getOtaUrl(customUrl, label);
     const char *project_version = get_project_version();
-    char *ota_page = malloc(ota_html_size + strlen(project_version) + strlen(customUrl) + strlen(latest_version) + strlen(chip_type) + strlen(label) + strlen(changelog));
-    sprintf(ota_page, ota_start, project_version, latest_version, changelog, customUrl, label, chip_type);
-
-    closeHeader(req);
+    const template_var_t vars[] = {
+        {.name = "project_version", .value = project_version},
+        {.name = "latest_version", .value = latest_version},
+        {.name = "changelog", .value = changelog},
+        {.name = "url", .value = customUrl},
+        {.name = "label", .value = label},
+        {.name = "chip_type", .value = chip_type},
+    };
 
-    ESP_LOGI(TAG, "Requesting OTA page with additional size of %d", strlen(ota_page));
+    ESP_LOGI(TAG, "Requesting OTA page");
 
-    esp_err_t ret = httpd_resp_send(req, ota_page, HTTPD_RESP_USE_STRLEN);
-    free(ota_page);
-    return ret;
+    return template_send(req, ota_start, vars, sizeof(vars) / sizeof(vars[0]));
 }
 
 esp_err_t ota_post_handler(httpd_req_t *req)
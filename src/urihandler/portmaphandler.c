@@ -9,6 +9,7 @@
 #include "router_globals.h"
 #include "esp_wifi.h"
 #include "esp_wifi_ap_get_sta_list.h"
+#include "portparse.h"
 
 static const char *TAG = "PortMapHandler";
 const char *PORTMAP_ROW_TEMPLATE = "<tr> <td>%s</td> <td>%hu</td> <td>%s</td> <td>%hu</td> <td> <form action='/portmap' method='POST'><input type='hidden' name='func' value='del'><input type='hidden' name='entry' value='%s'> <button title='Remove' name='remove' class='btn btn-light'> <svg version='2.0' width='16' height='16'> <use href='#trash' /> </svg> </form> </td></tr>";
@@ -22,74 +23,38 @@ esp_err_t portmap_get_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Requesting portmap page");
     httpd_req_to_sockfd(req);
 
-    // send first part
-    extern const unsigned char portmap_start[] asm("_binary_portmap_start_html_start");
-    ESP_LOGI(TAG, "Sending portmap start part");
-    ESP_ERROR_CHECK(httpd_resp_send_chunk(req, (const char *)portmap_start, HTTPD_RESP_USE_STRLEN));
+    extern const char portmap_start[] asm("_binary_portmap_start_html_start");
+    extern const char portmap_end_start[] asm("_binary_portmap_end_html_start");
+    template_out_t out;
+    template_begin(&out, req);
+    template_write(&out, portmap_start, strlen(portmap_start));
 
-    // send entries
-    bool entriesSent = false;
-    for (int i = 0; i < PORTMAP_MAX; i++)
+    for (int i = 0; i < portmap_count; i++)
     {
-        if (portmap_tab[i].valid)
-        {
-            char *protocol;
-            if (portmap_tab[i].proto == PROTO_TCP)
-            {
-                protocol = "TCP";
-            }
-            else
-            {
-                protocol = "UDP";
-            }
-            esp_ip4_addr_t addr;
-            addr.addr = portmap_tab[i].daddr;
-            char ip_str[16];
-            sprintf(ip_str, IPSTR, IP2STR(&addr));
-            char delParam[50];
-            sprintf(delParam, "%s_%hu_%s_%hu", protocol, portmap_tab[i].mport, ip_str, portmap_tab[i].dport);
-
-            char *template = malloc(strlen(PORTMAP_ROW_TEMPLATE) + 12 + strlen(ip_str) + strlen(protocol) + strlen(delParam));
-
-            sprintf(template, PORTMAP_ROW_TEMPLATE, protocol, portmap_tab[i].mport, ip_str, portmap_tab[i].dport, delParam);
-
-            ESP_LOGI(TAG, "Sending portmap entry part");
-            ESP_ERROR_CHECK(httpd_resp_send_chunk(req, template, HTTPD_RESP_USE_STRLEN));
-            entriesSent = true;
-            free(template);
-        }
+        const char *protocol = portmap_tab[i].proto == PROTO_TCP ? "TCP" : "UDP";
+        esp_ip4_addr_t addr;
+        addr.addr = portmap_tab[i].daddr;
+        char ip_str[16];
+        sprintf(ip_str, IPSTR, IP2STR(&addr));
+        char delParam[50];
+        sprintf(delParam, "%s_%hu_%s_%hu", protocol, portmap_tab[i].mport, ip_str, portmap_tab[i].dport);
+        template_printf(&out, PORTMAP_ROW_TEMPLATE, protocol, portmap_tab[i].mport, ip_str, portmap_tab[i].dport, delParam);
     }
-    if (!entriesSent)
+    if (portmap_count == 0)
     {
-        ESP_LOGI(TAG, "Sending no entry part");
-        const char *template = "<tr><td colspan='5' class='text-warning'>No portmap entries found</td></tr>";
-        ESP_ERROR_CHECK(httpd_resp_send_chunk(req, template, HTTPD_RESP_USE_STRLEN));
+        const char *row = "<tr><td colspan='5' class='text-warning'>No portmap entries found</td></tr>";
+        template_write(&out, row, strlen(row));
     }
 
-    // send end
-
-    extern const char portmap_end_start[] asm("_binary_portmap_end_html_start");
-    extern const char portmap_end[] asm("_binary_portmap_end_html_end");
-    const size_t portmap_html_size = (portmap_end - portmap_end_start);
-    char *defaultIP = getDefaultIPByNetmask();
-    char ip_prefix[strlen(defaultIP) - 1];
-    strncpy(ip_prefix, defaultIP, strlen(defaultIP) - 1); // Without the last part
-    ip_prefix[strlen(defaultIP) - 1] = '\0';
-    char *portmap_page = malloc(portmap_html_size + strlen(ip_prefix));
-    sprintf(portmap_page, portmap_end_start, ip_prefix);
-    ESP_LOGI(TAG, "Sending portmap end part");
-
-    ESP_ERROR_CHECK(httpd_resp_send_chunk(req, portmap_page, HTTPD_RESP_USE_STRLEN));
-
-    free(portmap_page);
-    free(defaultIP);
-
-    // Finalize
-    closeHeader(req);
-    esp_err_t ret = httpd_resp_send_chunk(req, NULL, 0);
-
-    ESP_LOGI(TAG, "Requesting portmap page");
-    return ret;
+    // The address of the AP without the last part
+    const char *defaultIP = getDefaultIPByNetmask();
+    char ip_prefix[16];
+    strlcpy(ip_prefix, defaultIP, MIN(sizeof(ip_prefix), strlen(defaultIP)));
+    const template_var_t vars[] = {
+        {.name = "ip_prefix", .value = ip_prefix},
+    };
+    template_render(&out, portmap_end_start, vars, sizeof(vars) / sizeof(vars[0]));
+    return template_finish(&out);
 }
 
 void addPortmapEntry(char *urlContent)
@@ -107,21 +72,19 @@ void addPortmapEntry(char *urlContent)
         tcp_udp = PROTO_UDP;
     }
     readUrlParameterIntoBuffer(urlContent, "eport", param, contentLength);
-    char *endptr;
-    uint16_t ext_port = (uint16_t)strtoul(param, &endptr, 10);
-    if (ext_port < 1 || *endptr != '\0')
+    uint16_t ext_port = parse_port(param);
+    if (ext_port == 0)
     {
         ESP_LOGW(TAG, "External port out of range");
         return;
     }
 
     readUrlParameterIntoBuffer(urlContent, "ip", param, contentLength);
-    char *defaultIP = getDefaultIPByNetmask();
+    const char *defaultIP = getDefaultIPByNetmask();
     char resultIP[strlen(defaultIP) + strlen(param)];
     strncpy(resultIP, defaultIP, strlen(defaultIP) - 1);
     resultIP[strlen(defaultIP) - 1] = '\0';
     strcat(resultIP, param);
-    free(defaultIP);
     uint32_t int_ip = ipaddr_addr(resultIP);
     if (int_ip == IPADDR_NONE)
     {
@@ -129,9 +92,8 @@ void addPortmapEntry(char *urlContent)
         return;
     }
     readUrlParameterIntoBuffer(urlContent, "iport", param, contentLength);
-    uint16_t int_port = (uint16_t)strtoul(param, &endptr, 10);
-
-    if (int_port < 1 || *endptr != '\0')
+    uint16_t int_port = parse_port(param);
+    if (int_port == 0)
     {
         ESP_LOGW(TAG, "Internal port out of range");
         return;
@@ -149,6 +111,11 @@ void delPortmapEntry(char *urlContent)
     const char delimiter[] = "_";
 
     char *token = strtok(param, delimiter);
+    if (token == NULL)
+    {
+        ESP_LOGW(TAG, "Missing portmap entry");
+        return;
+    }
     uint8_t tcp_udp;
     if (strcmp(token, "TCP") == 0)
     {
@@ -160,15 +127,14 @@ void delPortmapEntry(char *urlContent)
     }
 
     token = strtok(NULL, delimiter);
-    char *endptr;
-    uint16_t ext_port = (uint16_t)strtoul(token, &endptr, 10);
-    if (ext_port < 1 || *endptr != '\0')
+    uint16_t ext_port = parse_port(token);
+    if (ext_port == 0)
     {
         ESP_LOGW(TAG, "External port out of range");
         return;
     }
     token = strtok(NULL, delimiter);
-    uint32_t int_ip = ipaddr_addr(token);
+    uint32_t int_ip = token != NULL ? ipaddr_addr(token) : IPADDR_NONE;
     if (int_ip == IPADDR_NONE)
     {
         ESP_LOGW(TAG, "Invalid IP");
@@ -176,9 +142,8 @@ void delPortmapEntry(char *urlContent)
     }
 
     token = strtok(NULL, delimiter);
-    uint16_t int_port = (uint16_t)strtoul(token, &endptr, 10);
-
-    if (int_port < 1 || *endptr != '\0')
+    uint16_t int_port = parse_port(token);
+    if (int_port == 0)
     {
         ESP_LOGW(TAG, "Internal port out of range");
         return;
@@ -0,0 +1,71 @@
+#include "handler.h"
+#include "stats.h"
+
+static const char *TAG = "ProbeHandler";
+
+/* The connectivity checks of the operating systems. While the DNS server is
+   captive they are sent to the start page, afterwards they get the answer
+   the OS expects, so it doesn't show a login page. */
+typedef struct
+{
+    const char *uri;
+    const char *status;
+    const char *type;
+    const char *body;
+} captive_probe_t;
+
+#define APPLE_SUCCESS "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>"
+
+static const captive_probe_t PROBES[] = {
+    {"/generate_204", "204 No Content", "text/plain", ""}, // Android, Chrome OS
+    {"/gen_204", "204 No Content", "text/plain", ""},
+    {"/hotspot-detect.html", "200 OK", "text/html", APPLE_SUCCESS}, // iOS, macOS
+    {"/library/test/success.html", "200 OK", "text/html", APPLE_SUCCESS},
+    {"/connecttest.txt", "200 OK", "text/plain", "Microsoft Connect Test"}, // Windows
+    {"/ncsi.txt", "200 OK", "text/plain", "Microsoft NCSI"},
+    {"/canonical.html", "200 OK", "text/html", "<meta http-equiv=\"refresh\" content=\"0;url=https://support.mozilla.org/kb/captive-portal\"/>"}, // Firefox
+    {"/success.txt", "200 OK", "text/plain", "success\n"},
+};
+#define PROBE_COUNT (sizeof(PROBES) / sizeof(PROBES[0]))
+
+// Built once, the address of the AP only changes with a restart
+static char probe_location[32];
+
+static esp_err_t captive_probe_handler(httpd_req_t *req)
+{
+    const captive_probe_t *probe = req->user_ctx;
+    stats_inc(&stats_http.probes);
+    if (isDnsCaptive())
+    {
+        httpd_resp_set_status(req, "302 Temporary Redirect");
+        httpd_resp_set_hdr(req, "Location", probe_location);
+        return httpd_resp_send(req, NULL, 0);
+    }
+    httpd_resp_set_status(req, probe->status);
+    httpd_resp_set_type(req, probe->type);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, probe->body, HTTPD_RESP_USE_STRLEN);
+}
+
+size_t captive_probe_count(void)
+{
+    return PROBE_COUNT;
+}
+
+void captive_probe_register(httpd_handle_t server)
+{
+    snprintf(probe_location, sizeof(probe_location), "http://%s/", getDefaultIPByNetmask());
+    for (size_t i = 0; i < PROBE_COUNT; i++)
+    {
+        const httpd_uri_t uri = {
+            .uri = PROBES[i].uri,
+            .method = HTTP_GET,
+            .handler = captive_probe_handler,
+            .user_ctx = (void *)&PROBES[i],
+        };
+        if (httpd_register_uri_handler(server, &uri) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "Registering %s failed", PROBES[i].uri);
+        }
+    }
+}
@@ -1,28 +1,111 @@
 #include "handler.h"
+#include "scan.h"
+#include "json.h"
 #include "router_globals.h"
 
 static const char *TAG = "RestHandler";
 
-const char *JSON_TEMPLATE = "{\"clients\": %d,\"strength\": %s,\"text\": \"%s\"}";
-
+/* The info of the config page, the pages poll /api/v1/status now */
 esp_err_t rest_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    char db[5];
+    char *textColor = NULL;
+    fillInfoData(db, sizeof(db), &textColor);
+
+    json_writer_t w;
+    json_begin(&w, req, false);
+    json_object_begin(&w, NULL);
+    json_uint(&w, "clients", getConnectCount());
+    json_int(&w, "strength", atoi(db));
+    json_string(&w, "text", textColor);
+    json_object_end(&w);
+    return json_end(&w);
+}
+
+esp_err_t stats_get_handler(httpd_req_t *req)
 {
     if (isLocked())
     {
         return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
     }
     httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
 
-    char *db = NULL;
-    char *textColor = NULL;
-    fillInfoData(&db, &textColor);
-
-    size_t size = strlen(JSON_TEMPLATE) + 5 + strlen(db) + strlen(textColor);
-    char *json = malloc(size);
-    sprintf(json, JSON_TEMPLATE, getConnectCount(), db, textColor);
-    esp_err_t ret = httpd_resp_send(req, json, HTTPD_RESP_USE_STRLEN);
-    ESP_LOGD(TAG, "JSON-Response: %s", json);
-    free(json);
-    free(db);
-    return ret;
-}
\ No newline at end of file
+    char *json = req_arena_alloc(req, STATS_JSON_MAX_LEN);
+    if (json == NULL)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+    size_t len = stats_format_json(json, STATS_JSON_MAX_LEN);
+    return httpd_resp_send(req, json, len);
+}
+static const char *scanStateName(scan_state_t state)
+{
+    switch (state)
+    {
+    case SCAN_RUNNING:
+        return "running";
+    case SCAN_DONE:
+        return "done";
+    case SCAN_FAILED:
+        return "failed";
+    default:
+        return "idle";
+    }
+}
+
+esp_err_t scan_api_get_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    scan_record_t *records = req_arena_alloc(req, DEFAULT_SCAN_LIST_SIZE * sizeof(scan_record_t));
+    if (records == NULL)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+    scan_state_t state;
+    int64_t age_ms;
+    size_t count = scan_get_results(records, DEFAULT_SCAN_LIST_SIZE, &state, &age_ms);
+
+    json_writer_t w;
+    json_begin(&w, req, false);
+    json_object_begin(&w, NULL);
+    json_string(&w, "state", scanStateName(state));
+    json_int(&w, "age_ms", age_ms);
+    json_array_begin(&w, "networks");
+    for (size_t i = 0; i < count; i++)
+    {
+        json_object_begin(&w, NULL);
+        json_string(&w, "ssid", records[i].ssid);
+        json_int(&w, "rssi", records[i].rssi);
+        json_uint(&w, "channel", records[i].channel);
+        json_uint(&w, "auth", records[i].authmode);
+        json_object_end(&w);
+    }
+    json_array_end(&w);
+    json_object_end(&w);
+    return json_end(&w);
+}
+
+esp_err_t scan_api_post_handler(httpd_req_t *req)
+{
+    if (isLocked())
+    {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, NULL);
+    }
+    esp_err_t err = scan_start();
+    if (err != ESP_OK)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+    }
+    ESP_LOGI(TAG, "Scan started");
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, "{\"state\":\"running\"}");
+}
@@ -1,15 +1,10 @@
 #include "handler.h"
+#include "scan.h"
 
-#include <esp_wifi.h>
-
-#include "nvs.h"
-#include "cmd_nvs.h"
 #include "router_globals.h"
 
 static const char *TAG = "ResultHandler";
 
-const char *ROW_TEMPLATE = "<tr><td class='text-%s'>%s</td><td class='text-%s'>%s</td><td><form action='/' method='POST'><input type='hidden' name='ssid' value='%s'><input type='submit' value='Use' name='use' class='btn btn-primary'/></form></td></tr>";
-
 char *findTextColorForSSID(int8_t rssi)
 {
     char *color;
@@ -28,6 +23,63 @@ char *findTextColorForSSID(int8_t rssi)
     return color;
 }
 
+// SSIDs can contain any character
+static void writeEscaped(template_out_t *out, const char *text)
+{
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        switch (*c)
+        {
+        case '&':
+            template_write(out, "&amp;", 5);
+            break;
+        case '<':
+            template_write(out, "&lt;", 4);
+            break;
+        case '>':
+            template_write(out, "&gt;", 4);
+            break;
+        case '\'':
+            template_write(out, "&#39;", 5);
+            break;
+        case '"':
+            template_write(out, "&quot;", 6);
+            break;
+        default:
+            template_write(out, c, 1);
+        }
+    }
+}
+
+typedef struct
+{
+    scan_record_t *records;
+    size_t count;
+    scan_state_t state;
+} scan_rows_t;
+
+static void writeResultRows(template_out_t *out, void *arg)
+{
+    scan_rows_t *rows = (scan_rows_t *)arg;
+    if (rows->count == 0)
+    {
+        const char *row = rows->state == SCAN_RUNNING ? "<tr><td colspan='3'>Scanning...</td></tr>" : "<tr><td colspan='3' class='text-danger'>No networks found</td></tr>";
+        template_write(out, row, strlen(row));
+        return;
+    }
+    for (size_t i = 0; i < rows->count; i++)
+    {
+        scan_record_t *record = &rows->records[i];
+        char *css = findTextColorForSSID(record->rssi);
+        template_printf(out, "<tr><td class='text-%s'>", css);
+        writeEscaped(out, record->ssid);
+        template_printf(out, "</td><td class='text-%s'>%d</td><td><form action='/' method='POST'><input type='hidden' name='ssid' value='", css, record->rssi);
+        writeEscaped(out, record->ssid);
+        const char *end = "'><input type='submit' value='Use' name='use' class='btn btn-primary'/></form></td></tr>";
+        template_write(out, end, strlen(end));
+    }
+}
+
 esp_err_t result_download_get_handler(httpd_req_t *req)
 {
     if (isLocked())
@@ -38,57 +90,43 @@ esp_err_t result_download_get_handler(httpd_req_t *req)
     httpd_req_to_sockfd(req);
 
     extern const char result_start[] asm("_binary_result_html_start");
-    extern const char result_end[] asm("_binary_result_html_end");
-    const size_t result_html_size = (result_end - result_start);
 
-    char *result_param = NULL;
-    int allocatedSize = (strlen(ROW_TEMPLATE) + 100) * DEFAULT_SCAN_LIST_SIZE;
+    scan_record_t *records = req_arena_alloc(req, DEFAULT_SCAN_LIST_SIZE * sizeof(scan_record_t));
+    if (records == NULL)
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    }
+    int64_t age_ms;
+    scan_rows_t rows = {.records = records};
+    rows.count = scan_get_results(records, DEFAULT_SCAN_LIST_SIZE, &rows.state, &age_ms);
 
-    char result[allocatedSize];
-    strcpy(result, "");
-    get_config_param_str("scan_result", &result_param);
-    if (result_param == NULL)
+    char status[48];
+    const char *statusColor = "muted";
+    if (rows.state == SCAN_RUNNING)
+    {
+        strcpy(status, "Scanning, the page is updated automatically");
+    }
+    else if (rows.state == SCAN_FAILED)
     {
-        strcat(result, "<tr><td colspan='3' class='text-danger'>No networks found</td></tr>");
+        strcpy(status, "The scan failed");
+        statusColor = "danger";
+    }
+    else if (age_ms >= 0)
+    {
+        snprintf(status, sizeof(status), "Scanned %lld s ago", age_ms / 1000);
     }
     else
     {
-        char *end_str;
-        char *row = strtok_r(result_param, "\x05", &end_str);
-        while (row != NULL)
-        {
-            char *template = malloc(strlen(ROW_TEMPLATE) + 100);
-            char *ssid = strtok(row, "\x03");
-            char *rssi = strtok(NULL, "\x03");
-
-            char *css = findTextColorForSSID(atoi(rssi));
-            sprintf(template, ROW_TEMPLATE, css, ssid, css, rssi, ssid);
-            strcat(result, template);
-
-            row = strtok_r(NULL, "\x05", &end_str);
-
-            free(template);
-        }
+        strcpy(status, "");
     }
 
-    int size = result_html_size + strlen(result);
-    char *result_page = malloc(size + 1);
-    sprintf(result_page, result_start, result);
-
-    closeHeader(req);
-
-    esp_err_t ret = httpd_resp_send(req, result_page, HTTPD_RESP_USE_STRLEN);
-    ESP_LOGI(TAG, "Requesting result page with  %d additional bytes", strlen(result_page));
-
-    free(result_page);
-    nvs_handle_t nvs;
-    nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
-    int32_t result_shown = 0;
-    get_config_param_int("result_shown", &result_shown);
-    nvs_set_i32(nvs, "result_shown", ++result_shown);
-    ESP_LOGI(TAG, "Result shown %ld times", result_shown);
-
-    nvs_commit(nvs);
-    nvs_close(nvs);
+    template_var_t vars[] = {
+        {.name = "refresh", .value = rows.state == SCAN_RUNNING ? "<meta http-equiv=refresh content=2>" : ""},
+        {.name = "status", .value = status},
+        {.name = "status_color", .value = statusColor},
+        {.name = "rows", .cb = writeResultRows, .arg = &rows},
+    };
+    ESP_LOGI(TAG, "Requesting result page with %d networks", rows.count);
+    esp_err_t ret = template_send(req, result_start, vars, sizeof(vars) / sizeof(vars[0]));
     return ret;
-}
\ No newline at end of file
+}
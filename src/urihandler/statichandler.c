@@ -2,63 +2,158 @@
 
 static const char *TAG_HANDLER = "LockHandler";
 
-void closeHeader(httpd_req_t *req)
+extern const uint8_t styles_start[] asm("_binary_styles_67aa3b0203355627b525be2ea57be7bf_css_start");
+extern const uint8_t styles_end[] asm("_binary_styles_67aa3b0203355627b525be2ea57be7bf_css_end");
+extern const uint8_t styles_gz_start[] asm("_binary_styles_67aa3b0203355627b525be2ea57be7bf_css_gz_start");
+extern const uint8_t styles_gz_end[] asm("_binary_styles_67aa3b0203355627b525be2ea57be7bf_css_gz_end");
+extern const uint8_t jquery_js_start[] asm("_binary_jquery_8a1045d9cbf50b52a0805c111ba08e94_js_start");
+extern const uint8_t jquery_js_end[] asm("_binary_jquery_8a1045d9cbf50b52a0805c111ba08e94_js_end");
+extern const uint8_t jquery_js_gz_start[] asm("_binary_jquery_8a1045d9cbf50b52a0805c111ba08e94_js_gz_start");
+extern const uint8_t jquery_js_gz_end[] asm("_binary_jquery_8a1045d9cbf50b52a0805c111ba08e94_js_gz_end");
+extern const uint8_t favicon_ico_start[] asm("_binary_favicon_ico_start");
+extern const uint8_t favicon_ico_end[] asm("_binary_favicon_ico_end");
+extern const uint8_t favicon_ico_gz_start[] asm("_binary_favicon_ico_gz_start");
+extern const uint8_t favicon_ico_gz_end[] asm("_binary_favicon_ico_gz_end");
+
+#define ASSET_HDR_MAX_LEN 128
+
+typedef struct
+{
+    const char *type;
+    const uint8_t *start;
+    size_t len;
+    const uint8_t *gz_start;
+    size_t gz_len;
+    char etag[12];    // "<fnv1a of the content>", calculated on first request
+    char etag_gz[15]; // "<fnv1a>-gz", the compressed variant is a different representation
+} static_asset_t;
+
+static static_asset_t styles_asset = {.type = "text/css"};
+static static_asset_t jquery_asset = {.type = "text/javascript"};
+static static_asset_t favicon_asset = {.type = "image/x-icon"};
+
+static void initAsset(static_asset_t *asset, const uint8_t *start, size_t len, const uint8_t *gz_start, const uint8_t *gz_end)
+{
+    if (asset->start != NULL)
+    {
+        return;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ start[i]) * 16777619u;
+    }
+    sprintf(asset->etag, "\"%08lx\"", (unsigned long)hash);
+    sprintf(asset->etag_gz, "\"%08lx-gz\"", (unsigned long)hash);
+    asset->len = len;
+    asset->gz_start = gz_start;
+    asset->gz_len = gz_end - gz_start;
+    asset->start = start;
+}
+
+// True if the Accept-Encoding header lists gzip (or *) without q=0
+static bool acceptsGzip(httpd_req_t *req)
+{
+    char value[ASSET_HDR_MAX_LEN];
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, sizeof(value));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC)
+    {
+        return false;
+    }
+    char *save = NULL;
+    for (char *token = strtok_r(value, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        while (*token == ' ')
+        {
+            token++;
+        }
+        size_t nameLen = strcspn(token, " ;");
+        if ((nameLen == 4 && strncasecmp(token, "gzip", 4) == 0) || (nameLen == 1 && *token == '*'))
+        {
+            char *q = strstr(token + nameLen, "q=");
+            return q == NULL || strtod(q + 2, NULL) > 0;
+        }
+    }
+    return false;
+}
+
+static bool etagMatches(httpd_req_t *req, const char *etag)
 {
-    httpd_resp_set_hdr(req, "Connection", "close");
+    char value[ASSET_HDR_MAX_LEN];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK)
+    {
+        return false;
+    }
+    return strstr(value, etag) != NULL || strcmp(value, "*") == 0;
 }
 
-esp_err_t download(httpd_req_t *req, const char *fileStart)
+/*
+    Sends an embedded asset with its known length. The compressed variant is used if
+    the browser accepts it, a cached copy is confirmed with 304 Not Modified.
+*/
+static esp_err_t sendAsset(httpd_req_t *req, static_asset_t *asset)
 {
+    bool gzip = acceptsGzip(req);
+    const char *etag = gzip ? asset->etag_gz : asset->etag;
+
+    httpd_resp_set_type(req, asset->type);
     httpd_resp_set_hdr(req, "Cache-Control", "max-age=31536000");
-    closeHeader(req);
-    return httpd_resp_send(req, fileStart, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    httpd_resp_set_hdr(req, "ETag", etag);
+
+    if (etagMatches(req, etag))
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    if (gzip)
+    {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        return httpd_resp_send(req, (const char *)asset->gz_start, asset->gz_len);
+    }
+    return httpd_resp_send(req, (const char *)asset->start, asset->len);
 }
 
 esp_err_t styles_download_get_handler(httpd_req_t *req)
 {
-    extern const unsigned char styles_start[] asm("_binary_styles_67aa3b0203355627b525be2ea57be7bf_css_start");
-    httpd_resp_set_type(req, "text/css");
     ESP_LOGD(TAG_HANDLER, "Requesting style");
-    return download(req, (const char *)styles_start);
+    // The text files are embedded with a terminating 0, which isn't sent
+    initAsset(&styles_asset, styles_start, styles_end - styles_start - 1, styles_gz_start, styles_gz_end);
+    return sendAsset(req, &styles_asset);
 }
 
 esp_err_t jquery_get_handler(httpd_req_t *req)
 {
-    extern const unsigned char jquery_js_start[] asm("_binary_jquery_8a1045d9cbf50b52a0805c111ba08e94_js_start");
-    httpd_resp_set_type(req, "text/javascript");
     ESP_LOGD(TAG_HANDLER, "Requesting jquery");
-    return download(req, (const char *)jquery_js_start);
+    initAsset(&jquery_asset, jquery_js_start, jquery_js_end - jquery_js_start - 1, jquery_js_gz_start, jquery_js_gz_end);
+    return sendAsset(req, &jquery_asset);
 }
 
 // Handler to download a "favicon.ico" file kept on the server
 esp_err_t favicon_get_handler(httpd_req_t *req)
 {
-    extern const char favicon_ico_start[] asm("_binary_favicon_ico_start");
-    extern const char favicon_ico_end[] asm("_binary_favicon_ico_end");
-    const size_t favicon_ico_size = (favicon_ico_end - favicon_ico_start);
-    httpd_resp_set_type(req, "image/x-icon");
     ESP_LOGD(TAG_HANDLER, "Requesting favicon");
-    closeHeader(req);
-    return httpd_resp_send(req, favicon_ico_start, favicon_ico_size);
+    initAsset(&favicon_asset, favicon_ico_start, favicon_ico_end - favicon_ico_start, favicon_ico_gz_start, favicon_ico_gz_end);
+    return sendAsset(req, &favicon_asset);
 }
 
 esp_err_t redirectToRoot(httpd_req_t *req)
 {
     httpd_resp_set_status(req, "302 Temporary Redirect");
-    char *currentIP = getDefaultIPByNetmask();
-    char str[strlen("http://") + strlen(currentIP)];
-    strcpy(str, "http://");
-    strcat(str, currentIP);
-    httpd_resp_set_hdr(req, "Location", str);
-    httpd_resp_set_hdr(req, "Connection", "Close");
+    char location[32];
+    snprintf(location, sizeof(location), "http://%s", getDefaultIPByNetmask());
+    httpd_resp_set_hdr(req, "Location", location);
     httpd_resp_send(req, "", HTTPD_RESP_USE_STRLEN);
-    free(currentIP);
 
     return ESP_OK;
 }
 
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
 {
+    if (isDnsCaptive())
+    {
+        return redirectToRoot(req); // one redirect less for unknown captive portal checks
+    }
 
     httpd_resp_set_status(req, "302 Temporary Redirect");
     httpd_resp_set_hdr(req, "Location", "/");
@@ -70,8 +165,6 @@ esp_err_t reset_get_handler(httpd_req_t *req)
     httpd_req_to_sockfd(req);
     extern const char reset_start[] asm("_binary_reset_html_start");
 
-    closeHeader(req);
-
     esp_err_t ret = httpd_resp_send(req, reset_start, HTTPD_RESP_USE_STRLEN);
     return ret;
 }
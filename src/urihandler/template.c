@@ -0,0 +1,133 @@
+#include "template.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+
+static const char *TAG = "Template";
+
+#define TEMPLATE_NAME_MAX_LEN 32
+
+static void flush(template_out_t *out)
+{
+    if (out->len > 0 && out->err == ESP_OK)
+    {
+        out->err = httpd_resp_send_chunk(out->req, out->buf, out->len);
+    }
+    out->len = 0;
+}
+
+void template_write(template_out_t *out, const char *data, size_t len)
+{
+    if (len > sizeof(out->buf) - out->len)
+    {
+        flush(out);
+        // Large parts are sent directly instead of being copied through the buffer
+        if (len >= sizeof(out->buf))
+        {
+            if (out->err == ESP_OK)
+            {
+                out->err = httpd_resp_send_chunk(out->req, data, len);
+            }
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+void template_printf(template_out_t *out, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, args);
+    va_end(args);
+    if (n < 0)
+    {
+        return;
+    }
+    if ((size_t)n < sizeof(out->buf) - out->len)
+    {
+        out->len += n;
+        return;
+    }
+    // Didn't fit, retry with an empty buffer
+    flush(out);
+    va_start(args, fmt);
+    n = vsnprintf(out->buf, sizeof(out->buf), fmt, args);
+    va_end(args);
+    out->len = MIN((size_t)n, sizeof(out->buf) - 1);
+}
+
+static void write_var(template_out_t *out, const char *name, size_t name_len, const template_var_t *vars, size_t var_count)
+{
+    for (size_t i = 0; i < var_count; i++)
+    {
+        if (strlen(vars[i].name) == name_len && strncmp(vars[i].name, name, name_len) == 0)
+        {
+            if (vars[i].cb != NULL)
+            {
+                vars[i].cb(out, vars[i].arg);
+            }
+            else if (vars[i].value != NULL)
+            {
+                template_write(out, vars[i].value, strlen(vars[i].value));
+            }
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "No value for placeholder '%.*s'", (int)name_len, name);
+}
+
+void template_begin(template_out_t *out, httpd_req_t *req)
+{
+    out->req = req;
+    out->len = 0;
+    out->err = ESP_OK;
+}
+
+esp_err_t template_finish(template_out_t *out)
+{
+    flush(out);
+    if (out->err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Sending page failed: %s", esp_err_to_name(out->err));
+        return out->err;
+    }
+    return httpd_resp_send_chunk(out->req, NULL, 0);
+}
+
+void template_render(template_out_t *out, const char *page, const template_var_t *vars, size_t var_count)
+{
+    const char *pos = page;
+
+    while (*pos != '\0' && out->err == ESP_OK)
+    {
+        const char *start = strstr(pos, "{{");
+        const char *end = start != NULL ? strstr(start + 2, "}}") : NULL;
+        if (start == NULL || end == NULL || end - start - 2 > TEMPLATE_NAME_MAX_LEN)
+        {
+            if (start != NULL && end != NULL)
+            {
+                // Not a placeholder, keep the braces
+                template_write(out, pos, start + 2 - pos);
+                pos = start + 2;
+                continue;
+            }
+            template_write(out, pos, strlen(pos));
+            break;
+        }
+        template_write(out, pos, start - pos);
+        write_var(out, start + 2, end - start - 2, vars, var_count);
+        pos = end + 2;
+    }
+}
+
+esp_err_t template_send(httpd_req_t *req, const char *page, const template_var_t *vars, size_t var_count)
+{
+    template_out_t out;
+    template_begin(&out, req);
+    template_render(&out, page, vars, var_count);
+    return template_finish(&out);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <esp_http_server.h>
+
+/* Size of the buffer, which collects the output before it is sent as chunk */
+#define TEMPLATE_CHUNK_SIZE 1024
+
+typedef struct
+{
+    httpd_req_t *req;
+    size_t len;
+    esp_err_t err;
+    char buf[TEMPLATE_CHUNK_SIZE];
+} template_out_t;
+
+typedef void (*template_cb_t)(template_out_t *out, void *arg);
+
+/* Value of a {{name}} placeholder. If cb is set, it writes the value itself. */
+typedef struct
+{
+    const char *name;
+    const char *value;
+    template_cb_t cb;
+    void *arg;
+} template_var_t;
+
+/* For responses written piece by piece, i.e. JSON: template_begin, the writes and template_finish */
+void template_begin(template_out_t *out, httpd_req_t *req);
+/* Sends the rest of the buffer and ends the chunked response */
+esp_err_t template_finish(template_out_t *out);
+
+void template_write(template_out_t *out, const char *data, size_t len);
+void template_printf(template_out_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Writes the page with the placeholders replaced, for pages made of several parts */
+void template_render(template_out_t *out, const char *page, const template_var_t *vars, size_t var_count);
+
+/**
+ * @brief Sends the embedded page as chunked response and replaces every {{name}} with the value of vars.
+ * The memory needed doesn't depend on the size of the page or the values.
+ */
+esp_err_t template_send(httpd_req_t *req, const char *page, const template_var_t *vars, size_t var_count);
@@ -0,0 +1,37 @@
+#include <ctype.h>
+
+#include "urldecode.h"
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    return toupper((unsigned char)c) - 'A' + 10;
+}
+
+size_t url_decode(char *str)
+{
+    char *p, *q;
+
+    for (p = q = str; *p != '\0'; p++)
+    {
+        // isxdigit is false for the terminating 0, p[2] is only read if p[1] isn't the end
+        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]))
+        {
+            *q++ = (char)((hexValue(p[1]) << 4) | hexValue(p[2]));
+            p += 2;
+        }
+        else if (*p == '+')
+        {
+            *q++ = ' ';
+        }
+        else
+        {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+    return q - str;
+}
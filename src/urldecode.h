@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Decodes %XX escapes and '+' of a form value in place and returns the
+   decoded length. A '%' which isn't followed by two hex digits is kept as it
+   is. Only depends on the C library, so it can be built for the host. */
+size_t url_decode(char *str);
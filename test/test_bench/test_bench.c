@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+
+#include "dnsparse.h"
+#include "portparse.h"
+#include "urldecode.h"
+
+/* Throughput of the parsers on the host. The numbers only compare builds on the
+   same machine, e.g. before and after a change of a parser, there are no limits. */
+
+#define BENCH_ROUNDS (1000000)
+
+static volatile size_t bench_sink; // keeps the compiler from dropping the work
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double seconds, double count, const char *unit)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%s: %.2f %s/s", name, count / seconds, unit);
+    TEST_MESSAGE(line);
+}
+
+// A query of a client with the EDNS record, as the proxy forwards it
+static size_t buildQuery(uint8_t *msg)
+{
+    static const uint8_t query[] = {
+        0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        17, 'c', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'v', 'i', 't', 'y', 'c', 'h', 'e', 'c', 'k',
+        7, 'g', 's', 't', 'a', 't', 'i', 'c', 3, 'c', 'o', 'm', 0, 0x00, 0x01, 0x00, 0x01,
+        0x00, 0x00, 0x29, 0x10, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00};
+    memcpy(msg, query, sizeof(query));
+    return sizeof(query);
+}
+
+// An answer with four A records, as it is stored in the cache
+static size_t buildResponse(uint8_t *msg, size_t *qlen)
+{
+    static const uint8_t head[] = {
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+        3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0x00, 0x01, 0x00, 0x01};
+    static const uint8_t answer[] = {0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x00, 0x04, 93, 184, 216, 34};
+    size_t len = sizeof(head);
+    memcpy(msg, head, len);
+    for (int i = 0; i < 4; i++)
+    {
+        memcpy(msg + len, answer, sizeof(answer));
+        len += sizeof(answer);
+    }
+    *qlen = sizeof(head) - sizeof(dns_header_t);
+    return len;
+}
+
+static void test_bench_dns_query(void)
+{
+    uint8_t msg[512];
+    size_t len = buildQuery(msg);
+    TEST_ASSERT_NOT_EQUAL(0, dns_question_len(msg, len));
+
+    double start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        // what the proxy parses of every query before the cache lookup and forwarding
+        msg[len - 8] = 0x10; // 4096 again
+        bench_sink += dns_question_len(msg, len);
+        bench_sink += dns_clamp_udp_size(msg, len, 1232);
+    }
+    report("DNS queries", now() - start, BENCH_ROUNDS, "queries");
+}
+
+static void test_bench_dns_cache_hit(void)
+{
+    uint8_t msg[512];
+    size_t qlen;
+    size_t len = buildResponse(msg, &qlen);
+    TEST_ASSERT_EQUAL_UINT(qlen, dns_question_len(msg, len));
+    TEST_ASSERT_EQUAL_UINT32(300, dns_walk_ttls(msg, len, qlen, 0));
+
+    double start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        // the TTLs are read when an answer is stored and lowered for every hit
+        bench_sink += dns_walk_ttls(msg, len, qlen, 0);
+        bench_sink += dns_walk_ttls(msg, len, qlen, 1);
+    }
+    report("DNS cached answers", now() - start, BENCH_ROUNDS, "answers");
+}
+
+static void test_bench_url_decode(void)
+{
+    // a form value with escapes, spaces and plain text, e.g. a password
+    static const char value[] = "My+WiFi%20P%40ssw%C3%B6rd%21+with+some+plain+text+%26+more";
+    static char buf[(sizeof(value) - 1) * 1024 + 1];
+    size_t input_len = sizeof(buf) - 1;
+
+    double seconds = 0;
+    int rounds = 0;
+    while (seconds < 0.5)
+    {
+        for (size_t i = 0; i < input_len; i += sizeof(value) - 1)
+        {
+            memcpy(buf + i, value, sizeof(value) - 1);
+        }
+        buf[input_len] = '\0';
+        double start = now();
+        bench_sink += url_decode(buf);
+        seconds += now() - start;
+        rounds++;
+    }
+    report("URL decode", seconds, (double)input_len * rounds / (1024 * 1024), "MB");
+}
+
+static void test_bench_parse_port(void)
+{
+    static const char *ports[] = {"80", "443", "8080", "65535", "65536", "22x", ""};
+    const int count = sizeof(ports) / sizeof(ports[0]);
+
+    double start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        bench_sink += parse_port(ports[i % count]);
+    }
+    report("Port parsing", now() - start, BENCH_ROUNDS, "ports");
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bench_dns_query);
+    RUN_TEST(test_bench_dns_cache_hit);
+    RUN_TEST(test_bench_url_decode);
+    RUN_TEST(test_bench_parse_port);
+    return UNITY_END();
+}
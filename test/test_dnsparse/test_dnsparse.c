@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "dnsparse.h"
+
+#define HEADER_LEN (sizeof(dns_header_t))
+#define FUZZ_ROUNDS (200000)
+
+typedef struct
+{
+    uint8_t data[1500];
+    size_t len;
+} msg_t;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void put8(msg_t *m, uint8_t value)
+{
+    TEST_ASSERT_LESS_THAN_UINT(sizeof(m->data), m->len);
+    m->data[m->len++] = value;
+}
+
+static void put16(msg_t *m, uint16_t value)
+{
+    put8(m, value >> 8);
+    put8(m, value & 0xFF);
+}
+
+static void put32(msg_t *m, uint32_t value)
+{
+    put16(m, value >> 16);
+    put16(m, value & 0xFFFF);
+}
+
+// Writes a dotted name as labels with the root label at the end
+static void putName(msg_t *m, const char *name)
+{
+    while (*name != '\0')
+    {
+        const char *dot = strchr(name, '.');
+        size_t label_len = dot != NULL ? (size_t)(dot - name) : strlen(name);
+        put8(m, label_len);
+        for (size_t i = 0; i < label_len; i++)
+        {
+            put8(m, name[i]);
+        }
+        name += label_len + (dot != NULL ? 1 : 0);
+    }
+    put8(m, 0);
+}
+
+static void putLabel(msg_t *m, size_t len)
+{
+    put8(m, len);
+    for (size_t i = 0; i < len; i++)
+    {
+        put8(m, 'a');
+    }
+}
+
+static void putHeader(msg_t *m, uint16_t qd, uint16_t an, uint16_t ns, uint16_t ar)
+{
+    m->len = 0;
+    put16(m, 0x1234);
+    put16(m, 0x0100);
+    put16(m, qd);
+    put16(m, an);
+    put16(m, ns);
+    put16(m, ar);
+}
+
+static void putQuestion(msg_t *m, const char *name)
+{
+    putName(m, name);
+    put16(m, 1);
+    put16(m, 1);
+}
+
+// A record with a compression pointer to the question
+static void putA(msg_t *m, uint32_t ttl)
+{
+    put16(m, 0xC000 | HEADER_LEN);
+    put16(m, 1);
+    put16(m, 1);
+    put32(m, ttl);
+    put16(m, 4);
+    put32(m, 0x01020304);
+}
+
+static void putOpt(msg_t *m, uint16_t udp_size)
+{
+    put8(m, 0);
+    put16(m, QD_TYPE_OPT);
+    put16(m, udp_size);
+    put32(m, 0x00008000); // DO bit
+    put16(m, 0);
+}
+
+static uint32_t ttlAt(const msg_t *m, size_t off)
+{
+    const uint8_t *p = m->data + off;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* The parsers get a copy of exactly len bytes, so the sanitizer catches
+   every read past the end of the message */
+static uint8_t *exactCopy(const uint8_t *data, size_t len)
+{
+    uint8_t *copy = malloc(len > 0 ? len : 1);
+    TEST_ASSERT_NOT_NULL(copy);
+    memcpy(copy, data, len);
+    return copy;
+}
+
+static void test_skip_name(void)
+{
+    msg_t m = {0};
+    putName(&m, "www.example.com");
+    TEST_ASSERT_EQUAL_UINT(17, m.len);
+    TEST_ASSERT_EQUAL_UINT(m.len, dns_skip_name(m.data, m.len, 0));
+    // the root name
+    TEST_ASSERT_EQUAL_UINT(1, dns_skip_name((const uint8_t *)"", 1, 0));
+}
+
+static void test_skip_name_without_end(void)
+{
+    msg_t m = {0};
+    putName(&m, "www.example.com");
+    // the root label is missing
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len - 1, 0));
+    // the label is longer than the message
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, 3, 0));
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len, m.len));
+}
+
+static void test_skip_name_label_limit(void)
+{
+    msg_t m = {0};
+    putLabel(&m, DNS_MAX_LABEL_LEN);
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(m.len, dns_skip_name(m.data, m.len, 0));
+
+    // 64 is the reserved label type 0x40
+    m.len = 0;
+    putLabel(&m, DNS_MAX_LABEL_LEN + 1);
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len, 0));
+
+    m.len = 0;
+    put8(&m, 0x80);
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len, 0));
+}
+
+static void test_skip_name_length_limit(void)
+{
+    // 3 * 64 + 62 + the root label = 255 bytes
+    msg_t m = {0};
+    putLabel(&m, 63);
+    putLabel(&m, 63);
+    putLabel(&m, 63);
+    putLabel(&m, 61);
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(DNS_MAX_NAME_LEN, m.len);
+    TEST_ASSERT_EQUAL_UINT(m.len, dns_skip_name(m.data, m.len, 0));
+
+    // 256 bytes
+    m.len = 0;
+    putLabel(&m, 63);
+    putLabel(&m, 63);
+    putLabel(&m, 63);
+    putLabel(&m, 62);
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(DNS_MAX_NAME_LEN + 1, m.len);
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len, 0));
+
+    // many short labels
+    m.len = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        putLabel(&m, 1);
+    }
+    put8(&m, 0);
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(m.data, m.len, 0));
+}
+
+static void test_skip_name_pointer(void)
+{
+    msg_t m = {0};
+    putLabel(&m, 3);
+    put16(&m, 0xC00C);
+    TEST_ASSERT_EQUAL_UINT(m.len, dns_skip_name(m.data, m.len, 0));
+
+    // the second byte of the pointer is behind the end of the message
+    uint8_t *copy = exactCopy(m.data, m.len - 1);
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(copy, m.len - 1, 0));
+    free(copy);
+
+    // a pointer as last byte of a message without a name before
+    const uint8_t last[] = {0xC0};
+    copy = exactCopy(last, sizeof(last));
+    TEST_ASSERT_EQUAL_UINT(0, dns_skip_name(copy, sizeof(last), 0));
+    free(copy);
+}
+
+static void test_question_len(void)
+{
+    msg_t m = {0};
+    putHeader(&m, 1, 0, 0, 1);
+    putQuestion(&m, "example.com");
+    putOpt(&m, 4096);
+    TEST_ASSERT_EQUAL_UINT(13 + 4, dns_question_len(m.data, m.len));
+
+    // the type and class are cut off
+    TEST_ASSERT_EQUAL_UINT(0, dns_question_len(m.data, HEADER_LEN + 13 + 3));
+    TEST_ASSERT_EQUAL_UINT(0, dns_question_len(m.data, HEADER_LEN - 1));
+
+    // only messages with one question are cached
+    putHeader(&m, 2, 0, 0, 0);
+    putQuestion(&m, "example.com");
+    putQuestion(&m, "example.org");
+    TEST_ASSERT_EQUAL_UINT(0, dns_question_len(m.data, m.len));
+    putHeader(&m, 0, 0, 0, 0);
+    TEST_ASSERT_EQUAL_UINT(0, dns_question_len(m.data, m.len));
+}
+
+static void test_walk_ttls(void)
+{
+    msg_t m = {0};
+    putHeader(&m, 1, 2, 0, 1);
+    putQuestion(&m, "example.com");
+    size_t qlen = m.len - HEADER_LEN;
+    size_t first_ttl = m.len + 6;
+    putA(&m, 300);
+    size_t second_ttl = m.len + 6;
+    putA(&m, 60);
+    putOpt(&m, 1232);
+    TEST_ASSERT_EQUAL_UINT(qlen, dns_question_len(m.data, m.len));
+
+    // the flags of the OPT record are no TTL
+    TEST_ASSERT_EQUAL_UINT32(60, dns_walk_ttls(m.data, m.len, qlen, 0));
+
+    TEST_ASSERT_NOT_EQUAL(UINT32_MAX, dns_walk_ttls(m.data, m.len, qlen, 100));
+    TEST_ASSERT_EQUAL_UINT32(200, ttlAt(&m, first_ttl));
+    TEST_ASSERT_EQUAL_UINT32(0, ttlAt(&m, second_ttl));
+    TEST_ASSERT_EQUAL_UINT32(0x00008000, ttlAt(&m, m.len - 6));
+}
+
+static void test_walk_ttls_limits(void)
+{
+    msg_t m = {0};
+    putHeader(&m, 1, 1, 0, 0);
+    putQuestion(&m, "example.com");
+    size_t qlen = m.len - HEADER_LEN;
+    putA(&m, 7 * 24 * 3600);
+    TEST_ASSERT_EQUAL_UINT32(DNS_CACHE_MAX_TTL_SEC, dns_walk_ttls(m.data, m.len, qlen, 0));
+
+    // a negative answer without SOA
+    putHeader(&m, 1, 0, 0, 0);
+    putQuestion(&m, "example.com");
+    TEST_ASSERT_EQUAL_UINT32(DNS_CACHE_NEGATIVE_TTL_SEC, dns_walk_ttls(m.data, m.len, qlen, 0));
+}
+
+static void test_walk_ttls_malformed(void)
+{
+    msg_t m = {0};
+    putHeader(&m, 1, 2, 0, 0);
+    putQuestion(&m, "example.com");
+    size_t qlen = m.len - HEADER_LEN;
+    putA(&m, 300);
+    putA(&m, 300);
+
+    // the data of the last record is cut off
+    uint8_t *copy = exactCopy(m.data, m.len - 1);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, dns_walk_ttls(copy, m.len - 1, qlen, 0));
+    free(copy);
+    // the fixed part of the last record is cut off
+    copy = exactCopy(m.data, m.len - 8);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, dns_walk_ttls(copy, m.len - 8, qlen, 0));
+    free(copy);
+    // the last record ends with the first byte of its pointer
+    size_t pointer_end = m.len - 15;
+    copy = exactCopy(m.data, pointer_end);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, dns_walk_ttls(copy, pointer_end, qlen, 0));
+    free(copy);
+    // more records in the header than in the message
+    putHeader(&m, 1, 3, 0, 0);
+    putQuestion(&m, "example.com");
+    putA(&m, 300);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, dns_walk_ttls(m.data, m.len, qlen, 0));
+    // the question is longer than the message
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, dns_walk_ttls(m.data, HEADER_LEN + qlen - 1, qlen, 0));
+}
+
+static void test_clamp_udp_size(void)
+{
+    msg_t m = {0};
+    putHeader(&m, 1, 0, 0, 1);
+    putQuestion(&m, "example.com");
+    size_t udp_size = m.len + 3;
+    putOpt(&m, 4096);
+    TEST_ASSERT_TRUE(dns_clamp_udp_size(m.data, m.len, 1232));
+    TEST_ASSERT_EQUAL_UINT16(1232, (m.data[udp_size] << 8) | m.data[udp_size + 1]);
+
+    // smaller sizes are kept
+    putHeader(&m, 1, 0, 0, 1);
+    putQuestion(&m, "example.com");
+    putOpt(&m, 512);
+    TEST_ASSERT_TRUE(dns_clamp_udp_size(m.data, m.len, 1232));
+    TEST_ASSERT_EQUAL_UINT16(512, (m.data[udp_size] << 8) | m.data[udp_size + 1]);
+
+    // a query without EDNS
+    putHeader(&m, 1, 0, 0, 0);
+    putQuestion(&m, "example.com");
+    TEST_ASSERT_TRUE(dns_clamp_udp_size(m.data, m.len, 1232));
+
+    putHeader(&m, 1, 0, 0, 1);
+    putQuestion(&m, "example.com");
+    putOpt(&m, 4096);
+    TEST_ASSERT_FALSE(dns_clamp_udp_size(m.data, m.len - 1, 1232));
+    TEST_ASSERT_FALSE(dns_clamp_udp_size(m.data, HEADER_LEN - 1, 1232));
+}
+
+static uint32_t fuzz_state = 0x12345678;
+
+static uint32_t fuzzRandom(void)
+{
+    // xorshift32, the same inputs on every run
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 17;
+    fuzz_state ^= fuzz_state << 5;
+    return fuzz_state;
+}
+
+// Runs all parsers on the message, none of them may read or report anything behind its end
+static void fuzzParse(const uint8_t *data, size_t len)
+{
+    uint8_t *msg = exactCopy(data, len);
+
+    size_t off = dns_skip_name(msg, len, HEADER_LEN);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT(len, off);
+    size_t qlen = dns_question_len(msg, len);
+    if (qlen > 0)
+    {
+        TEST_ASSERT_LESS_OR_EQUAL_UINT(len, HEADER_LEN + qlen);
+        dns_walk_ttls(msg, len, qlen, 0);
+        dns_walk_ttls(msg, len, qlen, 1 + fuzzRandom() % 600);
+    }
+    dns_clamp_udp_size(msg, len, 1232);
+    free(msg);
+}
+
+static void test_fuzz(void)
+{
+    msg_t query = {0};
+    putHeader(&query, 1, 0, 0, 1);
+    putQuestion(&query, "connectivitycheck.gstatic.com");
+    putOpt(&query, 4096);
+
+    msg_t response = {0};
+    putHeader(&response, 1, 3, 0, 1);
+    putQuestion(&response, "www.example.com");
+    putA(&response, 300);
+    putA(&response, 60);
+    putA(&response, 3600);
+    putOpt(&response, 1232);
+
+    const msg_t *seeds[] = {&query, &response};
+    uint8_t buf[sizeof(query.data)];
+    for (int round = 0; round < FUZZ_ROUNDS; round++)
+    {
+        const msg_t *seed = seeds[round % 2];
+        size_t len = seed->len;
+        memcpy(buf, seed->data, len);
+        // change a few bytes, most of all the counts, lengths and pointers are interesting
+        int changes = 1 + fuzzRandom() % 4;
+        for (int i = 0; i < changes; i++)
+        {
+            buf[fuzzRandom() % len] = fuzzRandom();
+        }
+        if (fuzzRandom() % 4 == 0)
+        {
+            len = fuzzRandom() % (len + 1);
+        }
+        fuzzParse(buf, len);
+    }
+
+    // random bytes
+    for (int round = 0; round < FUZZ_ROUNDS / 10; round++)
+    {
+        size_t len = fuzzRandom() % 128;
+        for (size_t i = 0; i < len; i++)
+        {
+            buf[i] = fuzzRandom();
+        }
+        fuzzParse(buf, len);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_skip_name);
+    RUN_TEST(test_skip_name_without_end);
+    RUN_TEST(test_skip_name_label_limit);
+    RUN_TEST(test_skip_name_length_limit);
+    RUN_TEST(test_skip_name_pointer);
+    RUN_TEST(test_question_len);
+    RUN_TEST(test_walk_ttls);
+    RUN_TEST(test_walk_ttls_limits);
+    RUN_TEST(test_walk_ttls_malformed);
+    RUN_TEST(test_clamp_udp_size);
+    RUN_TEST(test_fuzz);
+    return UNITY_END();
+}
@@ -0,0 +1,49 @@
+#include <unity.h>
+
+#include "portparse.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void test_valid_ports(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(1, parse_port("1"));
+    TEST_ASSERT_EQUAL_UINT16(80, parse_port("80"));
+    TEST_ASSERT_EQUAL_UINT16(8080, parse_port("08080"));
+    TEST_ASSERT_EQUAL_UINT16(65535, parse_port("65535"));
+}
+
+static void test_out_of_range(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("0"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("65536"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("70000"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("4294967377"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("99999999999999999999999"));
+}
+
+static void test_not_a_number(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port(NULL));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port(""));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("http"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("80x"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("80 "));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port(" 80"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("+80"));
+    TEST_ASSERT_EQUAL_UINT16(0, parse_port("-65535"));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_ports);
+    RUN_TEST(test_out_of_range);
+    RUN_TEST(test_not_a_number);
+    return UNITY_END();
+}
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "urldecode.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void assertDecoded(const char *input, const char *expected)
+{
+    char buf[64];
+    strcpy(buf, input);
+    TEST_ASSERT_EQUAL_UINT(strlen(expected), url_decode(buf));
+    TEST_ASSERT_EQUAL_STRING(expected, buf);
+}
+
+static void test_escapes(void)
+{
+    assertDecoded("", "");
+    assertDecoded("abc", "abc");
+    assertDecoded("%41%62", "Ab");
+    assertDecoded("%2f%2F", "//");
+    assertDecoded("a%20b%3Dc", "a b=c");
+}
+
+static void test_plus_is_space(void)
+{
+    assertDecoded("a+b", "a b");
+    assertDecoded("+++", "   ");
+    assertDecoded("%2B", "+");
+}
+
+static void test_invalid_escapes_are_kept(void)
+{
+    assertDecoded("%zz", "%zz");
+    assertDecoded("%4z", "%4z");
+    assertDecoded("%z4", "%z4");
+    assertDecoded("%%41", "%A");
+}
+
+static void test_truncated_escape_at_end(void)
+{
+    assertDecoded("%", "%");
+    assertDecoded("ab%4", "ab%4");
+    assertDecoded("%41%4", "A%4");
+}
+
+static void test_decoded_zero_byte(void)
+{
+    char buf[] = "a%00b";
+    TEST_ASSERT_EQUAL_UINT(3, url_decode(buf));
+    TEST_ASSERT_EQUAL_MEMORY("a\0b", buf, 4);
+}
+
+static void test_long_input(void)
+{
+    const size_t count = 64 * 1024;
+    char *buf = malloc(count * 3 + 1);
+    TEST_ASSERT_NOT_NULL(buf);
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(buf + i * 3, i % 2 == 0 ? "%41" : "+bc", 3);
+    }
+    buf[count * 3] = '\0';
+
+    size_t len = url_decode(buf);
+    TEST_ASSERT_EQUAL_UINT(count / 2 * 4, len);
+    TEST_ASSERT_EQUAL_CHAR('\0', buf[len]);
+    for (size_t i = 0; i < len; i += 4)
+    {
+        TEST_ASSERT_EQUAL_MEMORY("A bc", buf + i, 4);
+    }
+    free(buf);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_escapes);
+    RUN_TEST(test_plus_is_space);
+    RUN_TEST(test_invalid_escapes_are_kept);
+    RUN_TEST(test_truncated_escape_at_end);
+    RUN_TEST(test_decoded_zero_byte);
+    RUN_TEST(test_long_input);
+    return UNITY_END();
+}
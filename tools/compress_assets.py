@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Writes a gzip compressed copy (<name>.gz) of the static web assets.
+
+The copies are embedded next to the originals and sent to browsers which
+accept gzip. The output is reproducible (no timestamp, no file name), so a
+copy is only rewritten if its asset changed.
+
+Runs as PlatformIO pre script (extra_scripts) and at CMake configure time,
+it can also be called directly: python3 tools/compress_assets.py
+"""
+
+import gzip
+import os
+
+PAGES_DIR = os.path.join("src", "pages")
+
+# Keep in sync with the embedded files in platformio.ini and src/CMakeLists.txt
+ASSETS = (
+    "styles-67aa3b0203355627b525be2ea57be7bf.css",
+    "jquery-8a1045d9cbf50b52a0805c111ba08e94.js",
+    "favicon.ico",
+)
+
+
+def compress_assets(project_dir):
+    for name in ASSETS:
+        source = os.path.join(project_dir, PAGES_DIR, name)
+        target = source + ".gz"
+        with open(source, "rb") as f:
+            data = gzip.compress(f.read(), compresslevel=9, mtime=0)
+        if os.path.exists(target):
+            with open(target, "rb") as f:
+                if f.read() == data:
+                    continue
+        with open(target, "wb") as f:
+            f.write(data)
+        print("compress_assets: %s (%d bytes)" % (os.path.relpath(target, project_dir), len(data)))
+
+
+try:
+    Import("env")  # noqa: F821 (only defined as PlatformIO extra script)
+    compress_assets(env.subst("$PROJECT_DIR"))  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        compress_assets(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+"""Writes a zlib compressed copy (<image>.zz) of OTA images.
+
+The router downloads firmware.bin.zz if it exists and inflates it while
+writing the OTA partition, which roughly halves the transfer. The default
+window of 32 KB is required, the router inflates with a dictionary of that
+size.
+
+Usage: python3 tools/compress_ota.py release/ota/*/firmware.bin
+"""
+
+import sys
+import zlib
+
+
+def compress_image(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    compressed = zlib.compress(data, 9)
+    with open(path + ".zz", "wb") as f:
+        f.write(compressed)
+    print(f"{path}: {len(data)} -> {len(compressed)} bytes ({len(compressed) * 100 // len(data)}%)")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    for image in sys.argv[1:]:
+        compress_image(image)
@@ -0,0 +1,509 @@
+#!/usr/bin/env python3
+"""Host side harness for benchmarking the NAT forwarding path.
+
+Setup: the 'server' runs on a host in the uplink network, 'run' is started on
+a station connected to the soft AP of the router. All traffic of 'run' is
+therefore forwarded (and translated) by the router.
+
+    natbench.py server
+    natbench.py run <server-ip> --env esp32 --sdkconfig sdkconfig.esp32 --out esp32.json
+    natbench.py compare baseline.json esp32.json --tolerance 10
+    natbench.py parse-log console.log
+
+'parse-log' extracts the 'BENCH <json>' lines printed by the 'bench' console
+command of the device. Only the Python standard library is used.
+"""
+
+import argparse
+import json
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+import urllib.request
+
+# TCP and UDP sink use the base port, UDP echo base + 1, TCP source base + 2
+BASE_PORT = 5001
+
+UDP_HDR = struct.Struct("!II")
+UDP_REPORT = b"NATBENCH-REPORT"
+
+# Keys of the sdkconfig, which influence the forwarding performance
+SDKCONFIG_KEYS = (
+    "CONFIG_IDF_TARGET",
+    "CONFIG_LWIP_TCPIP_RECVMBOX_SIZE",
+    "CONFIG_LWIP_TCP_WND_DEFAULT",
+    "CONFIG_LWIP_TCP_SND_BUF_DEFAULT",
+    "CONFIG_LWIP_TCP_RECVMBOX_SIZE",
+    "CONFIG_LWIP_UDP_RECVMBOX_SIZE",
+    "CONFIG_LWIP_TCP_MSS",
+    "CONFIG_LWIP_IRAM_OPTIMIZATION",
+    "CONFIG_ESP_WIFI_STATIC_RX_BUFFER_NUM",
+    "CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM",
+    "CONFIG_ESP_WIFI_DYNAMIC_TX_BUFFER_NUM",
+    "CONFIG_ESP_WIFI_AMPDU_TX_ENABLED",
+    "CONFIG_ESP_WIFI_AMPDU_RX_ENABLED",
+    "CONFIG_ESP_WIFI_TX_BA_WIN",
+    "CONFIG_ESP_WIFI_RX_BA_WIN",
+    "CONFIG_ESP_WIFI_IRAM_OPT",
+    "CONFIG_ESP_WIFI_RX_IRAM_OPT",
+    "CONFIG_SPIRAM",
+)
+
+# Metric -> True if higher is better
+METRICS = {
+    "tcp_up.mbps": True,
+    "tcp_down.mbps": True,
+    "udp_up.mbps": True,
+    "udp_up.pps": True,
+    "udp_up.loss_pct": False,
+    "latency.rtt_us.p50": False,
+    "latency.rtt_us.p90": False,
+    "latency.rtt_us.p99": False,
+    "dns_qps.qps": True,
+    "dns_qps.rtt_us.p50": False,
+}
+
+
+def log(msg):
+    print(msg, file=sys.stderr, flush=True)
+
+
+# ---------------------------------------------------------------- server ---
+
+def serve_tcp_sink(port):
+    srv = socket.create_server(("", port))
+    while True:
+        conn, peer = srv.accept()
+        threading.Thread(target=tcp_sink_client, args=(conn, peer), daemon=True).start()
+
+
+def tcp_sink_client(conn, peer):
+    total = 0
+    start = time.monotonic()
+    with conn:
+        while True:
+            data = conn.recv(65536)
+            if not data:
+                break
+            total += len(data)
+    duration = time.monotonic() - start
+    log("tcp sink %s: %d bytes in %.1fs" % (peer[0], total, duration))
+
+
+def serve_tcp_source(port):
+    srv = socket.create_server(("", port))
+    while True:
+        conn, peer = srv.accept()
+        threading.Thread(target=tcp_source_client, args=(conn,), daemon=True).start()
+
+
+def tcp_source_client(conn):
+    # the client sends the duration in seconds as first line
+    with conn:
+        line = conn.makefile("rb").readline()
+        try:
+            secs = float(line.strip() or b"10")
+        except ValueError:
+            return
+        buf = b"N" * 65536
+        end = time.monotonic() + secs
+        try:
+            while time.monotonic() < end:
+                conn.sendall(buf)
+        except OSError:
+            pass
+
+
+def serve_udp_sink(port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+    sock.bind(("", port))
+    runs = {}
+    while True:
+        data, peer = sock.recvfrom(65536)
+        now = time.monotonic()
+        if data.startswith(UDP_REPORT):
+            run = runs.pop(peer, None) or {"packets": 0, "bytes": 0, "max_seq": -1, "first": now, "last": now}
+            report = {
+                "packets": run["packets"],
+                "bytes": run["bytes"],
+                "expected": run["max_seq"] + 1,
+                "duration_s": run["last"] - run["first"],
+            }
+            sock.sendto(json.dumps(report).encode(), peer)
+            continue
+        run = runs.setdefault(peer, {"packets": 0, "bytes": 0, "max_seq": -1, "first": now, "last": now})
+        run["packets"] += 1
+        run["bytes"] += len(data)
+        run["last"] = now
+        if len(data) >= UDP_HDR.size:
+            run["max_seq"] = max(run["max_seq"], UDP_HDR.unpack_from(data)[0])
+
+
+def serve_udp_echo(port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", port))
+    while True:
+        data, peer = sock.recvfrom(65536)
+        sock.sendto(data, peer)
+
+
+def cmd_server(args):
+    threads = [
+        threading.Thread(target=serve_tcp_sink, args=(args.port,), daemon=True),
+        threading.Thread(target=serve_tcp_source, args=(args.port + 2,), daemon=True),
+        threading.Thread(target=serve_udp_sink, args=(args.port,), daemon=True),
+        threading.Thread(target=serve_udp_echo, args=(args.port + 1,), daemon=True),
+    ]
+    for t in threads:
+        t.start()
+    log("natbench server: tcp sink/udp sink %d, udp echo %d, tcp source %d"
+        % (args.port, args.port + 1, args.port + 2))
+    try:
+        while True:
+            time.sleep(3600)
+    except KeyboardInterrupt:
+        return 0
+
+
+# ---------------------------------------------------------------- client ---
+
+def run_tcp_up(host, port, secs):
+    buf = b"N" * 65536
+    total = 0
+    with socket.create_connection((host, port), timeout=10) as sock:
+        start = time.monotonic()
+        end = start + secs
+        while time.monotonic() < end:
+            total += sock.send(buf)
+        duration = time.monotonic() - start
+    return {"bytes": total, "duration_s": round(duration, 3), "mbps": round(total * 8 / duration / 1e6, 3)}
+
+
+def run_tcp_down(host, port, secs):
+    total = 0
+    with socket.create_connection((host, port), timeout=10) as sock:
+        sock.sendall(b"%d\n" % secs)
+        start = time.monotonic()
+        while True:
+            data = sock.recv(65536)
+            if not data:
+                break
+            total += len(data)
+        duration = time.monotonic() - start
+    return {"bytes": total, "duration_s": round(duration, 3), "mbps": round(total * 8 / duration / 1e6, 3)}
+
+
+def run_udp_up(host, port, secs, length, kbps):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((host, port))
+    payload = bytearray(b"N" * length)
+    interval = length * 8 / (kbps * 1000) if kbps > 0 else 0
+    seq = 0
+    errors = 0
+    start = time.monotonic()
+    end = start + secs
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+        if interval > 0:
+            ahead = start + seq * interval - now
+            if ahead > 0.001:
+                time.sleep(ahead)
+        UDP_HDR.pack_into(payload, 0, seq, int(now * 1e6) & 0xFFFFFFFF)
+        try:
+            sock.send(payload)
+            seq += 1
+        except OSError:
+            errors += 1
+    # let the queues drain before asking for the report
+    time.sleep(1)
+    sock.settimeout(3)
+    report = None
+    for _ in range(3):
+        sock.send(UDP_REPORT)
+        try:
+            report = json.loads(sock.recv(4096))
+            break
+        except (socket.timeout, ValueError):
+            continue
+    sock.close()
+    if report is None:
+        raise RuntimeError("no report from udp sink")
+    duration = report["duration_s"] or (time.monotonic() - start)
+    lost = max(seq - report["packets"], 0)
+    return {
+        "sent": seq,
+        "send_errors": errors,
+        "received": report["packets"],
+        "loss_pct": round(100.0 * lost / seq, 3) if seq else 0.0,
+        "mbps": round(report["bytes"] * 8 / duration / 1e6, 3),
+        "pps": round(report["packets"] / duration, 1),
+    }
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    return sorted_values[(len(sorted_values) - 1) * p // 100]
+
+
+def run_latency(host, port, count, length):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((host, port))
+    sock.settimeout(1)
+    payload = bytearray(b"N" * max(length, UDP_HDR.size))
+    rtts = []
+    for seq in range(count):
+        UDP_HDR.pack_into(payload, 0, seq, 0)
+        sent = time.perf_counter()
+        sock.send(payload)
+        while True:
+            try:
+                data = sock.recv(65536)
+            except socket.timeout:
+                break
+            if len(data) >= UDP_HDR.size and UDP_HDR.unpack_from(data)[0] == seq:
+                rtts.append(int((time.perf_counter() - sent) * 1e6))
+                break
+        time.sleep(0.01)
+    sock.close()
+    rtts.sort()
+    return {
+        "sent": count,
+        "received": len(rtts),
+        "rtt_us": {
+            "min": rtts[0] if rtts else 0,
+            "p50": percentile(rtts, 50),
+            "p90": percentile(rtts, 90),
+            "p99": percentile(rtts, 99),
+            "max": rtts[-1] if rtts else 0,
+        },
+    }
+
+
+def dns_query(qid, name, qtype):
+    labels = b"".join(bytes([len(p)]) + p.encode() for p in name.split("."))
+    return struct.pack("!HHHHHH", qid, 0x0100, 1, 0, 0, 0) + labels + b"\0" + struct.pack("!HH", qtype, 1)
+
+
+def run_dns_qps(server, secs, window, names):
+    """Keeps 'window' queries in flight against the DNS server of the router."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((server, 53))
+    sock.settimeout(0.5)
+    pending = {}
+    rtts = []
+    sent = answered = timeouts = 0
+    qid = 0
+    start = time.perf_counter()
+    end = start + secs
+    while True:
+        now = time.perf_counter()
+        if now >= end and not pending:
+            break
+        while now < end and len(pending) < window:
+            qid = (qid + 1) & 0xFFFF
+            # alternating A and AAAA, like phones probing for connectivity
+            name = names[sent % len(names)]
+            sock.send(dns_query(qid, name, 1 if sent % 2 == 0 else 28))
+            pending[qid] = time.perf_counter()
+            sent += 1
+        try:
+            data = sock.recv(2048)
+        except socket.timeout:
+            timeouts += len(pending)
+            pending.clear()
+            continue
+        rid = struct.unpack_from("!H", data)[0] if len(data) >= 2 else -1
+        if rid in pending:
+            rtts.append(int((time.perf_counter() - pending.pop(rid)) * 1e6))
+            answered += 1
+    duration = time.perf_counter() - start
+    sock.close()
+    rtts.sort()
+    return {
+        "sent": sent,
+        "answered": answered,
+        "timeouts": timeouts,
+        "qps": round(answered / duration, 1),
+        "rtt_us": {
+            "p50": percentile(rtts, 50),
+            "p90": percentile(rtts, 90),
+            "p99": percentile(rtts, 99),
+        },
+    }
+
+
+def read_sdkconfig(path):
+    values = {}
+    pattern = re.compile(r"^(CONFIG_[A-Z0-9_]+)=(.*)$")
+    with open(path) as f:
+        for line in f:
+            m = pattern.match(line.strip())
+            if m and m.group(1) in SDKCONFIG_KEYS:
+                values[m.group(1)] = m.group(2).strip('"')
+    return values
+
+
+def read_profile(router):
+    """Performance profile of the router, as reported by /api/stats."""
+    try:
+        with urllib.request.urlopen("http://%s/api/stats" % router, timeout=5) as resp:
+            return json.load(resp).get("profile", "unknown")
+    except (OSError, ValueError) as e:
+        log("can't read the profile of the router: %s" % e)
+        return "unknown"
+
+
+def cmd_run(args):
+    result = {
+        "env": args.env,
+        "timestamp": int(time.time()),
+        "server": args.host,
+        "params": {"time_s": args.time, "udp_len": args.len, "udp_kbps": args.kbps, "pings": args.count,
+                   "dns_window": args.window},
+        "results": {},
+    }
+    if args.sdkconfig:
+        result["sdkconfig"] = read_sdkconfig(args.sdkconfig)
+    if args.router:
+        result["profile"] = read_profile(args.router)
+
+    tests = args.tests.split(",")
+    runners = {
+        "tcp_up": lambda: run_tcp_up(args.host, args.port, args.time),
+        "tcp_down": lambda: run_tcp_down(args.host, args.port + 2, args.time),
+        "udp_up": lambda: run_udp_up(args.host, args.port, args.time, args.len, args.kbps),
+        "latency": lambda: run_latency(args.host, args.port + 1, args.count, 64),
+        "dns_qps": lambda: run_dns_qps(args.dns, args.time, args.window, args.names.split(",")),
+    }
+    for name in tests:
+        if name not in runners:
+            log("unknown test '%s'" % name)
+            return 2
+        log("running %s ..." % name)
+        try:
+            result["results"][name] = runners[name]()
+        except (OSError, RuntimeError) as e:
+            result["results"][name] = {"error": str(e)}
+        log("  %s" % json.dumps(result["results"][name]))
+
+    output = json.dumps(result, indent=2, sort_keys=True)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(output + "\n")
+    else:
+        print(output)
+    return 0
+
+
+# --------------------------------------------------------------- compare ---
+
+def lookup(results, path):
+    value = results.get("results", {})
+    for key in path.split("."):
+        if not isinstance(value, dict) or key not in value:
+            return None
+        value = value[key]
+    return value
+
+
+def cmd_compare(args):
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    with open(args.current) as f:
+        current = json.load(f)
+
+    if baseline.get("profile") != current.get("profile"):
+        log("warning: the results were measured with different performance profiles (%s -> %s)"
+            % (baseline.get("profile"), current.get("profile")))
+
+    regressions = 0
+    print("%-22s %12s %12s %8s" % ("metric", "baseline", "current", "change"))
+    for metric, higher_is_better in METRICS.items():
+        old = lookup(baseline, metric)
+        new = lookup(current, metric)
+        if old is None or new is None:
+            continue
+        if old == 0:
+            change = 0.0 if new == 0 else 100.0
+        else:
+            change = 100.0 * (new - old) / abs(old)
+        worse = -change if higher_is_better else change
+        flag = ""
+        if worse > args.tolerance:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-22s %12s %12s %7.1f%%%s" % (metric, old, new, change, flag))
+
+    old_cfg = baseline.get("sdkconfig", {})
+    new_cfg = current.get("sdkconfig", {})
+    for key in sorted(set(old_cfg) | set(new_cfg)):
+        if old_cfg.get(key) != new_cfg.get(key):
+            print("sdkconfig %s: %s -> %s" % (key, old_cfg.get(key), new_cfg.get(key)))
+    return 1 if regressions else 0
+
+
+def cmd_parse_log(args):
+    results = []
+    with open(args.log, errors="replace") as f:
+        for line in f:
+            idx = line.find("BENCH {")
+            if idx < 0:
+                continue
+            try:
+                results.append(json.loads(line[idx + len("BENCH "):]))
+            except ValueError:
+                log("skipping malformed line: %s" % line.strip())
+    print(json.dumps(results, indent=2))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("server", help="run the sinks, source and echo on the uplink host")
+    p.add_argument("--port", type=int, default=BASE_PORT, help="base port (default 5001)")
+    p.set_defaults(func=cmd_server)
+
+    p = sub.add_parser("run", help="run the benchmark from a station on the soft AP")
+    p.add_argument("host", help="IP of the natbench server in the uplink network")
+    p.add_argument("--port", type=int, default=BASE_PORT, help="base port (default 5001)")
+    p.add_argument("--env", default="unknown", help="PlatformIO env of the firmware, e.g. esp32-c3")
+    p.add_argument("--sdkconfig", help="sdkconfig file of the firmware, the buffer settings are recorded")
+    p.add_argument("--router", default="192.168.4.1",
+                   help="IP of the soft AP, the performance profile is read from /api/stats, empty to skip")
+    p.add_argument("--tests", default="tcp_up,tcp_down,udp_up,latency", help="comma separated list of tests, dns_qps is also available")
+    p.add_argument("--time", type=int, default=10, help="duration of the throughput tests in seconds")
+    p.add_argument("--len", type=int, default=1400, help="UDP datagram length")
+    p.add_argument("--kbps", type=int, default=0, help="UDP rate in kbit/s, 0 = unlimited")
+    p.add_argument("--count", type=int, default=200, help="number of latency probes")
+    p.add_argument("--dns", default="192.168.4.1", help="DNS server for dns_qps, the IP of the soft AP")
+    p.add_argument("--window", type=int, default=8, help="DNS queries in flight for dns_qps")
+    p.add_argument("--names", default="connectivitycheck.gstatic.com,captive.apple.com,www.msftconnecttest.com",
+                   help="comma separated names queried by dns_qps")
+    p.add_argument("--out", help="write the JSON result to this file")
+    p.set_defaults(func=cmd_run)
+
+    p = sub.add_parser("compare", help="compare two results, exit code 1 on regression")
+    p.add_argument("baseline")
+    p.add_argument("current")
+    p.add_argument("--tolerance", type=float, default=10.0, help="allowed regression in percent")
+    p.set_defaults(func=cmd_compare)
+
+    p = sub.add_parser("parse-log", help="extract the BENCH lines of a device console log")
+    p.add_argument("log")
+    p.set_defaults(func=cmd_parse_log)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())